@@ -1,13 +1,23 @@
 #ifndef COMMUNICATOR_H_
 #define COMMUNICATOR_H_
 
+#include <cstddef>
+
 namespace vsharp {
 
+// NOTE: one piece of a message, which is sent directly from the memory of its owner
+struct IOChunk {
+    const char *data;
+    size_t size;
+};
+
 class Communicator {
 public:
     bool open();
     int read(char *buffer, int count);
     int write(char *message, int count);
+    // NOTE: writes all chunks as one message, returns the total amount of written bytes
+    int writev(const IOChunk *chunks, int count);
     bool close();
 };
 
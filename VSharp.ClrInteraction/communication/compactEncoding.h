@@ -0,0 +1,35 @@
+#ifndef COMPACTENCODING_H_
+#define COMPACTENCODING_H_
+
+namespace vsharp {
+
+// NOTE: unsigned LEB128, 64-bit values take at most 10 bytes
+#define MAX_VARINT_SIZE 10
+
+inline void writeVarUInt(char *&buffer, unsigned long long value) {
+    while (value >= 0x80) {
+        *buffer++ = (char)(value | 0x80);
+        value >>= 7;
+    }
+    *buffer++ = (char)value;
+}
+
+// NOTE: zigzag encoding keeps small negative values short
+inline void writeVarInt(char *&buffer, long long value) {
+    writeVarUInt(buffer, ((unsigned long long)value << 1) ^ (unsigned long long)(value >> 63));
+}
+
+// NOTE: returns false if the value does not fit into [buffer; end)
+inline bool readVarUInt(const char *&buffer, const char *end, unsigned long long &value) {
+    value = 0;
+    for (int shift = 0; buffer < end && shift < 7 * MAX_VARINT_SIZE; shift += 7) {
+        unsigned char byte = (unsigned char)*buffer++;
+        value |= (unsigned long long)(byte & 0x7F) << shift;
+        if (byte < 0x80) return true;
+    }
+    return false;
+}
+
+}
+
+#endif // COMPACTENCODING_H_
@@ -2,28 +2,89 @@
 #include "../logging.h"
 #include "../probes.h"
 
+#include <algorithm>
 #include <cstring>
 #include <iostream>
+#include <string>
 
 using namespace vsharp;
 
+// NOTE: state of the request, which is currently served by the thread
+thread_local unsigned currentRequestId = 0;
+thread_local ChannelKind currentChannel = SessionChannel;
+thread_local std::vector<char> receiveBuffer;
+thread_local std::vector<IOChunk> chunksBuffer;
+thread_local std::vector<char> scratchBuffer;
+
+Protocol::Protocol()
+    : m_framing(ConfirmedFraming)
+    , m_encoding(FixedEncoding)
+    , m_features(0)
+    , m_creditWindow(0)
+    , m_credits(0)
+    , m_consumedFrames(0)
+    , m_reading(false)
+    , m_failed(false)
+    , m_nextRequestId(1)
+{
+}
+
+char *Protocol::reserveReceiveBuffer(int count) {
+    // NOTE: buffer only grows, so after the first large messages no allocations happen
+    if (receiveBuffer.size() < (size_t)count)
+        receiveBuffer.resize(count);
+    return receiveBuffer.data();
+}
+
+std::vector<IOChunk> &Protocol::outgoingChunks() {
+    return chunksBuffer;
+}
+
+std::vector<char> &Protocol::outgoingScratch() {
+    return scratchBuffer;
+}
+
+void Protocol::beginRequest(ChannelKind channel) {
+    currentRequestId = m_nextRequestId.fetch_add(1);
+    currentChannel = channel;
+}
+
+bool Protocol::prepareRequest(char commandByte) {
+    if (commandByte != ExecuteDeferredCommand && !flushDeferredCommands()) return false;
+    beginRequest(commandByte == ExecuteCommand || commandByte == ExecuteDeferredCommand ? ExecutionChannel : InstrumentationChannel);
+    return true;
+}
+
+void Protocol::resumeRequest(unsigned requestId) {
+    currentRequestId = requestId;
+}
+
+bool Protocol::readExactly(char *buffer, int count) {
+    int bytesRead = 0;
+    while (bytesRead < count) {
+        int newBytesCount = m_communicator.read(buffer + bytesRead, count - bytesRead);
+        if (newBytesCount <= 0) break;
+        bytesRead += newBytesCount;
+    }
+    return bytesRead == count;
+}
+
 bool Protocol::readConfirmation() {
-    char *buffer = new char[1];
+    char buffer[1];
     int bytesRead = m_communicator.read(buffer, 1);
     if (bytesRead != 1 || buffer[0] != Confirmation) {
         LOG_ERROR(tout << "Communication with server: could not get the confirmation message. Instead read "
                        << bytesRead << " bytes with message [";
               for (int i = 0; i < bytesRead; ++i) tout << buffer[i] << " ";
               tout << "].");
-        delete[] buffer;
         return false;
     }
-    delete[] buffer;
     return true;
 }
 
 bool Protocol::writeConfirmation() {
-    int bytesWritten = m_communicator.write(new char[1] {Confirmation}, 1);
+    char confirmation = Confirmation;
+    int bytesWritten = m_communicator.write(&confirmation, 1);
     if (bytesWritten != 1) {
         LOG_ERROR(tout << "Communication with server: could not send the confirmation message. Instead sent"
                        << bytesWritten << " bytes.");
@@ -33,9 +94,8 @@ bool Protocol::writeConfirmation() {
 }
 
 bool Protocol::readCount(int &count) {
-    int countCount = m_communicator.read((char*)(&count), 4);
-    if (countCount != 4) {
-        LOG_ERROR(tout << "Communication with server: could not get the amount of bytes of the next message. Instead read " << countCount << " bytes");
+    if (!readExactly((char*)(&count), 4)) {
+        LOG_ERROR(tout << "Communication with server: could not get the amount of bytes of the next message");
         return false;
     }
 
@@ -51,7 +111,7 @@ bool Protocol::writeCount(int count) {
     return true;
 }
 
-bool Protocol::readBuffer(char *&buffer, int &count) {
+bool Protocol::readConfirmedBuffer(char *&buffer, int &count) {
     if (!readCount(count)) {
         return false;
     }
@@ -60,37 +120,35 @@ bool Protocol::readBuffer(char *&buffer, int &count) {
         return false;
     }
     if (!writeConfirmation()) return false;
-    buffer = new char[count];
-    char *bufferBeginning = buffer;
+    buffer = reserveReceiveBuffer(count);
     int bytesRead = 0;
     while (bytesRead < count) {
-        int newBytesCount = m_communicator.read(buffer, count - bytesRead);
+        int newBytesCount = m_communicator.read(buffer + bytesRead, count - bytesRead);
         if (newBytesCount == 0) break;
         bytesRead += newBytesCount;
-        buffer += newBytesCount;
     }
-    buffer = bufferBeginning;
     if (bytesRead != count) {
         LOG_ERROR(tout << "Communication with server: expected " << count << " bytes, but read " << bytesRead << " bytes");
-        delete[] buffer;
         buffer = nullptr;
         return false;
     }
     if (!writeConfirmation()) {
         LOG_ERROR(tout << "Communication with server: I've got the message, but could not confirm it.");
-        delete[] buffer;
         buffer = nullptr;
         return false;
     }
     return true;
 }
 
-bool Protocol::writeBuffer(char *buffer, int count) {
-    if (!writeCount(count) || !readConfirmation()) {
+bool Protocol::writeConfirmedChunks(IOChunk *chunks, int count) {
+    size_t size = 0;
+    for (int i = 1; i < count; ++i)
+        size += chunks[i].size;
+    if (!writeCount((int)size) || !readConfirmation()) {
         return false;
     }
-    int bytesWritten = m_communicator.write(buffer, count);
-    if (bytesWritten != count) {
+    int bytesWritten = m_communicator.writev(chunks + 1, count - 1);
+    if (bytesWritten != (int)size) {
         LOG_ERROR(tout << "Communication with server: could not sent the message. Instead sent " << bytesWritten << " bytes");
         return false;
     }
@@ -101,19 +159,242 @@ bool Protocol::writeBuffer(char *buffer, int count) {
     return true;
 }
 
+bool Protocol::writeFrame(int header, IOChunk *chunks, int count) {
+    // NOTE: the whole frame is written at once, so one message costs one syscall
+    size_t size = 0;
+    for (int i = 1; i < count; ++i)
+        size += chunks[i].size;
+    std::lock_guard<std::mutex> lock(m_writeLock);
+    int headerSize = 0;
+    m_frameHeader[headerSize++] = header;
+    if (m_framing == MultiplexedFraming) {
+        m_frameHeader[headerSize++] = (int)currentRequestId;
+        m_frameHeader[headerSize++] = currentChannel;
+    }
+    // NOTE: control frames carry the length of their payload after the header
+    if (header < 0)
+        m_frameHeader[headerSize++] = (int)size;
+    chunks[0] = IOChunk{(char*)m_frameHeader, headerSize * sizeof(int)};
+    size += chunks[0].size;
+    int bytesWritten = m_communicator.writev(chunks, count);
+    if (bytesWritten != (int)size) {
+        LOG_ERROR(tout << "Communication with server: could not sent the frame. Instead sent " << bytesWritten << " bytes of " << size);
+        return false;
+    }
+    return true;
+}
+
+bool Protocol::writeControlFrame(int kind, const char *payload, int count) {
+    IOChunk chunks[2] = {{nullptr, 0}, {payload, (size_t)count}};
+    return writeFrame(kind, chunks, 2);
+}
+
+bool Protocol::readControlFrame(int kind) {
+    int length;
+    if (!readCount(length) || length < 0) return false;
+    // NOTE: control frames can arrive while the caller holds a view into the receive buffer, so it is not used here
+    switch (kind) {
+        case CreditFrame: {
+            int credits;
+            if (length != sizeof(int) || !readExactly((char*)&credits, length) || credits < 0) return false;
+            m_credits.fetch_add((unsigned)credits);
+            return true;
+        }
+        case ErrorFrame: {
+            std::string message(length, '\0');
+            if (!readExactly(&message[0], length)) return false;
+            LOG_ERROR(tout << "Communication with server: server reported an error: " << message);
+            return false;
+        }
+        default:
+            LOG_ERROR(tout << "Communication with server: unexpected control frame " << kind);
+            return false;
+    }
+}
+
+bool Protocol::acquireCredit() {
+    // NOTE: server grants credits right after consuming the frames, so nothing else can precede them
+    unsigned credits = m_credits.load();
+    while (true) {
+        if (credits > 0) {
+            // NOTE: on failure 'credits' gets the current amount, which another thread has changed
+            if (m_credits.compare_exchange_weak(credits, credits - 1)) return true;
+            continue;
+        }
+        int header;
+        if (!readCount(header)) return false;
+        if (header >= 0 || header == TerminateFrame) {
+            LOG_ERROR(tout << "Communication with server: expected credits, but got frame " << header);
+            return false;
+        }
+        if (!readControlFrame(header)) return false;
+        credits = m_credits.load();
+    }
+}
+
+bool Protocol::readStreamedBuffer(char *&buffer, int &count) {
+    if (!readCount(count)) return false;
+    while (count < 0) {
+        if (count == TerminateFrame || !readControlFrame(count)) return false;
+        if (!readCount(count)) return false;
+    }
+    if (count == 0) {
+        LOG_ERROR(tout << "Communication with server: unexpected empty frame");
+        sendError("Unexpected empty frame");
+        return false;
+    }
+    buffer = reserveReceiveBuffer(count);
+    if (!readExactly(buffer, count)) {
+        LOG_ERROR(tout << "Communication with server: could not read the frame of " << count << " bytes");
+        buffer = nullptr;
+        return false;
+    }
+    if (m_creditWindow > 0 && ++m_consumedFrames == m_creditWindow) {
+        m_consumedFrames = 0;
+        return writeControlFrame(CreditFrame, (char*)&m_creditWindow, sizeof(int));
+    }
+    return true;
+}
+
+bool Protocol::writeStreamedChunks(IOChunk *chunks, int count) {
+    if (m_creditWindow > 0 && !acquireCredit()) return false;
+    size_t size = 0;
+    for (int i = 1; i < count; ++i)
+        size += chunks[i].size;
+    return writeFrame((int)size, chunks, count);
+}
+
+bool Protocol::readMultiplexedFrame(FrameHeader &header, char *&buffer) {
+    if (!readExactly((char*)&header, sizeof(FrameHeader))) {
+        LOG_ERROR(tout << "Communication with server: could not read the frame header");
+        return false;
+    }
+    if (header.length < 0) {
+        if (header.length == TerminateFrame) return false;
+        // NOTE: credits are not used in multiplexed mode, so only errors can arrive here
+        return readControlFrame(header.length);
+    }
+    if (header.length == 0) {
+        LOG_ERROR(tout << "Communication with server: unexpected empty frame");
+        return false;
+    }
+    if (header.requestId == currentRequestId) {
+        buffer = reserveReceiveBuffer(header.length);
+        if (readExactly(buffer, header.length)) return true;
+    } else {
+        // NOTE: frame is published only after it is read completely, its owner may take it right away
+        std::vector<char> frame(header.length);
+        if (readExactly(frame.data(), header.length)) {
+            std::lock_guard<std::mutex> lock(m_readLock);
+            m_pendingFrames[header.requestId].push_back(std::move(frame));
+            return true;
+        }
+    }
+    LOG_ERROR(tout << "Communication with server: could not read the frame of " << header.length << " bytes");
+    return false;
+}
+
+bool Protocol::readMultiplexedBuffer(char *&buffer, int &count) {
+    std::unique_lock<std::mutex> lock(m_readLock);
+    while (true) {
+        auto pending = m_pendingFrames.find(currentRequestId);
+        if (pending != m_pendingFrames.end() && !pending->second.empty()) {
+            // NOTE: frame, read by another thread, becomes the receive buffer of this thread
+            receiveBuffer.swap(pending->second.front());
+            pending->second.pop_front();
+            if (pending->second.empty())
+                m_pendingFrames.erase(pending);
+            buffer = receiveBuffer.data();
+            count = (int)receiveBuffer.size();
+            return true;
+        }
+        if (m_failed) return false;
+        if (m_reading) {
+            m_frameArrived.wait(lock);
+            continue;
+        }
+        m_reading = true;
+        lock.unlock();
+        FrameHeader header;
+        bool success = readMultiplexedFrame(header, buffer);
+        lock.lock();
+        m_reading = false;
+        m_failed = !success;
+        m_frameArrived.notify_all();
+        if (!success) return false;
+        if (header.requestId == currentRequestId) {
+            count = header.length;
+            return true;
+        }
+    }
+}
+
+bool Protocol::readBuffer(char *&buffer, int &count) {
+    switch (m_framing) {
+        case MultiplexedFraming:
+            return readMultiplexedBuffer(buffer, count);
+        case StreamedFraming:
+            return readStreamedBuffer(buffer, count);
+        default:
+            return readConfirmedBuffer(buffer, count);
+    }
+}
+
+bool Protocol::writeChunks(IOChunk *chunks, int count) {
+    if (m_framing != ConfirmedFraming)
+        return writeStreamedChunks(chunks, count);
+    return writeConfirmedChunks(chunks, count);
+}
+
+bool Protocol::writeBuffer(char *buffer, int count) {
+    IOChunk chunks[2] = {{nullptr, 0}, {buffer, (size_t)count}};
+    return writeChunks(chunks, 2);
+}
+
 bool Protocol::handshake() {
     const char *expectedMessage = "Hi!";
     char *message;
     int count;
     if (readBuffer(message, count) && !strcmp(message, expectedMessage)) {
-        strcpy(message, "Hi!");
-        count = strlen(message);
-        if (writeBuffer(message, count)) {
-            delete[] message;
-            LOG(tout << "Communication with server: handshake success!");
+        int greetingLength = strlen(expectedMessage) + 1;
+        HandshakeOptions options = {ConfirmedFraming, 0, FixedEncoding, 0};
+        // NOTE: servers, which do not know about encodings or features, send only framing options
+        int optionsSize = count - greetingLength;
+        bool hasOptions = optionsSize >= 2 * (int)sizeof(int);
+        if (hasOptions) {
+            memcpy(&options, message + greetingLength, std::min(optionsSize, (int)sizeof(HandshakeOptions)));
+            if ((options.framing != StreamedFraming && options.framing != MultiplexedFraming) || options.creditWindow < 0) {
+                options.framing = ConfirmedFraming;
+                options.creditWindow = 0;
+            }
+            // NOTE: credits are granted for the whole connection, so they are not combined with multiplexing
+            if (options.framing == MultiplexedFraming)
+                options.creditWindow = 0;
+            if (options.encoding < FixedEncoding)
+                options.encoding = FixedEncoding;
+            if (options.encoding > LatestEncoding)
+                options.encoding = LatestEncoding;
+            options.features &= SupportedFeatures;
+        }
+        // NOTE: old servers expect just the greeting, so options are echoed only if they were proposed
+        char reply[sizeof("Hi!") + sizeof(HandshakeOptions)];
+        strcpy(reply, "Hi!");
+        count = hasOptions ? sizeof(reply) : strlen(reply);
+        memcpy(reply + greetingLength, &options, sizeof(HandshakeOptions));
+        if (writeBuffer(reply, count)) {
+            m_framing = (FramingMode)options.framing;
+            m_encoding = (WireEncoding)options.encoding;
+            m_features = options.features;
+            m_creditWindow = options.creditWindow;
+            m_credits.store((unsigned)options.creditWindow);
+            m_consumedFrames = 0;
+            LOG(tout << "Communication with server: handshake success! Framing mode = " << m_framing
+                     << ", credit window = " << m_creditWindow << ", encoding = " << m_encoding
+                     << ", features = " << HEX(m_features));
             return true;
         }
-        delete[] message;
+        LOG_ERROR(tout << "Communication with server: handshake failed!");
+        return false;
     }
     LOG_ERROR(tout << "Communication with server: handshake failed!");
     return false;
@@ -129,6 +410,19 @@ bool Protocol::sendProbes() {
     return writeBuffer((char*)ProbesAddresses.data(), bytesCount);
 }
 
+const std::vector<unsigned long long> &Protocol::probesAddresses() const {
+    return ProbesAddresses;
+}
+
+const std::vector<ProbeImport> &Protocol::probeImports() const {
+    return ProbesImports;
+}
+
+bool Protocol::sendRemoteMemoryLayout(const RemoteMemoryLayout &layout) {
+    LOG(tout << "Sending layout of shadow objects for remote reads..." << std::endl);
+    return writeBuffer((char*)&layout, (int)sizeof(RemoteMemoryLayout));
+}
+
 void Protocol::acceptEntryPoint(char *&entryPointBytes, int &length) {
     if (!readBuffer(entryPointBytes, length)) {
         FAIL_LOUD("Exec response validation failed!");
@@ -137,6 +431,14 @@ void Protocol::acceptEntryPoint(char *&entryPointBytes, int &length) {
     assert(length >= 0);
 }
 
+bool Protocol::acceptInstrumentationScope(char *&bytes, int &length) {
+    if (!readBuffer(bytes, length)) {
+        LOG_ERROR(tout << "Reading instrumentation scope failed!");
+        return false;
+    }
+    return true;
+}
+
 bool Protocol::acceptCommand(CommandType &command)
 {
     char *message;
@@ -148,7 +450,6 @@ bool Protocol::acceptCommand(CommandType &command)
     command = (CommandType) *message;
 //    CLOG(command == ReadMethodBody, tout << "Accepted ReadMethodBody command");
 //    CLOG(command == ReadString, tout << "Accepted ReadString command");
-    delete[] message;
     return true;
 }
 
@@ -159,20 +460,21 @@ bool Protocol::acceptString(char *&string) {
         LOG_ERROR(tout << "Reading instrumented method body failed!");
         return false;
     }
+    // NOTE: strings are owned by the strings pool, so they are copied out of the receive buffer
     string = new char[messageLength];
     memcpy(string, message, messageLength);
 //    LOG(tout << "Successfully accepted string: " << string);
-    delete[] message;
     return true;
 }
 
 bool Protocol::sendStringsPoolIndex(const unsigned index) {
-    unsigned messageLength = sizeof(unsigned);
-    char *buffer = new char[messageLength];
-    *(unsigned *)buffer = index;
-    bool result = writeBuffer(buffer, (int)messageLength);
-    delete[] buffer;
-    return result;
+    unsigned message = index;
+    return writeBuffer((char*)&message, (int)sizeof(unsigned));
+}
+
+bool Protocol::sendMainReached() {
+    char commandByte = MainReachedCommand;
+    return prepareRequest(commandByte) && writeBuffer(&commandByte, 1);
 }
 
 bool Protocol::acceptMethodBody(char *&bytecode, int &codeLength, unsigned &maxStackSize, char *&ehs, unsigned &ehsLength) {
@@ -182,18 +484,14 @@ bool Protocol::acceptMethodBody(char *&bytecode, int &codeLength, unsigned &maxS
         LOG_ERROR(tout << "Reading instrumented method body failed!");
         return false;
     }
-    char *origMessage = message;
     LOG(tout << "Successfully accepted " << messageLength << " bytes of message, parsing it...");
     codeLength = *(int*)message;
     message += sizeof(int);
     maxStackSize = *(unsigned*)message;
     message += sizeof(unsigned);
-    bytecode = new char[codeLength];
-    memcpy(bytecode, message, codeLength);
+    bytecode = message;
     ehsLength = messageLength - sizeof(int) - sizeof(unsigned) - codeLength;
-    ehs = new char[ehsLength];
-    memcpy(ehs, message + codeLength, ehsLength);
-    delete[] origMessage;
+    ehs = message + codeLength;
     return true;
 }
 
@@ -204,12 +502,28 @@ void Protocol::acceptExecResult(char *&bytes, int &messageLength) {
     assert(messageLength >= 5);
 }
 
+bool Protocol::acceptInstrumentedModule(char *&bytes, int &messageLength) {
+    if (!readBuffer(bytes, messageLength)) {
+        LOG_ERROR(tout << "Reading instrumented module failed!");
+        return false;
+    }
+    return true;
+}
+
 bool Protocol::connect() {
     LOG(tout << "Connecting to server...");
     return m_communicator.open() && handshake();
 }
 
+bool Protocol::sendError(const char *message) {
+    if (m_framing == ConfirmedFraming) return false;
+    return writeControlFrame(ErrorFrame, message, (int)strlen(message));
+}
+
 bool Protocol::shutdown()
 {
-    return writeCount(-1);
+    if (!flushDeferredCommands()) return false;
+    if (m_framing != ConfirmedFraming)
+        return writeControlFrame(TerminateFrame, nullptr, 0);
+    return writeCount(TerminateFrame);
 }
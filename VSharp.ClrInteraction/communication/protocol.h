@@ -2,6 +2,12 @@
 #define PROTOCOL_H_
 
 #include "communicator.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <vector>
 
 namespace vsharp {
 
@@ -10,12 +16,113 @@ enum CommandType {
     InstrumentCommand = 0x56,
     ExecuteCommand = 0x57,
     ReadMethodBody = 0x58,
-    ReadString = 0x59
+    ReadString = 0x59,
+    // NOTE: all method bodies of the module, instrumented by the server in one batch
+    InstrumentModuleCommand = 0x5A,
+    // NOTE: exec commands with predictable results, sent in one batch without waiting for replies
+    ExecuteDeferredCommand = 0x5B,
+    // NOTE: body of main is not requested from the server, if it is taken from the instrumentation cache
+    MainReachedCommand = 0x5C
+};
+
+enum FramingMode {
+    // NOTE: length and payload are confirmed separately by the receiver
+    ConfirmedFraming = 0,
+    // NOTE: length-prefixed frames are written at once, no confirmations are sent
+    StreamedFraming = 1,
+    // NOTE: streamed frames tagged with request id and channel, so several threads can have requests in flight
+    MultiplexedFraming = 2
+};
+
+enum ChannelKind {
+    SessionChannel = 0,
+    InstrumentationChannel = 1,
+    ExecutionChannel = 2
+};
+
+// NOTE: header of frames in multiplexed mode; replies of server carry the request id of the request they answer
+struct FrameHeader {
+    int length;
+    unsigned requestId;
+    int channel;
+};
+
+// NOTE: in streamed mode negative lengths denote control frames, which carry their own payload length
+enum ControlFrame {
+    TerminateFrame = -1,
+    ErrorFrame = -2,
+    CreditFrame = -3
+};
+
+// NOTE: encoding of exec commands; server proposes the newest version it knows, client answers with the one it will use
+enum WireEncoding {
+    FixedEncoding = 0,
+    // NOTE: header presence bitmask, LEB128 counts and offsets, 1-byte operand tags
+    CompactEncodingV1 = 1,
+    LatestEncoding = CompactEncodingV1
+};
+
+// NOTE: optional requests, which server can serve; client answers with the subset it will use
+enum ProtocolFeature {
+    ModuleBatchFeature = 1,
+    RemoteMemoryFeature = 2,
+    DeferredExecutionFeature = 4,
+    InstrumentationScopeFeature = 8,
+    // NOTE: signature tokens of probes are sent with the first body of each module, later bodies refer to them by the module id
+    ModuleTokensFeature = 16,
+    // NOTE: P/Invoke methods of probes are defined in each module, their tokens follow signature tokens,
+    //       so that instrumented code calls probes by 'call <token>' instead of 'ldc.i8 <address>; calli <signature>'
+    ProbeMethodsFeature = 32,
+    // NOTE: unmanaged signatures with the CallConvSuppressGCTransition modifier are defined for leaf probes in each module,
+    //       their tokens follow tokens of P/Invoke methods, so that leaf probes are called without GC transitions
+    LeafProbesFeature = 64,
+    SupportedFeatures = ModuleBatchFeature | RemoteMemoryFeature | DeferredExecutionFeature | InstrumentationScopeFeature | ModuleTokensFeature
+                        | ProbeMethodsFeature | LeafProbesFeature
+};
+
+// NOTE: exported name and managed signature of a probe
+struct ProbeImport {
+    const char *name;
+    std::vector<unsigned char> signature;
+    bool leaf;
+};
+
+// NOTE: sent after probes if RemoteMemoryFeature is negotiated; server resolves bases of objects by reading
+//       shadow objects (their ids are sent in exec commands) directly from the memory of this process
+struct RemoteMemoryLayout {
+    unsigned long long processId;
+    unsigned objectLeftOffset;
+    unsigned objectRightOffset;
+};
+
+// NOTE: sent by server after the null-terminated greeting; old clients ignore it and stay in confirmed mode
+struct HandshakeOptions {
+    int framing;
+    int creditWindow; // NOTE: amount of frames that can be sent without waiting for credits, 0 disables flow control
+    int encoding;
+    int features;
 };
 
 class Protocol {
 private:
     Communicator m_communicator;
+    FramingMode m_framing;
+    WireEncoding m_encoding;
+    int m_features;
+    int m_creditWindow;
+    // NOTE: granted by the reading thread and taken by writing threads, so it is changed atomically
+    std::atomic<unsigned> m_credits;
+    int m_consumedFrames;
+    int m_frameHeader[4];
+
+    // NOTE: frames are written by one thread at a time, reading is done by one of the waiting threads
+    std::mutex m_writeLock;
+    std::mutex m_readLock;
+    std::condition_variable m_frameArrived;
+    bool m_reading;
+    bool m_failed;
+    std::atomic<unsigned> m_nextRequestId;
+    std::map<unsigned, std::deque<std::vector<char>>> m_pendingFrames;
 
     bool readConfirmation();
     bool writeConfirmation();
@@ -23,31 +130,73 @@ private:
     bool readCount(int &count);
     bool writeCount(int count);
 
+    char *reserveReceiveBuffer(int count);
+    std::vector<IOChunk> &outgoingChunks();
+    std::vector<char> &outgoingScratch();
+    void beginRequest(ChannelKind channel);
+    // NOTE: sends deferred commands of the calling thread, so that the engine serves its requests in program order
+    bool prepareRequest(char commandByte);
+    bool readExactly(char *buffer, int count);
+    bool readControlFrame(int kind);
+    bool writeFrame(int header, IOChunk *chunks, int count);
+    bool writeControlFrame(int kind, const char *payload, int count);
+    bool acquireCredit();
+
+    bool readConfirmedBuffer(char *&buffer, int &count);
+    bool writeConfirmedChunks(IOChunk *chunks, int count);
+    bool readStreamedBuffer(char *&buffer, int &count);
+    bool writeStreamedChunks(IOChunk *chunks, int count);
+    bool readMultiplexedFrame(FrameHeader &header, char *&buffer);
+    bool readMultiplexedBuffer(char *&buffer, int &count);
+
+    // NOTE: the first chunk is reserved for the header of the message
+    bool writeChunks(IOChunk *chunks, int count);
+    // NOTE: 'buffer' points into the receive buffer of the calling thread and stays valid until its next read
     bool readBuffer(char *&buffer, int &count);
     bool writeBuffer(char *buffer, int count);
 
     bool handshake();
 
 public:
+    Protocol();
+
     bool connect();
     bool sendProbes();
+    bool sendRemoteMemoryLayout(const RemoteMemoryLayout &layout);
     bool startSession();
+    // NOTE: accepted messages are views into the receive buffer, valid until the next accept
     void acceptEntryPoint(char *&entryPointBytes, int &length);
+    // NOTE: follows the entry point if InstrumentationScopeFeature is negotiated
+    bool acceptInstrumentationScope(char *&bytes, int &length);
     bool acceptCommand(CommandType &command);
     bool acceptString(char *&string);
     bool sendStringsPoolIndex(unsigned index);
+    bool sendMainReached();
     bool acceptMethodBody(char *&bytecode, int &codeLength, unsigned &maxStackSize, char *&ehs, unsigned &ehsLength);
+    // NOTE: starts new request of the calling thread, replies to it are accepted by the same thread;
+    //       command byte and the object are sent in one frame
     template<typename T>
     bool sendSerializable(char commandByte, const T &object) {
-        if (!writeBuffer(new char[1] {commandByte}, 1)) return false;
-        char *bytes;
-        unsigned count;
-        object.serialize(bytes, count);
-        bool result = writeBuffer(bytes, count);
-        delete[] bytes;
-        return result;
+        if (!prepareRequest(commandByte)) return false;
+        std::vector<IOChunk> &chunks = outgoingChunks();
+        chunks.clear();
+        chunks.push_back(IOChunk{nullptr, 0});
+        chunks.push_back(IOChunk{&commandByte, 1});
+        object.serialize(chunks, outgoingScratch(), m_encoding);
+        return writeChunks(chunks.data(), (int)chunks.size());
     }
+    // NOTE: makes the calling thread wait for replies to the given request, used by the traffic replay
+    void resumeRequest(unsigned requestId);
+    FramingMode framing() const { return m_framing; }
+    WireEncoding encoding() const { return m_encoding; }
+    bool supports(ProtocolFeature feature) const { return (m_features & feature) != 0; }
+    // NOTE: addresses of probes, which instrumented code calls, in the order they have been sent to the engine
+    const std::vector<unsigned long long> &probesAddresses() const;
+    // NOTE: imports of probes in the same order
+    const std::vector<ProbeImport> &probeImports() const;
     void acceptExecResult(char *&bytes, int &messageLength);
+    bool acceptInstrumentedModule(char *&bytes, int &messageLength);
+    bool sendError(const char *message);
     bool shutdown();
 };
 
@@ -0,0 +1,171 @@
+// Replays recorded responses of the engine into the protocol without CLR and engine:
+//     vsharpReplay <traffic log>
+// Requests of the profiler are taken from the same log, so that replies are accepted in the recorded order.
+
+#include "protocol.h"
+#include "trafficLog.h"
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+using namespace vsharp;
+
+// NOTE: walks frames, written by the profiler during the recorded session
+class ProfilerTrafficReader {
+private:
+    const std::vector<char> &m_traffic;
+    size_t m_position;
+
+    bool readInt(int &value) {
+        if (m_position + sizeof(int) > m_traffic.size()) return false;
+        memcpy(&value, m_traffic.data() + m_position, sizeof(int));
+        m_position += sizeof(int);
+        return true;
+    }
+
+    bool skip(int count) {
+        if (count < 0 || m_position + count > m_traffic.size()) return false;
+        m_position += count;
+        return true;
+    }
+
+public:
+    explicit ProfilerTrafficReader(const std::vector<char> &traffic) : m_traffic(traffic), m_position(0) {}
+
+    // NOTE: the handshake reply is always sent with confirmed framing
+    bool skipConfirmedMessage() {
+        int count;
+        return readInt(count) && skip(count);
+    }
+
+    // NOTE: control frames are skipped, 'payload' points into the log
+    bool nextFrame(FramingMode framing, unsigned &requestId, const char *&payload, int &length) {
+        while (true) {
+            int header, id = 0, channel;
+            if (!readInt(header)) return false;
+            if (framing == MultiplexedFraming && !(readInt(id) && readInt(channel))) return false;
+            requestId = (unsigned)id;
+            if (header < 0) {
+                int size;
+                if (!readInt(size) || !skip(size)) return false;
+                if (header == TerminateFrame) return false;
+                continue;
+            }
+            payload = m_traffic.data() + m_position;
+            length = header;
+            return skip(header);
+        }
+    }
+
+    // NOTE: skips the next frame of the request, which the profiler wrote in reply to the engine
+    bool skipReply(FramingMode framing, unsigned requestId) {
+        unsigned id;
+        const char *payload;
+        int length;
+        while (nextFrame(framing, id, payload, length)) {
+            if (framing != MultiplexedFraming || id == requestId) return true;
+        }
+        return false;
+    }
+};
+
+static bool replayInstrumentation(Protocol &protocol, ProfilerTrafficReader &reader, unsigned requestId) {
+    CommandType command;
+    while (protocol.acceptCommand(command)) {
+        switch (command) {
+            case ReadString: {
+                char *string;
+                if (!protocol.acceptString(string)) return false;
+                delete[] string;
+                // NOTE: index of the string in the pool can not be taken for a command
+                if (!reader.skipReply(protocol.framing(), requestId)) return false;
+                break;
+            }
+            case ReadMethodBody: {
+                char *bytecode, *ehs;
+                int codeLength;
+                unsigned maxStackSize, ehsLength;
+                return protocol.acceptMethodBody(bytecode, codeLength, maxStackSize, ehs, ehsLength);
+            }
+            default:
+                std::cerr << "Unexpected command " << command << " from the engine" << std::endl;
+                return false;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        std::cerr << "Usage: " << argv[0] << " <traffic log>" << std::endl;
+        return 1;
+    }
+    if (!trafficLog.openForReplay(argv[1])) {
+        std::cerr << "Could not load traffic log " << argv[1] << std::endl;
+        return 1;
+    }
+    Protocol protocol;
+    auto start = std::chrono::steady_clock::now();
+    if (!protocol.startSession()) {
+        std::cerr << "Replay of the handshake failed" << std::endl;
+        return 1;
+    }
+    // NOTE: writes of the profiler are dropped, so the engine traffic stays aligned only without confirmations
+    if (protocol.framing() == ConfirmedFraming) {
+        std::cerr << "Sessions with confirmed framing can not be replayed" << std::endl;
+        return 1;
+    }
+    char *entryPoint;
+    int entryPointLength;
+    protocol.acceptEntryPoint(entryPoint, entryPointLength);
+    if (protocol.supports(InstrumentationScopeFeature)) {
+        char *scope;
+        int scopeLength;
+        if (!protocol.acceptInstrumentationScope(scope, scopeLength)) {
+            std::cerr << "Replay of the instrumentation scope failed" << std::endl;
+            return 1;
+        }
+    }
+
+    ProfilerTrafficReader reader(trafficLog.profilerTraffic());
+    unsigned requestId;
+    const char *payload;
+    int length;
+    // NOTE: probes and the layout of shadow objects follow the handshake reply
+    if (!reader.skipConfirmedMessage() || !reader.nextFrame(protocol.framing(), requestId, payload, length) ||
+        (protocol.supports(RemoteMemoryFeature) && !reader.nextFrame(protocol.framing(), requestId, payload, length))) {
+        std::cerr << "Traffic of the profiler is truncated" << std::endl;
+        return 1;
+    }
+    unsigned instrumented = 0, executed = 0;
+    bool success = true;
+    while (success && reader.nextFrame(protocol.framing(), requestId, payload, length)) {
+        // NOTE: command byte starts the frame of the request, its payload follows in the same frame
+        if (length < 1 || (*payload != InstrumentCommand && *payload != InstrumentModuleCommand && *payload != ExecuteCommand)) continue;
+        CommandType command = (CommandType)*payload;
+        protocol.resumeRequest(requestId);
+        if (command == InstrumentCommand) {
+            success = replayInstrumentation(protocol, reader, requestId);
+            ++instrumented;
+        } else if (command == InstrumentModuleCommand) {
+            char *bytes;
+            int messageLength;
+            success = protocol.acceptInstrumentedModule(bytes, messageLength);
+            ++instrumented;
+        } else {
+            char *bytes;
+            int messageLength;
+            protocol.acceptExecResult(bytes, messageLength);
+            ++executed;
+        }
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Replayed " << instrumented << " instrumentations and " << executed << " executions ("
+              << trafficLog.replayedBytes() << " bytes) in " << elapsed / 1000 << " us, recorded session took "
+              << trafficLog.recordedNanoseconds() / 1000 << " us" << std::endl;
+    if (!success || !trafficLog.replayFinished()) {
+        std::cerr << "Replay diverged from the recorded session" << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,207 @@
+#include "sharedMemoryChannel.h"
+#include "waitStrategy.h"
+#include "../logging.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <ctime>
+#include <cstring>
+#include <cerrno>
+
+using namespace vsharp;
+
+// NOTE: the segment is shared between processes, so private futexes can not be used
+// NOTE: returns false on timeout
+static bool futexWait(std::atomic<uint32_t> *word, uint32_t expected) {
+    // NOTE: waking up periodically to notice the termination of the engine
+    struct timespec timeout = {0, 100 * 1000 * 1000};
+    return syscall(SYS_futex, (uint32_t *)word, FUTEX_WAIT, expected, &timeout, nullptr, 0) == 0 || errno != ETIMEDOUT;
+}
+
+static void futexWake(std::atomic<uint32_t> *word) {
+    syscall(SYS_futex, (uint32_t *)word, FUTEX_WAKE, 1, nullptr, nullptr, 0);
+}
+
+SharedMemoryChannel::SharedMemoryChannel()
+    : m_segment(nullptr)
+    , m_segmentSize(0)
+    , m_header(nullptr)
+    , m_in()
+    , m_out()
+    , m_peer(0)
+    , m_peerLost(false)
+{
+}
+
+bool SharedMemoryChannel::open(const char *name) {
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        LOG_ERROR(tout << "Could not open shared memory segment " << name << ": " << strerror(errno));
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) < 0 || (size_t)info.st_size < sizeof(SegmentHeader)) {
+        LOG_ERROR(tout << "Shared memory segment " << name << " is too small");
+        ::close(fd);
+        return false;
+    }
+    m_segmentSize = (size_t)info.st_size;
+    void *segment = mmap(nullptr, m_segmentSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (segment == MAP_FAILED) {
+        LOG_ERROR(tout << "Could not map shared memory segment: " << strerror(errno));
+        return false;
+    }
+    m_segment = (char *)segment;
+    m_header = (SegmentHeader *)m_segment;
+    uint32_t capacity = m_header->capacity;
+    if (m_header->magic != SHM_MAGIC || m_header->version != SHM_VERSION || capacity == 0 || (capacity & (capacity - 1))
+        || sizeof(SegmentHeader) + 2 * sizeof(RingControl) + 2 * (size_t)capacity > m_segmentSize) {
+        LOG_ERROR(tout << "Shared memory segment has unexpected layout (magic = " << HEX(m_header->magic)
+                       << ", version = " << m_header->version << ", capacity = " << capacity << ")");
+        munmap(m_segment, m_segmentSize);
+        m_segment = nullptr;
+        m_header = nullptr;
+        return false;
+    }
+    auto controls = (RingControl *)(m_segment + sizeof(SegmentHeader));
+    char *data = (char *)(controls + 2);
+    // NOTE: ring 0 is written by the engine, ring 1 is written by the profiler
+    m_in = Ring{controls, data, capacity - 1};
+    m_out = Ring{controls + 1, data + capacity, capacity - 1};
+    m_peer = getppid();
+    m_peerLost = false;
+    LOG(tout << "Connected to shared memory segment " << name << " with ring capacity " << capacity);
+    return true;
+}
+
+bool SharedMemoryChannel::peerClosed() const {
+    return m_peerLost || m_header->closed.load(std::memory_order_acquire) != 0;
+}
+
+// NOTE: orphaned processes are reparented, so the engine is gone if the parent has changed or does not exist
+bool SharedMemoryChannel::peerAlive() {
+    if (getppid() == m_peer && (kill(m_peer, 0) == 0 || errno != ESRCH)) return true;
+    LOG_ERROR(tout << "Engine process " << m_peer << " has terminated, failing shared memory channel");
+    m_peerLost = true;
+    return false;
+}
+
+uint32_t SharedMemoryChannel::waitForData(uint32_t tail) {
+    RingControl *control = m_in.control;
+    uint32_t head = control->head.load(std::memory_order_acquire);
+    if (head != tail) return head;
+    uint64_t startedAt = monotonicNanoseconds();
+    bool blocked = false;
+    for (unsigned iteration = 0; head == tail && waiter.maySpin(iteration); ++iteration) {
+        if (peerClosed()) return head;
+        cpuRelax();
+        head = control->head.load(std::memory_order_acquire);
+    }
+    while (head == tail) {
+        if (peerClosed()) return head;
+        control->readerWaiting.store(1, std::memory_order_seq_cst);
+        head = control->head.load(std::memory_order_seq_cst);
+        if (head == tail) {
+            if (!futexWait(&control->head, head) && !peerAlive()) {
+                control->readerWaiting.store(0, std::memory_order_relaxed);
+                return head;
+            }
+            blocked = true;
+        }
+        control->readerWaiting.store(0, std::memory_order_relaxed);
+        head = control->head.load(std::memory_order_acquire);
+    }
+    waiter.recordWait(startedAt, blocked);
+    waiter.recordLatency(control->publishedAt.load(std::memory_order_relaxed), monotonicNanoseconds());
+    return head;
+}
+
+uint32_t SharedMemoryChannel::waitForSpace(uint32_t head) {
+    RingControl *control = m_out.control;
+    uint32_t capacity = m_out.mask + 1;
+    uint32_t tail = control->tail.load(std::memory_order_acquire);
+    for (unsigned iteration = 0; head - tail == capacity && waiter.maySpin(iteration); ++iteration) {
+        if (peerClosed()) return tail;
+        cpuRelax();
+        tail = control->tail.load(std::memory_order_acquire);
+    }
+    while (head - tail == capacity) {
+        if (peerClosed()) return tail;
+        control->writerWaiting.store(1, std::memory_order_seq_cst);
+        tail = control->tail.load(std::memory_order_seq_cst);
+        if (head - tail == capacity && !futexWait(&control->tail, tail) && !peerAlive()) {
+            control->writerWaiting.store(0, std::memory_order_relaxed);
+            return tail;
+        }
+        control->writerWaiting.store(0, std::memory_order_relaxed);
+        tail = control->tail.load(std::memory_order_acquire);
+    }
+    return tail;
+}
+
+int SharedMemoryChannel::read(char *buffer, int count) {
+    RingControl *control = m_in.control;
+    uint32_t tail = control->tail.load(std::memory_order_relaxed);
+    uint32_t head = waitForData(tail);
+    uint32_t available = head - tail;
+    if (available == 0) return 0;
+    uint32_t size = available < (uint32_t)count ? available : (uint32_t)count;
+    uint32_t start = tail & m_in.mask;
+    uint32_t firstPart = m_in.mask + 1 - start;
+    if (firstPart >= size) {
+        memcpy(buffer, m_in.data + start, size);
+    } else {
+        memcpy(buffer, m_in.data + start, firstPart);
+        memcpy(buffer + firstPart, m_in.data, size - firstPart);
+    }
+    control->tail.store(tail + size, std::memory_order_seq_cst);
+    if (control->writerWaiting.load(std::memory_order_seq_cst))
+        futexWake(&control->tail);
+    return (int)size;
+}
+
+int SharedMemoryChannel::write(const char *message, int count) {
+    RingControl *control = m_out.control;
+    uint32_t capacity = m_out.mask + 1;
+    uint32_t head = control->head.load(std::memory_order_relaxed);
+    int written = 0;
+    while (written < count) {
+        uint32_t tail = waitForSpace(head);
+        uint32_t space = capacity - (head - tail);
+        if (space == 0) break;
+        uint32_t rest = (uint32_t)(count - written);
+        uint32_t size = space < rest ? space : rest;
+        uint32_t start = head & m_out.mask;
+        uint32_t firstPart = capacity - start;
+        if (firstPart >= size) {
+            memcpy(m_out.data + start, message + written, size);
+        } else {
+            memcpy(m_out.data + start, message + written, firstPart);
+            memcpy(m_out.data, message + written + firstPart, size - firstPart);
+        }
+        head += size;
+        written += (int)size;
+        control->publishedAt.store(monotonicNanoseconds(), std::memory_order_relaxed);
+        control->head.store(head, std::memory_order_seq_cst);
+        if (control->readerWaiting.load(std::memory_order_seq_cst))
+            futexWake(&control->head);
+    }
+    return written;
+}
+
+bool SharedMemoryChannel::close() {
+    if (!m_segment) return true;
+    waiter.report("shared memory transport");
+    m_header->closed.store(1, std::memory_order_release);
+    futexWake(&m_out.control->head);
+    futexWake(&m_in.control->tail);
+    bool result = munmap(m_segment, m_segmentSize) == 0;
+    m_segment = nullptr;
+    m_header = nullptr;
+    return result;
+}
@@ -0,0 +1,71 @@
+#ifndef SHAREDMEMORYCHANNEL_H_
+#define SHAREDMEMORYCHANNEL_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <sys/types.h>
+
+namespace vsharp {
+
+// NOTE: layout of the segment must be kept in sync with VSharp.SILI/SharedMemoryTransport.fs
+//       [ SegmentHeader | RingControl (engine -> profiler) | RingControl (profiler -> engine) | data 0 | data 1 ]
+#define SHM_MAGIC 0x4D485356 // "VSHM"
+#define SHM_VERSION 2
+#define SHM_CACHE_LINE 64
+
+struct SegmentHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t capacity; // NOTE: size of each ring in bytes, power of two
+    std::atomic<uint32_t> closed;
+    char padding[SHM_CACHE_LINE - 4 * sizeof(uint32_t)];
+};
+
+// NOTE: 'head' and 'tail' are free-running counters, they are also used as futex words;
+//       'publishedAt' is the CLOCK_MONOTONIC time of the last head update, it is used to measure wakeup latency
+struct RingControl {
+    std::atomic<uint32_t> head;
+    std::atomic<uint32_t> readerWaiting;
+    std::atomic<uint64_t> publishedAt;
+    char headPadding[SHM_CACHE_LINE - 2 * sizeof(uint32_t) - sizeof(uint64_t)];
+    std::atomic<uint32_t> tail;
+    std::atomic<uint32_t> writerWaiting;
+    char tailPadding[SHM_CACHE_LINE - 2 * sizeof(uint32_t)];
+};
+
+struct Ring {
+    RingControl *control;
+    char *data;
+    uint32_t mask;
+};
+
+// Single-producer/single-consumer transport over a shared memory segment created by the engine
+class SharedMemoryChannel {
+private:
+    char *m_segment;
+    size_t m_segmentSize;
+    SegmentHeader *m_header;
+    Ring m_in;
+    Ring m_out;
+    // NOTE: the engine, which has started the process; a crashed engine can not set 'closed', so it is polled on timeouts
+    pid_t m_peer;
+    bool m_peerLost;
+
+    bool peerClosed() const;
+    bool peerAlive();
+    uint32_t waitForData(uint32_t tail);
+    uint32_t waitForSpace(uint32_t head);
+
+public:
+    SharedMemoryChannel();
+
+    bool open(const char *name);
+    int read(char *buffer, int count);
+    int write(const char *message, int count);
+    bool close();
+};
+
+}
+
+#endif // SHAREDMEMORYCHANNEL_H_
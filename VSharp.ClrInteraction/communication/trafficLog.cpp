@@ -0,0 +1,133 @@
+#include "trafficLog.h"
+#include "compactEncoding.h"
+#include "../logging.h"
+#include <cstdlib>
+#include <cstring>
+
+using namespace vsharp;
+
+TrafficLog vsharp::trafficLog;
+
+TrafficLog::TrafficLog()
+    : m_file(nullptr)
+    , m_replaying(false)
+    , m_replayPosition(0)
+    , m_recordedNanoseconds(0)
+{
+}
+
+bool TrafficLog::openFromEnvironment() {
+    if (m_replaying) return true;
+    const char *replayPath = getenv("CONCOLIC_REPLAY");
+    if (replayPath && strlen(replayPath) > 0)
+        return openForReplay(replayPath);
+    const char *recordPath = getenv("CONCOLIC_RECORD");
+    if (recordPath && strlen(recordPath) > 0)
+        return openForRecording(recordPath);
+    return true;
+}
+
+bool TrafficLog::openForRecording(const char *path) {
+    m_file = fopen(path, "wb");
+    if (!m_file) {
+        LOG_ERROR(tout << "Could not create traffic log " << path);
+        return false;
+    }
+    unsigned header[3] = {TRAFFIC_LOG_MAGIC, TRAFFIC_LOG_VERSION, ProfilerSide};
+    fwrite(header, sizeof(unsigned), 3, m_file);
+    m_lastRecord = std::chrono::steady_clock::now();
+    LOG(tout << "Recording traffic to " << path);
+    return true;
+}
+
+bool TrafficLog::openForReplay(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        LOG_ERROR(tout << "Could not open traffic log " << path);
+        return false;
+    }
+    std::vector<char> log;
+    char buffer[1 << 16];
+    size_t bytes;
+    while ((bytes = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        log.insert(log.end(), buffer, buffer + bytes);
+    fclose(file);
+    unsigned header[3];
+    if (log.size() < sizeof(header)) {
+        LOG_ERROR(tout << "Traffic log " << path << " is too small");
+        return false;
+    }
+    memcpy(header, log.data(), sizeof(header));
+    if (header[0] != TRAFFIC_LOG_MAGIC || header[1] != TRAFFIC_LOG_VERSION) {
+        LOG_ERROR(tout << "Traffic log " << path << " has unexpected format (magic = " << HEX(header[0])
+                       << ", version = " << header[1] << ")");
+        return false;
+    }
+    // NOTE: logs of both sides can be replayed, bytes sent by the engine are served to the profiler
+    TrafficDirection fromEngine = header[2] == ProfilerSide ? TrafficRead : TrafficWritten;
+    const char *current = log.data() + sizeof(header);
+    const char *end = log.data() + log.size();
+    while (current < end) {
+        TrafficDirection direction = (TrafficDirection)*current++;
+        unsigned long long delta, size;
+        // NOTE: log of the crashed session may end with an incomplete record
+        if (!readVarUInt(current, end, delta) || !readVarUInt(current, end, size) || size > (size_t)(end - current)) {
+            LOG_ERROR(tout << "Traffic log " << path << " is truncated, replaying its complete records");
+            break;
+        }
+        std::vector<char> &traffic = direction == fromEngine ? m_replayed : m_profilerTraffic;
+        traffic.insert(traffic.end(), current, current + size);
+        m_recordedNanoseconds += delta;
+        current += size;
+    }
+    m_replaying = true;
+    m_replayPosition = 0;
+    LOG(tout << "Replaying " << m_replayed.size() << " bytes of engine traffic from " << path);
+    return true;
+}
+
+bool TrafficLog::close() {
+    if (!m_file) return true;
+    std::lock_guard<std::mutex> lock(m_lock);
+    bool result = fclose(m_file) == 0;
+    m_file = nullptr;
+    return result;
+}
+
+void TrafficLog::writeRecord(TrafficDirection direction, const IOChunk *chunks, int count, int size) {
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (!m_file) return;
+    auto now = std::chrono::steady_clock::now();
+    auto delta = std::chrono::duration_cast<std::chrono::nanoseconds>(now - m_lastRecord).count();
+    m_lastRecord = now;
+    m_record.resize(1 + 2 * MAX_VARINT_SIZE);
+    char *current = m_record.data();
+    *current++ = (char)direction;
+    writeVarUInt(current, (unsigned long long)delta);
+    writeVarUInt(current, (unsigned long long)size);
+    fwrite(m_record.data(), 1, current - m_record.data(), m_file);
+    for (int i = 0; i < count && size > 0; ++i) {
+        size_t part = chunks[i].size < (size_t)size ? chunks[i].size : (size_t)size;
+        fwrite(chunks[i].data, 1, part, m_file);
+        size -= (int)part;
+    }
+}
+
+void TrafficLog::record(TrafficDirection direction, const char *data, int size) {
+    if (!m_file || size <= 0) return;
+    IOChunk chunk{data, (size_t)size};
+    writeRecord(direction, &chunk, 1, size);
+}
+
+void TrafficLog::record(TrafficDirection direction, const IOChunk *chunks, int count, int size) {
+    if (!m_file || size <= 0) return;
+    writeRecord(direction, chunks, count, size);
+}
+
+int TrafficLog::replayRead(char *buffer, int count) {
+    size_t rest = m_replayed.size() - m_replayPosition;
+    size_t size = rest < (size_t)count ? rest : (size_t)count;
+    memcpy(buffer, m_replayed.data() + m_replayPosition, size);
+    m_replayPosition += size;
+    return (int)size;
+}
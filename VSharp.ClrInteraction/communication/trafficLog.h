@@ -0,0 +1,69 @@
+#ifndef TRAFFICLOG_H_
+#define TRAFFICLOG_H_
+
+#include "communicator.h"
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+namespace vsharp {
+
+// NOTE: format must be kept in sync with VSharp.SILI/TrafficLog.fs
+//       [ magic | version | side ] followed by records [ direction : byte | time delta in ns : varint | length : varint | bytes ]
+#define TRAFFIC_LOG_MAGIC 0x4C545356 // "VSTL"
+#define TRAFFIC_LOG_VERSION 1
+
+enum TrafficSide {
+    ProfilerSide = 0,
+    EngineSide = 1
+};
+
+enum TrafficDirection {
+    TrafficRead = 0,
+    TrafficWritten = 1
+};
+
+// Tees the traffic of the communicator into a file (CONCOLIC_RECORD) or serves recorded responses of the engine (CONCOLIC_REPLAY)
+class TrafficLog {
+private:
+    FILE *m_file;
+    std::mutex m_lock;
+    std::chrono::steady_clock::time_point m_lastRecord;
+    std::vector<char> m_record;
+
+    bool m_replaying;
+    std::vector<char> m_replayed;
+    std::vector<char> m_profilerTraffic;
+    size_t m_replayPosition;
+    unsigned long long m_recordedNanoseconds;
+
+    void writeRecord(TrafficDirection direction, const IOChunk *chunks, int count, int size);
+
+public:
+    TrafficLog();
+
+    bool openFromEnvironment();
+    bool openForRecording(const char *path);
+    bool openForReplay(const char *path);
+    bool close();
+
+    bool recording() const { return m_file != nullptr; }
+    bool replaying() const { return m_replaying; }
+
+    void record(TrafficDirection direction, const char *data, int size);
+    // NOTE: records the first 'size' bytes of chunks as one record
+    void record(TrafficDirection direction, const IOChunk *chunks, int count, int size);
+
+    int replayRead(char *buffer, int count);
+    size_t replayedBytes() const { return m_replayed.size(); }
+    const std::vector<char> &profilerTraffic() const { return m_profilerTraffic; }
+    bool replayFinished() const { return m_replayPosition == m_replayed.size(); }
+    unsigned long long recordedNanoseconds() const { return m_recordedNanoseconds; }
+};
+
+extern TrafficLog trafficLog;
+
+}
+
+#endif // TRAFFICLOG_H_
@@ -1,21 +1,45 @@
 #include "communicator.h"
+#include "trafficLog.h"
+#include "waitStrategy.h"
 #include "../logging.h"
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
+#include <climits>
+#include <vector>
 #include <unistd.h>
 #include <cstring>
 #include <cerrno>
+#ifdef SHARED_MEMORY_TRANSPORT
+#include "sharedMemoryChannel.h"
+#endif
 
 using namespace vsharp;
 
 int fd;
+std::vector<iovec> iovecs;
+#ifdef SHARED_MEMORY_TRANSPORT
+// NOTE: if engine has provided shared memory segment, it is used instead of socket
+SharedMemoryChannel shm;
+bool useSharedMemory = false;
+#endif
 
 bool reportError() {
     LOG_ERROR(tout << strerror(errno));
     return false;
 }
 
-bool Communicator::open() {
+bool writeAll(const char *message, size_t count) {
+    while (count > 0) {
+        ssize_t bytes = ::write(fd, message, count);
+        if (bytes < 0) return reportError();
+        message += bytes;
+        count -= bytes;
+    }
+    return true;
+}
+
+bool openSocket() {
     fd = socket(AF_UNIX, SOCK_STREAM, 0);
     if (fd < 0)
         return reportError();
@@ -31,22 +55,134 @@ bool Communicator::open() {
     return true;
 }
 
-int Communicator::read(char *buffer, int count) {
-    int bytes = ::read(fd, buffer, count);
+bool Communicator::open() {
+    if (!trafficLog.openFromEnvironment()) return false;
+    // NOTE: replayed session does not need the engine
+    if (trafficLog.replaying()) return true;
+    waiter.configureFromEnvironment();
+    if (!pinProcessFromEnvironment()) return false;
+#ifdef SHARED_MEMORY_TRANSPORT
+    std::string shmEnvVar = "CONCOLIC_SHM";
+    auto segmentName = getenv(shmEnvVar.c_str());
+    if (segmentName && strlen(segmentName) > 0) {
+        LOG(tout << "Using shared memory transport");
+        useSharedMemory = true;
+        return shm.open(segmentName);
+    }
+#endif
+    return openSocket();
+}
+
+int readChannel(char *buffer, int count) {
+#ifdef SHARED_MEMORY_TRANSPORT
+    if (useSharedMemory)
+        return shm.read(buffer, count);
+#endif
+    // NOTE: socket does not tell when the data was sent, so only the time of waiting is measured
+    ssize_t bytes = recv(fd, buffer, count, MSG_DONTWAIT);
+    if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        uint64_t startedAt = monotonicNanoseconds();
+        for (unsigned iteration = 0; bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && waiter.maySpin(iteration); ++iteration) {
+            cpuRelax();
+            bytes = recv(fd, buffer, count, MSG_DONTWAIT);
+        }
+        bool blocked = bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        if (blocked)
+            bytes = ::read(fd, buffer, count);
+        waiter.recordWait(startedAt, blocked);
+    }
 //    LOG(tout << "read " << count << " bytes: " << buffer);
     if (bytes < 0) reportError();
-    return bytes;
+    return (int)bytes;
 }
 
-int Communicator::write(char *message, int count) {
+int writeChannel(char *message, int count) {
 //    LOG(tout << "writing " << count << " bytes: " << message);
+#ifdef SHARED_MEMORY_TRANSPORT
+    if (useSharedMemory)
+        return shm.write(message, count);
+#endif
     int bytes = ::write(fd, message, count);
     if (bytes < 0) reportError();
     return bytes;
 }
 
+int writevChannel(const IOChunk *chunks, int count) {
+#ifdef SHARED_MEMORY_TRANSPORT
+    if (useSharedMemory) {
+        // NOTE: chunks are copied straight into the ring
+        int written = 0;
+        for (int i = 0; i < count; ++i) {
+            int size = (int)chunks[i].size;
+            int bytes = shm.write(chunks[i].data, size);
+            written += bytes;
+            if (bytes != size) break;
+        }
+        return written;
+    }
+#endif
+    int written = 0;
+    for (int i = 0; i < count; i += IOV_MAX) {
+        int batch = count - i < IOV_MAX ? count - i : IOV_MAX;
+        iovecs.resize(batch);
+        for (int j = 0; j < batch; ++j) {
+            iovecs[j].iov_base = (void *)chunks[i + j].data;
+            iovecs[j].iov_len = chunks[i + j].size;
+        }
+        ssize_t bytes = ::writev(fd, iovecs.data(), batch);
+        if (bytes < 0) {
+            reportError();
+            return written;
+        }
+        // NOTE: the rest of partially written batch is sent chunk by chunk
+        for (int j = 0; j < batch; ++j) {
+            size_t size = iovecs[j].iov_len;
+            if ((size_t)bytes < size && !writeAll(chunks[i + j].data + bytes, size - bytes))
+                return written;
+            bytes = (size_t)bytes < size ? 0 : bytes - size;
+            written += (int)size;
+        }
+    }
+    return written;
+}
+
+int Communicator::read(char *buffer, int count) {
+    if (trafficLog.replaying())
+        return trafficLog.replayRead(buffer, count);
+    int bytes = readChannel(buffer, count);
+    trafficLog.record(TrafficRead, buffer, bytes);
+    return bytes;
+}
+
+// NOTE: in replay messages of the profiler are dropped
+int Communicator::write(char *message, int count) {
+    if (trafficLog.replaying()) return count;
+    int bytes = writeChannel(message, count);
+    trafficLog.record(TrafficWritten, message, bytes);
+    return bytes;
+}
+
+int Communicator::writev(const IOChunk *chunks, int count) {
+    if (trafficLog.replaying()) {
+        int size = 0;
+        for (int i = 0; i < count; ++i)
+            size += (int)chunks[i].size;
+        return size;
+    }
+    int bytes = writevChannel(chunks, count);
+    trafficLog.record(TrafficWritten, chunks, count, bytes);
+    return bytes;
+}
+
 bool Communicator::close() {
-    if (::close(fd)) 
+    if (!trafficLog.close()) reportError();
+    if (trafficLog.replaying()) return true;
+#ifdef SHARED_MEMORY_TRANSPORT
+    if (useSharedMemory)
+        return shm.close();
+#endif
+    waiter.report("socket transport");
+    if (::close(fd))
         return reportError();
-    return true;   
+    return true;
 }
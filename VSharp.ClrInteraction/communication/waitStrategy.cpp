@@ -0,0 +1,140 @@
+#include "waitStrategy.h"
+#include "../logging.h"
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#ifdef __linux__
+#include <sched.h>
+#include <dirent.h>
+#endif
+
+using namespace vsharp;
+
+Waiter vsharp::waiter;
+
+Waiter::Waiter()
+    : m_strategy(BlockingWait)
+    , m_spinBudget(DEFAULT_SPIN_BUDGET)
+    , m_statistics()
+{
+}
+
+void Waiter::configureFromEnvironment() {
+    const char *strategy = getenv("CONCOLIC_WAIT");
+    if (strategy && !strcmp(strategy, "spin"))
+        m_strategy = SpinThenBlockWait;
+    else if (strategy && !strcmp(strategy, "poll"))
+        m_strategy = BusyPollWait;
+    else
+        m_strategy = BlockingWait;
+    const char *budget = getenv("CONCOLIC_SPIN_BUDGET");
+    if (budget && strlen(budget) > 0)
+        m_spinBudget = (unsigned)strtoul(budget, nullptr, 10);
+    LOG(tout << "Wait strategy " << m_strategy << ", spin budget " << m_spinBudget);
+}
+
+bool Waiter::maySpin(unsigned iteration) const {
+    switch (m_strategy) {
+        case SpinThenBlockWait:
+            return iteration < m_spinBudget;
+        case BusyPollWait:
+            return true;
+        default:
+            return false;
+    }
+}
+
+void Waiter::recordWait(uint64_t startedAt, bool blocked) {
+    ++m_statistics.waits;
+    if (blocked)
+        ++m_statistics.blockedWakeups;
+    else
+        ++m_statistics.spinWakeups;
+    m_statistics.waitNanoseconds += monotonicNanoseconds() - startedAt;
+}
+
+void Waiter::recordLatency(uint64_t publishedAt, uint64_t observedAt) {
+    // NOTE: peer could publish a timestamp of the previous write, when several writes were merged into one read
+    if (publishedAt == 0 || observedAt < publishedAt) return;
+    ++m_statistics.latencySamples;
+    m_statistics.wakeupLatencyNanoseconds += observedAt - publishedAt;
+}
+
+void Waiter::report(const char *transport) const {
+    const WaitStatistics &s = m_statistics;
+    LOG(tout << "Wait statistics of " << transport << " (strategy " << m_strategy << ", spin budget " << m_spinBudget << "): "
+             << s.waits << " waits, " << s.spinWakeups << " woken while spinning, " << s.blockedWakeups << " woken after blocking, "
+             << "mean wait " << (s.waits ? s.waitNanoseconds / s.waits : 0) << " ns, "
+             << "mean wakeup latency " << (s.latencySamples ? s.wakeupLatencyNanoseconds / s.latencySamples : 0) << " ns");
+}
+
+uint64_t vsharp::monotonicNanoseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+void vsharp::cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+#ifdef __linux__
+static bool parseCpus(const char *cpus, cpu_set_t &set) {
+    CPU_ZERO(&set);
+    const char *current = cpus;
+    while (*current) {
+        char *end;
+        unsigned long first = strtoul(current, &end, 10);
+        if (end == current) return false;
+        unsigned long last = first;
+        if (*end == '-') {
+            current = end + 1;
+            last = strtoul(current, &end, 10);
+            if (end == current || last < first) return false;
+        }
+        for (unsigned long cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu)
+            CPU_SET(cpu, &set);
+        current = *end == ',' ? end + 1 : end;
+        if (*end && *end != ',') return false;
+    }
+    return CPU_COUNT(&set) > 0;
+}
+#endif
+
+bool vsharp::pinProcessFromEnvironment() {
+    const char *cpus = getenv("CONCOLIC_CPUS");
+    if (!cpus || strlen(cpus) == 0) return true;
+#ifdef __linux__
+    cpu_set_t set;
+    if (!parseCpus(cpus, set)) {
+        LOG_ERROR(tout << "Invalid CPU list " << cpus);
+        return false;
+    }
+    // NOTE: runtime threads already exist at this point, new threads inherit the affinity of their creators
+    DIR *tasks = opendir("/proc/self/task");
+    if (!tasks) {
+        LOG_ERROR(tout << "Could not enumerate threads: " << strerror(errno));
+        return false;
+    }
+    bool result = true;
+    while (struct dirent *task = readdir(tasks)) {
+        if (task->d_name[0] == '.') continue;
+        pid_t tid = (pid_t)atoi(task->d_name);
+        if (sched_setaffinity(tid, sizeof(set), &set) < 0) {
+            LOG_ERROR(tout << "Could not pin thread " << tid << " to CPUs " << cpus << ": " << strerror(errno));
+            result = false;
+        }
+    }
+    closedir(tasks);
+    LOG(tout << "Pinned profiled process to CPUs " << cpus);
+    return result;
+#else
+    LOG(tout << "CPU pinning is not supported on this platform, ignoring CONCOLIC_CPUS=" << cpus);
+    return true;
+#endif
+}
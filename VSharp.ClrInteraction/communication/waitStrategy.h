@@ -0,0 +1,61 @@
+#ifndef WAITSTRATEGY_H_
+#define WAITSTRATEGY_H_
+
+#include <cstdint>
+
+namespace vsharp {
+
+// NOTE: chosen via CONCOLIC_WAIT=block|spin|poll, spin budget is set via CONCOLIC_SPIN_BUDGET (iterations)
+enum WaitStrategy {
+    BlockingWait = 0,
+    SpinThenBlockWait = 1,
+    BusyPollWait = 2
+};
+
+#define DEFAULT_SPIN_BUDGET 4096
+
+// NOTE: wakeup latency is the time between publication of data by the peer and the moment the reader notices it;
+//       it is known only for transports, which publish timestamps (shared memory)
+struct WaitStatistics {
+    uint64_t waits;
+    uint64_t spinWakeups;
+    uint64_t blockedWakeups;
+    uint64_t waitNanoseconds;
+    uint64_t latencySamples;
+    uint64_t wakeupLatencyNanoseconds;
+};
+
+class Waiter {
+private:
+    WaitStrategy m_strategy;
+    unsigned m_spinBudget;
+    WaitStatistics m_statistics;
+
+public:
+    Waiter();
+
+    void configureFromEnvironment();
+    WaitStrategy strategy() const { return m_strategy; }
+    // NOTE: amount of polls before falling back to blocking, unbounded for busy-poll
+    bool maySpin(unsigned iteration) const;
+    bool mayBlock() const { return m_strategy != BusyPollWait; }
+
+    void recordWait(uint64_t startedAt, bool blocked);
+    void recordLatency(uint64_t publishedAt, uint64_t observedAt);
+    const WaitStatistics &statistics() const { return m_statistics; }
+    void report(const char *transport) const;
+};
+
+// NOTE: CLOCK_MONOTONIC in nanoseconds, the same clock is used by the engine to stamp publications
+uint64_t monotonicNanoseconds();
+void cpuRelax();
+
+// NOTE: pins all threads of the profiled process to the CPUs from CONCOLIC_CPUS (e.g. "2,3" or "2-5"),
+//       so that it shares caches with the engine
+bool pinProcessFromEnvironment();
+
+extern Waiter waiter;
+
+}
+
+#endif // WAITSTRATEGY_H_
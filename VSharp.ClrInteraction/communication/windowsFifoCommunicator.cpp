@@ -1,4 +1,5 @@
 #include "communicator.h"
+#include "trafficLog.h"
 #include "../logging.h"
 #include <windows.h>
 #include <stdio.h>
@@ -17,6 +18,9 @@ bool reportError() {
 }
 
 bool Communicator::open() {
+    if (!trafficLog.openFromEnvironment()) return false;
+    // NOTE: replayed session does not need the engine
+    if (trafficLog.replaying()) return true;
     std::wstring pipeEnvVar = L"CONCOLIC_PIPE";
     const wchar_t *pipeFile = _wgetenv(pipeEnvVar.c_str());
     std::wstring pipe(pipeFile);
@@ -26,7 +30,7 @@ bool Communicator::open() {
     return true;
 }
 
-int Communicator::read(char *buffer, int count) {
+int readPipe(char *buffer, int count) {
     DWORD cbRead = -1;
     BOOL fSuccess = ReadFile(hPipe, buffer, count, &cbRead, NULL);
 
@@ -34,7 +38,7 @@ int Communicator::read(char *buffer, int count) {
     return cbRead;
 }
 
-int Communicator::write(char *message, int count) {
+int writePipe(char *message, int count) {
     DWORD cbWritten;
     BOOL fSuccess = WriteFile(hPipe, message, count, &cbWritten, NULL);
 
@@ -42,7 +46,36 @@ int Communicator::write(char *message, int count) {
     return cbWritten;
 }
 
+int Communicator::read(char *buffer, int count) {
+    if (trafficLog.replaying())
+        return trafficLog.replayRead(buffer, count);
+    int bytes = readPipe(buffer, count);
+    trafficLog.record(TrafficRead, buffer, bytes);
+    return bytes;
+}
+
+// NOTE: in replay messages of the profiler are dropped
+int Communicator::write(char *message, int count) {
+    if (trafficLog.replaying()) return count;
+    int bytes = writePipe(message, count);
+    trafficLog.record(TrafficWritten, message, bytes);
+    return bytes;
+}
+
+int Communicator::writev(const IOChunk *chunks, int count) {
+    int written = 0;
+    for (int i = 0; i < count; ++i) {
+        int size = (int)chunks[i].size;
+        int bytes = write((char *)chunks[i].data, size);
+        written += bytes;
+        if (bytes != size) break;
+    }
+    return written;
+}
+
 bool Communicator::close() {
+    if (!trafficLog.close()) reportError();
+    if (trafficLog.replaying()) return true;
     CloseHandle(hPipe);
     return true;
 }
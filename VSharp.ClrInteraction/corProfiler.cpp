@@ -34,6 +34,7 @@ HRESULT STDMETHODCALLTYPE CorProfiler::Initialize(IUnknown *pICorProfilerInfoUnk
 
     DWORD eventMask =
         COR_PRF_MONITOR_JIT_COMPILATION |
+        COR_PRF_MONITOR_MODULE_LOADS |
         COR_PRF_DISABLE_ALL_NGEN_IMAGES |
 //        COR_PRF_DISABLE_OPTIMIZATIONS |
 //        COR_PRF_MONITOR_CACHE_SEARCHES |
@@ -65,7 +66,13 @@ HRESULT STDMETHODCALLTYPE CorProfiler::Initialize(IUnknown *pICorProfilerInfoUnk
 
     protocol = new vsharp::Protocol();
     if (!protocol->startSession()) return E_FAIL;
+    if (protocol->supports(RemoteMemoryFeature)) {
+        RemoteMemoryLayout layout{GetCurrentProcessId(), 0, 0};
+        Heap::objectLayout(layout.objectLeftOffset, layout.objectRightOffset);
+        if (!protocol->sendRemoteMemoryLayout(layout)) return E_FAIL;
+    }
 
+    heap.openShadowFromEnvironment();
     instrumenter = new Instrumenter(*corProfilerInfo, *protocol);
     instrumenter->configureEntryPoint();
 
@@ -74,6 +81,7 @@ HRESULT STDMETHODCALLTYPE CorProfiler::Initialize(IUnknown *pICorProfilerInfoUnk
 
 HRESULT STDMETHODCALLTYPE CorProfiler::Shutdown()
 {
+    heap.reportFootprint();
 #ifdef _LOGGING
     close_log();
 #endif
@@ -152,14 +160,14 @@ HRESULT STDMETHODCALLTYPE CorProfiler::ModuleLoadStarted(ModuleID moduleId)
 
 HRESULT STDMETHODCALLTYPE CorProfiler::ModuleLoadFinished(ModuleID moduleId, HRESULT hrStatus)
 {
-    UNUSED(moduleId);
-    UNUSED(hrStatus);
-    return S_OK;
+    if (FAILED(hrStatus))
+        return S_OK;
+    return instrumenter->instrumentModule(moduleId);
 }
 
 HRESULT STDMETHODCALLTYPE CorProfiler::ModuleUnloadStarted(ModuleID moduleId)
 {
-    UNUSED(moduleId);
+    instrumenter->moduleUnloaded(moduleId);
     return S_OK;
 }
 
@@ -388,9 +396,7 @@ HRESULT STDMETHODCALLTYPE CorProfiler::RuntimeThreadResumed(ThreadID threadId)
 
 HRESULT STDMETHODCALLTYPE CorProfiler::MovedReferences(ULONG cMovedObjectIDRanges, ObjectID oldObjectIDRangeStart[], ObjectID newObjectIDRangeStart[], ULONG cObjectIDRangeLength[])
 {
-    for (int i = 0; i < cMovedObjectIDRanges; ++i) {
-        heap.moveAndMark(oldObjectIDRangeStart[i], newObjectIDRangeStart[i], cObjectIDRangeLength[i]);
-    }
+    heap.moveAndMark(cMovedObjectIDRanges, oldObjectIDRangeStart, newObjectIDRangeStart, cObjectIDRangeLength);
     return S_OK;
 }
 bool corElementTypeIsPrimitive(CorElementType corElementType) {
@@ -793,8 +799,7 @@ HRESULT STDMETHODCALLTYPE CorProfiler::GarbageCollectionStarted(int cGenerations
 
 HRESULT STDMETHODCALLTYPE CorProfiler::SurvivingReferences(ULONG cSurvivingObjectIDRanges, ObjectID objectIDRangeStart[], ULONG cObjectIDRangeLength[])
 {
-    for (int i = 0; i < cSurvivingObjectIDRanges; ++i)
-        heap.markSurvivedObjects(objectIDRangeStart[i], cObjectIDRangeLength[i]);
+    heap.markSurvivedObjects(cSurvivingObjectIDRanges, objectIDRangeStart, cObjectIDRangeLength);
     return S_OK;
 }
 
@@ -0,0 +1,238 @@
+#include "instrumentationCache.h"
+#include "logging.h"
+#include <cstdlib>
+#include <cstring>
+#include <set>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace vsharp;
+
+#define CEE_LDC_I8_BYTE 0x21
+
+struct CacheRecordHeader {
+    GUID mvid;
+    unsigned long long ilHash;
+    unsigned long long probesVersion;
+    // NOTE: address of the first probe in the run, which has instrumented the body
+    unsigned long long probesBase;
+    unsigned recordSize;
+    unsigned token;
+    unsigned maxStackSize;
+    unsigned codeLength;
+    unsigned ehsLength;
+    unsigned reserved;
+};
+
+bool CacheKey::operator<(const CacheKey &other) const {
+    int mvidOrder = memcmp(&mvid, &other.mvid, sizeof(GUID));
+    if (mvidOrder != 0) return mvidOrder < 0;
+    if (token != other.token) return token < other.token;
+    if (ilHash != other.ilHash) return ilHash < other.ilHash;
+    return probesVersion < other.probesVersion;
+}
+
+InstrumentationCache::InstrumentationCache()
+    : m_file(-1)
+    , m_mapping(nullptr)
+    , m_mappingSize(0)
+    , m_probesLayoutHash(0)
+    , m_entryPointHash(0)
+    , m_hits(0)
+    , m_stores(0)
+{
+}
+
+InstrumentationCache::~InstrumentationCache() {
+    close();
+}
+
+// NOTE: FNV-1a
+unsigned long long InstrumentationCache::hash(const char *bytes, size_t count, unsigned long long seed) {
+    unsigned long long result = seed;
+    for (size_t i = 0; i < count; i++) {
+        result ^= (unsigned char)bytes[i];
+        result *= 0x100000001B3ULL;
+    }
+    return result;
+}
+
+unsigned long long InstrumentationCache::ilHash(const char *bytecode, unsigned codeLength, const char *ehs, unsigned ehsLength, unsigned maxStackSize) const {
+    unsigned long long result = hash((const char *)&maxStackSize, sizeof(unsigned), 0xCBF29CE484222325ULL);
+    result = hash((const char *)&codeLength, sizeof(unsigned), result);
+    result = hash(bytecode, codeLength, result);
+    return hash(ehs, ehsLength, result);
+}
+
+void InstrumentationCache::setEntryPoint(const GUID &mvid, unsigned token) {
+    unsigned long long result = hash((const char *)&mvid, sizeof(GUID), 0xCBF29CE484222325ULL);
+    m_entryPointHash = hash((const char *)&token, sizeof(unsigned), result);
+}
+
+unsigned long long InstrumentationCache::probesVersion(const char *signatureTokens, unsigned signatureTokensLength) const {
+    unsigned long long entryPoint = m_entryPointHash;
+    unsigned long long result = hash((const char *)&entryPoint, sizeof(entryPoint), m_probesLayoutHash);
+    return hash(signatureTokens, signatureTokensLength, result);
+}
+
+bool InstrumentationCache::openFromEnvironment(const std::vector<unsigned long long> &probes) {
+#ifdef _DEBUG
+    // NOTE: debug probes refer to strings by indices of the pool, which are valid only in the run, that has allocated them
+    LOG(tout << "Instrumentation cache is disabled in debug builds");
+    return false;
+#else
+    const char *path = getenv("CONCOLIC_IL_CACHE");
+    if (!path || strlen(path) == 0) return false;
+    return open(path, probes);
+#endif
+}
+
+bool InstrumentationCache::open(const char *path, const std::vector<unsigned long long> &probes) {
+#ifdef WIN32
+    LOG_ERROR(tout << "Instrumentation cache is not supported on this platform");
+    return false;
+#else
+    if (probes.empty()) return false;
+    m_probes = probes;
+    // NOTE: probes are relocated together with the client library, so only their relative layout must match
+    m_probesLayoutHash = 0xCBF29CE484222325ULL;
+    for (unsigned long long probe : probes) {
+        unsigned long long offset = probe - probes[0];
+        m_probesLayoutHash = hash((const char *)&offset, sizeof(offset), m_probesLayoutHash);
+    }
+
+    m_file = ::open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (m_file < 0) {
+        LOG_ERROR(tout << "Could not open instrumentation cache " << path);
+        return false;
+    }
+    struct stat status;
+    if (fstat(m_file, &status) != 0) {
+        close();
+        return false;
+    }
+    size_t fileSize = (size_t)status.st_size;
+    unsigned header[2] = {IL_CACHE_MAGIC, IL_CACHE_VERSION};
+    size_t validSize = 0;
+    if (fileSize >= sizeof(header)) {
+        m_mapping = (const char *)mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, m_file, 0);
+        if (m_mapping == MAP_FAILED) {
+            m_mapping = nullptr;
+        } else {
+            m_mappingSize = fileSize;
+            if (!index(fileSize, validSize))
+                LOG_ERROR(tout << "Instrumentation cache " << path << " is corrupted, keeping " << m_records.size() << " records");
+        }
+    }
+    // NOTE: cache of another format is dropped, incomplete record of the crashed run is cut off
+    if (validSize == 0) {
+        m_records.clear();
+        if (ftruncate(m_file, 0) != 0 || write(m_file, header, sizeof(header)) != (ssize_t)sizeof(header)) {
+            close();
+            return false;
+        }
+    } else if (validSize != fileSize && ftruncate(m_file, (off_t)validSize) != 0) {
+        close();
+        return false;
+    }
+    LOG(tout << "Instrumentation cache " << path << " is opened with " << m_records.size() << " records");
+    return true;
+#endif
+}
+
+bool InstrumentationCache::index(size_t fileSize, size_t &validSize) {
+    unsigned header[2];
+    memcpy(header, m_mapping, sizeof(header));
+    if (header[0] != IL_CACHE_MAGIC || header[1] != IL_CACHE_VERSION) {
+        validSize = 0;
+        return true;
+    }
+    const char *current = m_mapping + sizeof(header);
+    const char *end = m_mapping + fileSize;
+    while (current < end) {
+        validSize = current - m_mapping;
+        if ((size_t)(end - current) < sizeof(CacheRecordHeader)) return false;
+        CacheRecordHeader record;
+        memcpy(&record, current, sizeof(CacheRecordHeader));
+        size_t expectedSize = sizeof(CacheRecordHeader) + (size_t)record.codeLength + record.ehsLength;
+        if (record.recordSize != expectedSize || (size_t)(end - current) < expectedSize) return false;
+        // NOTE: later records win, so that a body is refreshed by storing it again
+        m_records[CacheKey{record.mvid, record.token, record.ilHash, record.probesVersion}] = current;
+        current += record.recordSize;
+    }
+    validSize = fileSize;
+    return true;
+}
+
+void InstrumentationCache::close() {
+#ifndef WIN32
+    if (m_mapping) munmap((void *)m_mapping, m_mappingSize);
+    if (m_file >= 0) {
+        LOG(tout << "Instrumentation cache: " << m_hits.load() << " hits, " << m_stores.load() << " stored bodies");
+        ::close(m_file);
+    }
+#endif
+    m_mapping = nullptr;
+    m_mappingSize = 0;
+    m_file = -1;
+    m_records.clear();
+}
+
+// NOTE: instrumented IL calls probes by absolute addresses (ldc.i8 <address>; calli), which change with the load address
+//       of the client library; immediates of ldc.i8, equal to probe addresses of the run that has stored the body, are shifted
+void InstrumentationCache::relocate(std::vector<char> &bytecode, unsigned long long probesBase) const {
+    unsigned long long delta = m_probes[0] - probesBase;
+    if (delta == 0) return;
+    std::set<unsigned long long> storedProbes;
+    for (unsigned long long probe : m_probes)
+        storedProbes.insert(probe - delta);
+    size_t size = bytecode.size();
+    for (size_t i = 0; i + 1 + sizeof(unsigned long long) <= size; i++) {
+        if ((unsigned char)bytecode[i] != CEE_LDC_I8_BYTE) continue;
+        unsigned long long value;
+        memcpy(&value, bytecode.data() + i + 1, sizeof(value));
+        if (storedProbes.find(value) == storedProbes.end()) continue;
+        value += delta;
+        memcpy(bytecode.data() + i + 1, &value, sizeof(value));
+        i += sizeof(value);
+    }
+}
+
+bool InstrumentationCache::lookup(const CacheKey &key, CachedBody &body) {
+    if (!enabled() || m_entryPointHash == 0) return false;
+    const auto found = m_records.find(key);
+    if (found == m_records.end()) return false;
+    CacheRecordHeader record;
+    memcpy(&record, found->second, sizeof(CacheRecordHeader));
+    const char *bytecode = found->second + sizeof(CacheRecordHeader);
+    body.bytecode.assign(bytecode, bytecode + record.codeLength);
+    body.ehs.assign(bytecode + record.codeLength, bytecode + record.codeLength + record.ehsLength);
+    body.maxStackSize = record.maxStackSize;
+    relocate(body.bytecode, record.probesBase);
+    ++m_hits;
+    return true;
+}
+
+void InstrumentationCache::store(const CacheKey &key, const char *bytecode, unsigned codeLength, const char *ehs, unsigned ehsLength, unsigned maxStackSize) {
+#ifndef WIN32
+    if (!enabled() || m_entryPointHash == 0) return;
+    CacheRecordHeader record{key.mvid, key.ilHash, key.probesVersion, m_probes[0],
+                             (unsigned)(sizeof(CacheRecordHeader) + codeLength + ehsLength),
+                             key.token, maxStackSize, codeLength, ehsLength, 0};
+    std::vector<char> buffer(record.recordSize);
+    memcpy(buffer.data(), &record, sizeof(CacheRecordHeader));
+    memcpy(buffer.data() + sizeof(CacheRecordHeader), bytecode, codeLength);
+    memcpy(buffer.data() + sizeof(CacheRecordHeader) + codeLength, ehs, ehsLength);
+    // NOTE: one write per record, so that concurrent runs do not interleave their records
+    if (write(m_file, buffer.data(), buffer.size()) != (ssize_t)buffer.size()) {
+        LOG_ERROR(tout << "Could not store instrumented body of token " << HEX(key.token) << " in the instrumentation cache");
+        return;
+    }
+    ++m_stores;
+#endif
+}
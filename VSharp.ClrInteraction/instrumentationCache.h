@@ -0,0 +1,74 @@
+#ifndef INSTRUMENTATIONCACHE_H_
+#define INSTRUMENTATIONCACHE_H_
+
+#include "cor.h"
+#include <atomic>
+#include <cstddef>
+#include <map>
+#include <vector>
+
+namespace vsharp {
+
+// NOTE: format of the cache file: [ magic | version ] followed by records [ CacheRecordHeader | bytecode | ehs ]
+#define IL_CACHE_MAGIC 0x43495356 // "VSIC"
+#define IL_CACHE_VERSION 2
+
+// NOTE: body is valid only for the same module version (MVID), the same original IL and the same probes,
+//       i.e. the same layout of probes in the client library, the same signature tokens in the module and the same
+//       entry point (module MVID and token), which gets EnterMain/LeaveMain probes and no concrete clone
+struct CacheKey {
+    GUID mvid;
+    unsigned token;
+    unsigned long long ilHash;
+    unsigned long long probesVersion;
+
+    bool operator<(const CacheKey &other) const;
+};
+
+struct CachedBody {
+    std::vector<char> bytecode;
+    std::vector<char> ehs;
+    unsigned maxStackSize;
+};
+
+// Instrumented method bodies, persisted across concolic runs in a file (CONCOLIC_IL_CACHE);
+// records of previous runs are memory-mapped, records of the current run are appended to the file
+class InstrumentationCache {
+private:
+    int m_file;
+    const char *m_mapping;
+    size_t m_mappingSize;
+    std::map<CacheKey, const char *> m_records;
+    std::vector<unsigned long long> m_probes;
+    unsigned long long m_probesLayoutHash;
+    // NOTE: bodies are neither looked up nor stored, until the entry point is known
+    std::atomic<unsigned long long> m_entryPointHash;
+    // NOTE: records are indexed once at start, then lookups and appends are done concurrently by JIT threads
+    std::atomic<unsigned> m_hits;
+    std::atomic<unsigned> m_stores;
+
+    bool index(size_t fileSize, size_t &validSize);
+    void relocate(std::vector<char> &bytecode, unsigned long long probesBase) const;
+
+public:
+    InstrumentationCache();
+    ~InstrumentationCache();
+
+    bool openFromEnvironment(const std::vector<unsigned long long> &probes);
+    bool open(const char *path, const std::vector<unsigned long long> &probes);
+    void close();
+
+    bool enabled() const { return m_file >= 0; }
+
+    static unsigned long long hash(const char *bytes, size_t count, unsigned long long seed);
+    unsigned long long ilHash(const char *bytecode, unsigned codeLength, const char *ehs, unsigned ehsLength, unsigned maxStackSize) const;
+    void setEntryPoint(const GUID &mvid, unsigned token);
+    unsigned long long probesVersion(const char *signatureTokens, unsigned signatureTokensLength) const;
+
+    bool lookup(const CacheKey &key, CachedBody &body);
+    void store(const CacheKey &key, const char *bytecode, unsigned codeLength, const char *ehs, unsigned ehsLength, unsigned maxStackSize);
+};
+
+}
+
+#endif // INSTRUMENTATIONCACHE_H_
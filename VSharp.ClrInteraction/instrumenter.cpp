@@ -4,24 +4,14 @@
 #include "cComPtr.h"
 #include <vector>
 #include <stdexcept>
+#include <cstdlib>
+#include <cstring>
 #include <corhlpr.cpp>
 #include "memory/memory.h"
 
 using namespace vsharp;
 
 
-#define TOKENPASTE(x, y) x ## y
-#define TOKENPASTE2(x, y) TOKENPASTE(x, y)
-#define UNIQUE TOKENPASTE2(Sig, __LINE__)
-#define SIG_DEF(...) \
-    constexpr COR_SIGNATURE UNIQUE[] = {__VA_ARGS__};\
-    IfFailRet(metadataEmit->GetTokenFromSig(UNIQUE, sizeof(UNIQUE), &signatureToken));\
-    tokens.push_back(signatureToken);
-
-#define ELEMENT_TYPE_COND ELEMENT_TYPE_I
-#define ELEMENT_TYPE_TOKEN ELEMENT_TYPE_U4
-#define ELEMENT_TYPE_OFFSET ELEMENT_TYPE_I4
-
 struct MethodBodyInfo {
     unsigned token;
     unsigned codeLength;
@@ -36,182 +26,322 @@ struct MethodBodyInfo {
     const char *bytecode;
     const char *ehs;
 
-    void serialize(char *&bytes, unsigned &count) const {
-        count = codeLength + 6 * sizeof(unsigned) + ehsLength + assemblyNameLength + moduleNameLength + signatureTokensLength;
-        bytes = new char[count];
-        char *buffer = bytes;
-        unsigned size = sizeof(unsigned);
-        *(unsigned *)buffer = token; buffer += size;
-        *(unsigned *)buffer = codeLength; buffer += size;
-        *(unsigned *)buffer = assemblyNameLength; buffer += size;
-        *(unsigned *)buffer = moduleNameLength; buffer += size;
-        *(unsigned *)buffer = maxStackSize; buffer += size;
-        *(unsigned *)buffer = signatureTokensLength;
-        buffer += size; size = signatureTokensLength;
-        memcpy(buffer, signatureTokens, size);
-        buffer += size; size = assemblyNameLength;
-        memcpy(buffer, (char*)assemblyName, size);
-        buffer += size; size = moduleNameLength;
-        memcpy(buffer, (char*)moduleName, size);
-        buffer += size; size = codeLength;
-        memcpy(buffer, bytecode, size);
-        buffer += size; size = ehsLength;
-        memcpy(buffer, ehs, size);
+    // NOTE: method bodies are rare and mostly consist of IL, so they are always sent in fixed encoding
+    void serialize(std::vector<IOChunk> &chunks, std::vector<char> &scratch, WireEncoding /*encoding*/) const {
+        scratch.resize(6 * sizeof(unsigned));
+        unsigned *header = (unsigned *)scratch.data();
+        header[0] = token;
+        header[1] = codeLength;
+        header[2] = assemblyNameLength;
+        header[3] = moduleNameLength;
+        header[4] = maxStackSize;
+        header[5] = signatureTokensLength;
+        chunks.push_back(IOChunk{scratch.data(), scratch.size()});
+        chunks.push_back(IOChunk{signatureTokens, signatureTokensLength});
+        chunks.push_back(IOChunk{(char*)assemblyName, assemblyNameLength});
+        chunks.push_back(IOChunk{(char*)moduleName, moduleNameLength});
+        chunks.push_back(IOChunk{bytecode, codeLength});
+        chunks.push_back(IOChunk{ehs, ehsLength});
     }
 };
 
-HRESULT initTokens(const CComPtr<IMetaDataEmit> &metadataEmit, std::vector<mdSignature> &tokens) {
-    HRESULT hr;
-    mdSignature signatureToken;
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x00, ELEMENT_TYPE_VOID)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x00, ELEMENT_TYPE_COND)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x01, ELEMENT_TYPE_VOID, ELEMENT_TYPE_U1)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x01, ELEMENT_TYPE_VOID, ELEMENT_TYPE_U4)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x01, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x01, ELEMENT_TYPE_COND, ELEMENT_TYPE_I)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x01, ELEMENT_TYPE_COND, ELEMENT_TYPE_U2)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x01, ELEMENT_TYPE_I1, ELEMENT_TYPE_I1)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x01, ELEMENT_TYPE_I2, ELEMENT_TYPE_I1)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x01, ELEMENT_TYPE_I4, ELEMENT_TYPE_I1)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x01, ELEMENT_TYPE_I8, ELEMENT_TYPE_I1)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x01, ELEMENT_TYPE_R4, ELEMENT_TYPE_I1)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x01, ELEMENT_TYPE_R8, ELEMENT_TYPE_I1)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x01, ELEMENT_TYPE_I, ELEMENT_TYPE_I1)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I1)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I2)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_U2)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I4)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I8)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_R4)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_R8)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I4, ELEMENT_TYPE_I4)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I4, ELEMENT_TYPE_I)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I8, ELEMENT_TYPE_I4)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I8, ELEMENT_TYPE_I8)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_R4, ELEMENT_TYPE_R4)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_R8, ELEMENT_TYPE_R8)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_COND, ELEMENT_TYPE_I, ELEMENT_TYPE_I4)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_COND, ELEMENT_TYPE_I, ELEMENT_TYPE_I)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I, ELEMENT_TYPE_I)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I, ELEMENT_TYPE_I1)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I, ELEMENT_TYPE_I2)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I, ELEMENT_TYPE_I4)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I, ELEMENT_TYPE_I8)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I, ELEMENT_TYPE_R4)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I, ELEMENT_TYPE_R8)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I1, ELEMENT_TYPE_I)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I1, ELEMENT_TYPE_I1, ELEMENT_TYPE_I1)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I2, ELEMENT_TYPE_I1, ELEMENT_TYPE_I1)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I4, ELEMENT_TYPE_I1, ELEMENT_TYPE_I1)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I8, ELEMENT_TYPE_I1, ELEMENT_TYPE_I1)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_R4, ELEMENT_TYPE_I1, ELEMENT_TYPE_I1)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_R8, ELEMENT_TYPE_I1, ELEMENT_TYPE_I1)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I1, ELEMENT_TYPE_I1)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x05, ELEMENT_TYPE_VOID, ELEMENT_TYPE_TOKEN, ELEMENT_TYPE_U2, ELEMENT_TYPE_BOOLEAN, ELEMENT_TYPE_U4, ELEMENT_TYPE_U4)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x01, ELEMENT_TYPE_VOID, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_U1, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_U2, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I4, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I8, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_R4, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_R8, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_TOKEN, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I1, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I2, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I4, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I8, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_R4, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_R8, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_TOKEN, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I4, ELEMENT_TYPE_I4, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_U2, ELEMENT_TYPE_I4, ELEMENT_TYPE_I4, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_U2, ELEMENT_TYPE_I4, ELEMENT_TYPE_I, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_U2, ELEMENT_TYPE_I8, ELEMENT_TYPE_I4, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_U2, ELEMENT_TYPE_I8, ELEMENT_TYPE_I8, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_U2, ELEMENT_TYPE_R4, ELEMENT_TYPE_R4, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_U2, ELEMENT_TYPE_R8, ELEMENT_TYPE_R8, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_U2, ELEMENT_TYPE_I, ELEMENT_TYPE_I, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_U2, ELEMENT_TYPE_I, ELEMENT_TYPE_I4, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I, ELEMENT_TYPE_I, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I, ELEMENT_TYPE_I1, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I, ELEMENT_TYPE_I2, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I, ELEMENT_TYPE_I4, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I, ELEMENT_TYPE_I8, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I, ELEMENT_TYPE_R4, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I, ELEMENT_TYPE_R8, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I1, ELEMENT_TYPE_I, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_TOKEN, ELEMENT_TYPE_U4, ELEMENT_TYPE_U4, ELEMENT_TYPE_U4)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_TOKEN, ELEMENT_TYPE_I, ELEMENT_TYPE_I, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_TOKEN, ELEMENT_TYPE_I, ELEMENT_TYPE_I4, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_TOKEN, ELEMENT_TYPE_I, ELEMENT_TYPE_I8, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_TOKEN, ELEMENT_TYPE_I, ELEMENT_TYPE_R4, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_TOKEN, ELEMENT_TYPE_I, ELEMENT_TYPE_R8, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x05, ELEMENT_TYPE_VOID, ELEMENT_TYPE_TOKEN, ELEMENT_TYPE_TOKEN, ELEMENT_TYPE_BOOLEAN, ELEMENT_TYPE_U2, ELEMENT_TYPE_OFFSET)
+struct ModuleMethodBody {
+    unsigned token;
+    unsigned maxStackSize;
+    std::vector<char> bytecode;
+    std::vector<char> ehs;
+};
+
+struct ModuleBodiesInfo {
+    unsigned firstStringIndex;
+    unsigned assemblyNameLength;
+    unsigned moduleNameLength;
+    unsigned signatureTokensLength;
+    const char *signatureTokens;
+    const WCHAR *assemblyName;
+    const WCHAR *moduleName;
+    const std::vector<ModuleMethodBody> &methods;
+
+    // NOTE: names and signature tokens are shared by all methods of the module, so they are sent once
+    void serialize(std::vector<IOChunk> &chunks, std::vector<char> &scratch, WireEncoding /*encoding*/) const {
+        const size_t moduleHeaderSize = 5, methodHeaderSize = 4;
+        scratch.resize((moduleHeaderSize + methodHeaderSize * methods.size()) * sizeof(unsigned));
+        unsigned *header = (unsigned *)scratch.data();
+        header[0] = (unsigned)methods.size();
+        header[1] = firstStringIndex;
+        header[2] = assemblyNameLength;
+        header[3] = moduleNameLength;
+        header[4] = signatureTokensLength;
+        chunks.push_back(IOChunk{scratch.data(), moduleHeaderSize * sizeof(unsigned)});
+        chunks.push_back(IOChunk{signatureTokens, signatureTokensLength});
+        chunks.push_back(IOChunk{(char*)assemblyName, assemblyNameLength});
+        chunks.push_back(IOChunk{(char*)moduleName, moduleNameLength});
+        unsigned *methodHeader = header + moduleHeaderSize;
+        for (const ModuleMethodBody &method : methods) {
+            methodHeader[0] = method.token;
+            methodHeader[1] = (unsigned)method.bytecode.size();
+            methodHeader[2] = method.maxStackSize;
+            methodHeader[3] = (unsigned)method.ehs.size();
+            chunks.push_back(IOChunk{(char*)methodHeader, methodHeaderSize * sizeof(unsigned)});
+            chunks.push_back(IOChunk{method.bytecode.data(), method.bytecode.size()});
+            chunks.push_back(IOChunk{method.ehs.data(), method.ehs.size()});
+            methodHeader += methodHeaderSize;
+        }
+    }
+};
+
+// NOTE: signatures of probes for 'calli' are generated from declarations of probes (see 'probeSignature'), so they
+//       can not diverge from the probes; tokens are appended to 'tokens' in the order of probes
+static HRESULT defineProbeSignatures(const CComPtr<IMetaDataEmit> &metadataEmit, const std::vector<ProbeImport> &imports, std::vector<mdToken> &tokens) {
+    std::vector<mdToken> signatures(imports.size(), mdTokenNil);
+    std::vector<COR_SIGNATURE> signature;
+    for (size_t i = 0; i < imports.size(); i++) {
+        const ProbeImport &probe = imports[i];
+        // NOTE: probes are called through native function pointers, so the managed calling convention is replaced
+        signature.assign(probe.signature.begin(), probe.signature.end());
+        signature[0] = (COR_SIGNATURE)IMAGE_CEE_CS_CALLCONV_STDCALL;
+        HRESULT hr = metadataEmit->GetTokenFromSig(signature.data(), (ULONG)signature.size(), &signatures[i]);
+        if (FAILED(hr)) {
+            LOG_ERROR(tout << "Could not emit signature of probe " << probe.name);
+            return hr;
+        }
+    }
+    tokens.insert(tokens.end(), signatures.begin(), signatures.end());
     return S_OK;
 }
 
 
+namespace vsharp {
+
+struct InstrumentationContext {
+    ModuleID moduleId;
+    mdMethodDef jittedToken;
+    mdToken tkLocalVarSig;
+    unsigned maxStack;
+    unsigned flags;
+    std::vector<char> code;
+    // NOTE: clauses of the original body in the fat format
+    std::vector<char> ehs;
+    const std::vector<mdSignature> *signatureTokens;
+    // NOTE: header of the body, read by importIL
+    LPCBYTE header;
+    // NOTE: the method is instrumented by ReJIT, its first jitted code has no probes
+    bool reJit;
+};
+
+}
+
+static std::basic_string<WCHAR> widen(const char *s) {
+    std::basic_string<WCHAR> result;
+    for (; *s; s++)
+        result.push_back((WCHAR)(unsigned char)*s);
+    return result;
+}
+
 Instrumenter::Instrumenter(ICorProfilerInfo8 &profilerInfo, Protocol &protocol)
     : m_profilerInfo(profilerInfo)
     , m_protocol(protocol)
-    , m_methodMalloc(nullptr)
-    , m_moduleId(0)
-    , m_signatureTokens(nullptr)
-    , m_generateTinyHeader(false)
-    , m_pEH(nullptr)
     , m_reJitInstrumentedStarted(false)
     , m_mainModuleName(nullptr)
     , m_mainModuleSize(0)
     , m_mainMethod(0)
     , m_mainReached(false)
+    , m_scopeKnown(false)
 {
+    m_cache.openFromEnvironment(m_protocol.probesAddresses());
+    unsigned demotionThreshold = DEFAULT_DEMOTION_THRESHOLD;
+    const char *demoteAfter = getenv("CONCOLIC_DEMOTE_AFTER");
+    if (demoteAfter && strlen(demoteAfter) > 0)
+        demotionThreshold = (unsigned)strtoul(demoteAfter, nullptr, 10);
+    configureDemotion(demotionThreshold);
+    // NOTE: P/Invoke methods of probes import them from the library of the profiler, which is already loaded
+    const char *library = getenv("CORECLR_PROFILER_PATH_64");
+    if (!library || strlen(library) == 0) library = getenv("CORECLR_PROFILER_PATH");
+    m_probesLibrary = widen(library && strlen(library) > 0 ? library : "libvsharpConcolic");
 }
 
 Instrumenter::~Instrumenter()
 {
-    delete[] m_signatureTokens;
     delete[] m_mainModuleName;
 }
 
-unsigned Instrumenter::codeSize() const
-{
-    return m_codeSize;
+// NOTE: System.Object is referenced by every module except the core library; its resolution scope is the assembly,
+//       from which other runtime types are referenced
+static HRESULT findObjectType(const CComPtr<IMetaDataImport> &metadataImport, mdTypeRef &objectType, mdToken &runtimeScope) {
+    objectType = mdTokenNil;
+    HCORENUM typeRefs = nullptr;
+    mdTypeRef typeRef;
+    ULONG count;
+    const std::basic_string<WCHAR> objectName = widen("System.Object");
+    while (objectType == mdTokenNil && metadataImport->EnumTypeRefs(&typeRefs, &typeRef, 1, &count) == S_OK && count == 1) {
+        mdToken scope;
+        WCHAR name[16];
+        ULONG nameLength;
+        if (metadataImport->GetTypeRefProps(typeRef, &scope, name, 16, &nameLength) == S_OK && objectName == name) {
+            objectType = typeRef;
+            runtimeScope = scope;
+        }
+    }
+    metadataImport->CloseEnum(typeRefs);
+    return objectType == mdTokenNil ? E_FAIL : S_OK;
 }
 
-char *Instrumenter::code() const
-{
-    return m_code;
+// NOTE: GC transition suppression types exist since .NET 6; they are forwarded by System.Runtime, but not by facades
+//       of other profiles (netstandard, mscorlib), so modules, which refer them, keep full GC transitions
+static HRESULT defineRuntimeTypeRef(const CComPtr<IMetaDataImport> &metadataImport, const CComPtr<IMetaDataEmit> &metadataEmit,
+                                    mdToken runtimeScope, const char *typeName, mdTypeRef &typeRef) {
+    if (TypeFromToken(runtimeScope) != mdtAssemblyRef) return E_FAIL;
+    CComPtr<IMetaDataAssemblyImport> assemblyImport;
+    IfFailRet(metadataImport->QueryInterface(IID_IMetaDataAssemblyImport, reinterpret_cast<void **>(&assemblyImport)));
+    WCHAR name[32];
+    ULONG nameLength;
+    ASSEMBLYMETADATA assemblyMetadata = {};
+    IfFailRet(assemblyImport->GetAssemblyRefProps(runtimeScope, nullptr, nullptr, name, 32, &nameLength, &assemblyMetadata, nullptr, nullptr, nullptr));
+    if (widen("System.Runtime") != name && widen("System.Private.CoreLib") != name) return E_FAIL;
+    return metadataEmit->DefineTypeRefByName(runtimeScope, widen(typeName).c_str(), &typeRef);
 }
 
-unsigned Instrumenter::ehCount() const
-{
-    return m_nEH * sizeof(IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT);
+// NOTE: P/Invoke methods of probes are defined in a new type of the module, as methods, added to types, which are already
+//       loaded, are not seen by the runtime; tokens of the methods are appended to 'tokens' in the order of probes;
+//       methods of leaf probes are marked by SuppressGCTransitionAttribute, if the module can refer it
+static HRESULT defineProbeMethods(const CComPtr<IMetaDataImport> &metadataImport, const CComPtr<IMetaDataEmit> &metadataEmit,
+                                  const std::basic_string<WCHAR> &library, const std::vector<ProbeImport> &imports, std::vector<mdToken> &tokens) {
+    mdTypeRef objectType;
+    mdToken runtimeScope;
+    // NOTE: modules, which do not refer System.Object (e.g. the core library), call probes by addresses
+    IfFailRet(findObjectType(metadataImport, objectType, runtimeScope));
+
+    mdMemberRef suppressTransition = mdTokenNil;
+    mdTypeRef attributeType;
+    if (SUCCEEDED(defineRuntimeTypeRef(metadataImport, metadataEmit, runtimeScope, "System.Runtime.InteropServices.SuppressGCTransitionAttribute", attributeType))) {
+        const COR_SIGNATURE constructorSignature[] = {IMAGE_CEE_CS_CALLCONV_HASTHIS, 0x00, ELEMENT_TYPE_VOID};
+        if (FAILED(metadataEmit->DefineMemberRef(attributeType, widen(".ctor").c_str(), constructorSignature, sizeof(constructorSignature), &suppressTransition)))
+            suppressTransition = mdTokenNil;
+    }
+    // NOTE: prolog of the custom attribute blob without arguments and named arguments
+    const BYTE attributeBlob[] = {0x01, 0x00, 0x00, 0x00};
+
+    mdTypeDef probesType;
+    IfFailRet(metadataEmit->DefineTypeDef(widen("<VSharpProbes>").c_str(), tdNotPublic | tdClass | tdAbstract | tdSealed,
+                                          objectType, nullptr, &probesType));
+    mdModuleRef libraryRef;
+    IfFailRet(metadataEmit->DefineModuleRef(library.c_str(), &libraryRef));
+    std::vector<mdToken> methods(imports.size());
+    for (size_t i = 0; i < imports.size(); i++) {
+        const ProbeImport &probe = imports[i];
+        const std::basic_string<WCHAR> name = widen(probe.name);
+        IfFailRet(metadataEmit->DefineMethod(probesType, name.c_str(), mdPublic | mdStatic | mdHideBySig | mdPinvokeImpl,
+                                             probe.signature.data(), (ULONG)probe.signature.size(), 0, miPreserveSig, &methods[i]));
+        IfFailRet(metadataEmit->DefinePinvokeMap(methods[i], pmNoMangle | pmCallConvWinapi, name.c_str(), libraryRef));
+        mdCustomAttribute attribute;
+        if (probe.leaf && suppressTransition != mdTokenNil)
+            IfFailRet(metadataEmit->DefineCustomAttribute(methods[i], suppressTransition, attributeBlob, sizeof(attributeBlob), &attribute));
+    }
+    tokens.insert(tokens.end(), methods.begin(), methods.end());
+    return S_OK;
 }
 
-IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT *Instrumenter::ehs() const
-{
-    return m_pEH;
+// NOTE: signatures of leaf probes for 'calli': the unmanaged calling convention with the CallConvSuppressGCTransition
+//       modifier of the return type; tokens are appended to 'tokens' in the order of probes, blocking probes get nil tokens
+static HRESULT defineLeafSignatures(const CComPtr<IMetaDataImport> &metadataImport, const CComPtr<IMetaDataEmit> &metadataEmit,
+                                    const std::vector<ProbeImport> &imports, std::vector<mdToken> &tokens) {
+    mdTypeRef objectType;
+    mdToken runtimeScope;
+    IfFailRet(findObjectType(metadataImport, objectType, runtimeScope));
+    mdTypeRef callConv;
+    IfFailRet(defineRuntimeTypeRef(metadataImport, metadataEmit, runtimeScope, "System.Runtime.CompilerServices.CallConvSuppressGCTransition", callConv));
+    COR_SIGNATURE compressedCallConv[4];
+    ULONG compressedLength = CorSigCompressToken(callConv, compressedCallConv);
+
+    std::vector<mdToken> signatures(imports.size(), mdTokenNil);
+    std::vector<COR_SIGNATURE> signature;
+    for (size_t i = 0; i < imports.size(); i++) {
+        const ProbeImport &probe = imports[i];
+        if (!probe.leaf) continue;
+        // NOTE: P/Invoke signature is [calling convention | count of arguments | return type | argument types]
+        signature.assign({(COR_SIGNATURE)IMAGE_CEE_CS_CALLCONV_UNMANAGED, probe.signature[1], (COR_SIGNATURE)ELEMENT_TYPE_CMOD_OPT});
+        signature.insert(signature.end(), compressedCallConv, compressedCallConv + compressedLength);
+        signature.insert(signature.end(), probe.signature.begin() + 2, probe.signature.end());
+        IfFailRet(metadataEmit->GetTokenFromSig(signature.data(), (ULONG)signature.size(), &signatures[i]));
+    }
+    tokens.insert(tokens.end(), signatures.begin(), signatures.end());
+    return S_OK;
 }
 
-unsigned Instrumenter::maxStackSize() const
-{
-    return m_maxStack;
+// NOTE: [signatures of probes | P/Invoke methods, if ProbeMethodsFeature is negotiated | leaf signatures, if LeafProbesFeature
+//       is negotiated]; sections, which could not be defined in the module, are filled by nil tokens
+const std::vector<mdSignature> *Instrumenter::moduleSignatureTokens(ModuleID moduleId, const CComPtr<IMetaDataImport> &metadataImport, const CComPtr<IMetaDataEmit> &metadataEmit) {
+    std::lock_guard<std::mutex> lock(m_tokensLock);
+    const auto found = m_signatureTokens.find(moduleId);
+    if (found != m_signatureTokens.end())
+        return &found->second.tokens;
+    ModuleTokens &module = m_signatureTokens[moduleId];
+    module.delivered = false;
+    const std::vector<ProbeImport> &imports = m_protocol.probeImports();
+    if (FAILED(defineProbeSignatures(metadataEmit, imports, module.tokens))) {
+        m_signatureTokens.erase(moduleId);
+        return nullptr;
+    }
+    size_t sectionStart = module.tokens.size();
+    if (m_protocol.supports(ProbeMethodsFeature) && FAILED(defineProbeMethods(metadataImport, metadataEmit, m_probesLibrary, imports, module.tokens))) {
+        LOG(tout << "Could not define P/Invoke methods of probes in module " << HEX(moduleId) << ", probes are called by addresses");
+        module.tokens.resize(sectionStart);
+        module.tokens.resize(sectionStart + imports.size(), mdTokenNil);
+    }
+    sectionStart = module.tokens.size();
+    if (m_protocol.supports(LeafProbesFeature) && FAILED(defineLeafSignatures(metadataImport, metadataEmit, imports, module.tokens))) {
+        LOG(tout << "Could not define signatures of leaf probes in module " << HEX(moduleId) << ", leaf probes keep GC transitions");
+        module.tokens.resize(sectionStart);
+        module.tokens.resize(sectionStart + imports.size(), mdTokenNil);
+    }
+    return &module.tokens;
 }
 
-HRESULT Instrumenter::setILFunctionBody(LPCBYTE pBody)
-{
-    return m_profilerInfo.SetILFunctionBody(m_moduleId, m_jittedToken, pBody);
+// NOTE: [tokens] or, if ModuleTokensFeature is negotiated, [module id | tokens], where tokens are omitted once the engine has them;
+//       concurrent first requests of the module may all carry the tokens, as delivery is known only after the answer
+void Instrumenter::signatureTokensPayload(ModuleID moduleId, const std::vector<mdSignature> &tokens, std::vector<char> &payload) {
+    const char *tokensBytes = (const char *)tokens.data();
+    size_t tokensLength = tokens.size() * sizeof(mdSignature);
+    if (!m_protocol.supports(ModuleTokensFeature)) {
+        payload.assign(tokensBytes, tokensBytes + tokensLength);
+        return;
+    }
+    unsigned long long moduleKey = (unsigned long long)moduleId;
+    payload.assign((const char *)&moduleKey, (const char *)&moduleKey + sizeof(moduleKey));
+    std::lock_guard<std::mutex> lock(m_tokensLock);
+    if (!m_signatureTokens[moduleId].delivered)
+        payload.insert(payload.end(), tokensBytes, tokensBytes + tokensLength);
 }
 
-LPBYTE Instrumenter::allocateILMemory(unsigned size)
-{
-    if (FAILED(m_profilerInfo.GetILFunctionBodyAllocator(m_moduleId, &m_methodMalloc)))
-        return nullptr;
+void Instrumenter::tokensDelivered(ModuleID moduleId) {
+    std::lock_guard<std::mutex> lock(m_tokensLock);
+    const auto found = m_signatureTokens.find(moduleId);
+    if (found != m_signatureTokens.end())
+        found->second.delivered = true;
+}
 
-    return (LPBYTE)m_methodMalloc->Alloc(size);
+// NOTE: ids of unloaded modules may be reused, so that tokens of the new module are emitted and sent again
+void Instrumenter::moduleUnloaded(ModuleID moduleId) {
+    {
+        std::lock_guard<std::mutex> lock(m_tokensLock);
+        m_signatureTokens.erase(moduleId);
+    }
+    // NOTE: original bodies are referenced in the image of the module, which is unmapped
+    instrumentedFunctions.eraseIf([=](const std::pair<ModuleID, mdMethodDef> &method, const OriginalBody &) {
+        return method.first == moduleId;
+    });
+}
+
+std::unique_lock<std::mutex> Instrumenter::lockRequest() {
+    std::unique_lock<std::mutex> lock(m_requestLock, std::defer_lock);
+#ifdef _DEBUG
+    // NOTE: strings of debug probes are allocated during requests, their indices must follow the order of requests
+    lock.lock();
+#else
+    if (m_protocol.framing() != MultiplexedFraming)
+        lock.lock();
+#endif
+    return lock;
 }
 
 void Instrumenter::configureEntryPoint() {
@@ -224,7 +354,41 @@ void Instrumenter::configureEntryPoint() {
     unsigned bytesCount = m_mainModuleSize * sizeof(WCHAR);
     memcpy(m_mainModuleName, bytes, m_mainModuleSize * sizeof(WCHAR)); bytes += bytesCount;
     assert(bytes - start == messageLength);
-    delete[] start;
+    if (m_protocol.supports(InstrumentationScopeFeature) && !acceptInstrumentationScope())
+        LOG_ERROR(tout << "Instrumentation scope is malformed, all methods will be instrumented");
+}
+
+bool Instrumenter::acceptInstrumentationScope() {
+    char *bytes; int messageLength;
+    if (!m_protocol.acceptInstrumentationScope(bytes, messageLength)) return false;
+    const char *current = bytes;
+    const char *end = bytes + messageLength;
+    if (end - current < (int)sizeof(INT32)) return false;
+    INT32 modulesCount = *(INT32*) current; current += sizeof(INT32);
+    for (INT32 i = 0; i < modulesCount; i++) {
+        if (end - current < 3 * (int)sizeof(INT32)) return false;
+        INT32 nameLength = *(INT32*) current; current += sizeof(INT32);
+        INT32 whole = *(INT32*) current; current += sizeof(INT32);
+        INT32 bitmapLength = *(INT32*) current; current += sizeof(INT32);
+        if (nameLength < 0 || bitmapLength < 0 || (size_t)(end - current) < (size_t)nameLength * sizeof(WCHAR) + bitmapLength) return false;
+        std::basic_string<WCHAR> name((const WCHAR*) current, nameLength); current += nameLength * sizeof(WCHAR);
+        ModuleScope &scope = m_scope[name];
+        scope.whole = whole != 0;
+        scope.bitmap.assign(current, current + bitmapLength); current += bitmapLength;
+    }
+    m_scopeKnown = current == end;
+    LOG(tout << "Instrumentation scope of " << modulesCount << " modules is accepted" << std::endl);
+    return m_scopeKnown;
+}
+
+bool Instrumenter::inScope(const WCHAR *moduleName, int moduleSize, mdMethodDef method) const {
+    if (!m_scopeKnown) return true;
+    // NOTE: decrementing 'moduleSize', because of null terminator
+    const auto scope = m_scope.find(std::basic_string<WCHAR>(moduleName, moduleSize - 1));
+    if (scope == m_scope.end()) return false;
+    if (scope->second.whole) return true;
+    ULONG rid = RidFromToken(method);
+    return rid / 8 < scope->second.bitmap.size() && (scope->second.bitmap[rid / 8] & (1 << (rid % 8))) != 0;
 }
 
 bool Instrumenter::currentMethodIsMain(const WCHAR *moduleName, int moduleSize, mdMethodDef method) const {
@@ -236,92 +400,95 @@ bool Instrumenter::currentMethodIsMain(const WCHAR *moduleName, int moduleSize,
     return true;
 }
 
-HRESULT Instrumenter::importIL()
+bool Instrumenter::isMainModule(const WCHAR *moduleName, int moduleSize) const {
+    // NOTE: decrementing 'moduleSize', because of null terminator
+    if (m_mainModuleSize != moduleSize - 1)
+        return false;
+    for (int i = 0; i < m_mainModuleSize; i++)
+        if (m_mainModuleName[i] != moduleName[i]) return false;
+    return true;
+}
+
+static void copyEHs(const COR_ILMETHOD_DECODER &decoder, std::vector<char> &ehs) {
+    unsigned count = decoder.EHCount();
+    ehs.resize(count * sizeof(IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT));
+    for (unsigned i = 0; i < count; i++) {
+        COR_ILMETHOD_SECT_EH_CLAUSE_FAT scratch;
+        const COR_ILMETHOD_SECT_EH_CLAUSE_FAT *ehInfo = decoder.EH->EHClause(i, &scratch);
+        memcpy(ehs.data() + i * sizeof(IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT), ehInfo, sizeof(IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT));
+    }
+}
+
+HRESULT Instrumenter::importIL(InstrumentationContext &context)
 {
     HRESULT hr;
     LPCBYTE pMethodBytes;
 
-    IfFailRet(m_profilerInfo.GetILFunctionBody(m_moduleId, m_jittedToken, &pMethodBytes, NULL));
+    IfFailRet(m_profilerInfo.GetILFunctionBody(context.moduleId, context.jittedToken, &pMethodBytes, NULL));
+    context.header = pMethodBytes;
 
     COR_ILMETHOD_DECODER decoder((COR_ILMETHOD*)pMethodBytes);
 
     // Import the header flags
-    m_tkLocalVarSig = decoder.GetLocalVarSigTok();
-    m_maxStack = decoder.GetMaxStack();
-    m_flags = (decoder.GetFlags() & CorILMethod_InitLocals);
-
-    m_codeSize = decoder.GetCodeSize();
-    m_code = new char[m_codeSize];
-    memcpy(m_code, decoder.Code, m_codeSize);
+    context.tkLocalVarSig = decoder.GetLocalVarSigTok();
+    context.maxStack = decoder.GetMaxStack();
+    context.flags = (decoder.GetFlags() & CorILMethod_InitLocals);
 
-    IfFailRet(importEH(decoder.EH, decoder.EHCount()));
+    context.code.assign((const char *)decoder.Code, (const char *)decoder.Code + decoder.GetCodeSize());
+    copyEHs(decoder, context.ehs);
 
     return S_OK;
 }
 
-HRESULT Instrumenter::importEH(const COR_ILMETHOD_SECT_EH* pILEH, unsigned nEH)
+HRESULT Instrumenter::exportOriginalIL(const InstrumentationContext &context, LPCBYTE header)
 {
-    assert(m_pEH == nullptr);
-
-    m_nEH = nEH;
-
-    if (nEH == 0)
-        return S_OK;
-
-    IfNullRet(m_pEH = new IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT[m_nEH]);
-    for (unsigned iEH = 0; iEH < m_nEH; iEH++)
-    {
-        // If the EH clause is in tiny form, the call to pILEH->EHClause() below will
-        // use this as a scratch buffer to expand the EH clause into its fat form.
-        COR_ILMETHOD_SECT_EH_CLAUSE_FAT scratch;
-        const COR_ILMETHOD_SECT_EH_CLAUSE_FAT* ehInfo;
-        ehInfo = (COR_ILMETHOD_SECT_EH_CLAUSE_FAT*)pILEH->EHClause(iEH, &scratch);
-        memcpy(m_pEH + iEH, ehInfo, sizeof (IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT));
-    }
-
-    return S_OK;
+    COR_ILMETHOD_DECODER decoder((COR_ILMETHOD*)header);
+    std::vector<char> ehs;
+    copyEHs(decoder, ehs);
+    return exportIL(context, (char *)decoder.Code, decoder.GetCodeSize(), decoder.GetMaxStack(), ehs.data(), (unsigned)ehs.size());
 }
 
-
-HRESULT Instrumenter::exportIL(char *bytecode, unsigned codeLength, unsigned maxStackSize, char *ehs, unsigned ehsLength)
+HRESULT Instrumenter::exportIL(const InstrumentationContext &context, char *bytecode, unsigned codeLength, unsigned maxStackSize, char *ehs, unsigned ehsLength)
 {
     HRESULT hr;
 
     // Use FAT header
-    m_nEH = ehsLength / sizeof(IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT);
-    m_maxStack = maxStackSize;
+    unsigned nEH = ehsLength / sizeof(IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT);
 
     unsigned alignedCodeSize = (codeLength + 3) & ~3;
 
     unsigned totalSize = sizeof(IMAGE_COR_ILMETHOD_FAT) + alignedCodeSize +
-        (m_nEH ? (sizeof(IMAGE_COR_ILMETHOD_SECT_FAT) + sizeof(IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT) * m_nEH) : 0);
+        (nEH ? (sizeof(IMAGE_COR_ILMETHOD_SECT_FAT) + sizeof(IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT) * nEH) : 0);
 
-    LPBYTE pBody = allocateILMemory(totalSize);
+    IMethodMalloc *methodMalloc = nullptr;
+    IfFailRet(m_profilerInfo.GetILFunctionBodyAllocator(context.moduleId, &methodMalloc));
+    LPBYTE pBody = (LPBYTE)methodMalloc->Alloc(totalSize);
+    methodMalloc->Release();
     IfNullRet(pBody);
 
     BYTE * pCurrent = pBody;
 
     IMAGE_COR_ILMETHOD_FAT *pHeader = (IMAGE_COR_ILMETHOD_FAT *)pCurrent;
-    pHeader->Flags = m_flags | (m_nEH ? CorILMethod_MoreSects : 0) | CorILMethod_FatFormat;
+    pHeader->Flags = context.flags | (nEH ? CorILMethod_MoreSects : 0) | CorILMethod_FatFormat;
     pHeader->Size = sizeof(IMAGE_COR_ILMETHOD_FAT) / sizeof(DWORD);
-    pHeader->MaxStack = m_maxStack;
+    pHeader->MaxStack = maxStackSize;
     pHeader->CodeSize = codeLength;
-    pHeader->LocalVarSigTok = m_tkLocalVarSig;
+    pHeader->LocalVarSigTok = context.tkLocalVarSig;
 
     pCurrent = (BYTE*)(pHeader + 1);
 
     CopyMemory(pCurrent, bytecode, codeLength);
     pCurrent += alignedCodeSize;
 
-    if (m_nEH != 0)
+    if (nEH != 0)
     {
         IMAGE_COR_ILMETHOD_SECT_FAT *pEH = (IMAGE_COR_ILMETHOD_SECT_FAT *)pCurrent;
         pEH->Kind = CorILMethod_Sect_EHTable | CorILMethod_Sect_FatFormat;
-        pEH->DataSize = (unsigned)(sizeof(IMAGE_COR_ILMETHOD_SECT_FAT) + sizeof(IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT) * m_nEH);
+        pEH->DataSize = (unsigned)(sizeof(IMAGE_COR_ILMETHOD_SECT_FAT) + sizeof(IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT) * nEH);
 
         pCurrent = (BYTE*)(pEH + 1);
 
-        for (unsigned iEH = 0; iEH < m_nEH; iEH++)
+        for (unsigned iEH = 0; iEH < nEH; iEH++)
         {
             IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT * pDst = (IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT *)pCurrent;
             *pDst = *(IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT *)(ehs + iEH * sizeof(IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT));
@@ -329,120 +496,148 @@ HRESULT Instrumenter::exportIL(char *bytecode, unsigned codeLength, unsigned max
         }
     }
 
-    IfFailRet(setILFunctionBody(pBody));
-
-    if (m_pEH) {
-        delete[] m_pEH;
-        m_pEH = nullptr;
-    }
-
-    if (m_methodMalloc)
-        m_methodMalloc->Release();
+    IfFailRet(m_profilerInfo.SetILFunctionBody(context.moduleId, context.jittedToken, pBody));
 
     return S_OK;
 }
 
+// NOTE: methods, instrumented by ReJIT, are reverted to their first jitted code; others are jitted again without probes
 HRESULT Instrumenter::startReJitInstrumented() {
     LOG(tout << "ReJIT of instrumented methods is started" << std::endl);
-    m_reJitInstrumentedStarted = true;
-    ULONG count = instrumentedFunctions.size();
-    auto *modules = new ModuleID[count];
-    auto *methods = new mdMethodDef[count];
-    int i = 0;
-    for (const auto &it : instrumentedFunctions) {
-        modules[i] = it.first.first;
-        methods[i] = it.first.second;
-        i++;
+    std::vector<ModuleID> revertedModules;
+    std::vector<mdMethodDef> revertedMethods;
+    instrumentedFunctions.eraseIf([&](const std::pair<ModuleID, mdMethodDef> &method, const OriginalBody &body) {
+        if (!body.revertible) return false;
+        revertedModules.push_back(method.first);
+        revertedMethods.push_back(method.second);
+        return true;
+    });
+    HRESULT hr;
+    if (!revertedMethods.empty()) {
+        LOG(tout << "Reverting " << revertedMethods.size() << " methods" << std::endl);
+        IfFailRet(m_profilerInfo.RequestRevert((ULONG)revertedMethods.size(), revertedModules.data(), revertedMethods.data(), nullptr));
+    }
+    std::vector<ModuleID> modules;
+    std::vector<mdMethodDef> methods;
+    instrumentedFunctions.forEach([&](const std::pair<ModuleID, mdMethodDef> &method, const OriginalBody &) {
+        modules.push_back(method.first);
+        methods.push_back(method.second);
+    });
+    if (methods.empty()) return S_OK;
+    return m_profilerInfo.RequestReJIT((ULONG)methods.size(), modules.data(), methods.data());
+}
+
+// NOTE: the entry point is instrumented differently from other methods, so cached bodies are versioned by it
+void Instrumenter::cacheEntryPoint(ModuleID mainModuleId) {
+    if (!m_cache.enabled()) return;
+    CComPtr<IMetaDataImport> metadataImport;
+    GUID mvid;
+    if (FAILED(m_profilerInfo.GetModuleMetaData(mainModuleId, ofRead, IID_IMetaDataImport, reinterpret_cast<IUnknown **>(&metadataImport))) ||
+        FAILED(metadataImport->GetScopeProps(nullptr, 0, nullptr, &mvid))) {
+        LOG_ERROR(tout << "Could not get MVID of the main module, instrumentation cache is not used");
+        return;
     }
-    HRESULT hr = m_profilerInfo.RequestReJIT(count, modules, methods);
-    delete[] modules;
-    delete[] methods;
-    return hr;
+    m_cache.setEntryPoint(mvid, m_mainMethod);
 }
 
-HRESULT Instrumenter::startReJitSkipped() {
+HRESULT Instrumenter::startReJitSkipped(const std::set<std::pair<ModuleID, mdMethodDef>> &skipped) {
     LOG(tout << "ReJIT of skipped methods is started" << std::endl);
-    ULONG count = skippedBeforeMain.size();
-    auto *modules = new ModuleID[count];
-    auto *methods = new mdMethodDef[count];
-    int i = 0;
-    for (const auto &it : skippedBeforeMain) {
-        modules[i] = it.first;
-        methods[i] = it.second;
-        i++;
+    std::vector<ModuleID> modules;
+    std::vector<mdMethodDef> methods;
+    for (const auto &it : skipped) {
+        modules.push_back(it.first);
+        methods.push_back(it.second);
     }
-    HRESULT hr = m_profilerInfo.RequestReJIT(count, modules, methods);
-    delete[] modules;
-    delete[] methods;
-    return hr;
+    if (methods.empty()) return S_OK;
+    return m_profilerInfo.RequestReJIT((ULONG)methods.size(), modules.data(), methods.data());
 }
 
-HRESULT Instrumenter::doInstrumentation(ModuleID oldModuleId, const WCHAR *assemblyName, ULONG assemblyNameLength, const WCHAR *moduleName, ULONG moduleNameLength) {
+HRESULT Instrumenter::doInstrumentation(InstrumentationContext &context, const WCHAR *assemblyName, ULONG assemblyNameLength, const WCHAR *moduleName, ULONG moduleNameLength) {
     HRESULT hr;
     CComPtr<IMetaDataImport> metadataImport;
     CComPtr<IMetaDataEmit> metadataEmit;
-    IfFailRet(m_profilerInfo.GetModuleMetaData(m_moduleId, ofRead | ofWrite, IID_IMetaDataImport, reinterpret_cast<IUnknown **>(&metadataImport)));
+    IfFailRet(m_profilerInfo.GetModuleMetaData(context.moduleId, ofRead | ofWrite, IID_IMetaDataImport, reinterpret_cast<IUnknown **>(&metadataImport)));
     IfFailRet(metadataImport->QueryInterface(IID_IMetaDataEmit, reinterpret_cast<void **>(&metadataEmit)));
 
-    // TODO: analyze the IL code instead to understand that we've injected functions?
-    if (instrumentedFunctions.find({m_moduleId, m_jittedToken}) != instrumentedFunctions.end()) {
-        LOG(tout << "Duplicate jitting of " << HEX(m_jittedToken) << std::endl);
-        return S_OK;
-    }
     if (mainLeft()) {
-        if (!m_reJitInstrumentedStarted)
+        if (!m_reJitInstrumentedStarted.exchange(true))
             IfFailRet(startReJitInstrumented());
-        LOG(tout << "Main left! Skipping instrumentation of " << HEX(m_jittedToken) << std::endl);
+        LOG(tout << "Main left! Skipping instrumentation of " << HEX(context.jittedToken) << std::endl);
         return S_OK;
     }
 
-    if (oldModuleId != m_moduleId) {
-        delete[] m_signatureTokens;
-        std::vector<mdSignature> *tokens = new std::vector<mdSignature>;
-        initTokens(metadataEmit, *tokens);
-        m_signatureTokensLength = tokens->size() * sizeof(mdSignature);
-        m_signatureTokens = (char *) &(*tokens)[0];
-    }
+    context.signatureTokens = moduleSignatureTokens(context.moduleId, metadataImport, metadataEmit);
+    IfNullRet(context.signatureTokens);
+    const char *signatureTokens = (const char *)context.signatureTokens->data();
+    unsigned signatureTokensLength = (unsigned)(context.signatureTokens->size() * sizeof(mdSignature));
 
-    LOG(tout << "Instrumenting token " << HEX(m_jittedToken) << "..." << std::endl);
+    LOG(tout << "Instrumenting token " << HEX(context.jittedToken) << "..." << std::endl);
 
-    IfFailRet(importIL());
+    IfFailRet(importIL(context));
 
-    unsigned codeLength = codeSize();
-    char *bytes = new char[codeLength];
-    char *ehcs = new char[ehCount()];
-    memcpy(bytes, code(), codeLength);
-    memcpy(ehcs, ehs(), ehCount());
-    MethodInfo mi = MethodInfo{m_jittedToken, bytes, codeLength, maxStackSize(), ehcs, ehCount()};
-    instrumentedFunctions[{m_moduleId, m_jittedToken}] = mi;
+    unsigned codeLength = (unsigned)context.code.size();
+    unsigned ehsCount = (unsigned)context.ehs.size();
+    // TODO: analyze the IL code instead to understand that we've injected functions?
+    if (!instrumentedFunctions.insert({context.moduleId, context.jittedToken}, OriginalBody{context.header, context.reJit})) {
+        LOG(tout << "Duplicate jitting of " << HEX(context.jittedToken) << std::endl);
+        return S_OK;
+    }
+
+    MethodInfo body;
+    if (batchInstrumented.take({context.moduleId, context.jittedToken}, body)) {
+        LOG(tout << "Applying instrumented body of token " << HEX(context.jittedToken) << " from the module batch");
+        IfFailRet(reportPreparedMain(context, moduleName, moduleNameLength));
+        hr = exportIL(context, body.bytecode, body.codeLength, body.maxStackSize, body.ehs, body.ehsLength);
+        delete[] body.bytecode;
+        delete[] body.ehs;
+        return hr;
+    }
 
+    CacheKey key{};
+    if (m_cache.enabled()) {
+        IfFailRet(metadataImport->GetScopeProps(nullptr, 0, nullptr, &key.mvid));
+        key.token = context.jittedToken;
+        key.ilHash = m_cache.ilHash(context.code.data(), codeLength, context.ehs.data(), ehsCount, context.maxStack);
+        key.probesVersion = m_cache.probesVersion(signatureTokens, signatureTokensLength);
+        CachedBody cached;
+        if (m_cache.lookup(key, cached)) {
+            LOG(tout << "Applying instrumented body of token " << HEX(context.jittedToken) << " from the instrumentation cache");
+            IfFailRet(reportPreparedMain(context, moduleName, moduleNameLength));
+            return exportIL(context, cached.bytecode.data(), cached.bytecode.size(), cached.maxStackSize, cached.ehs.data(), cached.ehs.size());
+        }
+    }
+
+    std::vector<char> tokensPayload;
+    signatureTokensPayload(context.moduleId, *context.signatureTokens, tokensPayload);
     MethodBodyInfo info{
-        (unsigned)m_jittedToken,
-        (unsigned)codeSize(),
+        (unsigned)context.jittedToken,
+        codeLength,
         (unsigned)(assemblyNameLength - 1) * sizeof(WCHAR),
         (unsigned)(moduleNameLength - 1) * sizeof(WCHAR),
-        (unsigned)maxStackSize(),
-        (unsigned)ehCount(),
-        m_signatureTokensLength,
-        m_signatureTokens,
+        context.maxStack,
+        ehsCount,
+        (unsigned)tokensPayload.size(),
+        tokensPayload.data(),
         assemblyName,
         moduleName,
-        code(),
-        (char*)ehs()
+        context.code.data(),
+        context.ehs.data()
     };
-    if (!m_protocol.sendSerializable(InstrumentCommand, info)) return false;
+    // NOTE: accepted body is a view into the receive buffer of this thread, so it is exported before the next request
+    std::unique_lock<std::mutex> requestLock = lockRequest();
+    if (!m_protocol.sendSerializable(InstrumentCommand, info)) return E_FAIL;
     LOG(tout << "Successfully sent method body!");
     char *bytecode; int length; unsigned maxStackSize; char *ehs; unsigned ehsLength;
 #ifdef _DEBUG
     CommandType command;
     do {
-        if (!m_protocol.acceptCommand(command)) return false;
+        if (!m_protocol.acceptCommand(command)) return E_FAIL;
         switch (command) {
             case ReadString: {
                 char *string;
-                if (!m_protocol.acceptString(string)) return false;
+                if (!m_protocol.acceptString(string)) return E_FAIL;
                 unsigned index = allocateString(string);
-                if (!m_protocol.sendStringsPoolIndex(index)) return false;
+                if (!m_protocol.sendStringsPoolIndex(index)) return E_FAIL;
                 break;
             }
             default:
@@ -451,65 +646,234 @@ HRESULT Instrumenter::doInstrumentation(ModuleID oldModuleId, const WCHAR *assem
     } while (command != ReadMethodBody);
 #endif
     LOG(tout << "Reading method body back...");
-    if (!m_protocol.acceptMethodBody(bytecode, length, maxStackSize, ehs, ehsLength)) return false;
+    if (!m_protocol.acceptMethodBody(bytecode, length, maxStackSize, ehs, ehsLength)) return E_FAIL;
+    requestLock.unlock();
+    tokensDelivered(context.moduleId);
     LOG(tout << "Exporting " << length << " IL bytes!");
-    IfFailRet(exportIL(bytecode, length, maxStackSize, ehs, ehsLength));
+    // NOTE: bodies, returned unchanged (skipped by the engine or failed to instrument), are not cached
+    if (m_cache.enabled() && ((unsigned)length != codeLength || memcmp(bytecode, context.code.data(), length) != 0))
+        m_cache.store(key, bytecode, length, ehs, ehsLength, maxStackSize);
+    IfFailRet(exportIL(context, bytecode, length, maxStackSize, ehs, ehsLength));
 
     return S_OK;
 }
 
-HRESULT Instrumenter::instrument(FunctionID functionId) {
+// NOTE: engine starts instrumenting after it gets the body of main; if the body is taken from the cache or the module batch,
+//       engine is told about main explicitly
+HRESULT Instrumenter::reportPreparedMain(const InstrumentationContext &context, const WCHAR *moduleName, ULONG moduleNameLength) {
+    if (!currentMethodIsMain(moduleName, (int) moduleNameLength, context.jittedToken)) return S_OK;
+    std::unique_lock<std::mutex> requestLock = lockRequest();
+    return m_protocol.sendMainReached() ? S_OK : E_FAIL;
+}
+
+HRESULT Instrumenter::instrument(FunctionID functionId, bool reJit) {
     HRESULT hr;
-    ModuleID oldModuleId = m_moduleId;
+    InstrumentationContext context{};
+    context.reJit = reJit;
     ClassID classId;
-    IfFailRet(m_profilerInfo.GetFunctionInfo(functionId, &classId, &m_moduleId, &m_jittedToken));
-    assert((m_jittedToken & 0xFF000000L) == mdtMethodDef);
+    IfFailRet(m_profilerInfo.GetFunctionInfo(functionId, &classId, &context.moduleId, &context.jittedToken));
+    assert((context.jittedToken & 0xFF000000L) == mdtMethodDef);
 
     LPCBYTE baseLoadAddress;
     ULONG moduleNameLength;
     AssemblyID assembly;
-    IfFailRet(m_profilerInfo.GetModuleInfo(m_moduleId, &baseLoadAddress, 0, &moduleNameLength, nullptr, &assembly));
-    WCHAR *moduleName = new WCHAR[moduleNameLength];
-    IfFailRet(m_profilerInfo.GetModuleInfo(m_moduleId, &baseLoadAddress, moduleNameLength, &moduleNameLength, moduleName, &assembly));
+    IfFailRet(m_profilerInfo.GetModuleInfo(context.moduleId, &baseLoadAddress, 0, &moduleNameLength, nullptr, &assembly));
+    std::vector<WCHAR> moduleName(moduleNameLength);
+    IfFailRet(m_profilerInfo.GetModuleInfo(context.moduleId, &baseLoadAddress, moduleNameLength, &moduleNameLength, moduleName.data(), &assembly));
     ULONG assemblyNameLength;
     AppDomainID appDomainId;
     ModuleID startModuleId;
     IfFailRet(m_profilerInfo.GetAssemblyInfo(assembly, 0, &assemblyNameLength, nullptr, &appDomainId, &startModuleId));
-    WCHAR *assemblyName = new WCHAR[assemblyNameLength];
-    IfFailRet(m_profilerInfo.GetAssemblyInfo(assembly, assemblyNameLength, &assemblyNameLength, assemblyName, &appDomainId, &startModuleId));
+    std::vector<WCHAR> assemblyName(assemblyNameLength);
+    IfFailRet(m_profilerInfo.GetAssemblyInfo(assembly, assemblyNameLength, &assemblyNameLength, assemblyName.data(), &appDomainId, &startModuleId));
 
+    // NOTE: methods out of the scope are neither instrumented nor remembered for ReJIT, so they run as externs
+    bool methodInScope = inScope(moduleName.data(), (int) moduleNameLength, context.jittedToken);
     if (!m_mainReached) {
-        if (currentMethodIsMain(moduleName, (int) moduleNameLength, m_jittedToken)) {
-            m_mainReached = true;
-            IfFailRet(startReJitSkipped());
+        std::set<std::pair<ModuleID, mdMethodDef>> skipped;
+        bool mainJustReached = false;
+        {
+            std::lock_guard<std::mutex> lock(m_skippedLock);
+            if (!m_mainReached) {
+                if (currentMethodIsMain(moduleName.data(), (int) moduleNameLength, context.jittedToken)) {
+                    cacheEntryPoint(context.moduleId);
+                    m_mainReached = true;
+                    mainJustReached = true;
+                    skipped.swap(skippedBeforeMain);
+                } else {
+                    if (methodInScope) {
+                        LOG(tout << "Instrumentation of token " << HEX(context.jittedToken) << " is skipped" << std::endl);
+                        skippedBeforeMain.insert({context.moduleId, context.jittedToken});
+                    }
+                    return S_OK;
+                }
+            }
         }
+        if (mainJustReached)
+            IfFailRet(startReJitSkipped(skipped));
     }
 
-    if (m_mainReached) {
-        LOG(tout << "Main function reached!" << std::endl);
-        doInstrumentation(oldModuleId, assemblyName, assemblyNameLength, moduleName, moduleNameLength);
+    if (!methodInScope) {
+        LOG(tout << "Token " << HEX(context.jittedToken) << " is out of the instrumentation scope" << std::endl);
     } else {
-        LOG(tout << "Instrumentation of token " << HEX(m_jittedToken) << " is skipped" << std::endl);
-        skippedBeforeMain.insert({m_moduleId, m_jittedToken});
+        LOG(tout << "Main function reached!" << std::endl);
+        doInstrumentation(context, assemblyName.data(), assemblyNameLength, moduleName.data(), moduleNameLength);
+    }
+
+    return S_OK;
+}
+
+bool Instrumenter::acceptInstrumentedModule(ModuleID moduleId, const GUID &mvid, unsigned long long probesVersion, const std::vector<ModuleMethodBody> &methods) {
+    char *message;
+    int messageLength;
+    if (!m_protocol.acceptInstrumentedModule(message, messageLength)) return false;
+    const char *current = message;
+    const char *end = message + messageLength;
+    if (end - current < (int)(2 * sizeof(unsigned))) return false;
+    unsigned methodsCount = *(unsigned*)current; current += sizeof(unsigned);
+    unsigned stringsCount = *(unsigned*)current; current += sizeof(unsigned);
+    // NOTE: strings for debug probes are allocated in the order of indices, which server has assigned to them
+    for (unsigned i = 0; i < stringsCount; i++) {
+        size_t length = strnlen(current, end - current) + 1;
+        if (current + length > end) return false;
+#ifdef _DEBUG
+        char *string = new char[length];
+        memcpy(string, current, length);
+        allocateString(string);
+#endif
+        current += length;
+    }
+    for (unsigned i = 0; i < methodsCount; i++) {
+        if (end - current < (int)(4 * sizeof(unsigned))) return false;
+        const unsigned *header = (const unsigned *)current;
+        current += 4 * sizeof(unsigned);
+        unsigned token = header[0], codeLength = header[1], maxStackSize = header[2], ehsLength = header[3];
+        if ((size_t)(end - current) < (size_t)codeLength + ehsLength) return false;
+        char *bytecode = new char[codeLength];
+        memcpy(bytecode, current, codeLength); current += codeLength;
+        char *ehs = new char[ehsLength];
+        memcpy(ehs, current, ehsLength); current += ehsLength;
+        batchInstrumented.set({moduleId, token}, MethodInfo{token, bytecode, codeLength, maxStackSize, ehs, ehsLength});
+        // NOTE: bodies are replied in the order of the batch
+        if (m_cache.enabled() && i < methods.size() && methods[i].token == token &&
+            (methods[i].bytecode.size() != codeLength || memcmp(methods[i].bytecode.data(), bytecode, codeLength) != 0)) {
+            const ModuleMethodBody &original = methods[i];
+            CacheKey key{mvid, token, m_cache.ilHash(original.bytecode.data(), (unsigned)original.bytecode.size(), original.ehs.data(), (unsigned)original.ehs.size(), original.maxStackSize), probesVersion};
+            m_cache.store(key, bytecode, codeLength, ehs, ehsLength, maxStackSize);
+        }
+    }
+    LOG(tout << "Accepted " << methodsCount << " instrumented method bodies of the module batch");
+    return current == end;
+}
+
+HRESULT Instrumenter::instrumentModule(ModuleID moduleId) {
+    if (!m_protocol.supports(ModuleBatchFeature)) return S_OK;
+    HRESULT hr;
+    LPCBYTE baseLoadAddress;
+    ULONG moduleNameLength;
+    AssemblyID assembly;
+    IfFailRet(m_profilerInfo.GetModuleInfo(moduleId, &baseLoadAddress, 0, &moduleNameLength, nullptr, &assembly));
+    std::vector<WCHAR> moduleName(moduleNameLength);
+    IfFailRet(m_profilerInfo.GetModuleInfo(moduleId, &baseLoadAddress, moduleNameLength, &moduleNameLength, moduleName.data(), &assembly));
+    if (!isMainModule(moduleName.data(), (int) moduleNameLength))
+        return S_OK;
+    ULONG assemblyNameLength;
+    AppDomainID appDomainId;
+    ModuleID startModuleId;
+    IfFailRet(m_profilerInfo.GetAssemblyInfo(assembly, 0, &assemblyNameLength, nullptr, &appDomainId, &startModuleId));
+    std::vector<WCHAR> assemblyName(assemblyNameLength);
+    IfFailRet(m_profilerInfo.GetAssemblyInfo(assembly, assemblyNameLength, &assemblyNameLength, assemblyName.data(), &appDomainId, &startModuleId));
+
+    CComPtr<IMetaDataImport> metadataImport;
+    CComPtr<IMetaDataEmit> metadataEmit;
+    IfFailRet(m_profilerInfo.GetModuleMetaData(moduleId, ofRead | ofWrite, IID_IMetaDataImport, reinterpret_cast<IUnknown **>(&metadataImport)));
+    IfFailRet(metadataImport->QueryInterface(IID_IMetaDataEmit, reinterpret_cast<void **>(&metadataEmit)));
+    const std::vector<mdSignature> *moduleTokens = moduleSignatureTokens(moduleId, metadataImport, metadataEmit);
+    IfNullRet(moduleTokens);
+    const std::vector<mdSignature> &tokens = *moduleTokens;
+    GUID mvid;
+    IfFailRet(metadataImport->GetScopeProps(nullptr, 0, nullptr, &mvid));
+    // NOTE: the main module is loaded before main is jitted, so its batch is the first user of the cache
+    m_cache.setEntryPoint(mvid, m_mainMethod);
+    unsigned long long probesVersion = m_cache.probesVersion((char*)tokens.data(), (unsigned)(tokens.size() * sizeof(mdSignature)));
+
+    std::vector<ModuleMethodBody> methods;
+    unsigned cachedCount = 0;
+    for (ULONG rid = 1; metadataImport->IsValidToken(TokenFromRid(rid, mdtMethodDef)); rid++) {
+        mdMethodDef method = TokenFromRid(rid, mdtMethodDef);
+        DWORD attributes, implFlags;
+        ULONG rva;
+        IfFailRet(metadataImport->GetMethodProps(method, nullptr, nullptr, 0, nullptr, &attributes, nullptr, nullptr, &rva, &implFlags));
+        // NOTE: abstract, runtime-implemented and P/Invoke methods have no IL body
+        if (rva == 0 || !IsMiIL(implFlags) || !IsMiManaged(implFlags))
+            continue;
+        if (!inScope(moduleName.data(), (int) moduleNameLength, method))
+            continue;
+        LPCBYTE pMethodBytes;
+        if (FAILED(m_profilerInfo.GetILFunctionBody(moduleId, method, &pMethodBytes, nullptr)))
+            continue;
+        COR_ILMETHOD_DECODER decoder((COR_ILMETHOD*)pMethodBytes);
+        ModuleMethodBody body;
+        body.token = method;
+        body.maxStackSize = decoder.GetMaxStack();
+        body.bytecode.assign((const char *)decoder.Code, (const char *)decoder.Code + decoder.GetCodeSize());
+        copyEHs(decoder, body.ehs);
+        CachedBody cached;
+        if (m_cache.enabled() && m_cache.lookup(CacheKey{mvid, method, m_cache.ilHash(body.bytecode.data(), (unsigned)body.bytecode.size(), body.ehs.data(), (unsigned)body.ehs.size(), body.maxStackSize), probesVersion}, cached)) {
+            char *bytecode = new char[cached.bytecode.size()];
+            memcpy(bytecode, cached.bytecode.data(), cached.bytecode.size());
+            char *ehs = new char[cached.ehs.size()];
+            memcpy(ehs, cached.ehs.data(), cached.ehs.size());
+            batchInstrumented.set({moduleId, method}, MethodInfo{method, bytecode, (unsigned)cached.bytecode.size(), cached.maxStackSize, ehs, (unsigned)cached.ehs.size()});
+            ++cachedCount;
+            continue;
+        }
+        methods.push_back(std::move(body));
     }
 
-    delete[] moduleName;
-    delete[] assemblyName;
+    if (methods.empty()) {
+        LOG(tout << "All " << cachedCount << " methods of the main module are taken from the instrumentation cache" << std::endl);
+        return S_OK;
+    }
 
+    LOG(tout << "Instrumenting " << methods.size() << " methods of the main module in one batch (" << cachedCount << " cached)..." << std::endl);
+#ifdef _DEBUG
+    unsigned firstStringIndex = nextStringIndex();
+#else
+    unsigned firstStringIndex = 0;
+#endif
+    std::vector<char> tokensPayload;
+    signatureTokensPayload(moduleId, tokens, tokensPayload);
+    ModuleBodiesInfo info{
+        firstStringIndex,
+        (unsigned)(assemblyNameLength - 1) * sizeof(WCHAR),
+        (unsigned)(moduleNameLength - 1) * sizeof(WCHAR),
+        (unsigned)tokensPayload.size(),
+        tokensPayload.data(),
+        assemblyName.data(),
+        moduleName.data(),
+        methods
+    };
+    std::unique_lock<std::mutex> requestLock = lockRequest();
+    if (!m_protocol.sendSerializable(InstrumentModuleCommand, info) || !acceptInstrumentedModule(moduleId, mvid, probesVersion, methods))
+        return E_FAIL;
+    requestLock.unlock();
+    tokensDelivered(moduleId);
     return S_OK;
 }
 
 HRESULT Instrumenter::undoInstrumentation(FunctionID functionId) {
     HRESULT hr;
+    InstrumentationContext context{};
     ClassID classId;
-    IfFailRet(m_profilerInfo.GetFunctionInfo(functionId, &classId, &m_moduleId, &m_jittedToken));
-    assert((m_jittedToken & 0xFF000000L) == mdtMethodDef);
-    const auto instrumented = instrumentedFunctions.find({m_moduleId, m_jittedToken});
-    if (instrumented != instrumentedFunctions.end()) {
-        MethodInfo mi = instrumented->second;
-        LOG(tout << "Undo instrumentation token " << HEX(m_jittedToken) << "..." << std::endl);
-        IfFailRet(exportIL(mi.bytecode, mi.codeLength, mi.maxStackSize, mi.ehs, mi.ehsLength));
-        instrumentedFunctions.erase(instrumented);
+    IfFailRet(m_profilerInfo.GetFunctionInfo(functionId, &classId, &context.moduleId, &context.jittedToken));
+    assert((context.jittedToken & 0xFF000000L) == mdtMethodDef);
+    OriginalBody original;
+    if (instrumentedFunctions.take({context.moduleId, context.jittedToken}, original)) {
+        LOG(tout << "Undo instrumentation token " << HEX(context.jittedToken) << "..." << std::endl);
+        // NOTE: header flags and local signature are kept by instrumentation, so they are taken from the current body
+        IfFailRet(importIL(context));
+        return exportOriginalIL(context, original.header);
     }
     return S_OK;
 }
@@ -520,5 +884,5 @@ HRESULT Instrumenter::reInstrument(FunctionID functionId) {
     if (mainLeft())
         return undoInstrumentation(functionId);
     else
-        return instrument(functionId);
+        return instrument(functionId, true);
 }
@@ -1,12 +1,15 @@
 #ifndef INSTRUMENTER_H_
 #define INSTRUMENTER_H_
 
+#include <atomic>
+#include <mutex>
 #include <set>
+#include <string>
 #include "corProfiler.h"
 #include "cComPtr.h"
+#include "instrumentationCache.h"
 
-struct COR_ILMETHOD_SECT_EH;
-struct IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT;
+struct ModuleMethodBody;
 
 namespace vsharp {
 
@@ -21,71 +24,154 @@ struct MethodInfo {
     unsigned ehsLength;
 };
 
+// NOTE: original IL is referenced, not copied: the header, returned by GetILFunctionBody before the body is replaced,
+//       stays in the image of the module until the module is unloaded
+struct OriginalBody {
+    LPCBYTE header;
+    // NOTE: the method was jitted without probes and instrumented by ReJIT, so RequestRevert restores its original code
+    bool revertible;
+};
+
+// NOTE: methods are spread over shards by their tokens, so that concurrent JIT threads rarely wait for the same lock
+template<typename Value>
+class ShardedMethodTable {
+private:
+    static const unsigned ShardsCount = 16;
+    typedef std::pair<ModuleID, mdMethodDef> Key;
+    struct Shard {
+        std::mutex lock;
+        std::map<Key, Value> entries;
+    };
+    Shard m_shards[ShardsCount];
+
+    Shard &shard(const Key &key) { return m_shards[(key.second ^ (unsigned)(key.first >> 4)) % ShardsCount]; }
+
+public:
+    // NOTE: returns false if the method is already in the table
+    bool insert(const Key &key, const Value &value) {
+        Shard &s = shard(key);
+        std::lock_guard<std::mutex> lock(s.lock);
+        return s.entries.insert({key, value}).second;
+    }
+
+    void set(const Key &key, const Value &value) {
+        Shard &s = shard(key);
+        std::lock_guard<std::mutex> lock(s.lock);
+        s.entries[key] = value;
+    }
+
+    bool take(const Key &key, Value &value) {
+        Shard &s = shard(key);
+        std::lock_guard<std::mutex> lock(s.lock);
+        const auto found = s.entries.find(key);
+        if (found == s.entries.end()) return false;
+        value = found->second;
+        s.entries.erase(found);
+        return true;
+    }
+
+    template<typename Predicate>
+    void eraseIf(Predicate predicate) {
+        for (Shard &s : m_shards) {
+            std::lock_guard<std::mutex> lock(s.lock);
+            for (auto it = s.entries.begin(); it != s.entries.end();)
+                it = predicate(it->first, it->second) ? s.entries.erase(it) : std::next(it);
+        }
+    }
+
+    template<typename Action>
+    void forEach(Action action) {
+        for (Shard &s : m_shards) {
+            std::lock_guard<std::mutex> lock(s.lock);
+            for (const auto &entry : s.entries)
+                action(entry.first, entry.second);
+        }
+    }
+};
+
+// NOTE: concrete invocations in a row, after which guarded methods switch to their lightweight clones
+#define DEFAULT_DEMOTION_THRESHOLD 64
+
+// NOTE: state of one instrumentation request, it is owned by the JIT thread, which serves the request
+struct InstrumentationContext;
+
 class Instrumenter {
 private:
     ICorProfilerInfo8 &m_profilerInfo;  // Does not have ownership
-    IMethodMalloc *m_methodMalloc;  // Does not have ownership
 
     Protocol &m_protocol;
 
     WCHAR *m_mainModuleName;
     int m_mainModuleSize;
     mdMethodDef m_mainMethod;
-    bool m_mainReached;
-
-    mdMethodDef m_jittedToken;
-    ModuleID m_moduleId;
-
-    char *m_signatureTokens;
-    unsigned m_signatureTokensLength;
-
-    mdToken     m_tkLocalVarSig;
-    unsigned    m_maxStack;
-    unsigned    m_flags;
-    bool        m_generateTinyHeader;
-
-    unsigned    m_nEH;
-    IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT *m_pEH;
-
-    char *m_code;
-    unsigned    m_codeSize;
-
-    std::map<std::pair<ModuleID, mdMethodDef>, MethodInfo> instrumentedFunctions;
+    std::atomic<bool> m_mainReached;
+
+    // NOTE: signature tokens of probes are emitted once per module, when its first method is instrumented
+    // NOTE: tokens of P/Invoke methods of probes follow signature tokens, if ProbeMethodsFeature is negotiated
+    struct ModuleTokens {
+        std::vector<mdSignature> tokens;
+        // NOTE: the engine has answered a request, which carried the tokens
+        bool delivered;
+    };
+    std::mutex m_tokensLock;
+    std::map<ModuleID, ModuleTokens> m_signatureTokens;
+    std::basic_string<WCHAR> m_probesLibrary;
+
+    ShardedMethodTable<OriginalBody> instrumentedFunctions;
+    // NOTE: guards both 'skippedBeforeMain' and the moment main is reached, so that no skipped method misses ReJIT
+    std::mutex m_skippedLock;
     std::set<std::pair<ModuleID, mdMethodDef>> skippedBeforeMain;
+    // NOTE: bodies of the main module, instrumented in one batch at its load and applied when methods are jitted
+    ShardedMethodTable<MethodInfo> batchInstrumented;
 
-    bool m_reJitInstrumentedStarted;
+    std::atomic<bool> m_reJitInstrumentedStarted;
 
-    unsigned codeSize() const;
-    char *code() const;
-    unsigned ehCount() const;
-    IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT *ehs() const;
-    unsigned maxStackSize() const;
+    // NOTE: round trips of concurrent JIT threads may overlap only if the protocol multiplexes requests
+    std::mutex m_requestLock;
 
-    HRESULT setILFunctionBody(LPCBYTE pBody);
-    LPBYTE allocateILMemory(unsigned size);
+    // NOTE: methods to instrument, sent by the engine after the entry point; modules out of the scope are not instrumented
+    struct ModuleScope {
+        bool whole;
+        std::vector<char> bitmap;
+    };
+    bool m_scopeKnown;
+    std::map<std::basic_string<WCHAR>, ModuleScope> m_scope;
 
-    HRESULT importIL();
-    HRESULT importEH(const COR_ILMETHOD_SECT_EH* pILEH, unsigned nEH);
-    HRESULT exportIL(char *bytecode, unsigned codeLength, unsigned maxStackSize, char *ehs, unsigned ehsLength);
+    // NOTE: instrumented bodies of previous runs, so that warm runs instrument without round trips to the engine
+    InstrumentationCache m_cache;
+
+    HRESULT importIL(InstrumentationContext &context);
+    HRESULT exportOriginalIL(const InstrumentationContext &context, LPCBYTE header);
+    HRESULT exportIL(const InstrumentationContext &context, char *bytecode, unsigned codeLength, unsigned maxStackSize, char *ehs, unsigned ehsLength);
+    const std::vector<mdSignature> *moduleSignatureTokens(ModuleID moduleId, const CComPtr<IMetaDataImport> &metadataImport, const CComPtr<IMetaDataEmit> &metadataEmit);
+    void signatureTokensPayload(ModuleID moduleId, const std::vector<mdSignature> &tokens, std::vector<char> &payload);
+    void tokensDelivered(ModuleID moduleId);
+    std::unique_lock<std::mutex> lockRequest();
 
     HRESULT startReJitInstrumented();
-    HRESULT startReJitSkipped();
+    HRESULT startReJitSkipped(const std::set<std::pair<ModuleID, mdMethodDef>> &skipped);
     HRESULT undoInstrumentation(FunctionID functionId);
-    HRESULT doInstrumentation(ModuleID oldModuleId, const WCHAR *assemblyName, ULONG assemblyNameLength, const WCHAR *moduleName, ULONG moduleNameLength);
+    HRESULT doInstrumentation(InstrumentationContext &context, const WCHAR *assemblyName, ULONG assemblyNameLength, const WCHAR *moduleName, ULONG moduleNameLength);
+    HRESULT reportPreparedMain(const InstrumentationContext &context, const WCHAR *moduleName, ULONG moduleNameLength);
 
     bool currentMethodIsMain(const WCHAR *moduleName, int moduleSize, mdMethodDef method) const;
+    bool isMainModule(const WCHAR *moduleName, int moduleSize) const;
+    bool inScope(const WCHAR *moduleName, int moduleSize, mdMethodDef method) const;
+    bool acceptInstrumentationScope();
+    bool acceptInstrumentedModule(ModuleID moduleId, const GUID &mvid, unsigned long long probesVersion, const std::vector<ModuleMethodBody> &methods);
 
 public:
     explicit Instrumenter(ICorProfilerInfo8 &profilerInfo, Protocol &protocol);
     ~Instrumenter();
 
-    const char *signatureTokens() const { return m_signatureTokens; }
-    unsigned signatureTokensLength() const { return m_signatureTokensLength; }
-
     void configureEntryPoint();
+    void cacheEntryPoint(ModuleID mainModuleId);
 
-    HRESULT instrument(FunctionID functionId);
+    // NOTE: may be called concurrently from several JIT threads
+    HRESULT instrument(FunctionID functionId, bool reJit = false);
+    HRESULT instrumentModule(ModuleID moduleId);
     HRESULT reInstrument(FunctionID functionId);
+    void moduleUnloaded(ModuleID moduleId);
 };
 
 }
@@ -1,8 +1,15 @@
 #include <iostream>
 #include <algorithm>
+#include <bitset>
+#include <cstdlib>
+#include <cstring>
 #include <string>
 #include "heap.h"
 
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+
 #define min(a,b) (((a) < (b)) ? (a) : (b))
 #define max(a,b) (((a) > (b)) ? (a) : (b))
 
@@ -84,18 +91,53 @@ namespace vsharp {
 
 // --------------------------- Object ---------------------------
 
+    constexpr cell Object::max;
+    constexpr cell Object::min;
+    constexpr size_t Object::sizeofCell;
+    size_t Object::symbolicObjects = 0;
+    SlabAllocator Object::nodes(sizeof(Object));
+    // NOTE: bitmaps of objects up to 32KB are allocated from slabs, bitmaps of larger ones are allocated directly
+    SizeClassedAllocator Object::bitmaps(8, 4096);
+
+    void *Object::operator new(size_t size) {
+        assert(size == sizeof(Object));
+        return nodes.allocate();
+    }
+
+    void Object::operator delete(void *obj) {
+        if (obj) nodes.deallocate(obj);
+    }
+
+    void Object::trimAllocators() {
+        nodes.trim();
+        bitmaps.trim();
+    }
+
+    // NOTE: all contents are concrete at the beginning, so the bitmap is not allocated
     Object::Object(ADDR address, SIZE size)
         : Interval(address, size)
     {
         assert(size > 0);
-        SIZE squashedSize = (size + sizeofCell - 1) / sizeofCell;
-        concreteness = new cell[squashedSize];
-        // NOTE: all contents are concrete at the beginning
-        for (int i = 0; i < squashedSize; ++i) concreteness[i] = max;
     }
 
     Object::~Object() {
-        delete[] concreteness;
+        if (concreteness) {
+            bitmaps.deallocate(concreteness, squashedSize());
+            --symbolicObjects;
+        }
+    }
+
+    SIZE Object::squashedSize() const {
+        return (right - left + 1 + sizeofCell - 1) / sizeofCell;
+    }
+
+    static SIZE symbolicBits(cell value) {
+        return std::bitset<sizeof(cell) * 8>((unsigned char)~value).count();
+    }
+
+    void Object::setCell(SIZE index, cell value) {
+        symbolicBytes = symbolicBytes - symbolicBits(concreteness[index]) + symbolicBits(value);
+        concreteness[index] = value;
     }
 
     std::string Object::toString() const {
@@ -104,6 +146,7 @@ namespace vsharp {
 
     bool Object::read(SIZE offset, SIZE size) const {
         assert(size > 0);
+        if (!concreteness) return true;
         auto startOffset = offset % sizeofCell;
         auto startIndex = offset / sizeofCell;
         auto endOffset = (offset + size) % sizeofCell;
@@ -127,12 +170,19 @@ namespace vsharp {
 
     void Object::write(SIZE offset, SIZE size, bool vConcreteness) {
         assert(size > 0);
+        if (!concreteness) {
+            if (vConcreteness) return;
+            SIZE cells = squashedSize();
+            concreteness = (cell *)bitmaps.allocate(cells);
+            for (SIZE i = 0; i < cells; ++i) concreteness[i] = max;
+            ++symbolicObjects;
+        }
         auto startOffset = offset % sizeofCell;
         auto startIndex = offset / sizeofCell;
         auto endOffset = (offset + size) % sizeofCell;
         auto endIndex = (offset + size) / sizeofCell;
         for (unsigned i = startIndex + (startOffset ? 1 : 0); i < endIndex; ++i)
-            this->concreteness[i] = vConcreteness ? max : min;
+            setCell(i, vConcreteness ? max : min);
 
         auto shift = sizeofCell - startOffset;
         cell startMask = ((cell)1 << shift) - 1; // get 00..011...1
@@ -140,37 +190,155 @@ namespace vsharp {
         cell endMask = (max >> shift) << shift; // get 11..100..0
         if (startOffset) {
             if (vConcreteness)
-                this->concreteness[startIndex] |= startMask;
+                setCell(startIndex, concreteness[startIndex] | startMask);
             else
-                this->concreteness[startIndex] &= ~startMask;
+                setCell(startIndex, concreteness[startIndex] & ~startMask);
         }
         if (endOffset) {
             if (vConcreteness)
-                this->concreteness[endIndex] |= endMask;
+                setCell(endIndex, concreteness[endIndex] | endMask);
             else
-                this->concreteness[endIndex] &= ~endMask;
+                setCell(endIndex, concreteness[endIndex] & ~endMask);
         }
+        if (symbolicBytes == 0) {
+            bitmaps.deallocate(concreteness, squashedSize());
+            concreteness = nullptr;
+            --symbolicObjects;
+        }
+    }
+
+// --------------------------- ShadowMemory ---------------------------
+
+    ShadowMemory::ShadowMemory()
+        : m_shadow(nullptr), m_size(0) { }
+
+    ShadowMemory::~ShadowMemory() {
+        close();
+    }
+
+    bool ShadowMemory::open() {
+#ifdef WIN32
+        LOG_ERROR(tout << "Shadow memory is not supported on this platform");
+        return false;
+#else
+        size_t size = (size_t)1 << (SHADOW_ADDRESS_BITS - 3);
+        void *shadow = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (shadow == MAP_FAILED) {
+            LOG_ERROR(tout << "Could not reserve " << size << " bytes of shadow memory");
+            return false;
+        }
+        m_shadow = (unsigned char *)shadow;
+        m_size = size;
+        return true;
+#endif
+    }
+
+    void ShadowMemory::close() {
+#ifndef WIN32
+        if (m_shadow) munmap(m_shadow, m_size);
+#endif
+        m_shadow = nullptr;
+        m_size = 0;
+    }
+
+    bool ShadowMemory::covers(ADDR address, SIZE size) const {
+        return address + size <= ((ADDR)1 << SHADOW_ADDRESS_BITS) && address + size > address;
+    }
+
+    // NOTE: addresses out of the shadow are conservatively symbolic
+    bool ShadowMemory::read(ADDR address, SIZE size) const {
+        assert(size > 0);
+        if (!covers(address, size)) return false;
+        ADDR last = address + size - 1;
+        const unsigned char *first = m_shadow + (address >> 3);
+        const unsigned char *end = m_shadow + (last >> 3);
+        auto firstMask = (unsigned char)(0xFF << (address & 7));
+        auto lastMask = (unsigned char)(0xFF >> (7 - (last & 7)));
+        if (first == end)
+            return (*first & firstMask & lastMask) == 0;
+        if (*first & firstMask) return false;
+        for (const unsigned char *current = first + 1; current < end; ++current)
+            if (*current) return false;
+        return (*end & lastMask) == 0;
+    }
+
+    void ShadowMemory::write(ADDR address, SIZE size, bool vConcreteness) const {
+        assert(size > 0);
+        if (!covers(address, size)) {
+            LOG_ERROR(tout << "Writing to shadow memory: address " << HEX(address) << " is out of the shadow");
+            return;
+        }
+        ADDR last = address + size - 1;
+        unsigned char *first = m_shadow + (address >> 3);
+        unsigned char *end = m_shadow + (last >> 3);
+        auto firstMask = (unsigned char)(0xFF << (address & 7));
+        auto lastMask = (unsigned char)(0xFF >> (7 - (last & 7)));
+        if (first == end) firstMask &= lastMask;
+        if (vConcreteness) *first &= (unsigned char)~firstMask; else *first |= firstMask;
+        if (first == end) return;
+        if (end > first + 1) memset(first + 1, vConcreteness ? 0x00 : 0xFF, end - first - 1);
+        if (vConcreteness) *end &= (unsigned char)~lastMask; else *end |= lastMask;
+    }
+
+    void ShadowMemory::move(ADDR oldStart, ADDR newStart, SIZE length) {
+        if (!covers(oldStart, length) || !covers(newStart, length)) return;
+        // NOTE: objects are pointer-aligned, so ranges are moved by whole shadow bytes
+        if ((oldStart | newStart | length) & 7) {
+            LOG(tout << "Unaligned range " << HEX(oldStart) << " is moved, its shadow becomes symbolic");
+            m_moves.push_back(PendingMove{newStart, 0, (size_t)length, false});
+            return;
+        }
+        const unsigned char *source = m_shadow + (oldStart >> 3);
+        m_moves.push_back(PendingMove{newStart, m_movedBytes.size(), (size_t)(length >> 3), true});
+        m_movedBytes.insert(m_movedBytes.end(), source, source + (length >> 3));
+    }
+
+    void ShadowMemory::finishMoves() {
+        for (const PendingMove &move : m_moves) {
+            if (move.precise)
+                memcpy(m_shadow + (move.newStart >> 3), m_movedBytes.data() + move.offset, move.length);
+            else
+                write(move.newStart, move.length, false);
+        }
+        m_moves.clear();
+        m_movedBytes.clear();
     }
 
 // --------------------------- Heap ---------------------------
 
     Heap::Heap() = default;
 
+    void Heap::openShadowFromEnvironment() {
+        const char *mode = getenv("CONCOLIC_SHADOW_MEMORY");
+        if (!mode || strcmp(mode, "direct") != 0) return;
+        if (shadow.open())
+            LOG(tout << "Concreteness of the heap is kept in direct-mapped shadow memory");
+    }
+
     OBJID Heap::allocateObject(ADDR address, SIZE size, char *type, unsigned long typeLength) {
         auto *obj = new Object(address, size);
         tree.add(*obj);
+        // NOTE: memory of dead objects is reused, so the shadow of the new object is reset
+        if (shadow.enabled()) shadow.write(address, size, true);
         auto id = (OBJID) obj;
         newAddresses[id] = std::make_pair(type, typeLength);
         return id;
     }
 
-    void Heap::moveAndMark(ADDR oldLeft, ADDR newLeft, SIZE length) {
-        Interval i(oldLeft, length);
-        Shift s{oldLeft, newLeft};
-        tree.moveAndMark(i, s);
+    void Heap::moveAndMark(ULONG count, const ObjectID oldStarts[], const ObjectID newStarts[], const ULONG lengths[]) {
+        std::vector<std::pair<Interval, Shift>> moved;
+        moved.reserve(count);
+        for (ULONG i = 0; i < count; ++i) {
+            moved.emplace_back(Interval(oldStarts[i], lengths[i]), Shift{oldStarts[i], newStarts[i]});
+            if (shadow.enabled()) shadow.move(oldStarts[i], newStarts[i], lengths[i]);
+        }
+        tree.moveAndMark(moved);
     }
 
     bool Heap::read(ADDR address, SIZE sizeOfPtr) const {
+        if (shadow.enabled()) return shadow.read(address, sizeOfPtr);
+        // NOTE: no object has symbolic bytes, so the address is not resolved
+        if (Object::heapIsFullyConcrete()) return true;
         VirtualAddress vAddress{};
         if (!resolve(address, vAddress)) {
             return false;
@@ -180,7 +348,12 @@ namespace vsharp {
         return obj->read(vAddress.offset, sizeOfPtr);
     }
 
-    void Heap::write(ADDR address, SIZE sizeOfPtr, bool vConcreteness) const {
+    void Heap::write(ADDR address, SIZE sizeOfPtr, bool vConcreteness) {
+        if (shadow.enabled()) {
+            shadow.write(address, sizeOfPtr, vConcreteness);
+            return;
+        }
+        if (vConcreteness && Object::heapIsFullyConcrete()) return;
         VirtualAddress vAddress{};
         if (!resolve(address, vAddress)) {
             FAIL_LOUD("Writing to heap: unable to resolve address");
@@ -199,15 +372,40 @@ namespace vsharp {
         return false;
     }
 
-    void Heap::markSurvivedObjects(ADDR start, SIZE length) {
-        Interval i(start, length);
-        tree.mark(i);
+    void Heap::markSurvivedObjects(ULONG count, const ObjectID starts[], const ULONG lengths[]) {
+        std::vector<Interval> survived;
+        survived.reserve(count);
+        for (ULONG i = 0; i < count; ++i)
+            survived.emplace_back(starts[i], lengths[i]);
+        tree.mark(survived);
     }
 
     void Heap::clearAfterGC() {
+        if (shadow.enabled()) shadow.finishMoves();
         auto deleted = tree.clearUnmarked();
-        for (Interval *address : deleted)
-            deletedAddresses.push_back((OBJID) address);
+        for (Interval *address : deleted) {
+            // NOTE: the engine has not seen objects, which die before the next command, so they are not reported
+            auto pending = newAddresses.find((OBJID) address);
+            if (pending != newAddresses.end()) {
+                delete pending->second.first;
+                newAddresses.erase(pending);
+            } else {
+                deletedAddresses.push_back((OBJID) address);
+            }
+        }
+        Object::trimAllocators();
+        reportFootprint();
+    }
+
+    void Heap::reportFootprint() const {
+        size_t objects = tree.size();
+        size_t nodes = Object::nodeBytes();
+        size_t bitmaps = Object::bitmapBytes();
+        size_t index = tree.indexBytes();
+        size_t total = nodes + bitmaps + index;
+        LOG(tout << "Shadow heap: " << objects << " objects, " << nodes << " bytes of nodes, " << bitmaps
+                 << " bytes of bitmaps, " << index << " bytes of index, "
+                 << (objects ? total / objects : 0) << " bytes per object");
     }
 
     // TODO: store new addresses or get them from tree? #do
@@ -220,6 +418,13 @@ namespace vsharp {
         return result;
     }
 
+    // NOTE: ids of collected objects, so that the engine forgets them before ids are reused by new objects
+    std::vector<OBJID> Heap::flushDeletedObjects() {
+        std::vector<OBJID> result;
+        result.swap(deletedAddresses);
+        return result;
+    }
+
     void Heap::dump() const {
         LOG(tout << "-------------- HEAP DUMP --------------" << std::endl);
         std::string dump = tree.dumpObjects();
@@ -239,4 +444,11 @@ namespace vsharp {
         auto object = (Object *)virtAddress.obj;
         return object->left + virtAddress.offset;
     }
+
+    void Heap::objectLayout(unsigned &leftOffset, unsigned &rightOffset) {
+        // NOTE: Interval is polymorphic, so offsetof can not be used; Object inherits only Interval, so its base is at offset 0
+        Interval probe;
+        leftOffset = (unsigned)((char *)&probe.left - (char *)&probe);
+        rightOffset = (unsigned)((char *)&probe.right - (char *)&probe);
+    }
 }
@@ -4,6 +4,7 @@
 #include <map>
 #include <vector>
 #include "intervalTree.h"
+#include "slabAllocator.h"
 #include "cor.h"
 #include "corprof.h"
 #include "corhdr.h"
@@ -58,21 +59,77 @@ typedef char cell;
 
 class Object : public Interval {
 private:
-    // NOTE: each bit corresponds of concreteness of memory byte
+    // NOTE: each bit corresponds of concreteness of memory byte; objects are fully concrete without the bitmap,
+    //       it is allocated by the first symbolic write and freed, when the object becomes fully concrete again
     cell *concreteness = nullptr;
-    const cell max = 0xFF;
-    const cell min = 0x00;
-    const size_t sizeofCell = sizeof(cell) * 8;
+    // NOTE: count of symbolic bytes, it is kept by writes, so that the bitmap is freed without scanning it
+    SIZE symbolicBytes = 0;
+    static constexpr cell max = (cell)0xFF;
+    static constexpr cell min = 0x00;
+    static constexpr size_t sizeofCell = sizeof(cell) * 8;
+    // NOTE: count of objects with bitmaps; while it is zero, the whole heap is concrete
+    static size_t symbolicObjects;
+    // NOTE: objects and bitmaps are allocated from slabs, which are released in bulk after GC
+    static SlabAllocator nodes;
+    static SizeClassedAllocator bitmaps;
+
+    SIZE squashedSize() const;
+    void setCell(SIZE index, cell value);
 public:
     Object(ADDR address, SIZE size);
     ~Object() override;
     std::string toString() const override;
     bool read(SIZE offset, SIZE size) const;
     void write(SIZE offset, SIZE size, bool vConcreteness);
+
+    static void *operator new(size_t size);
+    static void operator delete(void *obj);
+
+    static bool heapIsFullyConcrete() { return symbolicObjects == 0; }
+    static void trimAllocators();
+    static size_t nodeBytes() { return nodes.reservedBytes(); }
+    static size_t bitmapBytes() { return bitmaps.reservedBytes(); }
 };
 
 typedef IntervalTree<Interval, Shift, ADDR> Intervals;
 
+// NOTE: addresses of user space, which are covered by the shadow memory
+#define SHADOW_ADDRESS_BITS 47
+
+// Direct-mapped shadow of the address space (CONCOLIC_SHADOW_MEMORY=direct), one bit per byte, set bits mark symbolic
+// bytes; the region is reserved without backing, so pages are mapped by first accesses, and untouched memory is concrete
+class ShadowMemory {
+private:
+    unsigned char *m_shadow;
+    size_t m_size;
+    // NOTE: GC reports moved ranges by old addresses, so their shadow bytes are saved and written to new addresses
+    //       after the GC, when no source range can be overwritten anymore
+    struct PendingMove {
+        ADDR newStart;
+        size_t offset;
+        size_t length;
+        // NOTE: unaligned ranges can not be moved by whole shadow bytes, they become symbolic
+        bool precise;
+    };
+    std::vector<PendingMove> m_moves;
+    std::vector<unsigned char> m_movedBytes;
+
+    bool covers(ADDR address, SIZE size) const;
+
+public:
+    ShadowMemory();
+    ~ShadowMemory();
+
+    bool open();
+    void close();
+    bool enabled() const { return m_shadow != nullptr; }
+
+    bool read(ADDR address, SIZE size) const;
+    void write(ADDR address, SIZE size, bool vConcreteness) const;
+    void move(ADDR oldStart, ADDR newStart, SIZE length);
+    void finishMoves();
+};
+
 struct VirtualAddress
 {
     OBJID obj;
@@ -82,6 +139,8 @@ struct VirtualAddress
 class Heap {
 private:
     Intervals tree;
+    // NOTE: if shadow memory is enabled, concreteness is kept there, and the tree only resolves objects
+    ShadowMemory shadow;
     // TODO: store new addresses or get them from tree? #do
     std::map<OBJID, std::pair<char*, unsigned long>> newAddresses;
     std::vector<OBJID> deletedAddresses;
@@ -91,19 +150,26 @@ private:
 public:
     Heap();
 
+    void openShadowFromEnvironment();
+
     OBJID allocateObject(ADDR address, SIZE size, char *type, unsigned long typeLength);
 
-    void moveAndMark(ADDR oldLeft, ADDR newLeft, SIZE length);
-    void markSurvivedObjects(ADDR start, SIZE length);
+    // NOTE: all ranges of one GC callback are processed in one pass over the index of objects
+    void moveAndMark(ULONG count, const ObjectID oldStarts[], const ObjectID newStarts[], const ULONG lengths[]);
+    void markSurvivedObjects(ULONG count, const ObjectID starts[], const ULONG lengths[]);
     void clearAfterGC();
+    void reportFootprint() const;
 
     std::map<OBJID, std::pair<char*, unsigned long>> flushObjects();
+    std::vector<OBJID> flushDeletedObjects();
 
     VirtualAddress physToVirtAddress(ADDR physAddress) const;
     static ADDR virtToPhysAddress(const VirtualAddress &virtAddress);
+    // NOTE: offsets of bounds inside of shadow objects, object ids are addresses of shadow objects
+    static void objectLayout(unsigned &leftOffset, unsigned &rightOffset);
 
     bool read(ADDR address, SIZE sizeOfPtr) const;
-    void write(ADDR address, SIZE sizeOfPtr, bool vConcreteness) const;
+    void write(ADDR address, SIZE sizeOfPtr, bool vConcreteness);
 
     void dump() const;
 };
@@ -2,62 +2,119 @@
 #define INTERVALTREE_H_
 
 #include "../logging.h"
+#include <algorithm>
 #include <cassert>
+#include <utility>
+#include <vector>
 
+// NOTE: intervals are disjoint, so they are indexed by their left bounds in a sorted array, and points are found by
+//       binary search; new intervals mostly come in increasing order (allocations inside of a segment), so they are
+//       appended, others wait in 'pending' and are merged into the index by the next lookup
 template<typename Interval, typename Shift, typename Point>
 class IntervalTree {
 private:
-    std::vector<Interval *> objects;
+    mutable std::vector<Interval *> objects;
+    mutable std::vector<Interval *> pending;
+    // NOTE: GC reports all moved ranges by old addresses, so intervals are moved after the GC, keeping the index valid
+    std::vector<std::pair<Interval *, Shift>> moves;
+
+    static bool leftLess(const Interval *first, const Interval *second) {
+        return first->left < second->left;
+    }
+
+    void merge() const {
+        if (pending.empty()) return;
+        if (!std::is_sorted(pending.begin(), pending.end(), leftLess))
+            std::sort(pending.begin(), pending.end(), leftLess);
+        auto middle = (long)objects.size();
+        objects.insert(objects.end(), pending.begin(), pending.end());
+        pending.clear();
+        std::inplace_merge(objects.begin(), objects.begin() + middle, objects.end(), leftLess);
+    }
+
+    static const Interval &rangeOf(const Interval &range) { return range; }
+    static const Interval &rangeOf(const std::pair<Interval, Shift> &range) { return range.first; }
+
+    // NOTE: intervals inside of 'ranges' in one merge pass over the index, intervals between ranges are skipped by binary
+    //       search from the current position; intervals, which are not inside of ranges, must not intersect them
+    template<typename Range, typename Action>
+    void forIncluded(std::vector<Range> &ranges, Action action) {
+        merge();
+        auto rangeLess = [](const Range &first, const Range &second) { return rangeOf(first).left < rangeOf(second).left; };
+        if (!std::is_sorted(ranges.begin(), ranges.end(), rangeLess))
+            std::sort(ranges.begin(), ranges.end(), rangeLess);
+        auto it = objects.begin();
+        for (const Range &range : ranges) {
+            const Interval &interval = rangeOf(range);
+            it = std::lower_bound(it, objects.end(), interval.left,
+                                  [](const Interval *obj, const Point &point) { return obj->left < point; });
+            assert(it == objects.begin() || !interval.intersects(**(it - 1)));
+            for (; it != objects.end() && (*it)->left <= interval.right; ++it) {
+                assert(interval.includes(**it));
+                action(*it, range);
+            }
+        }
+    }
+
 public:
     void add(Interval &node) {
-        objects.push_back(&node);
+        if (pending.empty() && (objects.empty() || leftLess(objects.back(), &node)))
+            objects.push_back(&node);
+        else
+            pending.push_back(&node);
     }
 
     const Interval *find(const Point &p) const {
-        for (const Interval *obj : objects) {
-            if (obj->contains(p))
-                return obj;
-        }
+        merge();
+        auto next = std::upper_bound(objects.begin(), objects.end(), p,
+                                     [](const Point &point, const Interval *obj) { return point < obj->left; });
+        if (next != objects.begin() && (*(next - 1))->contains(p))
+            return *(next - 1);
         FAIL_LOUD("Unbound pointer!");
     }
 
-    void moveAndMark(const Interval &interval, const Shift &shift) {
-        for (Interval *obj : objects) {
-            if (interval.includes(*obj)) {
-                obj->move(shift);
-                obj->mark();
-            } else {
-                assert(!interval.intersects(*obj));
-            }
-        }
+    // NOTE: ranges, moved by the GC, with their shifts; ranges are sorted in place
+    void moveAndMark(std::vector<std::pair<Interval, Shift>> &moved) {
+        forIncluded(moved, [this](Interval *obj, const std::pair<Interval, Shift> &range) {
+            moves.emplace_back(obj, range.second);
+            obj->mark();
+        });
     }
 
-    void mark(const Interval &interval) {
-        for (Interval *obj : objects) {
-            if (interval.includes(*obj))
-                obj->mark();
-            else
-                assert(!interval.intersects(*obj));
-        }
+    // NOTE: ranges, survived the GC without moving; ranges are sorted in place
+    void mark(std::vector<Interval> &survived) {
+        forIncluded(survived, [](Interval *obj, const Interval &) { obj->mark(); });
     }
 
-    // TODO: copy all marked and clear or remove unmarked one by one?
+    // NOTE: moves are applied, unmarked intervals are swept and the index is compacted in place in one pass;
+    //       sliding compaction keeps the order of survived intervals, so they are sorted only if promotion
+    //       into other segments has changed it
     std::vector<Interval *> clearUnmarked() {
-        std::vector<Interval *> marked;
+        merge();
+        for (auto &move : moves)
+            move.first->move(move.second);
+        moves.clear();
         std::vector<Interval *> unmarked;
+        bool sorted = true;
+        auto survived = objects.begin();
         for (Interval *obj : objects)
             if (obj->isMarked()) {
                 obj->unmark();
-                marked.push_back(obj);
+                if (survived != objects.begin() && leftLess(obj, *(survived - 1)))
+                    sorted = false;
+                *survived++ = obj;
             } else {
                 unmarked.push_back(obj);
                 delete obj;
             }
-        objects = marked;
+        objects.erase(survived, objects.end());
+        if (!sorted)
+            std::sort(objects.begin(), objects.end(), leftLess);
         return unmarked;
     }
 
     std::vector<Interval*> flush() {
+        merge();
         std::vector<Interval*> newAddresses;
         for (Interval *obj : objects)
             if (!obj->isFlushed()) {
@@ -67,7 +124,17 @@ public:
         return newAddresses;
     }
 
+    size_t size() const {
+        return objects.size() + pending.size();
+    }
+
+    size_t indexBytes() const {
+        return (objects.capacity() + pending.capacity()) * sizeof(Interval *)
+             + moves.capacity() * sizeof(std::pair<Interval *, Shift>);
+    }
+
     std::string dumpObjects() const {
+        merge();
         std::string dump;
         for (const Interval *obj : objects)
             dump += obj->toString() + "\n";
@@ -1,6 +1,8 @@
 #include "memory.h"
 #include "stack.h"
+#include "../logging.h"
 #include <mutex>
+#include <unordered_map>
 
 using namespace vsharp;
 
@@ -61,6 +63,10 @@ unsigned vsharp::allocateString(const char *s) {
     // Return string's index
     return currentIndex;
 }
+
+unsigned vsharp::nextStringIndex() {
+    return topStringIndex;
+}
 #endif
 
 unsigned entries_count, data_ptr;
@@ -287,6 +293,63 @@ bool vsharp::mainLeft() {
     return _mainEntered && stack().isEmpty();
 }
 
+struct MethodStatistics {
+    unsigned invocations = 0;
+    // NOTE: invocations, which have sent commands to the engine or got symbolic arguments
+    unsigned symbolicInvocations = 0;
+    unsigned concreteInARow = 0;
+    bool demoted = false;
+};
+
+unsigned demotionThreshold = 0;
+// NOTE: keyed by modules and tokens, as tokens alone are not unique across modules
+std::unordered_map<unsigned long long, MethodStatistics> methodStatistics;
+
+void vsharp::configureDemotion(unsigned threshold) {
+    demotionThreshold = threshold;
+}
+
+void vsharp::methodLeft(unsigned long long method, bool observedSymbolic) {
+    if (!demotionThreshold || !method) return;
+    MethodStatistics &statistics = methodStatistics[method];
+    ++statistics.invocations;
+    if (observedSymbolic) {
+        ++statistics.symbolicInvocations;
+        statistics.concreteInARow = 0;
+        return;
+    }
+    ++statistics.concreteInARow;
+    if (!statistics.demoted && statistics.concreteInARow >= demotionThreshold) {
+        LOG(tout << "Demoting method " << HEX(method) << " after " << statistics.invocations << " invocations, "
+                 << statistics.symbolicInvocations << " of them symbolic");
+        statistics.demoted = true;
+    }
+}
+
+bool vsharp::methodIsDemoted(unsigned long long method) {
+    if (!demotionThreshold) return false;
+    const auto found = methodStatistics.find(method);
+    return found != methodStatistics.end() && found->second.demoted;
+}
+
+void vsharp::promoteMethod(unsigned long long method) {
+    const auto found = methodStatistics.find(method);
+    if (found == methodStatistics.end() || !found->second.demoted) return;
+    LOG(tout << "Symbolic value reaches demoted method " << HEX(method) << ", promoting it");
+    found->second.demoted = false;
+    found->second.concreteInARow = 0;
+}
+
+bool _heapIsConcrete = true;
+
+void vsharp::markHeapSymbolic() {
+    _heapIsConcrete = false;
+}
+
+bool vsharp::heapIsConcrete() {
+    return _heapIsConcrete;
+}
+
 VirtualAddress vsharp::resolve(INT_PTR p) {
     // TODO: add stack and statics case #do
     return heap.physToVirtAddress(p);
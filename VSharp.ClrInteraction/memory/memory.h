@@ -24,7 +24,24 @@ StackFrame &topFrame();
 void mainEntered();
 bool mainLeft();
 
+// NOTE: no symbolic value has been stored into the heap, so that concrete calls can not reach symbolic state through it
+void markHeapSymbolic();
+bool heapIsConcrete();
+
+// NOTE: guarded methods, which keep running without meeting symbolic values, are demoted to their lightweight clones
+//       and promoted back, when a symbolic value reaches them; the entry guard selects the tier at every invocation,
+//       so no ReJIT is needed; methods are identified by keys of their modules, computed by the engine, and tokens
+inline unsigned long long methodKey(unsigned moduleKey, mdMethodDef token) {
+    return ((unsigned long long)moduleKey << 32) | token;
+}
+// NOTE: 0 disables demotion
+void configureDemotion(unsigned threshold);
+void methodLeft(unsigned long long method, bool observedSymbolic);
+bool methodIsDemoted(unsigned long long method);
+void promoteMethod(unsigned long long method);
+
 unsigned allocateString(const char *s);
+unsigned nextStringIndex();
 
 INT8 entriesCount();
 void clear_mem();
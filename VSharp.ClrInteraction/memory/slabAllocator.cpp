@@ -0,0 +1,162 @@
+#include "slabAllocator.h"
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <unordered_map>
+
+#ifdef WIN32
+#include <malloc.h>
+#endif
+
+using namespace vsharp;
+
+static char *allocateSlab() {
+    void *slab = nullptr;
+#ifdef WIN32
+    slab = _aligned_malloc(SLAB_SIZE, SLAB_SIZE);
+#else
+    if (posix_memalign(&slab, SLAB_SIZE, SLAB_SIZE) != 0) slab = nullptr;
+#endif
+    if (!slab) throw std::bad_alloc();
+    return (char *)slab;
+}
+
+static void freeSlab(char *slab) {
+#ifdef WIN32
+    _aligned_free(slab);
+#else
+    free(slab);
+#endif
+}
+
+static char *slabOf(const void *slot) {
+    return (char *)((uintptr_t)slot & ~(uintptr_t)(SLAB_SIZE - 1));
+}
+
+// --------------------------- SlabAllocator ---------------------------
+
+SlabAllocator::SlabAllocator(size_t slotSize)
+    : m_free(nullptr)
+    , m_liveSlots(0)
+{
+    // NOTE: slots keep the alignment of pointers and doubles, free slots keep the link to the next one
+    const size_t alignment = sizeof(double) > sizeof(void *) ? sizeof(double) : sizeof(void *);
+    m_slotSize = (slotSize < sizeof(FreeSlot) ? sizeof(FreeSlot) : slotSize);
+    m_slotSize = (m_slotSize + alignment - 1) / alignment * alignment;
+    assert(m_slotSize <= SLAB_SIZE);
+    m_slotsPerSlab = SLAB_SIZE / m_slotSize;
+}
+
+SlabAllocator::~SlabAllocator() {
+    for (char *slab : m_slabs)
+        freeSlab(slab);
+}
+
+void SlabAllocator::grow() {
+    char *slab = allocateSlab();
+    m_slabs.push_back(slab);
+    // NOTE: slots are linked in the order of addresses, so that consecutive allocations are adjacent
+    for (size_t i = m_slotsPerSlab; i > 0; --i) {
+        auto *slot = (FreeSlot *)(slab + (i - 1) * m_slotSize);
+        slot->next = m_free;
+        m_free = slot;
+    }
+}
+
+void *SlabAllocator::allocate() {
+    if (!m_free) grow();
+    FreeSlot *slot = m_free;
+    m_free = slot->next;
+    ++m_liveSlots;
+    return slot;
+}
+
+void SlabAllocator::deallocate(void *slot) {
+    assert(m_liveSlots > 0);
+    auto *freeSlot = (FreeSlot *)slot;
+    freeSlot->next = m_free;
+    m_free = freeSlot;
+    --m_liveSlots;
+}
+
+void SlabAllocator::trim() {
+    if (m_slabs.empty()) return;
+    std::unordered_map<char *, size_t> freeSlots;
+    for (FreeSlot *slot = m_free; slot; slot = slot->next)
+        ++freeSlots[slabOf(slot)];
+    std::vector<char *> released;
+    for (const auto &slab : freeSlots)
+        if (slab.second == m_slotsPerSlab)
+            released.push_back(slab.first);
+    if (released.empty()) return;
+
+    FreeSlot **link = &m_free;
+    while (*link) {
+        if (freeSlots[slabOf(*link)] == m_slotsPerSlab)
+            *link = (*link)->next;
+        else
+            link = &(*link)->next;
+    }
+    std::vector<char *> kept;
+    kept.reserve(m_slabs.size() - released.size());
+    for (char *slab : m_slabs) {
+        if (freeSlots.count(slab) && freeSlots[slab] == m_slotsPerSlab)
+            freeSlab(slab);
+        else
+            kept.push_back(slab);
+    }
+    m_slabs.swap(kept);
+}
+
+// --------------------------- SizeClassedAllocator ---------------------------
+
+SizeClassedAllocator::SizeClassedAllocator(size_t minSize, size_t maxSize)
+    : m_minSize(minSize)
+    , m_maxSize(maxSize)
+    , m_largeBytes(0)
+{
+    for (size_t size = minSize; size <= maxSize; size *= 2)
+        m_classes.push_back(new SlabAllocator(size));
+}
+
+SizeClassedAllocator::~SizeClassedAllocator() {
+    for (SlabAllocator *allocator : m_classes)
+        delete allocator;
+}
+
+size_t SizeClassedAllocator::sizeClass(size_t size) const {
+    size_t index = 0;
+    for (size_t classSize = m_minSize; classSize < size; classSize *= 2)
+        ++index;
+    return index;
+}
+
+void *SizeClassedAllocator::allocate(size_t size) {
+    if (size > m_maxSize) {
+        m_largeBytes += size;
+        return new char[size];
+    }
+    return m_classes[sizeClass(size)]->allocate();
+}
+
+void SizeClassedAllocator::deallocate(void *block, size_t size) {
+    if (size > m_maxSize) {
+        m_largeBytes -= size;
+        delete[] (char *)block;
+        return;
+    }
+    m_classes[sizeClass(size)]->deallocate(block);
+}
+
+void SizeClassedAllocator::trim() {
+    for (SlabAllocator *allocator : m_classes)
+        allocator->trim();
+}
+
+size_t SizeClassedAllocator::reservedBytes() const {
+    size_t result = m_largeBytes;
+    for (const SlabAllocator *allocator : m_classes)
+        result += allocator->reservedBytes();
+    return result;
+}
@@ -0,0 +1,67 @@
+#ifndef SLABALLOCATOR_H_
+#define SLABALLOCATOR_H_
+
+#include <cstddef>
+#include <vector>
+
+namespace vsharp {
+
+// NOTE: slabs are aligned by their size, so the slab of a slot is found by masking its address
+#define SLAB_SIZE 0x10000
+
+// Allocator of fixed-size slots, carved from slabs; freed slots are reused by next allocations, slabs without live slots
+// are released in bulk by 'trim', which is done after each GC. Like the shadow heap, it is not synchronized
+class SlabAllocator {
+private:
+    struct FreeSlot {
+        FreeSlot *next;
+    };
+
+    size_t m_slotSize;
+    size_t m_slotsPerSlab;
+    FreeSlot *m_free;
+    std::vector<char *> m_slabs;
+    size_t m_liveSlots;
+
+    void grow();
+
+public:
+    explicit SlabAllocator(size_t slotSize);
+    ~SlabAllocator();
+    SlabAllocator(const SlabAllocator &) = delete;
+    SlabAllocator &operator=(const SlabAllocator &) = delete;
+
+    void *allocate();
+    void deallocate(void *slot);
+    void trim();
+
+    size_t liveSlots() const { return m_liveSlots; }
+    size_t reservedBytes() const { return m_slabs.size() * SLAB_SIZE; }
+};
+
+// Slab allocators of power-of-two size classes from 'minSize' to 'maxSize'; larger blocks are allocated by new[]
+class SizeClassedAllocator {
+private:
+    size_t m_minSize;
+    size_t m_maxSize;
+    std::vector<SlabAllocator *> m_classes;
+    size_t m_largeBytes;
+
+    size_t sizeClass(size_t size) const;
+
+public:
+    SizeClassedAllocator(size_t minSize, size_t maxSize);
+    ~SizeClassedAllocator();
+    SizeClassedAllocator(const SizeClassedAllocator &) = delete;
+    SizeClassedAllocator &operator=(const SizeClassedAllocator &) = delete;
+
+    void *allocate(size_t size);
+    void deallocate(void *block, size_t size);
+    void trim();
+
+    size_t reservedBytes() const;
+};
+
+}
+
+#endif // SLABALLOCATOR_H_
@@ -13,11 +13,15 @@ StackFrame::StackFrame(unsigned resolvedToken, unsigned unresolvedToken, const b
     , m_concretenessTop(0)
     , m_symbolsCount(0)
     , m_args(new bool[argsCount])
+    , m_argsCount(argsCount)
     , m_locals(nullptr)
     , m_resolvedToken(resolvedToken)
     , m_unresolvedToken(unresolvedToken)
     , m_enteredMarker(false)
     , m_spontaneous(false)
+    , m_method(0)
+    , m_symbolicObserved(false)
+    , m_lightweight(false)
 {
     memcpy(m_args, args, argsCount);
     resetPopsTracking();
@@ -145,6 +149,14 @@ void StackFrame::setArg(unsigned index, bool value)
     m_args[index] = value;
 }
 
+bool StackFrame::argsAreConcrete() const
+{
+    for (unsigned i = 0; i < m_argsCount; ++i) {
+        if (!m_args[i]) return false;
+    }
+    return true;
+}
+
 bool StackFrame::loc(unsigned index) const
 {
     return m_locals[index];
@@ -200,6 +212,36 @@ void StackFrame::setSpontaneous(bool isUnmanaged)
     this->m_spontaneous = isUnmanaged;
 }
 
+unsigned long long StackFrame::method() const
+{
+    return m_method;
+}
+
+void StackFrame::setMethod(unsigned long long method)
+{
+    this->m_method = method;
+}
+
+bool StackFrame::isLightweight() const
+{
+    return m_lightweight;
+}
+
+void StackFrame::setLightweight()
+{
+    this->m_lightweight = true;
+}
+
+bool StackFrame::hasObservedSymbolic() const
+{
+    return m_symbolicObserved;
+}
+
+void StackFrame::observeSymbolic()
+{
+    this->m_symbolicObserved = true;
+}
+
 unsigned StackFrame::evaluationStackPops() const
 {
     assert(m_minSymbsCountSinceLastSent <= m_lastSentSymbolsCount);
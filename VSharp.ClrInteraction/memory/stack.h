@@ -17,12 +17,18 @@ private:
     unsigned m_minSymbsCountSinceLastSent;
 
     bool *m_args;
+    unsigned m_argsCount;
     bool *m_locals;
 
     unsigned m_resolvedToken;
     unsigned m_unresolvedToken;
     bool m_enteredMarker;
     bool m_spontaneous;
+    // NOTE: key of the guarded method, which has entered the frame, and whether it has met symbolic values
+    unsigned long long m_method;
+    bool m_symbolicObserved;
+    // NOTE: the frame runs the lightweight clone, which does not track its evaluation stack
+    bool m_lightweight;
 
     std::vector<std::pair<unsigned, unsigned>> m_lastPoppedSymbolics;
 
@@ -50,6 +56,7 @@ public:
 
     bool arg(unsigned index) const;
     void setArg(unsigned index, bool value);
+    bool argsAreConcrete() const;
     bool loc(unsigned index) const;
     void setLoc(unsigned index, bool value);
 
@@ -63,6 +70,12 @@ public:
     void setEnteredMarker(bool entered);
     bool isSpontaneous() const;
     void setSpontaneous(bool isUnmanaged);
+    unsigned long long method() const;
+    void setMethod(unsigned long long method);
+    bool isLightweight() const;
+    void setLightweight();
+    bool hasObservedSymbolic() const;
+    void observeSymbolic();
 
     const std::vector<std::pair<unsigned, unsigned>> &poppedSymbolics() const;
     unsigned evaluationStackPops() const;
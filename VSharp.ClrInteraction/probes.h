@@ -4,6 +4,9 @@
 #include "cor.h"
 #include "memory/memory.h"
 #include "communication/protocol.h"
+#include "communication/compactEncoding.h"
+#include <algorithm>
+#include <type_traits>
 #include <vector>
 
 #define COND INT_PTR
@@ -54,6 +57,29 @@ struct EvalStackOperand {
         }
     }
 
+    size_t maxCompactSize() const {
+        return 1 + 2 * MAX_VARINT_SIZE;
+    }
+
+    void serializeCompact(char *&buffer) const {
+        *buffer++ = (char)typ;
+        switch (typ) {
+            case OpRef:
+                writeVarUInt(buffer, content.address.obj);
+                writeVarUInt(buffer, content.address.offset);
+                break;
+            case OpR4:
+            case OpR8:
+                // NOTE: bits of floating point numbers are rarely small, so they are sent as is
+                *(long long *)buffer = content.number;
+                buffer += sizeof(long long);
+                break;
+            default:
+                writeVarInt(buffer, content.number);
+                break;
+        }
+    }
+
     void deserialize(char *&buffer) {
         typ = *(EvalStackArgType *)buffer;
         buffer += sizeof(EvalStackArgType);
@@ -75,49 +101,83 @@ struct ExecCommand {
     unsigned evaluationStackPushesCount;
     unsigned evaluationStackPops;
     unsigned newAddressesCount;
+    unsigned deletedAddressesCount;
     unsigned *newCallStackFrames;
     EvalStackOperand *evaluationStackPushes;
-    // TODO: add deleted addresses
     OBJID *newAddresses;
+    OBJID *deletedAddresses;
     unsigned long *newAddressesTypeLengths;
     char *newAddressesTypes;
 
-    void serialize(char *&bytes, unsigned &count) const {
-        count = 7 * sizeof(unsigned) + sizeof(unsigned) * newCallStackFramesCount;
+    void serialize(std::vector<IOChunk> &chunks, std::vector<char> &scratch, WireEncoding encoding) const {
+        if (encoding == CompactEncodingV1)
+            serializeCompact(chunks, scratch);
+        else
+            serializeFixed(chunks, scratch);
+    }
+
+    void serializeFixed(std::vector<IOChunk> &chunks, std::vector<char> &scratch) const {
+        // NOTE: operands have different layout on the wire, so only they are copied
+        size_t operandsSize = 0;
+        for (unsigned i = 0; i < evaluationStackPushesCount; ++i)
+            operandsSize += evaluationStackPushes[i].size();
+        scratch.resize(operandsSize);
+        char *buffer = scratch.data();
         for (unsigned i = 0; i < evaluationStackPushesCount; ++i)
-            count += evaluationStackPushes[i].size();
-        count += sizeof(UINT_PTR) * newAddressesCount;
-        count += newAddressesCount * sizeof(unsigned long);
+            evaluationStackPushes[i].serialize(buffer);
         unsigned long fullTypesSize = 0;
-        for (int i = 0; i < newAddressesCount; ++i)
+        for (unsigned i = 0; i < newAddressesCount; ++i)
+            fullTypesSize += newAddressesTypeLengths[i];
+        chunks.push_back(IOChunk{(char*)&offset, 8 * sizeof(unsigned)});
+        chunks.push_back(IOChunk{(char*)newCallStackFrames, newCallStackFramesCount * sizeof(unsigned)});
+        chunks.push_back(IOChunk{scratch.data(), operandsSize});
+        chunks.push_back(IOChunk{(char*)newAddresses, newAddressesCount * sizeof(UINT_PTR)});
+        chunks.push_back(IOChunk{(char*)deletedAddresses, deletedAddressesCount * sizeof(UINT_PTR)});
+        chunks.push_back(IOChunk{(char*)newAddressesTypeLengths, newAddressesCount * sizeof(unsigned long)});
+        chunks.push_back(IOChunk{newAddressesTypes, fullTypesSize});
+    }
+
+    void serializeCompact(std::vector<IOChunk> &chunks, std::vector<char> &scratch) const {
+        const unsigned *header = &offset;
+        size_t maxSize = 1 + 8 * MAX_VARINT_SIZE + newCallStackFramesCount * MAX_VARINT_SIZE + newAddressesCount * 2 * MAX_VARINT_SIZE
+            + deletedAddressesCount * MAX_VARINT_SIZE;
+        for (unsigned i = 0; i < evaluationStackPushesCount; ++i)
+            maxSize += evaluationStackPushes[i].maxCompactSize();
+        scratch.resize(maxSize);
+        char *buffer = scratch.data();
+        // NOTE: i-th bit of the mask is set iff i-th header field is non-zero, only such fields are sent
+        char *mask = buffer++;
+        *mask = 0;
+        for (unsigned i = 0; i < 8; ++i) {
+            if (header[i] == 0) continue;
+            *mask |= (char)(1 << i);
+            writeVarUInt(buffer, header[i]);
+        }
+        for (unsigned i = 0; i < newCallStackFramesCount; ++i)
+            writeVarUInt(buffer, newCallStackFrames[i]);
+        for (unsigned i = 0; i < evaluationStackPushesCount; ++i)
+            evaluationStackPushes[i].serializeCompact(buffer);
+        unsigned long fullTypesSize = 0;
+        for (unsigned i = 0; i < newAddressesCount; ++i)
+            writeVarUInt(buffer, newAddresses[i]);
+        for (unsigned i = 0; i < newAddressesCount; ++i) {
+            writeVarUInt(buffer, newAddressesTypeLengths[i]);
             fullTypesSize += newAddressesTypeLengths[i];
-        count += fullTypesSize;
-        bytes = new char[count];
-        char *buffer = bytes;
-        unsigned size = sizeof(unsigned);
-        *(unsigned *)buffer = offset; buffer += size;
-        *(unsigned *)buffer = isBranch; buffer += size;
-        *(unsigned *)buffer = newCallStackFramesCount; buffer += size;
-        *(unsigned *)buffer = callStackFramesPops; buffer += size;
-        *(unsigned *)buffer = evaluationStackPushesCount; buffer += size;
-        *(unsigned *)buffer = evaluationStackPops; buffer += size;
-        *(unsigned *)buffer = newAddressesCount; buffer += size;
-        size = newCallStackFramesCount * sizeof(unsigned);
-        memcpy(buffer, (char*)newCallStackFrames, size); buffer += size;
-        for (unsigned i = 0; i < evaluationStackPushesCount; ++i) {
-            evaluationStackPushes[i].serialize(buffer);
         }
-        size = newAddressesCount * sizeof(UINT_PTR);
-        memcpy(buffer, (char*)newAddresses, size); buffer += size;
-        size = newAddressesCount * sizeof(unsigned long);
-        memcpy(buffer, (char*)newAddressesTypeLengths, size); buffer += size;
-        memcpy(buffer, newAddressesTypes, fullTypesSize); buffer += fullTypesSize;
+        for (unsigned i = 0; i < deletedAddressesCount; ++i)
+            writeVarUInt(buffer, deletedAddresses[i]);
+        chunks.push_back(IOChunk{scratch.data(), (size_t)(buffer - scratch.data())});
+        chunks.push_back(IOChunk{newAddressesTypes, fullTypesSize});
     }
 };
 
+static_assert(offsetof(ExecCommand, deletedAddressesCount) == 7 * sizeof(unsigned), "Static part of ExecCommand is sent directly, so it must be packed");
+
 void initCommand(OFFSET offset, bool isBranch, unsigned opsCount, EvalStackOperand *ops, ExecCommand &command) {
     Stack &stack = vsharp::stack();
     StackFrame &top = stack.topFrame();
+    // NOTE: the method has needed the engine, so it is not demoted
+    top.observeSymbolic();
     command.offset = offset;
     command.isBranch = isBranch ? 1 : 0;
 
@@ -166,6 +226,10 @@ void initCommand(OFFSET offset, bool isBranch, unsigned opsCount, EvalStackOpera
         i++;
     }
     command.newAddressesTypes = begin;
+    auto deletedAddresses = heap.flushDeletedObjects();
+    command.deletedAddressesCount = (unsigned)deletedAddresses.size();
+    command.deletedAddresses = new OBJID[command.deletedAddressesCount];
+    std::copy(deletedAddresses.begin(), deletedAddresses.end(), command.deletedAddresses);
 }
 
 bool readExecResponse(StackFrame &top, EvalStackOperand *ops, unsigned &count, int &framesCount, EvalStackOperand &result) {
@@ -195,8 +259,6 @@ bool readExecResponse(StackFrame &top, EvalStackOperand *ops, unsigned &count, i
         result.deserialize(bytes);
     }
     assert(bytes - start == messageLength);
-
-    delete start;
     return opsConcretized;
 }
 
@@ -204,6 +266,7 @@ void freeCommand(ExecCommand &command) {
     delete[] command.newCallStackFrames;
     delete[] command.evaluationStackPushes;
     delete[] command.newAddresses;
+    delete[] command.deletedAddresses;
     delete[] command.newAddressesTypeLengths;
     delete[] command.newAddressesTypes;
 }
@@ -229,10 +292,72 @@ void updateMemory(EvalStackOperand &op, unsigned int idx) {
             FAIL_LOUD("updateMemory: unexpected symbolic value after concretization!");
     }
 }
+/// ------------------------------ Deferred commands ---------------------------
+
+// NOTE: straight-line symbolic operations can not fork and their results are symbolic, so the engine's replies to them
+//       are known in advance; such commands are logged per thread and sent in one batch before the thread blocks
+//       on the engine (next exec command, instrumentation request, shutdown) or leaves its outermost frame
+struct DeferredCommands {
+    unsigned count = 0;
+    std::vector<char> bytes;
+    std::vector<IOChunk> chunks;
+    std::vector<char> scratch;
+
+    ~DeferredCommands() {
+        // NOTE: outgoing buffers of the thread may be destroyed already, so commands can not be sent from here;
+        //       the outermost leave flushes the log, only a thread, which is unwound by an exception, gets here
+        if (count > 0)
+            LOG_ERROR(tout << "Thread exits with " << count << " deferred commands, which were not sent to the engine");
+    }
+
+    void serialize(std::vector<IOChunk> &out, std::vector<char> &/*scratch*/, WireEncoding /*encoding*/) const {
+        out.push_back(IOChunk{(char*)&count, sizeof(unsigned)});
+        out.push_back(IOChunk{bytes.data(), bytes.size()});
+    }
+};
+
+// NOTE: each thread logs and sends only its own commands, so the log needs no synchronization
+thread_local DeferredCommands deferredCommands;
+
+bool flushDeferredCommands() {
+    DeferredCommands &log = deferredCommands;
+    if (log.count == 0) return true;
+    bool result = protocol->sendSerializable(ExecuteDeferredCommand, log);
+    log.count = 0;
+    log.bytes.clear();
+    return result;
+}
+
+void deferCommand(OFFSET offset, unsigned opsCount, EvalStackOperand *ops, bool pushesResult) {
+    ExecCommand command;
+    initCommand(offset, false, opsCount, ops, command);
+    DeferredCommands &log = deferredCommands;
+    log.chunks.clear();
+    command.serialize(log.chunks, log.scratch, protocol->encoding());
+    // NOTE: each command is prefixed with its length, engine parses it as a standalone exec command
+    size_t size = 0;
+    for (const IOChunk &chunk : log.chunks)
+        size += chunk.size;
+    unsigned length = (unsigned)size;
+    log.bytes.insert(log.bytes.end(), (char*)&length, (char*)&length + sizeof(unsigned));
+    for (const IOChunk &chunk : log.chunks)
+        log.bytes.insert(log.bytes.end(), chunk.data, chunk.data + chunk.size);
+    ++log.count;
+    // NOTE: applying the reply, which engine would send: symbolic result and no concretization
+    Stack &stack = vsharp::stack();
+    if (pushesResult)
+        stack.topFrame().push1(false);
+    stack.resetPopsTracking((int)stack.framesCount());
+    freeCommand(command);
+}
+
 bool sendCommand(OFFSET offset, unsigned opsCount, EvalStackOperand *ops) {
     ExecCommand command;
     initCommand(offset, false, opsCount, ops, command);
-    protocol->sendSerializable(ExecuteCommand, command);
+    // NOTE: deferred commands of the thread are flushed by the protocol before the request
+    if (!protocol->sendSerializable(ExecuteCommand, command)) {
+        FAIL_LOUD("Sending exec command failed!");
+    }
     StackFrame &top = vsharp::topFrame();
     int framesCount;
     EvalStackOperand internalCallResult = EvalStackOperand {OpSymbolic, 0};
@@ -259,6 +384,16 @@ bool sendCommand(OFFSET offset, unsigned opsCount, EvalStackOperand *ops) {
 bool sendCommand0(OFFSET offset) { return sendCommand(offset, 0, nullptr); }
 bool sendCommand1(OFFSET offset) { return sendCommand(offset, 1, new EvalStackOperand[1]); }
 
+// NOTE: for commands of operations, which can not fork, throw or need concretization
+void sendDeferrableCommand(OFFSET offset, unsigned opsCount, EvalStackOperand *ops, bool pushesResult) {
+    if (protocol->supports(DeferredExecutionFeature))
+        deferCommand(offset, opsCount, ops, pushesResult);
+    else
+        sendCommand(offset, opsCount, ops);
+}
+void sendDeferrableCommand0(OFFSET offset) { sendDeferrableCommand(offset, 0, nullptr, true); }
+void sendDeferrableCommand1(OFFSET offset, bool pushesResult) { sendDeferrableCommand(offset, 1, new EvalStackOperand[1], pushesResult); }
+
 // TODO:
 EvalStackOperand mkop_4(INT32 op) { return {OpI4, (long long)op}; }
 EvalStackOperand mkop_8(INT64 op) { return {OpI8, (long long)op}; }
@@ -320,16 +455,55 @@ EvalStackOperand* createOps(int opsCount) {
 /// ------------------------------ Probes declarations ---------------------------
 
 std::vector<unsigned long long> ProbesAddresses;
+std::vector<ProbeImport> ProbesImports;
+
+// NOTE: element types of managed signatures of probes, by which P/Invoke methods of probes are defined
+template<typename T>
+struct ProbeElementType {
+    static const CorElementType value =
+        std::is_same<T, INT_PTR>::value ? ELEMENT_TYPE_I :
+        std::is_same<T, UINT_PTR>::value ? ELEMENT_TYPE_U :
+        std::is_floating_point<T>::value ? (sizeof(T) == 4 ? ELEMENT_TYPE_R4 : ELEMENT_TYPE_R8) :
+        std::is_signed<T>::value
+            ? (sizeof(T) == 1 ? ELEMENT_TYPE_I1 : sizeof(T) == 2 ? ELEMENT_TYPE_I2 : sizeof(T) == 4 ? ELEMENT_TYPE_I4 : ELEMENT_TYPE_I8)
+            : (sizeof(T) == 1 ? ELEMENT_TYPE_U1 : sizeof(T) == 2 ? ELEMENT_TYPE_U2 : sizeof(T) == 4 ? ELEMENT_TYPE_U4 : ELEMENT_TYPE_U8);
+};
+template<>
+struct ProbeElementType<void> { static const CorElementType value = ELEMENT_TYPE_VOID; };
+// NOTE: bool is not blittable, P/Invoke would marshal it as a 4-byte BOOL
+template<>
+struct ProbeElementType<bool> { static const CorElementType value = ELEMENT_TYPE_U1; };
+
+template<typename Ret, typename... Args>
+std::vector<unsigned char> probeSignature(Ret (STDMETHODCALLTYPE *)(Args...)) {
+    return {IMAGE_CEE_CS_CALLCONV_DEFAULT, (unsigned char)sizeof...(Args),
+            (unsigned char)ProbeElementType<Ret>::value, (unsigned char)ProbeElementType<Args>::value...};
+}
 
-int registerProbe(unsigned long long probe) {
+int registerProbe(unsigned long long probe, const char *name, std::vector<unsigned char> &&signature, bool leaf) {
     ProbesAddresses.push_back(probe);
+    ProbesImports.push_back(ProbeImport{name, std::move(signature), leaf});
     return 0;
 }
 
-#define PROBE(RETTYPE, NAME, ARGS) \
-    RETTYPE STDMETHODCALLTYPE NAME ARGS;\
-    int NAME##_tmp = registerProbe((unsigned long long)&NAME);\
-    RETTYPE STDMETHODCALLTYPE NAME ARGS
+#ifdef WIN32
+#define PROBE_EXPORT __declspec(dllexport)
+#else
+#define PROBE_EXPORT __attribute__((visibility("default")))
+#endif
+
+// NOTE: probes are exported with C linkage under prefixed names, so that instrumented modules may import them by P/Invoke;
+//       the unprefixed name is a constant pointer to the probe, which is used by other probes
+#define DEFINE_PROBE(RETTYPE, NAME, ARGS, LEAF) \
+    extern "C" PROBE_EXPORT RETTYPE STDMETHODCALLTYPE vsharp_##NAME ARGS;\
+    RETTYPE (STDMETHODCALLTYPE *const NAME) ARGS = &vsharp_##NAME;\
+    int NAME##_tmp = registerProbe((unsigned long long)&vsharp_##NAME, "vsharp_" #NAME, probeSignature(&vsharp_##NAME), LEAF);\
+    RETTYPE STDMETHODCALLTYPE vsharp_##NAME ARGS
+
+#define PROBE(RETTYPE, NAME, ARGS) DEFINE_PROBE(RETTYPE, NAME, ARGS, false)
+// NOTE: leaf probes only update the shadow stack: they never block, send commands, touch the shadow heap or call back
+//       into the runtime, so they are called without the transition of the thread into the preemptive GC mode
+#define LEAF_PROBE(RETTYPE, NAME, ARGS) DEFINE_PROBE(RETTYPE, NAME, ARGS, true)
 
 inline bool ldarg(INT16 idx) {
     StackFrame &top = vsharp::topFrame();
@@ -340,13 +514,13 @@ inline bool ldarg(INT16 idx) {
     }
     return concreteness;
 }
-PROBE(void, Track_Ldarg_0, (OFFSET offset)) { if (!ldarg(0)) sendCommand0(offset); }
-PROBE(void, Track_Ldarg_1, (OFFSET offset)) { if (!ldarg(1)) sendCommand0(offset); }
-PROBE(void, Track_Ldarg_2, (OFFSET offset)) { if (!ldarg(2)) sendCommand0(offset); }
-PROBE(void, Track_Ldarg_3, (OFFSET offset)) { if (!ldarg(3)) sendCommand0(offset); }
-PROBE(void, Track_Ldarg_S, (UINT8 idx, OFFSET offset)) { if (!ldarg(idx)) sendCommand0(offset); }
-PROBE(void, Track_Ldarg, (UINT16 idx, OFFSET offset)) { if (!ldarg(idx)) sendCommand0(offset); }
-PROBE(void, Track_Ldarga, (INT_PTR ptr, UINT16 idx)) { topFrame().push1Concrete(); }
+PROBE(void, Track_Ldarg_0, (OFFSET offset)) { if (!ldarg(0)) sendDeferrableCommand0(offset); }
+PROBE(void, Track_Ldarg_1, (OFFSET offset)) { if (!ldarg(1)) sendDeferrableCommand0(offset); }
+PROBE(void, Track_Ldarg_2, (OFFSET offset)) { if (!ldarg(2)) sendDeferrableCommand0(offset); }
+PROBE(void, Track_Ldarg_3, (OFFSET offset)) { if (!ldarg(3)) sendDeferrableCommand0(offset); }
+PROBE(void, Track_Ldarg_S, (UINT8 idx, OFFSET offset)) { if (!ldarg(idx)) sendDeferrableCommand0(offset); }
+PROBE(void, Track_Ldarg, (UINT16 idx, OFFSET offset)) { if (!ldarg(idx)) sendDeferrableCommand0(offset); }
+LEAF_PROBE(void, Track_Ldarga, (INT_PTR ptr, UINT16 idx)) { topFrame().push1Concrete(); }
 
 inline bool ldloc(INT16 idx) {
     StackFrame &top = vsharp::topFrame();
@@ -357,13 +531,13 @@ inline bool ldloc(INT16 idx) {
     }
     return concreteness;
 }
-PROBE(void, Track_Ldloc_0, (OFFSET offset)) { if (!ldloc(0)) sendCommand0(offset); }
-PROBE(void, Track_Ldloc_1, (OFFSET offset)) { if (!ldloc(1)) sendCommand0(offset); }
-PROBE(void, Track_Ldloc_2, (OFFSET offset)) { if (!ldloc(2)) sendCommand0(offset); }
-PROBE(void, Track_Ldloc_3, (OFFSET offset)) { if (!ldloc(3)) sendCommand0(offset); }
-PROBE(void, Track_Ldloc_S, (UINT8 idx, OFFSET offset)) { if (!ldloc(idx)) sendCommand0(offset); }
-PROBE(void, Track_Ldloc, (UINT16 idx, OFFSET offset)) { if (!ldloc(idx)) sendCommand0(offset); }
-PROBE(void, Track_Ldloca, (INT_PTR ptr, UINT16 idx)) { topFrame().push1Concrete(); }
+PROBE(void, Track_Ldloc_0, (OFFSET offset)) { if (!ldloc(0)) sendDeferrableCommand0(offset); }
+PROBE(void, Track_Ldloc_1, (OFFSET offset)) { if (!ldloc(1)) sendDeferrableCommand0(offset); }
+PROBE(void, Track_Ldloc_2, (OFFSET offset)) { if (!ldloc(2)) sendDeferrableCommand0(offset); }
+PROBE(void, Track_Ldloc_3, (OFFSET offset)) { if (!ldloc(3)) sendDeferrableCommand0(offset); }
+PROBE(void, Track_Ldloc_S, (UINT8 idx, OFFSET offset)) { if (!ldloc(idx)) sendDeferrableCommand0(offset); }
+PROBE(void, Track_Ldloc, (UINT16 idx, OFFSET offset)) { if (!ldloc(idx)) sendDeferrableCommand0(offset); }
+LEAF_PROBE(void, Track_Ldloca, (INT_PTR ptr, UINT16 idx)) { topFrame().push1Concrete(); }
 
 inline bool starg(INT16 idx) {
     StackFrame &top = vsharp::topFrame();
@@ -371,8 +545,8 @@ inline bool starg(INT16 idx) {
     top.setArg(idx, concreteness);
     return concreteness;
 }
-PROBE(void, Track_Starg_S, (UINT8 idx, OFFSET offset)) { if (!starg(idx)) sendCommand1(offset); }
-PROBE(void, Track_Starg, (UINT16 idx, OFFSET offset)) { if (!starg(idx)) sendCommand1(offset); }
+PROBE(void, Track_Starg_S, (UINT8 idx, OFFSET offset)) { if (!starg(idx)) sendDeferrableCommand1(offset, false); }
+PROBE(void, Track_Starg, (UINT16 idx, OFFSET offset)) { if (!starg(idx)) sendDeferrableCommand1(offset, false); }
 
 inline bool stloc(INT16 idx) {
     // TODO
@@ -381,21 +555,21 @@ inline bool stloc(INT16 idx) {
     top.setLoc(idx, concreteness);
     return concreteness;
 }
-PROBE(void, Track_Stloc_0, (OFFSET offset)) { if (!stloc(0)) sendCommand1(offset); }
-PROBE(void, Track_Stloc_1, (OFFSET offset)) { if (!stloc(1)) sendCommand1(offset); }
-PROBE(void, Track_Stloc_2, (OFFSET offset)) { if (!stloc(2)) sendCommand1(offset); }
-PROBE(void, Track_Stloc_3, (OFFSET offset)) { if (!stloc(3)) sendCommand1(offset); }
-PROBE(void, Track_Stloc_S, (UINT8 idx, OFFSET offset)) { if (!stloc(idx)) sendCommand1(offset); }
-PROBE(void, Track_Stloc, (UINT16 idx, OFFSET offset)) { if (!stloc(idx)) sendCommand1(offset); }
-
-PROBE(void, Track_Ldc, ()) { topFrame().push1Concrete(); }
+PROBE(void, Track_Stloc_0, (OFFSET offset)) { if (!stloc(0)) sendDeferrableCommand1(offset, false); }
+PROBE(void, Track_Stloc_1, (OFFSET offset)) { if (!stloc(1)) sendDeferrableCommand1(offset, false); }
+PROBE(void, Track_Stloc_2, (OFFSET offset)) { if (!stloc(2)) sendDeferrableCommand1(offset, false); }
+PROBE(void, Track_Stloc_3, (OFFSET offset)) { if (!stloc(3)) sendDeferrableCommand1(offset, false); }
+PROBE(void, Track_Stloc_S, (UINT8 idx, OFFSET offset)) { if (!stloc(idx)) sendDeferrableCommand1(offset, false); }
+PROBE(void, Track_Stloc, (UINT16 idx, OFFSET offset)) { if (!stloc(idx)) sendDeferrableCommand1(offset, false); }
+
+LEAF_PROBE(void, Track_Ldc, ()) { topFrame().push1Concrete(); }
 PROBE(void, Track_Dup, (OFFSET offset)) {
     if (!topFrame().dup()) {
         sendCommand1(offset);
         topFrame().push1(false);
     }
 }
-PROBE(void, Track_Pop, ()) { topFrame().pop1Async(); }
+LEAF_PROBE(void, Track_Pop, ()) { topFrame().pop1Async(); }
 
 inline bool branch(OFFSET offset) {
     if (!topFrame().pop1())
@@ -406,7 +580,7 @@ inline bool branch(OFFSET offset) {
 // TODO: make it bool, change instrumentation
 PROBE(void, BrTrue, (OFFSET offset)) { branch(offset); }
 PROBE(void, BrFalse, (OFFSET offset)) { branch(offset); }
-PROBE(void, Switch, (OFFSET offset)) {
+LEAF_PROBE(void, Switch, (OFFSET offset)) {
     // TODO:
     topFrame().pop1();
 }
@@ -417,23 +591,32 @@ PROBE(void, Track_UnOp, (UINT16 op, OFFSET offset)) {
     if (concreteness)
         top.push1Concrete();
     else
-        sendCommand1(offset);
+        sendDeferrableCommand1(offset, true);
 }
-PROBE(COND, Track_BinOp, ()) {
+LEAF_PROBE(COND, Track_BinOp, ()) {
     StackFrame &top = vsharp::topFrame();
     bool concreteness = top.pop(2);
     if (concreteness)
         top.push1Concrete();
     return concreteness; }
-// TODO: do we need op?
-PROBE(void, Exec_BinOp_4, (UINT16 op, INT32 arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_4(arg1), mkop_4(arg2) }); }
-PROBE(void, Exec_BinOp_8, (UINT16 op, INT64 arg1, INT64 arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_8(arg1), mkop_8(arg2) }); }
-PROBE(void, Exec_BinOp_f4, (UINT16 op, FLOAT arg1, FLOAT arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_f4(arg1), mkop_f4(arg2) }); }
-PROBE(void, Exec_BinOp_f8, (UINT16 op, DOUBLE arg1, DOUBLE arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_f8(arg1), mkop_f8(arg2) }); }
-PROBE(void, Exec_BinOp_p, (UINT16 op, INT_PTR arg1, INT_PTR arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(arg1), mkop_p(arg2) }); }
-PROBE(void, Exec_BinOp_8_4, (UINT16 op, INT64 arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_8(arg1), mkop_4(arg2) }); }
-PROBE(void, Exec_BinOp_4_p, (UINT16 op, INT32 arg1, INT_PTR arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_4(arg1), mkop_p(arg2) }); }
-PROBE(void, Exec_BinOp_p_4, (UINT16 op, INT_PTR arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(arg1), mkop_4(arg2) }); }
+// NOTE: 'op' is the value of IL opcode; division and remainder (0x5B..0x5E) may throw, so the engine may fork on them
+inline bool binOpMayThrow(UINT16 op) {
+    return op >= 0x5B && op <= 0x5E;
+}
+inline void execBinOp(UINT16 op, OFFSET offset, EvalStackOperand *ops) {
+    if (binOpMayThrow(op))
+        sendCommand(offset, 2, ops);
+    else
+        sendDeferrableCommand(offset, 2, ops, true);
+}
+PROBE(void, Exec_BinOp_4, (UINT16 op, INT32 arg1, INT32 arg2, OFFSET offset)) { execBinOp(op, offset, new EvalStackOperand[2] { mkop_4(arg1), mkop_4(arg2) }); }
+PROBE(void, Exec_BinOp_8, (UINT16 op, INT64 arg1, INT64 arg2, OFFSET offset)) { execBinOp(op, offset, new EvalStackOperand[2] { mkop_8(arg1), mkop_8(arg2) }); }
+PROBE(void, Exec_BinOp_f4, (UINT16 op, FLOAT arg1, FLOAT arg2, OFFSET offset)) { execBinOp(op, offset, new EvalStackOperand[2] { mkop_f4(arg1), mkop_f4(arg2) }); }
+PROBE(void, Exec_BinOp_f8, (UINT16 op, DOUBLE arg1, DOUBLE arg2, OFFSET offset)) { execBinOp(op, offset, new EvalStackOperand[2] { mkop_f8(arg1), mkop_f8(arg2) }); }
+PROBE(void, Exec_BinOp_p, (UINT16 op, INT_PTR arg1, INT_PTR arg2, OFFSET offset)) { execBinOp(op, offset, new EvalStackOperand[2] { mkop_p(arg1), mkop_p(arg2) }); }
+PROBE(void, Exec_BinOp_8_4, (UINT16 op, INT64 arg1, INT32 arg2, OFFSET offset)) { execBinOp(op, offset, new EvalStackOperand[2] { mkop_8(arg1), mkop_4(arg2) }); }
+PROBE(void, Exec_BinOp_4_p, (UINT16 op, INT32 arg1, INT_PTR arg2, OFFSET offset)) { execBinOp(op, offset, new EvalStackOperand[2] { mkop_4(arg1), mkop_p(arg2) }); }
+PROBE(void, Exec_BinOp_p_4, (UINT16 op, INT_PTR arg1, INT32 arg2, OFFSET offset)) { execBinOp(op, offset, new EvalStackOperand[2] { mkop_p(arg1), mkop_4(arg2) }); }
 PROBE(void, Exec_BinOp_4_ovf, (UINT16 op, INT32 arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_4(arg1), mkop_4(arg2) }); }
 PROBE(void, Exec_BinOp_8_ovf, (UINT16 op, INT64 arg1, INT64 arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_8(arg1), mkop_8(arg2) }); }
 PROBE(void, Exec_BinOp_f4_ovf, (UINT16 op, FLOAT arg1, FLOAT arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_f4(arg1), mkop_f4(arg2) }); }
@@ -447,12 +630,19 @@ PROBE(void, Track_Ldind, (INT_PTR ptr, OFFSET offset)) {
     // TODO
 }
 
+// NOTE: stores of symbolic values or through symbolic addresses are executed by the engine, so the heap is not concrete after them
+inline bool popStored(unsigned count) {
+    bool concreteness = topFrame().pop(count);
+    if (!concreteness) markHeapSymbolic();
+    return concreteness;
+}
+
 PROBE(COND, Track_Stind, (INT_PTR ptr, INT32 sizeOfPtr)) {
     StackFrame &top = topFrame();
     auto valueIsConcrete = top.peek0();
     auto addressIsConcrete = top.peek1();
     if (addressIsConcrete) heap.write(ptr, sizeOfPtr, valueIsConcrete);
-    return topFrame().pop(2);
+    return popStored(2);
 }
 
 PROBE(void, Exec_Stind_I1, (INT_PTR ptr, INT8 value, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_4(value) }); }
@@ -463,30 +653,32 @@ PROBE(void, Exec_Stind_R4, (INT_PTR ptr, FLOAT value, OFFSET offset)) { sendComm
 PROBE(void, Exec_Stind_R8, (INT_PTR ptr, DOUBLE value, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_f8(value) }); }
 PROBE(void, Exec_Stind_ref, (INT_PTR ptr, INT_PTR value, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_p(value) }); }
 
-inline void conv(OFFSET offset) {
+inline void conv(OFFSET offset, bool mayThrow) {
     StackFrame &top = vsharp::topFrame();
     bool concreteness = top.pop1();
     if (concreteness)
         top.push1Concrete();
-    else
+    else if (mayThrow)
         sendCommand1(offset);
+    else
+        sendDeferrableCommand1(offset, true);
 }
-PROBE(void, Track_Conv, (OFFSET offset)) { conv(offset); }
-PROBE(void, Track_Conv_Ovf, (OFFSET offset)) { conv(offset); }
+PROBE(void, Track_Conv, (OFFSET offset)) { conv(offset, false); }
+PROBE(void, Track_Conv_Ovf, (OFFSET offset)) { conv(offset, true); }
 
 PROBE(void, Track_Newarr, (INT_PTR ptr, mdToken typeToken, OFFSET offset)) { /*TODO! Do we need allocated address?*/ }
 PROBE(void, Track_Localloc, (INT_PTR len, OFFSET offset)) { /*TODO*/ }
 PROBE(void, Track_Ldobj, (INT_PTR ptr, OFFSET offset)) { /* TODO! will ptr be always concrete? */ }
-PROBE(void, Track_Ldstr, (INT_PTR ptr)) { topFrame().push1Concrete(); } // TODO: do we need allocated address?
-PROBE(void, Track_Ldtoken, ()) { topFrame().push1Concrete(); }
+LEAF_PROBE(void, Track_Ldstr, (INT_PTR ptr)) { topFrame().push1Concrete(); } // TODO: do we need allocated address?
+LEAF_PROBE(void, Track_Ldtoken, ()) { topFrame().push1Concrete(); }
 
 PROBE(void, Track_Stobj, (INT_PTR ptr)) {
     // TODO!
     // Will ptr be always concrete?
-    topFrame().pop(2);
+    popStored(2);
 }
 
-PROBE(void, Track_Initobj, (INT_PTR ptr)) {
+LEAF_PROBE(void, Track_Initobj, (INT_PTR ptr)) {
     // TODO!
     // Will ptr be always concrete?
     topFrame().pop1();
@@ -504,7 +696,7 @@ PROBE(void, Track_Ldlen, (INT_PTR ptr, OFFSET offset)) {
 
 PROBE(COND, Track_Cpobj, (INT_PTR dest, INT_PTR src)) {
     // TODO: check concreteness of referenced memory!
-    return topFrame().pop(2);
+    return popStored(2);
 }
 PROBE(void, Exec_Cpobj, (mdToken typeToken, INT_PTR dest, INT_PTR src, OFFSET offset)) {
     /*send command*/
@@ -512,7 +704,7 @@ PROBE(void, Exec_Cpobj, (mdToken typeToken, INT_PTR dest, INT_PTR src, OFFSET of
 
 PROBE(COND, Track_Cpblk, (INT_PTR dest, INT_PTR src)) {
     // TODO: check concreteness of referenced memory!
-    return topFrame().pop(3);
+    return popStored(3);
 }
 PROBE(void, Exec_Cpblk, (INT_PTR dest, INT_PTR src, INT_PTR count, OFFSET offset)) {
     /*send command*/
@@ -520,7 +712,7 @@ PROBE(void, Exec_Cpblk, (INT_PTR dest, INT_PTR src, INT_PTR count, OFFSET offset
 
 PROBE(COND, Track_Initblk, (INT_PTR ptr)) {
     // TODO: check concreteness of referenced memory!
-    return topFrame().pop(3);
+    return popStored(3);
 }
 PROBE(void, Exec_Initblk, (INT_PTR ptr, INT8 value, INT_PTR count, OFFSET offset)) {
     /*send command*/
@@ -537,7 +729,7 @@ PROBE(void, Track_Castclass, (INT_PTR ptr, mdToken typeToken, OFFSET offset)) {
 
 PROBE(void, Track_Isinst, (INT_PTR ptr, mdToken typeToken, OFFSET offset)) { /*TODO*/ }
 
-PROBE(void, Track_Box, (INT_PTR ptr, OFFSET offset)) {
+LEAF_PROBE(void, Track_Box, (INT_PTR ptr, OFFSET offset)) {
     // TODO
     StackFrame &top = vsharp::topFrame();
     top.pop1();
@@ -565,9 +757,8 @@ PROBE(void, Track_Ldfld, (INT_PTR objPtr, INT32 fieldOffset, INT32 fieldSize, OF
 PROBE(void, Track_Ldflda, (INT_PTR fieldPtr, mdToken fieldToken, OFFSET offset)) { /*TODO*/ }
 
 inline bool stfld(mdToken fieldToken, INT_PTR ptr) {
-    StackFrame &top = vsharp::topFrame();
     // TODO: check concreteness of memory referenced by ptr
-    return top.pop(2);
+    return popStored(2);
 }
 
 PROBE(void, Track_Stfld_4, (mdToken fieldToken, INT_PTR ptr, INT32 value, OFFSET offset)) {
@@ -602,22 +793,22 @@ PROBE(void, Track_Stfld_struct, (mdToken fieldToken, INT_PTR ptr, INT_PTR value,
 }
 /// TODO: stfld may be called with any value type! :(
 
-PROBE(void, Track_Ldsfld, (mdToken fieldToken, OFFSET offset)) {
+LEAF_PROBE(void, Track_Ldsfld, (mdToken fieldToken, OFFSET offset)) {
     // TODO
     topFrame().push1Concrete();
 }
-PROBE(void, Track_Ldsflda, (INT_PTR ptr)) { topFrame().push1Concrete(); }
+LEAF_PROBE(void, Track_Ldsflda, (INT_PTR ptr)) { topFrame().push1Concrete(); }
 PROBE(void, Track_Stsfld, (mdToken fieldToken, OFFSET offset)) {
     // TODO
-    topFrame().pop1();
+    popStored(1);
 }
 
-PROBE(COND, Track_Ldelema, (INT_PTR ptr, INT_PTR index)) {
+LEAF_PROBE(COND, Track_Ldelema, (INT_PTR ptr, INT_PTR index)) {
     // TODO
     StackFrame &top = vsharp::topFrame();
     return top.pop1() && top.peek0();
 }
-PROBE(COND, Track_Ldelem, (INT_PTR ptr, INT_PTR index)) {
+LEAF_PROBE(COND, Track_Ldelem, (INT_PTR ptr, INT_PTR index)) {
     // TODO
     StackFrame &top = vsharp::topFrame();
     return top.pop1() && top.peek0();
@@ -627,8 +818,7 @@ PROBE(void, Exec_Ldelem, (INT_PTR ptr, INT_PTR index, OFFSET offset)) { /*send c
 
 PROBE(COND, Track_Stelem, (INT_PTR ptr, INT_PTR index)) {
     // TODO
-    StackFrame &top = vsharp::topFrame();
-    return top.pop(3);
+    return popStored(3);
 }
 PROBE(void, Exec_Stelem_I, (INT_PTR ptr, INT_PTR index, INT_PTR value, OFFSET offset)) { /*send command*/ }
 PROBE(void, Exec_Stelem_I1, (INT_PTR ptr, INT_PTR index, INT8 value, OFFSET offset)) { /*send command*/ }
@@ -644,11 +834,11 @@ PROBE(void, Track_Ckfinite, ()) {
     // TODO
     // TODO: if exn is thrown, no value is pushed onto the stack
 }
-PROBE(void, Track_Sizeof, ()) { topFrame().push1Concrete(); }
-PROBE(void, Track_Ldftn, ()) { topFrame().push1Concrete(); }
+LEAF_PROBE(void, Track_Sizeof, ()) { topFrame().push1Concrete(); }
+LEAF_PROBE(void, Track_Ldftn, ()) { topFrame().push1Concrete(); }
 PROBE(void, Track_Ldvirtftn, (INT_PTR ptr, mdToken token, OFFSET offset)) { /*TODO*/ }
-PROBE(void, Track_Arglist, ()) { topFrame().push1Concrete(); }
-PROBE(void, Track_Mkrefany, ()) {
+LEAF_PROBE(void, Track_Arglist, ()) { topFrame().push1Concrete(); }
+LEAF_PROBE(void, Track_Mkrefany, ()) {
     // TODO
     topFrame().pop1();
 }
@@ -675,6 +865,8 @@ PROBE(void, Track_Enter, (mdMethodDef token, unsigned maxStackSize, unsigned arg
         delete[] args;
     }
     top->setEnteredMarker(true);
+    if (!top->argsAreConcrete())
+        top->observeSymbolic();
     top->configure(maxStackSize, localsCount);
 }
 
@@ -689,6 +881,55 @@ PROBE(void, Track_EnterMain, (mdMethodDef token, UINT16 argsCount, bool argsConc
     stack.resetPopsTracking(1);
 }
 
+// NOTE: entry of methods, which keep the uninstrumented clone and the lightweight clone of their body; the result selects
+//       the body: 1 runs the uninstrumented clone, if the method can not meet symbolic values: its arguments are concrete
+//       and the heap is concrete. Its frame, pushed by the caller, is not entered then, so that the caller pops it
+//       in Finalize_Call as the frame of an extern. 2 runs the lightweight clone of a demoted method with concrete
+//       arguments, which keeps only enter, leave and call bookkeeping. 0 runs the instrumented body; symbolic arguments
+//       promote the method, so that the switch takes effect in the same invocation
+PROBE(COND, Track_EnterGuarded, (unsigned moduleKey, mdMethodDef token, unsigned maxStackSize, unsigned argsCount, unsigned localsCount)) {
+    Stack &stack = vsharp::stack();
+    assert(!stack.isEmpty());
+    StackFrame &top = stack.topFrame();
+    unsigned expected = top.resolvedToken();
+    // NOTE: spontaneous enters get concrete arguments
+    bool argsAreConcrete = (expected && expected != token) || top.hasEntered() || top.argsAreConcrete();
+    if (argsAreConcrete && heapIsConcrete()) {
+        LOG(tout << "Frame " << stack.framesCount() << ": running uninstrumented clone of token " << HEX(token) << std::endl);
+        return 1;
+    }
+    unsigned long long method = methodKey(moduleKey, token);
+    bool lightweight = argsAreConcrete && methodIsDemoted(method);
+    if (!argsAreConcrete)
+        promoteMethod(method);
+    Track_Enter(token, maxStackSize, argsCount, localsCount);
+    StackFrame &entered = stack.topFrame();
+    entered.setMethod(method);
+    if (!lightweight) return 0;
+    LOG(tout << "Frame " << stack.framesCount() << ": running lightweight clone of token " << HEX(token) << std::endl);
+    entered.setLightweight();
+    return 2;
+}
+
+// NOTE: lightweight frames do not track their evaluation stacks; a symbolic value, returned into such frame, can not be
+//       tracked by the current invocation, but promotes the method for the next ones
+void pushReturnValue(StackFrame &frame, bool isConcrete) {
+    if (!frame.isLightweight()) {
+        frame.push1(isConcrete);
+    } else if (!isConcrete) {
+        LOG(tout << "Symbolic value is returned into lightweight frame of token " << HEX(frame.resolvedToken()) << std::endl);
+        promoteMethod(frame.method());
+    }
+}
+
+// NOTE: thread may not return to the engine for a long time (or ever, for threads of the pool), so its deferred
+//       commands are sent when it leaves the outermost tracked frame
+void leftOutermostFrame(const Stack &stack) {
+    if (stack.isEmpty() && !flushDeferredCommands()) {
+        FAIL_LOUD("Sending deferred commands failed!");
+    }
+}
+
 PROBE(void, Track_Leave, (UINT8 returnValues, OFFSET offset)) {
     Stack &stack = vsharp::stack();
     StackFrame &top = stack.topFrame();
@@ -698,12 +939,13 @@ PROBE(void, Track_Leave, (UINT8 returnValues, OFFSET offset)) {
         FAIL_LOUD("Corrupted stack: stack is not empty when popping frame!");
     }
 #endif
+    methodLeft(top.method(), top.hasObservedSymbolic());
     if (returnValues) {
         bool returnValue = top.pop1();
         stack.popFrame();
         if (!stack.isEmpty()) {
             if (!top.isSpontaneous())
-                stack.topFrame().push1(returnValue);
+                pushReturnValue(stack.topFrame(), returnValue);
             else
                 LOG(tout << "Ignoring return type because of internal execution in unmanaged context..." << std::endl);
         } else {
@@ -713,6 +955,18 @@ PROBE(void, Track_Leave, (UINT8 returnValues, OFFSET offset)) {
         stack.popFrame();
     }
     LOG(tout << "Managed leave to frame " << stack.framesCount() << ". After popping top frame stack balance is " << top.count() << std::endl);
+    leftOutermostFrame(stack);
+}
+
+// NOTE: leave of the lightweight clone, its return value is concrete
+PROBE(void, Track_LeaveLight, (UINT8 returnValues)) {
+    Stack &stack = vsharp::stack();
+    bool spontaneous = stack.topFrame().isSpontaneous();
+    stack.popFrame();
+    if (returnValues && !spontaneous && !stack.isEmpty())
+        pushReturnValue(stack.topFrame(), true);
+    LOG(tout << "Lightweight leave to frame " << stack.framesCount() << std::endl);
+    leftOutermostFrame(stack);
 }
 
 void leaveMain(OFFSET offset, UINT8 opsCount, EvalStackOperand *ops) {
@@ -749,16 +1003,18 @@ PROBE(void, Finalize_Call, (UINT8 returnValues)) {
         }
 #endif
         if (returnValues) {
-            stack.topFrame().push1Concrete();
+            pushReturnValue(stack.topFrame(), true);
         }
     }
 }
 
 PROBE(VOID, Exec_Call, (INT32 argsCount, OFFSET offset)) {
+    // NOTE: the engine executes the call with symbolic arguments and may store them into the heap
+    markHeapSymbolic();
     auto ops = createOps(argsCount);
     sendCommand(offset, argsCount, ops);
 }
-PROBE(COND, Track_Call, (UINT16 argsCount)) {
+LEAF_PROBE(COND, Track_Call, (UINT16 argsCount)) {
     return vsharp::stack().topFrame().pop(argsCount);
 }
 
@@ -789,36 +1045,36 @@ PROBE(VOID, PushFrame, (mdToken unresolvedToken, mdMethodDef resolvedToken, bool
 }
 
 PROBE(void, Track_CallVirt, (UINT16 count, OFFSET offset)) { Track_Call(count); PushFrame(0, 0, false, count, offset); }
-PROBE(void, Track_Newobj, (INT_PTR ptr)) { topFrame().push1Concrete(); }
+LEAF_PROBE(void, Track_Newobj, (INT_PTR ptr)) { topFrame().push1Concrete(); }
 PROBE(void, Track_Calli, (mdSignature signature, OFFSET offset)) {
     // TODO
     (void)signature;
     FAIL_LOUD("CALLI NOT IMLEMENTED!");
 }
 
-PROBE(void, Track_Throw, (OFFSET offset)) {
+LEAF_PROBE(void, Track_Throw, (OFFSET offset)) {
     //TODO
     StackFrame &top = vsharp::topFrame();
     top.pop1();
 }
 PROBE(void, Track_Rethrow, (OFFSET offset)) { /*TODO*/ }
 
-PROBE(void, Mem_p, (INT_PTR arg)) { clear_mem(); mem_p(arg); }
+LEAF_PROBE(void, Mem_p, (INT_PTR arg)) { clear_mem(); mem_p(arg); }
 
-PROBE(void, Mem_1_idx, (INT8 arg, INT8 idx, INT8 order)) { if (order == 0) clear_mem(); mem_i1(arg, idx); }
-PROBE(void, Mem_2_idx, (INT16 arg, INT8 idx, INT8 order)) { if (order == 0) clear_mem(); mem_i2(arg, idx); }
-PROBE(void, Mem_4_idx, (INT32 arg, INT8 idx, INT8 order)) { if (order == 0) clear_mem(); mem_i4(arg, idx); }
-PROBE(void, Mem_8_idx, (INT64 arg, INT8 idx, INT8 order)) { if (order == 0) clear_mem(); mem_i8(arg, idx); }
-PROBE(void, Mem_f4_idx, (FLOAT arg, INT8 idx, INT8 order)) { if (order == 0) clear_mem(); mem_f4(arg, idx); }
-PROBE(void, Mem_f8_idx, (DOUBLE arg, INT8 idx, INT8 order)) { if (order == 0) clear_mem(); mem_f8(arg, idx); }
-PROBE(void, Mem_p_idx, (INT_PTR arg, INT8 idx, INT8 order)) { if (order == 0) clear_mem(); mem_p(arg, idx); }
+LEAF_PROBE(void, Mem_1_idx, (INT8 arg, INT8 idx, INT8 order)) { if (order == 0) clear_mem(); mem_i1(arg, idx); }
+LEAF_PROBE(void, Mem_2_idx, (INT16 arg, INT8 idx, INT8 order)) { if (order == 0) clear_mem(); mem_i2(arg, idx); }
+LEAF_PROBE(void, Mem_4_idx, (INT32 arg, INT8 idx, INT8 order)) { if (order == 0) clear_mem(); mem_i4(arg, idx); }
+LEAF_PROBE(void, Mem_8_idx, (INT64 arg, INT8 idx, INT8 order)) { if (order == 0) clear_mem(); mem_i8(arg, idx); }
+LEAF_PROBE(void, Mem_f4_idx, (FLOAT arg, INT8 idx, INT8 order)) { if (order == 0) clear_mem(); mem_f4(arg, idx); }
+LEAF_PROBE(void, Mem_f8_idx, (DOUBLE arg, INT8 idx, INT8 order)) { if (order == 0) clear_mem(); mem_f8(arg, idx); }
+LEAF_PROBE(void, Mem_p_idx, (INT_PTR arg, INT8 idx, INT8 order)) { if (order == 0) clear_mem(); mem_p(arg, idx); }
 
-PROBE(void, Mem2_4, (INT32 arg1, INT32 arg2)) { clear_mem(); mem_i4(arg1); mem_i4(arg2); }
-PROBE(void, Mem2_8, (INT64 arg1, INT64 arg2)) { clear_mem(); mem_i8(arg1); mem_i8(arg2); }
-PROBE(void, Mem2_f4, (FLOAT arg1, FLOAT arg2)) { clear_mem(); mem_f4(arg1); mem_f4(arg2); }
-PROBE(void, Mem2_f8, (DOUBLE arg1, DOUBLE arg2)) { clear_mem(); mem_f8(arg1); mem_f8(arg2); }
+LEAF_PROBE(void, Mem2_4, (INT32 arg1, INT32 arg2)) { clear_mem(); mem_i4(arg1); mem_i4(arg2); }
+LEAF_PROBE(void, Mem2_8, (INT64 arg1, INT64 arg2)) { clear_mem(); mem_i8(arg1); mem_i8(arg2); }
+LEAF_PROBE(void, Mem2_f4, (FLOAT arg1, FLOAT arg2)) { clear_mem(); mem_f4(arg1); mem_f4(arg2); }
+LEAF_PROBE(void, Mem2_f8, (DOUBLE arg1, DOUBLE arg2)) { clear_mem(); mem_f8(arg1); mem_f8(arg2); }
 //PROBE(void, Mem2_p, (INT_PTR arg1, INT_PTR arg2)) { clear_mem(); mem_p(arg1); mem_p(arg2); }
-PROBE(void, Mem2_8_4, (INT64 arg1, INT32 arg2)) { clear_mem(); mem_i8(arg1); mem_i4(arg2); }
+LEAF_PROBE(void, Mem2_8_4, (INT64 arg1, INT32 arg2)) { clear_mem(); mem_i8(arg1); mem_i4(arg2); }
 //PROBE(void, Mem2_4_p, (INT32 arg1, INT_PTR arg2)) { clear_mem(); mem_i4(arg1); mem_p(arg2); }
 //PROBE(void, Mem2_p_1, (INT_PTR arg1, INT8 arg2)) { clear_mem(); mem_p(arg1); mem_i1(arg2); }
 //PROBE(void, Mem2_p_2, (INT_PTR arg1, INT16 arg2)) { clear_mem(); mem_p(arg1); mem_i2(arg2); }
@@ -842,13 +1098,13 @@ PROBE(void, Mem2_8_4, (INT64 arg1, INT32 arg2)) { clear_mem(); mem_i8(arg1); mem
 //PROBE(void, Mem3_p_p_f8, (INT_PTR arg1, INT_PTR arg2, DOUBLE arg3)) { clear_mem(); mem_p(arg1); mem_p(arg2); mem_f8(arg3); }
 //PROBE(void, Mem3_p_i1_p, (INT_PTR arg1, INT8 arg2, INT_PTR arg3)) { clear_mem(); mem_p(arg1); mem_i1(arg2); mem_p(arg3); }
 
-PROBE(INT8, Unmem_1, (INT8 idx)) { return unmem_i1(idx); }
-PROBE(INT16, Unmem_2, (INT8 idx)) { return unmem_i2(idx); }
-PROBE(INT32, Unmem_4, (INT8 idx)) { return unmem_i4(idx); }
-PROBE(INT64, Unmem_8, (INT8 idx)) { return unmem_i8(idx); }
-PROBE(FLOAT, Unmem_f4, (INT8 idx)) { return unmem_f4(idx); }
-PROBE(DOUBLE, Unmem_f8, (INT8 idx)) { return unmem_f8(idx); }
-PROBE(INT_PTR, Unmem_p, (INT8 idx)) { return unmem_p(idx); }
+LEAF_PROBE(INT8, Unmem_1, (INT8 idx)) { return unmem_i1(idx); }
+LEAF_PROBE(INT16, Unmem_2, (INT8 idx)) { return unmem_i2(idx); }
+LEAF_PROBE(INT32, Unmem_4, (INT8 idx)) { return unmem_i4(idx); }
+LEAF_PROBE(INT64, Unmem_8, (INT8 idx)) { return unmem_i8(idx); }
+LEAF_PROBE(FLOAT, Unmem_f4, (INT8 idx)) { return unmem_f4(idx); }
+LEAF_PROBE(DOUBLE, Unmem_f8, (INT8 idx)) { return unmem_f8(idx); }
+LEAF_PROBE(INT_PTR, Unmem_p, (INT8 idx)) { return unmem_p(idx); }
 
 PROBE(void, DumpInstruction, (UINT32 index)) {
 #ifdef _DEBUG
@@ -0,0 +1,26 @@
+namespace VSharp
+
+open System.Collections.Generic
+
+module CallGraphReachability =
+
+    // NOTE: callees are taken from CFGs, so only statically known calls are followed:
+    //       overrides of virtual callees and targets of delegates are not reached
+    let reachableFrom (entryPoint : Method) =
+        let visited = HashSet<Method>()
+        let queue = Queue<Method>()
+        let visit m = if visited.Add m then queue.Enqueue m
+        visit entryPoint
+        while queue.Count > 0 do
+            let m = queue.Dequeue()
+            let cfg =
+                try m.CFG
+                with e ->
+                    Logger.warning "Could not build CFG of %O to find its callees: %s" m e.Message
+                    None
+            match cfg with
+            | Some cfg ->
+                for call in cfg.Calls.Values do
+                    visit call.Callee
+            | None -> ()
+        visited
@@ -133,7 +133,9 @@ type probes = {
 
     mutable enter : uint64
     mutable enterMain : uint64
+    mutable enterGuarded : uint64
     mutable leave : uint64
+    mutable leaveLight : uint64
     mutable leaveMain_0 : uint64
     mutable leaveMain_4 : uint64
     mutable leaveMain_8 : uint64
@@ -198,108 +200,11 @@ with
         let result = ref ""
         if x.Probe2str.TryGetValue(uint64 address, result) then "probe_" + result.Value
         else toString address
-
-[<type: StructLayout(LayoutKind.Sequential, Pack=1, CharSet=CharSet.Ansi)>]
-type signatureTokens = {
-    mutable void_sig : uint32
-    mutable bool_sig : uint32
-    mutable void_u1_sig : uint32
-    mutable void_u4_sig : uint32
-    mutable void_i_sig : uint32
-    mutable bool_i_sig : uint32
-    mutable bool_u2_sig : uint32
-    mutable i1_i1_sig : uint32
-    mutable i2_i1_sig : uint32
-    mutable i4_i1_sig : uint32
-    mutable i8_i1_sig : uint32
-    mutable r4_i1_sig : uint32
-    mutable r8_i1_sig : uint32
-    mutable i_i1_sig : uint32
-    mutable void_i_i1_sig : uint32
-    mutable void_i_i2_sig : uint32
-    mutable void_i_u2_sig : uint32
-    mutable void_i_i4_sig : uint32
-    mutable void_i_i8_sig : uint32
-    mutable void_i_r4_sig : uint32
-    mutable void_i_r8_sig : uint32
-    mutable void_i_i_sig : uint32
-    mutable void_i4_i4_sig : uint32
-    mutable void_i4_i_sig : uint32
-    mutable void_i8_i4_sig : uint32
-    mutable void_i8_i8_sig : uint32
-    mutable void_r4_r4_sig : uint32
-    mutable void_r8_r8_sig : uint32
-    mutable bool_i_i4_sig : uint32
-    mutable bool_i_i_sig : uint32
-    mutable void_i_i_i_sig : uint32
-    mutable void_i_i_i1_sig : uint32
-    mutable void_i_i_i2_sig : uint32
-    mutable void_i_i_i4_sig : uint32
-    mutable void_i_i_i8_sig : uint32
-    mutable void_i_i_r4_sig : uint32
-    mutable void_i_i_r8_sig : uint32
-    mutable void_i_i1_i_sig : uint32
-    mutable void_i1_i1_i1_sig : uint32
-    mutable void_i2_i1_i1_sig : uint32
-    mutable void_i4_i1_i1_sig : uint32
-    mutable void_i8_i1_i1_sig : uint32
-    mutable void_r4_i1_i1_sig : uint32
-    mutable void_r8_i1_i1_sig : uint32
-    mutable void_i_i1_i1_sig : uint32
-    mutable void_token_u2_bool_u4_u4_sig : uint32
-    mutable void_offset_sig : uint32
-    mutable void_u1_offset_sig : uint32
-    mutable void_u2_offset_sig : uint32
-    mutable void_i4_offset_sig : uint32
-    mutable void_i8_offset_sig : uint32
-    mutable void_r4_offset_sig : uint32
-    mutable void_r8_offset_sig : uint32
-    mutable void_i_offset_sig : uint32
-    mutable void_token_offset_sig : uint32
-    mutable void_i_i1_offset_sig : uint32
-    mutable void_i_i2_offset_sig : uint32
-    mutable void_i_i4_offset_sig : uint32
-    mutable void_i_i8_offset_sig : uint32
-    mutable void_i_r4_offset_sig : uint32
-    mutable void_i_r8_offset_sig : uint32
-    mutable void_i_i_offset_sig : uint32
-    mutable void_i_token_offset_sig : uint32
-    mutable void_i_i4_i4_offset_sig : uint32
-    mutable void_u2_i4_i4_offset_sig : uint32
-    mutable void_u2_i4_i_offset_sig : uint32
-    mutable void_u2_i8_i4_offset_sig : uint32
-    mutable void_u2_i8_i8_offset_sig : uint32
-    mutable void_u2_r4_r4_offset_sig : uint32
-    mutable void_u2_r8_r8_offset_sig : uint32
-    mutable void_u2_i_i_offset_sig : uint32
-    mutable void_u2_i_i4_offset_sig : uint32
-    mutable void_i_i_i_offset_sig : uint32
-    mutable void_i_i_i1_offset_sig : uint32
-    mutable void_i_i_i2_offset_sig : uint32
-    mutable void_i_i_i4_offset_sig : uint32
-    mutable void_i_i_i8_offset_sig : uint32
-    mutable void_i_i_r4_offset_sig : uint32
-    mutable void_i_i_r8_offset_sig : uint32
-    mutable void_i_i1_i_offset_sig : uint32
-    mutable void_token_u4_u4_u4_sig : uint32
-    mutable void_token_i_i_offset_sig : uint32
-    mutable void_token_i_i4_offset_sig : uint32
-    mutable void_token_i_i8_offset_sig : uint32
-    mutable void_token_i_r4_offset_sig : uint32
-    mutable void_token_i_r8_offset_sig : uint32
-    mutable void_token_token_bool_u2_offset_sig : uint32
-}
-with
-    member private x.SigToken2str =
-        let map = System.Collections.Generic.Dictionary<uint32, string>()
-        typeof<signatureTokens>.GetFields() |> Seq.iter (fun fld ->
-            let token : uint32 = fld.GetValue x |> unbox
-            if not <| map.ContainsKey token then map.Add(token, fld.Name))
-        map
-    member x.TokenToString (token : int32) =
-        let result = ref ""
-        if x.SigToken2str.TryGetValue(uint32 token, result) then result.Value
-        else "<UNKNOWN TOKEN!>"
+    // NOTE: addresses in the order of the array of probe addresses, which is marshalled into this record
+    member x.Addresses =
+        typeof<probes>.GetFields(System.Reflection.BindingFlags.Instance ||| System.Reflection.BindingFlags.Public ||| System.Reflection.BindingFlags.NonPublic)
+        |> Array.sortBy (fun field -> Marshal.OffsetOf(typeof<probes>, field.Name).ToInt64())
+        |> Array.map (fun field -> field.GetValue x |> unbox<uint64>)
 
 [<type: StructLayout(LayoutKind.Sequential, Pack=1, CharSet=CharSet.Ansi)>]
 type rawMethodProperties = {
@@ -331,7 +236,14 @@ type rawMethodBody = {
     properties : rawMethodProperties
     assembly : string
     moduleName : string
-    tokens : signatureTokens
+    // NOTE: tokens of signatures of probes for 'calli', generated by the client from declarations of probes,
+    //       in the order of 'probes' fields
+    probeSignatures : uint32 array
+    // NOTE: tokens of P/Invoke methods of probes in the module, in the order of 'probes' fields; empty if probes are called by addresses
+    probeMethods : uint32 array
+    // NOTE: tokens of unmanaged signatures of leaf probes, which suppress GC transitions, in the order of 'probes' fields;
+    //       blocking probes have nil tokens, the array is empty if all probes keep GC transitions
+    leafSignatures : uint32 array
     il : byte array
     ehs : rawExceptionHandler array
 }
@@ -935,7 +847,7 @@ type ILRewriter(body : rawMethodBody) =
     let adjustState (instr : ilInstr) =
         maxStackSize <- maxStackSize + instr.opcode.StackBehaviourPush
 
-    static member PrintILInstr (tokens : signatureTokens option) (probes : probes option) (m : System.Reflection.MethodBase) (instr : ilInstr) =
+    static member PrintILInstr (probes : probes option) (m : System.Reflection.MethodBase) (instr : ilInstr) =
         let opcode, arg =
             match instr.opcode with
             | OpCode op ->
@@ -946,10 +858,6 @@ type ILRewriter(body : rawMethodBody) =
                             let callee = Reflection.resolveMethod m token
                             Reflection.methodToString callee
                         | _ -> __unreachable__()
-                    elif op = OpCodes.Calli then
-                        match tokens with
-                        | Some tokens -> tokens.TokenToString instr.Arg32
-                        | None -> instr.Arg32.ToString()
                     else
                         match instr.arg with
                         | NoArg -> ""
@@ -969,7 +877,17 @@ type ILRewriter(body : rawMethodBody) =
         sprintf "[%x] %s %s" instr.offset opcode arg
 
     member x.ILInstrToString (probes : probes) (instr : ilInstr) =
-        ILRewriter.PrintILInstr (Some body.tokens) (Some probes) m instr
+        // NOTE: P/Invoke methods of probes are defined by the client, so they can not be resolved here
+        match instr.opcode, instr.arg with
+        | OpCode op, Arg32 token when op = OpCodes.Call && Array.contains (uint32 token) body.probeMethods ->
+            let address = probes.Addresses.[Array.IndexOf(body.probeMethods, uint32 token)]
+            sprintf "[%x] %s %s" instr.offset op.Name (probes.AddressToString (int64 address))
+        | OpCode op, Arg32 token when op = OpCodes.Calli && token <> 0 && Array.contains (uint32 token) body.leafSignatures ->
+            sprintf "[%x] %s <leaf probe signature %x>" instr.offset op.Name token
+        // NOTE: probes of the same type share the signature token, so the probe is named by the preceding address
+        | OpCode op, Arg32 token when op = OpCodes.Calli && token <> 0 && Array.contains (uint32 token) body.probeSignatures ->
+            sprintf "[%x] %s <probe signature %x>" instr.offset op.Name token
+        | _ -> ILRewriter.PrintILInstr (Some probes) m instr
 
     member x.InstrEq instr1 instr2 =
         Microsoft.FSharp.Core.LanguagePrimitives.PhysicalEquality instr1 instr2
@@ -999,13 +917,11 @@ type ILRewriter(body : rawMethodBody) =
         instrCount <- instrCount + 1u
         {prev = instr.prev; next = instr.next; opcode = instr.opcode; offset = instr.offset; stackState = instr.stackState; arg = instr.arg}
 
+    // NOTE: detached clones of the body are counted in 'instrCount', but are not traversed
     member x.CopyInstructions() =
-        let result = Array.zeroCreate<ilInstr> <| int instrCount
-        let mutable index = 0
-        x.TraverseProgram (fun instr ->
-            result.[index] <- instr
-            index <- index + 1)
-        result
+        let result = System.Collections.Generic.List<ilInstr>(int instrCount)
+        x.TraverseProgram result.Add
+        result.ToArray()
 
     member x.InstrFromOffset offset =
         if offset > codeSize then
@@ -1260,6 +1176,43 @@ type ILRewriter(body : rawMethodBody) =
         x.RecalculateOffsets() |> ignore
         maxStackSize <- body.properties.maxStackSize
 
+    // NOTE: detached copy of the imported body with its own branch targets and exception handlers,
+    //       it is not traversed by instrumentation and is appended to the method by 'AppendClone'
+    member x.CloneBody() =
+        let copies = System.Collections.Generic.Dictionary<ilInstr, ilInstr>(HashIdentity.Reference)
+        let mutable last = il
+        x.TraverseProgram (fun instr ->
+            let copy = x.CopyInstruction instr
+            copy.prev <- last
+            if not <| x.IsEnd last then last.next <- copy
+            copies.Add(instr, copy)
+            last <- copy)
+        let copyOf instr = copies.[instr]
+        for copy in copies.Values do
+            match copy.arg with
+            | Target target -> copy.arg <- Target (copyOf target)
+            | _ -> ()
+        let cloneEH (eh : ehClause) = {
+            flags = eh.flags
+            tryBegin = copyOf eh.tryBegin
+            tryEnd = copyOf eh.tryEnd
+            handlerBegin = copyOf eh.handlerBegin
+            handlerEnd = copyOf eh.handlerEnd
+            matcher =
+                match eh.matcher with
+                | ClassToken _ -> eh.matcher
+                | Filter instr -> Filter (copyOf instr)
+        }
+        copyOf il.next, last, Array.map cloneEH ehs
+
+    // NOTE: the clone follows the last instruction of the method, which never falls through, so it is reached only by branches
+    member x.AppendClone(first : ilInstr, last : ilInstr, clonedEHs : ehClause array) =
+        first.prev <- il.prev
+        il.prev.next <- first
+        last.next <- il
+        il.prev <- last
+        ehs <- Array.append ehs clonedEHs
+
     member x.Export() = // TODO: refactor export #do
         // One instruction produces 2 + sizeof(native int) bytes in the worst case which can be 10 bytes for 64-bit.
         // For simplification we just use 10 here.
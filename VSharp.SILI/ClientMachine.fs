@@ -18,6 +18,12 @@ type ClientMachine(entryPoint : Method, requestMakeStep : cilState -> unit, cilS
     let pathToClient = "libvsharpConcolic" + extension
     let pathToTmp = sprintf "%s%c" (Directory.GetCurrentDirectory()) Path.DirectorySeparatorChar
     let tempTest (id : int) = sprintf "%sstart%d.vst" pathToTmp id
+    // NOTE: instrumented bodies are cached by the client across runs if VSHARP_CONCOLIC_IL_CACHE is 'on' or the path of the cache
+    let ilCache =
+        match Environment.GetEnvironmentVariable("VSHARP_CONCOLIC_IL_CACHE") with
+        | null | "" | "off" -> None
+        | "on" -> Some (sprintf "%sconcolic_il.cache" pathToTmp)
+        | path -> Some path
     [<DefaultValue>] val mutable probes : probes
     [<DefaultValue>] val mutable instrumenter : Instrumenter
 
@@ -58,13 +64,81 @@ type ClientMachine(entryPoint : Method, requestMakeStep : cilState -> unit, cilS
     let mutable callIsSkipped = false
     let mutable mainReached = false
     let mutable operands : list<_> = List.Empty
-    let environment (method : Method) pipePath =
+    let mutable remoteMemory : RemoteMemoryReader option = None
+    // NOTE: heap addresses of the engine keep only low bits of object ids, full ids are needed to read the client memory;
+    //       objects, whose low bits collide with another live object, are not read directly
+    let objectIds = System.Collections.Generic.Dictionary<uint64, uint64>()
+    let objectKey (address : int) = uint64 (uint32 address)
+    let addObjectId (objectId : uint64) =
+        let key = objectKey (int objectId)
+        match objectIds.TryGetValue key with
+        | true, known when known <> objectId && known <> 0UL ->
+            Logger.trace "Object ids 0x%x and 0x%x collide in the engine heap, reading them through the profiler" known objectId
+            objectIds.[key] <- 0UL
+        | true, _ -> ()
+        | _ -> objectIds.[key] <- objectId
+    let removeObjectId (objectId : uint64) =
+        let key = objectKey (int objectId)
+        match objectIds.TryGetValue key with
+        | true, known when known = objectId -> objectIds.Remove key |> ignore
+        | _ -> ()
+    // NOTE: client does not wait for replies to deferred commands, it has already assumed their results
+    let deferredCommands = System.Collections.Generic.Queue<execCommand>()
+    let mutable stepIsDeferred = false
+    // NOTE: module of the entry point is instrumented entirely, so that its virtual methods and lambdas are not missed;
+    //       other modules are instrumented only in methods, which are statically reachable from the entry point
+    let instrumentationScope () =
+        let entryModule = entryPoint.Module.FullyQualifiedName
+        let tokens = System.Collections.Generic.Dictionary<string, ResizeArray<int>>()
+        for m in CallGraphReachability.reachableFrom entryPoint do
+            let moduleName = m.Module.FullyQualifiedName
+            if moduleName <> entryModule then
+                let mutable moduleTokens = null
+                if not <| tokens.TryGetValue(moduleName, &moduleTokens) then
+                    moduleTokens <- ResizeArray<int>()
+                    tokens.[moduleName] <- moduleTokens
+                moduleTokens.Add m.MetadataToken
+        let bitmap (moduleTokens : ResizeArray<int>) =
+            let rids = moduleTokens |> Seq.map (fun token -> token &&& 0x00FFFFFF)
+            let result : byte[] = Array.zeroCreate (Seq.max rids / 8 + 1)
+            for rid in rids do
+                result.[rid / 8] <- result.[rid / 8] ||| (1uy <<< rid % 8)
+            result
+        Logger.trace "Instrumentation scope: module %s and %d methods of %d other modules" entryModule (Seq.sumBy Seq.length tokens.Values) tokens.Count
+        seq {
+            yield entryModule, true, Array.empty
+            for kvp in tokens -> kvp.Key, false, bitmap kvp.Value
+        }
+    let environment (method : Method) pipePath transport =
         let result = ProcessStartInfo()
         let profiler = sprintf "%s%c%s" (Directory.GetCurrentDirectory()) Path.DirectorySeparatorChar pathToClient
         result.EnvironmentVariables.["CORECLR_PROFILER"] <- "{2800fea6-9667-4b42-a2b6-45dc98e77e9e}"
         result.EnvironmentVariables.["CORECLR_ENABLE_PROFILING"] <- "1"
         result.EnvironmentVariables.["CORECLR_PROFILER_PATH"] <- profiler
-        result.EnvironmentVariables.["CONCOLIC_PIPE"] <- pipePath
+        match transport with
+        | SocketTransport -> result.EnvironmentVariables.["CONCOLIC_PIPE"] <- pipePath
+        | SharedMemoryTransport -> result.EnvironmentVariables.["CONCOLIC_SHM"] <- pipePath
+        | ReplayTransport -> ()
+        let strategy = waitStrategy.FromEnvironment()
+        result.EnvironmentVariables.["CONCOLIC_WAIT"] <- strategy.ClientName
+        match strategy with
+        | SpinThenBlockWait budget -> result.EnvironmentVariables.["CONCOLIC_SPIN_BUDGET"] <- string budget
+        | _ -> ()
+        match Environment.GetEnvironmentVariable("VSHARP_CONCOLIC_CLIENT_CPUS") with
+        | null | "" -> ()
+        | cpus -> result.EnvironmentVariables.["CONCOLIC_CPUS"] <- cpus
+        // NOTE: methods, which run concretely that many times in a row, lose their probes; VSHARP_CONCOLIC_DEMOTE_AFTER=off disables it
+        match Environment.GetEnvironmentVariable("VSHARP_CONCOLIC_DEMOTE_AFTER") with
+        | null | "" -> ()
+        | "off" -> result.EnvironmentVariables.["CONCOLIC_DEMOTE_AFTER"] <- "0"
+        | count -> result.EnvironmentVariables.["CONCOLIC_DEMOTE_AFTER"] <- count
+        // NOTE: concreteness of the heap is kept in direct-mapped shadow memory if VSHARP_CONCOLIC_SHADOW_MEMORY=direct
+        match Environment.GetEnvironmentVariable("VSHARP_CONCOLIC_SHADOW_MEMORY") with
+        | null | "" -> ()
+        | mode -> result.EnvironmentVariables.["CONCOLIC_SHADOW_MEMORY"] <- mode
+        match ilCache with
+        | Some path -> result.EnvironmentVariables.["CONCOLIC_IL_CACHE"] <- path
+        | None -> ()
         result.WorkingDirectory <- Directory.GetCurrentDirectory()
         result.FileName <- "dotnet"
         result.UseShellExecute <- false
@@ -82,31 +156,58 @@ type ClientMachine(entryPoint : Method, requestMakeStep : cilState -> unit, cilS
         let test = UnitTest((entryPoint :> IMethod).MethodBase)
         test.Serialize(tempTest id)
 
+        // NOTE: this thread drives ExecCommand, so it is pinned next to the CPUs of the client (VSHARP_CONCOLIC_CLIENT_CPUS)
+        match Environment.GetEnvironmentVariable("VSHARP_CONCOLIC_ENGINE_CPUS") with
+        | null | "" -> ()
+        | cpus -> Affinity.pinCurrentThread cpus
+        let transport = Communicator.DefaultTransport
         let pipe, pipePath =
-            if RuntimeInformation.IsOSPlatform(OSPlatform.Windows) then
+            if transport = ReplayTransport then
+                Communicator.ReplayLog, Communicator.ReplayLog
+            elif transport = SharedMemoryTransport then
+                let segment = sprintf "/vsharp_concolic_%d_%d" (Process.GetCurrentProcess().Id) id
+                segment, segment
+            elif RuntimeInformation.IsOSPlatform(OSPlatform.Windows) then
                 let pipe = sprintf "concolic_fifo_%d.pipe" id
                 let pipePath = sprintf "\\\\.\\pipe\\%s" pipe
                 pipe, pipePath
             else
                 let pipeFile = sprintf "%sconcolic_fifo_%d.pipe" pathToTmp id
                 pipeFile, pipeFile
-        let env = environment entryPoint pipePath
-        x.communicator <- new Communicator(pipe)
-        let proc = Process.Start env
+        let env = environment entryPoint pipePath transport
+        x.communicator <- new Communicator(pipe, transport, Communicator.DefaultFraming, Communicator.DefaultCreditWindow, Communicator.DefaultEncoding, Communicator.DefaultFeatures)
         id <- id + 1
-        proc.OutputDataReceived.Add <| fun args -> Logger.trace "CONCOLIC OUTPUT: %s" args.Data
-        proc.ErrorDataReceived.Add <| fun args -> Logger.trace "CONCOLIC ERROR: %s" args.Data
-        proc.BeginOutputReadLine()
-        proc.BeginErrorReadLine()
-        Logger.info "Successfully spawned pid %d, working dir \"%s\"" proc.Id env.WorkingDirectory
+        // NOTE: replayed session does not need the client, so the engine is benchmarked without CLR
+        if transport = ReplayTransport then
+            Logger.info "Replaying concolic traffic from %s" pipePath
+        else
+            let proc = Process.Start env
+            x.communicator.WatchClient proc
+            proc.OutputDataReceived.Add <| fun args -> Logger.trace "CONCOLIC OUTPUT: %s" args.Data
+            proc.ErrorDataReceived.Add <| fun args -> Logger.trace "CONCOLIC ERROR: %s" args.Data
+            proc.BeginOutputReadLine()
+            proc.BeginErrorReadLine()
+            Logger.info "Successfully spawned pid %d, working dir \"%s\"" proc.Id env.WorkingDirectory
         if x.communicator.Connect() then
             x.probes <- x.communicator.ReadProbes()
+            if x.communicator.Supports protocolFeature.RemoteMemoryFeature then
+                let layout = x.communicator.ReadRemoteMemoryLayout()
+                // NOTE: replayed client is not alive, so its memory can not be read
+                if transport <> ReplayTransport then
+                    remoteMemory <- Some (RemoteMemoryReader layout)
+                    Logger.trace "Reading memory of client %d directly" layout.processId
             x.communicator.SendEntryPoint entryPoint.Module.FullyQualifiedName entryPoint.MetadataToken
-            x.instrumenter <- Instrumenter(x.communicator, (entryPoint :> IMethod).MethodBase, x.probes)
+            if x.communicator.Supports protocolFeature.InstrumentationScopeFeature then
+                x.communicator.SendInstrumentationScope (instrumentationScope ())
+            x.instrumenter <- Instrumenter(x.communicator.SendStringAndReadItsIndex, (entryPoint :> IMethod).MethodBase, x.probes)
             true
         else false
 
     member x.SynchronizeStates (c : execCommand) =
+        remoteMemory |> Option.iter (fun reader -> reader.Invalidate())
+        // NOTE: ids of collected objects may be reused by new objects of the same command
+        c.deletedAddresses |> Array.iter (uint64 >> removeObjectId)
+        c.newAddresses |> Array.iter (uint64 >> addObjectId)
         Memory.ForcePopFrames (int c.callStackFramesPops) cilState.state
         assert(Memory.CallStackSize cilState.state > 0)
         let initFrame state token =
@@ -135,6 +236,7 @@ type ClientMachine(entryPoint : Method, requestMakeStep : cilState -> unit, cilS
                     Concrete (BitConverter.Int64BitsToDouble content) TypeUtils.float64Type
                 | _ -> __unreachable__()
             | PointerOp(baseAddress, offset) ->
+                addObjectId baseAddress
                 // TODO: what about StackLocation and StaticLocation? #do
                 let address = ConcreteHeapAddress [int32 baseAddress]
                 let typ = TypeOfAddress cilState.state address
@@ -153,28 +255,97 @@ type ClientMachine(entryPoint : Method, requestMakeStep : cilState -> unit, cilS
 
     member x.State with get() = cilState
 
+    member private x.ExecuteInstruction(c : execCommand, deferred : bool) =
+        x.SynchronizeStates c
+        stepIsDeferred <- deferred
+        cilState.suspended <- false
+        requestMakeStep cilState
+        true
+
     member x.ExecCommand() =
-        Logger.trace "Reading next command..."
-        match x.communicator.ReadCommand() with
-        | Instrument methodBody ->
-            if int methodBody.properties.token = entryPoint.MetadataToken && methodBody.moduleName = entryPoint.Module.FullyQualifiedName then
+        // NOTE: commands of the batch are executed one per step, as if they were sent separately
+        if deferredCommands.Count > 0 then x.ExecuteInstruction(deferredCommands.Dequeue(), true)
+        else
+            Logger.trace "Reading next command..."
+            match x.communicator.ReadCommand() with
+            | Instrument methodBody ->
+                if int methodBody.properties.token = entryPoint.MetadataToken && methodBody.moduleName = entryPoint.Module.FullyQualifiedName then
+                    mainReached <- true
+                let mb =
+                    if mainReached then
+                        Logger.trace "Got instrument command! bytes count = %d, max stack size = %d, eh count = %d" methodBody.il.Length methodBody.properties.maxStackSize methodBody.ehs.Length
+                        x.instrumenter.Instrument methodBody
+                    else x.instrumenter.Skip methodBody
+                x.communicator.SendMethodBody mb
+                true
+            | InstrumentModule batch ->
+                // NOTE: client applies the batch only after main is reached, as it does with single methods
                 mainReached <- true
-            let mb =
-                if mainReached then
-                    Logger.trace "Got instrument command! bytes count = %d, max stack size = %d, eh count = %d" methodBody.il.Length methodBody.properties.maxStackSize methodBody.ehs.Length
-                    x.instrumenter.Instrument methodBody
-                else x.instrumenter.Skip methodBody
-            x.communicator.SendMethodBody mb
-            true
-        | ExecuteInstruction c ->
-            Logger.trace "Got execute instruction command!"
-            x.SynchronizeStates c
-            cilState.suspended <- false
-            requestMakeStep cilState
-            true
-        | Terminate ->
-            Logger.trace "Got terminate command!"
-            false
+                Logger.trace "Got instrument module command! methods count = %d" batch.bodies.Length
+                let strings = ResizeArray<string>()
+                let internString str =
+                    lock strings (fun () ->
+                        strings.Add str
+                        batch.firstStringIndex + uint32 (strings.Count - 1))
+                let entryMethod = (entryPoint :> IMethod).MethodBase
+                let bodies = batch.bodies |> Array.Parallel.map (fun body ->
+                    body.properties.token, Instrumenter(internString, entryMethod, x.probes).Instrument body)
+                x.communicator.SendModuleBodies strings bodies
+                true
+            | MainReached ->
+                Logger.trace "Got main reached command!"
+                mainReached <- true
+                true
+            | ExecuteInstruction c ->
+                Logger.trace "Got execute instruction command!"
+                x.ExecuteInstruction(c, false)
+            | ExecuteDeferredInstructions commands ->
+                Logger.trace "Got %d deferred execute instruction commands!" commands.Length
+                Array.iter deferredCommands.Enqueue commands
+                x.ExecuteInstruction(deferredCommands.Dequeue(), true)
+            | Terminate ->
+                Logger.trace "Got terminate command!"
+                remoteMemory |> Option.iter (fun reader -> reader.Report())
+                false
+
+    // NOTE: concrete values are pulled from the client lazily, without a round trip through the profiler
+    member x.TryReadConcreteField (address : concreteHeapAddress) (field : Reflection.FieldInfo) =
+        match remoteMemory, address with
+        | Some reader, [address] ->
+            match objectIds.TryGetValue (objectKey address) with
+            | true, objectId when objectId <> 0UL -> reader.TryReadField objectId field
+            | _ -> None
+        | _ -> None
+
+    // NOTE: elements of strings and arrays start at different offsets, so the offset is taken from the type of the address
+    member x.TryReadConcreteArrayElement (address : concreteHeapAddress) (index : int) (elementType : Type) =
+        match remoteMemory, address with
+        | Some reader, [key] ->
+            match objectIds.TryGetValue (objectKey key) with
+            | true, objectId when objectId <> 0UL ->
+                let offset = metadataSizeOfAddress cilState.state (ConcreteHeapAddress address) + index * TypeUtils.internalSizeOf elementType
+                reader.TryRead objectId offset elementType
+            | _ -> None
+        | _ -> None
+
+    // NOTE: values of client objects, which the engine has not read yet, are taken from the client memory;
+    //       if they can not be read directly, they are concretized by the model and sent through the channel
+    member private x.TryReadConcrete term =
+        match term with
+        | {term = Constant(_, source, typ)} when RemoteMemoryReader.CanRead typ ->
+            let value =
+                match source with
+                | HeapReading(key, _) ->
+                    match key.address.term, GetHeapReadingRegionSort source with
+                    | ConcreteHeapAddress address, HeapFieldSort field -> x.TryReadConcreteField address (Reflection.getFieldInfo field)
+                    | _ -> None
+                | VectorIndexReading(_, key, _) ->
+                    match key.address.term, key.index.term with
+                    | ConcreteHeapAddress address, Concrete(index, _) -> x.TryReadConcreteArrayElement address (index :?> int) typ
+                    | _ -> None
+                | _ -> None
+            value |> Option.map (fun value -> value, typ)
+        | _ -> None
 
     member private x.ConcreteToObj term =
         let evalRefType baseAddress offset typ =
@@ -193,11 +364,15 @@ type ClientMachine(entryPoint : Method, requestMakeStep : cilState -> unit, cilS
             evalRefType baseAddress offset (TypeOf term)
         | {term = Ptr(baseAddress, sightType, offset)} ->
             evalRefType baseAddress offset (sightType.MakePointerType())
-        | _ -> None
+        | _ -> x.TryReadConcrete term
 
     member private x.EvalOperands cilState =
         let model = cilState.state.model
-        let concretizedOps = operands |> List.choose (model.Eval >> x.ConcreteToObj)
+        let concretizeOp op =
+            match x.TryReadConcrete op with
+            | Some _ as value -> value
+            | None -> model.Eval op |> x.ConcreteToObj
+        let concretizedOps = operands |> List.choose concretizeOp
         if List.length operands <> List.length concretizedOps then None
         else
             bindNewCilState cilState
@@ -208,6 +383,15 @@ type ClientMachine(entryPoint : Method, requestMakeStep : cilState -> unit, cilS
         if method.IsInternalCall then
             callIsSkipped <- true
             cilState
+        elif stepIsDeferred then
+            // NOTE: client assumed symbolic result without concretization, so even concrete result stays on the stack;
+            //       no operands are sent back, so the first stepped state is followed without evaluating them
+            stepIsDeferred <- false
+            match steppedStates with
+            | state :: _ -> bindNewCilState state
+            | [] -> ()
+            cilState.suspended <- true
+            cilState
         else
             let concretizedOps =
                 if callIsSkipped then Some List.empty
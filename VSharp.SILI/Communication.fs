@@ -73,6 +73,7 @@ type private execCommandStatic = {
     evaluationStackPushesCount : uint32
     evaluationStackPops : uint32
     newAddressesCount : uint32
+    deletedAddressesCount : uint32
 }
 type execCommand = {
     offset : uint32
@@ -83,7 +84,8 @@ type execCommand = {
     evaluationStackPushes : evalStackOperand array // NOTE: operands for executing instruction
     newAddresses : UIntPtr array
     newAddressesTypes : Type array
-    // TODO: add deleted addresses
+    // NOTE: objects, collected by GC of the client; their ids may be reused by new addresses of later commands
+    deletedAddresses : UIntPtr array
 }
 
 [<type: StructLayout(LayoutKind.Sequential, Pack=1, CharSet=CharSet.Ansi)>]
@@ -94,26 +96,132 @@ type execResponseStaticPart = {
     hasResult : byte
 }
 
+// NOTE: bodies of all methods of the module, strings of debug probes get indices starting from 'firstStringIndex'
+type rawModuleBodies = {
+    firstStringIndex : uint32
+    bodies : rawMethodBody array
+}
+
 type commandFromConcolic =
     | Instrument of rawMethodBody
+    | InstrumentModule of rawModuleBodies
     | ExecuteInstruction of execCommand
+    // NOTE: commands, which results are predicted by client, they are executed without replies
+    | ExecuteDeferredInstructions of execCommand array
+    // NOTE: client took the body of main from its instrumentation cache, so it did not request it
+    | MainReached
     | Terminate
 
 type commandForConcolic =
     | ReadMethodBody
     | ReadString
 
-type Communicator(pipeFile) =
+// NOTE: must be kept in sync with VSharp.ClrInteraction/communication/protocol.h
+type framingMode =
+    | ConfirmedFraming = 0
+    | StreamedFraming = 1
+    | MultiplexedFraming = 2
+
+type channelKind =
+    | SessionChannel = 0
+    | InstrumentationChannel = 1
+    | ExecutionChannel = 2
+
+// NOTE: frame of multiplexed mode, which was read while another request was served
+type private pendingFrame = {
+    requestId : uint32
+    channel : channelKind
+    payload : byte[]
+}
+
+type private controlFrame =
+    | TerminateFrame = -1
+    | ErrorFrame = -2
+    | CreditFrame = -3
+
+type wireEncoding =
+    | FixedEncoding = 0
+    | CompactEncodingV1 = 1
+
+[<Flags>]
+type protocolFeature =
+    | NoFeatures = 0
+    | ModuleBatchFeature = 1
+    | RemoteMemoryFeature = 2
+    | DeferredExecutionFeature = 4
+    | InstrumentationScopeFeature = 8
+    | ModuleTokensFeature = 16
+    | ProbeMethodsFeature = 32
+    | LeafProbesFeature = 64
+
+// NOTE: reader of exec commands in compact encoding, must be kept in sync with VSharp.ClrInteraction/communication/compactEncoding.h
+type private compactReader(bytes : byte[], start : int) =
+    let mutable position = start
+
+    member x.Position = position
+
+    member x.ReadByte() =
+        let b = bytes.[position]
+        position <- position + 1
+        b
+
+    member x.ReadVarUInt() =
+        let mutable result = 0UL
+        let mutable shift = 0
+        let mutable b = x.ReadByte()
+        while b >= 0x80uy do
+            result <- result ||| (uint64 (b &&& 0x7Fuy) <<< shift)
+            shift <- shift + 7
+            b <- x.ReadByte()
+        result ||| (uint64 b <<< shift)
+
+    member x.ReadVarInt() =
+        let value = x.ReadVarUInt()
+        int64 (value >>> 1) ^^^ -(int64 (value &&& 1UL))
+
+    member x.ReadInt64() =
+        let value = BitConverter.ToInt64(bytes, position)
+        position <- position + sizeof<int64>
+        value
+
+type Communicator(pipeFile, transport : concolicTransport, proposedFraming : framingMode, proposedCreditWindow : int, proposedEncoding : wireEncoding, proposedFeatures : protocolFeature) =
 
     let confirmationByte = byte(0x55)
     let instrumentCommandByte = byte(0x56)
     let executeCommandByte = byte(0x57)
     let readMethodBodyByte = byte(0x58)
     let readStringByte = byte(0x59)
+    let instrumentModuleCommandByte = byte(0x5A)
+    let executeDeferredCommandByte = byte(0x5B)
+    let mainReachedCommandByte = byte(0x5C)
     let confirmation = Array.singleton confirmationByte
 
-    let server = new NamedPipeServerStream(pipeFile, PipeDirection.InOut)
-    let stream = server :> Stream
+    // NOTE: for the shared memory transport 'pipeFile' is the name of the segment
+    let server, stream =
+        match transport with
+        | SocketTransport ->
+            let server = new NamedPipeServerStream(pipeFile, PipeDirection.InOut)
+            Some server, server :> Stream
+        | SharedMemoryTransport ->
+            None, new SharedMemoryStream(pipeFile, SharedMemoryStream.DefaultCapacity, waitStrategy.FromEnvironment()) :> Stream
+        | ReplayTransport ->
+            None, new TrafficReplayStream(pipeFile) :> Stream
+    let channel = stream
+    let stream = TrafficRecordingStream.FromEnvironment stream
+
+    let mutable framing = framingMode.ConfirmedFraming
+    let mutable encoding = wireEncoding.FixedEncoding
+    let mutable features = protocolFeature.NoFeatures
+    let mutable creditWindow = 0
+    let mutable credits = 0
+    let mutable consumedFrames = 0
+    // NOTE: replies are tagged with the request they answer; frames of other requests wait until they are served
+    let mutable currentRequest = 0u
+    let mutable currentChannel = channelKind.SessionChannel
+    let mutable clientTerminated = false
+    let pendingFrames = System.Collections.Generic.List<pendingFrame>()
+    // NOTE: signatures and P/Invoke methods of probes by ids of client modules, they are sent with the first body of each module
+    let moduleTokens = System.Collections.Generic.Dictionary<uint64, uint32 array * uint32 array * uint32 array>()
 
     let reportError (exn : IOException) =
         Logger.error "Error occured during communication with the concolic client! Message: %s" exn.Message
@@ -132,14 +240,23 @@ type Communicator(pipeFile) =
     let writeConfirmation () =
         stream.Write(confirmation, 0, 1)
 
+    let readExactly (buffer : byte[]) count =
+        let mutable bytesRead = 0
+        let mutable finished = false
+        while bytesRead < count && not finished do
+            let newBytesCount = stream.Read(buffer, bytesRead, count - bytesRead)
+            if newBytesCount = 0 then finished <- true
+            bytesRead <- bytesRead + newBytesCount
+        bytesRead
+
     let readCount () =
         let countBytes : byte[] = Array.zeroCreate 4
-        let countCount = stream.Read(countBytes, 0, 4)
+        let countCount = readExactly countBytes 4
         if countCount <> 4 then
             fail "Communication with CLR: could not get the amount of bytes of the next message. Instead read %d bytes" countCount
         BitConverter.ToInt32(countBytes, 0)
 
-    let readBuffer () =
+    let readConfirmedBuffer () =
         let chunkSize = 8192
         let count = readCount()
         assert(count <> 0)
@@ -152,7 +269,7 @@ type Communicator(pipeFile) =
                 let length = min chunkSize (count - bytesRead)
                 let chunk : byte[] = Array.zeroCreate length
                 let offset = bytesRead
-                bytesRead <- bytesRead + server.Read(chunk, 0, length)
+                bytesRead <- bytesRead + stream.Read(chunk, 0, length)
                 Array.Copy(chunk, 0, buffer, offset, length)
             if bytesRead <> count then
                 fail "Communication with CLR: expected %d bytes, but read %d bytes" count bytesRead
@@ -160,9 +277,7 @@ type Communicator(pipeFile) =
                 writeConfirmation()
                 Some buffer
 
-    let writeBuffer (buffer : byte[]) =
-        if buffer.LongLength > int64(Int32.MaxValue) then
-            fail "Communication with CLR: too large message (length = %s)!" (buffer.LongLength.ToString())
+    let writeConfirmedBuffer (buffer : byte[]) =
         let countBuffer = BitConverter.GetBytes(buffer.Length)
         assert(countBuffer.Length = 4)
         stream.Write(countBuffer, 0, 4)
@@ -170,6 +285,132 @@ type Communicator(pipeFile) =
         stream.Write(buffer, 0, buffer.Length)
         readConfirmation()
 
+    // NOTE: control frames carry the length of their payload after the header
+    let writeFrame (header : int) (payload : byte[]) =
+        let isControl = header < 0
+        let fields =
+            [ yield header
+              if framing = framingMode.MultiplexedFraming then
+                  yield int currentRequest
+                  yield int currentChannel
+              if isControl then yield payload.Length ]
+        let headerSize = List.length fields * sizeof<int>
+        let frame : byte[] = Array.zeroCreate (headerSize + payload.Length)
+        fields |> List.iteri (fun i field ->
+            let success = BitConverter.TryWriteBytes(Span(frame, i * sizeof<int>, sizeof<int>), field) in assert success)
+        Array.blit payload 0 frame headerSize payload.Length
+        stream.Write(frame, 0, frame.Length)
+
+    let readControlFrame (kind : controlFrame) =
+        let length = readCount()
+        let payload : byte[] = Array.zeroCreate length
+        let bytesRead = readExactly payload length
+        if bytesRead <> length then
+            fail "Communication with CLR: expected %d bytes of control frame %O, but read %d bytes" length kind bytesRead
+        match kind with
+        | controlFrame.CreditFrame -> credits <- credits + BitConverter.ToInt32(payload, 0)
+        | controlFrame.ErrorFrame -> fail "Communication with CLR: client reported an error: %s" (Encoding.ASCII.GetString payload)
+        | _ -> fail "Communication with CLR: unexpected control frame %O" kind
+
+    let rec readStreamedBuffer () =
+        let count = readCount()
+        if count = int controlFrame.TerminateFrame then
+            readCount() |> ignore
+            None
+        elif count < 0 then
+            readControlFrame (enum count)
+            readStreamedBuffer()
+        else
+            assert(count <> 0)
+            let buffer : byte[] = Array.zeroCreate count
+            let bytesRead = readExactly buffer count
+            if bytesRead <> count then
+                fail "Communication with CLR: expected %d bytes, but read %d bytes" count bytesRead
+            if creditWindow > 0 then
+                consumedFrames <- consumedFrames + 1
+                if consumedFrames = creditWindow then
+                    consumedFrames <- 0
+                    writeFrame (int controlFrame.CreditFrame) (BitConverter.GetBytes creditWindow)
+            Some buffer
+
+    // NOTE: client grants credits right after consuming the frames, so nothing else can precede them
+    let acquireCredit () =
+        while credits = 0 do
+            let header = readCount()
+            if header >= 0 || header = int controlFrame.TerminateFrame then
+                fail "Communication with CLR: expected credits, but got frame %d" header
+            readControlFrame (enum header)
+        credits <- credits - 1
+
+    let writeStreamedBuffer (buffer : byte[]) =
+        if creditWindow > 0 then acquireCredit()
+        writeFrame buffer.Length buffer
+
+    let rec readMultiplexedFrame () =
+        let length = readCount()
+        let requestId = uint32 (readCount())
+        let channel : channelKind = enum (readCount())
+        if length = int controlFrame.TerminateFrame then
+            readCount() |> ignore
+            clientTerminated <- true
+            None
+        elif length < 0 then
+            readControlFrame (enum length)
+            readMultiplexedFrame()
+        else
+            let payload : byte[] = Array.zeroCreate length
+            let bytesRead = readExactly payload length
+            if bytesRead <> length then
+                fail "Communication with CLR: expected %d bytes, but read %d bytes" length bytesRead
+            Some { requestId = requestId; channel = channel; payload = payload }
+
+    let rec readMultiplexedBuffer () =
+        match Seq.tryFindIndex (fun frame -> frame.requestId = currentRequest) pendingFrames with
+        | Some index ->
+            let frame = pendingFrames.[index]
+            pendingFrames.RemoveAt index
+            Some frame.payload
+        | None when clientTerminated -> None
+        | None ->
+            match readMultiplexedFrame() with
+            | Some frame when frame.requestId = currentRequest -> Some frame.payload
+            | Some frame ->
+                pendingFrames.Add frame
+                readMultiplexedBuffer()
+            | None -> None
+
+    let readBuffer () =
+        match framing with
+        | framingMode.MultiplexedFraming -> readMultiplexedBuffer()
+        | framingMode.StreamedFraming -> readStreamedBuffer()
+        | _ -> readConfirmedBuffer()
+
+    // NOTE: takes the earliest frame of any request and makes its request current
+    let readRequest () =
+        if framing <> framingMode.MultiplexedFraming then readBuffer()
+        elif pendingFrames.Count > 0 then
+            let frame = pendingFrames.[0]
+            pendingFrames.RemoveAt 0
+            currentRequest <- frame.requestId
+            currentChannel <- frame.channel
+            Some frame.payload
+        elif clientTerminated then None
+        else
+            match readMultiplexedFrame() with
+            | Some frame ->
+                currentRequest <- frame.requestId
+                currentChannel <- frame.channel
+                Some frame.payload
+            | None -> None
+
+    let writeBuffer (buffer : byte[]) =
+        if buffer.LongLength > int64(Int32.MaxValue) then
+            fail "Communication with CLR: too large message (length = %s)!" (buffer.LongLength.ToString())
+        match framing with
+        | framingMode.MultiplexedFraming -> writeFrame buffer.Length buffer
+        | framingMode.StreamedFraming -> writeStreamedBuffer buffer
+        | _ -> writeConfirmedBuffer buffer
+
     let readString () =
         match readBuffer() with
         | None -> unexpectedlyTerminated()
@@ -182,20 +423,107 @@ type Communicator(pipeFile) =
         writeBuffer buffer
 
     let waitClient () =
-        Logger.trace "Waiting for client connection..."
-        server.WaitForConnection()
-        Logger.trace "Client connected!"
-
+        match server with
+        | Some server ->
+            Logger.trace "Waiting for client connection..."
+            server.WaitForConnection()
+            Logger.trace "Client connected!"
+        | None -> ()
+
+    // NOTE: framing options follow the null-terminated greeting; old clients ignore them and reply with bare greeting
     let handshake () =
         let message = "Hi!"
-        writeString message
+        let greeting = Encoding.ASCII.GetBytes(message + Char.MinValue.ToString())
+        let options = Array.concat [BitConverter.GetBytes(int proposedFraming); BitConverter.GetBytes proposedCreditWindow; BitConverter.GetBytes(int proposedEncoding); BitConverter.GetBytes(int proposedFeatures)]
+        writeBuffer (Array.append greeting options)
         let expectedMessage = "Hi!"
-        let s = readString ()
+        let reply =
+            match readBuffer() with
+            | None -> unexpectedlyTerminated()
+            | Some reply -> reply
+        let s = Encoding.ASCII.GetString(reply, 0, min reply.Length expectedMessage.Length)
         if s <> expectedMessage then
             fail "Communication with CLR: handshake failed: got %s instead of %s" s expectedMessage
+        // NOTE: clients, which do not know about encodings or features, reply only with the options they know
+        if reply.Length >= greeting.Length + 2 * sizeof<int> then
+            framing <- enum (BitConverter.ToInt32(reply, greeting.Length))
+            creditWindow <- BitConverter.ToInt32(reply, greeting.Length + sizeof<int>)
+            credits <- creditWindow
+            consumedFrames <- 0
+        if reply.Length >= greeting.Length + 3 * sizeof<int> then
+            encoding <- enum (BitConverter.ToInt32(reply, greeting.Length + 2 * sizeof<int>))
+        if reply.Length >= greeting.Length + 4 * sizeof<int> then
+            features <- enum (BitConverter.ToInt32(reply, greeting.Length + 3 * sizeof<int>)) &&& proposedFeatures
+        Logger.trace "Handshake with client succeeded, framing mode = %O, credit window = %d, encoding = %O, features = %O" framing creditWindow encoding features
 
     override x.Finalize() =
-        server.Close()
+        stream.Close()
+
+    // NOTE: shared memory transport is chosen via VSHARP_CONCOLIC_TRANSPORT=shm, socket is used by default
+    static member DefaultTransport =
+        let requested = Environment.GetEnvironmentVariable("VSHARP_CONCOLIC_TRANSPORT")
+        if not (String.IsNullOrEmpty Communicator.ReplayLog) then ReplayTransport
+        elif requested = "shm" && RuntimeInformation.IsOSPlatform(OSPlatform.Linux) then SharedMemoryTransport
+        else SocketTransport
+
+    // NOTE: traffic, recorded via VSHARP_CONCOLIC_RECORD or CONCOLIC_RECORD, is replayed via VSHARP_CONCOLIC_REPLAY=<path>
+    static member ReplayLog = Environment.GetEnvironmentVariable("VSHARP_CONCOLIC_REPLAY")
+
+    // NOTE: other framing can be forced via VSHARP_CONCOLIC_FRAMING=confirmed|streamed
+    static member DefaultFraming =
+        match Environment.GetEnvironmentVariable("VSHARP_CONCOLIC_FRAMING") with
+        | "confirmed" -> framingMode.ConfirmedFraming
+        | "streamed" -> framingMode.StreamedFraming
+        | _ -> framingMode.MultiplexedFraming
+
+    // NOTE: flow control is disabled unless VSHARP_CONCOLIC_CREDIT_WINDOW is set to positive amount of frames
+    static member DefaultCreditWindow =
+        match Int32.TryParse(Environment.GetEnvironmentVariable("VSHARP_CONCOLIC_CREDIT_WINDOW")) with
+        | true, window when window > 0 -> window
+        | _ -> 0
+
+    // NOTE: fixed encoding of exec commands can be forced via VSHARP_CONCOLIC_ENCODING=fixed
+    static member DefaultEncoding =
+        if Environment.GetEnvironmentVariable("VSHARP_CONCOLIC_ENCODING") = "fixed" then wireEncoding.FixedEncoding
+        else wireEncoding.CompactEncodingV1
+
+    // NOTE: batch instrumentation of the main module can be disabled via VSHARP_CONCOLIC_MODULE_BATCH=off,
+    //       direct reads of the client memory can be disabled via VSHARP_CONCOLIC_REMOTE_MEMORY=off,
+    //       deferred execution of straight-line symbolic operations can be disabled via VSHARP_CONCOLIC_DEFERRED=off,
+    //       instrumentation of all methods, jitted after main, can be restored via VSHARP_CONCOLIC_SCOPE=off,
+    //       signature tokens can be sent with every method body via VSHARP_CONCOLIC_MODULE_TOKENS=off,
+    //       probes can be called via P/Invoke methods, defined in each module, via VSHARP_CONCOLIC_PROBE_METHODS=on,
+    //       GC transitions of leaf probes can be restored via VSHARP_CONCOLIC_LEAF_PROBES=off
+    static member DefaultFeatures =
+        let moduleBatch =
+            if Environment.GetEnvironmentVariable("VSHARP_CONCOLIC_MODULE_BATCH") = "off" then protocolFeature.NoFeatures
+            else protocolFeature.ModuleBatchFeature
+        let remoteMemory =
+            if Environment.GetEnvironmentVariable("VSHARP_CONCOLIC_REMOTE_MEMORY") = "off" || not RemoteMemoryReader.IsSupported then protocolFeature.NoFeatures
+            else protocolFeature.RemoteMemoryFeature
+        let deferredExecution =
+            if Environment.GetEnvironmentVariable("VSHARP_CONCOLIC_DEFERRED") = "off" then protocolFeature.NoFeatures
+            else protocolFeature.DeferredExecutionFeature
+        let instrumentationScope =
+            if Environment.GetEnvironmentVariable("VSHARP_CONCOLIC_SCOPE") = "off" then protocolFeature.NoFeatures
+            else protocolFeature.InstrumentationScopeFeature
+        let moduleTokens =
+            if Environment.GetEnvironmentVariable("VSHARP_CONCOLIC_MODULE_TOKENS") = "off" then protocolFeature.NoFeatures
+            else protocolFeature.ModuleTokensFeature
+        let probeMethods =
+            if Environment.GetEnvironmentVariable("VSHARP_CONCOLIC_PROBE_METHODS") = "on" then protocolFeature.ProbeMethodsFeature
+            else protocolFeature.NoFeatures
+        let leafProbes =
+            if Environment.GetEnvironmentVariable("VSHARP_CONCOLIC_LEAF_PROBES") = "off" then protocolFeature.NoFeatures
+            else protocolFeature.LeafProbesFeature
+        moduleBatch ||| remoteMemory ||| deferredExecution ||| instrumentationScope ||| moduleTokens ||| probeMethods ||| leafProbes
+
+    member x.Supports (feature : protocolFeature) = features &&& feature = feature
+
+    member x.ReportError (message : string) =
+        if framing <> framingMode.ConfirmedFraming then
+            try writeFrame (int controlFrame.ErrorFrame) (Encoding.ASCII.GetBytes message)
+            with :? IOException as e -> reportError e |> ignore
 
     member private x.Deserialize<'a> (bytes : byte array, startIndex : int) =
         let result = Reflection.createObject typeof<'a> :?> 'a
@@ -228,6 +556,12 @@ type Communicator(pipeFile) =
             | ReadMethodBody -> readMethodBodyByte
         Array.singleton byte
 
+    // NOTE: the shared memory transport can not notice a crashed client otherwise, as it never closes the segment
+    member x.WatchClient (client : System.Diagnostics.Process) =
+        match channel with
+        | :? SharedMemoryStream as shm -> shm.Client <- client
+        | _ -> ()
+
     member x.Connect() =
         try
             waitClient()
@@ -243,6 +577,8 @@ type Communicator(pipeFile) =
 
     member x.ReadProbes() = x.ReadStructure<probes>()
 
+    member x.ReadRemoteMemoryLayout() = x.ReadStructure<remoteMemoryLayout>()
+
     member x.SendEntryPoint (moduleName : string) (metadataToken : int) =
         let moduleNameBytes = Encoding.Unicode.GetBytes moduleName
         let moduleSize = BitConverter.GetBytes moduleName.Length
@@ -250,6 +586,14 @@ type Communicator(pipeFile) =
         let methodDef = BitConverter.GetBytes metadataToken
         Array.concat [moduleSize; methodDef; moduleNameBytes] |> writeBuffer
 
+    // NOTE: each module is sent with the bitmap of row ids of its methods to instrument, whole modules are sent without bitmaps
+    member x.SendInstrumentationScope (modules : (string * bool * byte[]) seq) =
+        let moduleBytes (name : string, whole : bool, bitmap : byte[]) =
+            let header = [|name.Length; (if whole then 1 else 0); bitmap.Length|] |> Array.collect BitConverter.GetBytes
+            Array.concat [header; Encoding.Unicode.GetBytes name; bitmap]
+        let modules = Array.ofSeq modules
+        Array.append (BitConverter.GetBytes modules.Length) (Array.collect moduleBytes modules) |> writeBuffer
+
     member x.SendCommand (command : commandForConcolic) =
         let bytes = x.SerializeCommand command
         writeBuffer bytes
@@ -261,26 +605,90 @@ type Communicator(pipeFile) =
         | Some bytes -> BitConverter.ToUInt32(bytes, 0)
         | None -> unexpectedlyTerminated()
 
-    member x.ReadMethodBody() =
-        match readBuffer() with
-        | Some bytes ->
-            let propertiesBytes, rest = Array.splitAt (Marshal.SizeOf typeof<rawMethodProperties>) bytes
-            let properties = x.Deserialize<rawMethodProperties> propertiesBytes
-            let sizeOfSignatureTokens = Marshal.SizeOf typeof<signatureTokens>
-            if int properties.signatureTokensLength <> sizeOfSignatureTokens then
-                fail "Size of received signature tokens buffer mismatch the expected! Probably you've altered the client-side signatures, but forgot to alter the server-side structure (or vice-versa)"
-            let signatureTokenBytes, rest = Array.splitAt sizeOfSignatureTokens rest
-            let assemblyNameBytes, rest = Array.splitAt (int properties.assemblyNameLength) rest
-            let moduleNameBytes, rest = Array.splitAt (int properties.moduleNameLength) rest
-            let signatureTokens = x.Deserialize<signatureTokens> signatureTokenBytes
-            let assemblyName = Encoding.Unicode.GetString(assemblyNameBytes)
-            let moduleName = Encoding.Unicode.GetString(moduleNameBytes)
-            let ilBytes, ehBytes  = Array.splitAt (int properties.ilCodeSize) rest
-            let ehSize = Marshal.SizeOf typeof<rawExceptionHandler>
-            let ehCount = Array.length ehBytes / ehSize
-            let ehs = Array.init ehCount (fun i -> x.Deserialize<rawExceptionHandler>(ehBytes, i * ehSize))
-            {properties = properties; tokens = signatureTokens; assembly = assemblyName; moduleName = moduleName; il = ilBytes; ehs = ehs}
-        | None -> unexpectedlyTerminated()
+    // NOTE: [tokens] or, if ModuleTokensFeature is negotiated, [module id | tokens], where tokens of known modules are omitted;
+    //       tokens are sections of one token per probe, in the order of 'probes' fields: signatures of probes, generated by
+    //       the client from their declarations, then P/Invoke methods of probes, if ProbeMethodsFeature is negotiated,
+    //       and signatures of leaf probes, if LeafProbesFeature is negotiated; nil tokens mark undefined ones
+    member private x.ReadSignatureTokens(bytes : byte[], offset : int, length : int) =
+        let probesCount = Marshal.SizeOf typeof<probes> / sizeof<uint64>
+        let mismatch () =
+            fail "Size of received signature tokens buffer mismatch the expected! Probably you've altered the client-side probes, but forgot to alter the server-side structure (or vice-versa)"
+        let sizeOfProbeTokens = probesCount * sizeof<uint32>
+        let readTokens offset length =
+            let sections = [protocolFeature.ProbeMethodsFeature; protocolFeature.LeafProbesFeature] |> List.filter x.Supports
+            if length <> (1 + List.length sections) * sizeOfProbeTokens then mismatch ()
+            let readSection index =
+                let sectionOffset = offset + index * sizeOfProbeTokens
+                Array.init probesCount (fun i -> BitConverter.ToUInt32(bytes, sectionOffset + i * sizeof<uint32>))
+            let readFeatureSection feature =
+                match List.tryFindIndex ((=) feature) sections with
+                | Some index -> readSection (index + 1)
+                | None -> Array.empty
+            let probeSignatures = readSection 0
+            let probeMethods = readFeatureSection protocolFeature.ProbeMethodsFeature
+            let leafSignatures = readFeatureSection protocolFeature.LeafProbesFeature
+            probeSignatures, probeMethods, leafSignatures
+        if x.Supports protocolFeature.ModuleTokensFeature then
+            let moduleId = BitConverter.ToUInt64(bytes, offset)
+            if length = sizeof<uint64> then
+                let tokens = ref Unchecked.defaultof<uint32 array * uint32 array * uint32 array>
+                if not <| moduleTokens.TryGetValue(moduleId, tokens) then
+                    fail "Communication with CLR: signature tokens of module %x were not received" moduleId
+                tokens.Value
+            elif length >= sizeof<uint64> + sizeOfProbeTokens then
+                let tokens = readTokens (offset + sizeof<uint64>) (length - sizeof<uint64>)
+                moduleTokens.[moduleId] <- tokens
+                tokens
+            else mismatch ()
+        elif length < sizeOfProbeTokens then mismatch ()
+        else readTokens offset length
+
+    member x.ReadMethodBody (bytes : byte[]) =
+        let propertiesBytes, rest = Array.splitAt (Marshal.SizeOf typeof<rawMethodProperties>) bytes
+        let properties = x.Deserialize<rawMethodProperties> propertiesBytes
+        let probeSignatures, probeMethods, leafSignatures = x.ReadSignatureTokens(bytes, propertiesBytes.Length, int properties.signatureTokensLength)
+        let _, rest = Array.splitAt (int properties.signatureTokensLength) rest
+        let assemblyNameBytes, rest = Array.splitAt (int properties.assemblyNameLength) rest
+        let moduleNameBytes, rest = Array.splitAt (int properties.moduleNameLength) rest
+        let assemblyName = Encoding.Unicode.GetString(assemblyNameBytes)
+        let moduleName = Encoding.Unicode.GetString(moduleNameBytes)
+        let ilBytes, ehBytes  = Array.splitAt (int properties.ilCodeSize) rest
+        let ehSize = Marshal.SizeOf typeof<rawExceptionHandler>
+        let ehCount = Array.length ehBytes / ehSize
+        let ehs = Array.init ehCount (fun i -> x.Deserialize<rawExceptionHandler>(ehBytes, i * ehSize))
+        {properties = properties; probeSignatures = probeSignatures; probeMethods = probeMethods; leafSignatures = leafSignatures; assembly = assemblyName; moduleName = moduleName; il = ilBytes; ehs = ehs}
+
+    member x.ReadModuleBodies (bytes : byte[]) =
+        let header i = BitConverter.ToUInt32(bytes, i * sizeof<uint32>)
+        let methodsCount = int (header 0)
+        let firstStringIndex = header 1
+        let assemblyNameLength = header 2
+        let moduleNameLength = header 3
+        let signatureTokensLength = header 4
+        let mutable offset = 5 * sizeof<uint32>
+        let probeSignatures, probeMethods, leafSignatures = x.ReadSignatureTokens(bytes, offset, int signatureTokensLength)
+        offset <- offset + int signatureTokensLength
+        let assemblyName = Encoding.Unicode.GetString(bytes, offset, int assemblyNameLength)
+        offset <- offset + int assemblyNameLength
+        let moduleName = Encoding.Unicode.GetString(bytes, offset, int moduleNameLength)
+        offset <- offset + int moduleNameLength
+        let ehSize = Marshal.SizeOf typeof<rawExceptionHandler>
+        let bodies = Array.init methodsCount (fun _ ->
+            let token = BitConverter.ToUInt32(bytes, offset)
+            let codeLength = BitConverter.ToUInt32(bytes, offset + sizeof<uint32>)
+            let maxStackSize = BitConverter.ToUInt32(bytes, offset + 2 * sizeof<uint32>)
+            let ehsLength = BitConverter.ToInt32(bytes, offset + 3 * sizeof<uint32>)
+            offset <- offset + 4 * sizeof<uint32>
+            let il = Array.sub bytes offset (int codeLength)
+            offset <- offset + int codeLength
+            let ehs = Array.init (ehsLength / ehSize) (fun i -> x.Deserialize<rawExceptionHandler>(bytes, offset + i * ehSize))
+            offset <- offset + ehsLength
+            let properties = { token = token; ilCodeSize = codeLength; assemblyNameLength = assemblyNameLength; moduleNameLength = moduleNameLength
+                               maxStackSize = maxStackSize; signatureTokensLength = signatureTokensLength }
+            {properties = properties; probeSignatures = probeSignatures; probeMethods = probeMethods; leafSignatures = leafSignatures; assembly = assemblyName; moduleName = moduleName; il = il; ehs = ehs})
+        if offset <> bytes.Length then
+            fail "Communication with CLR: module batch has %d unexpected bytes" (bytes.Length - offset)
+        {firstStringIndex = firstStringIndex; bodies = bodies}
 
     member private x.ToUIntPtr =
         if IntPtr.Size = 4 then fun (bytes : byte[]) index -> BitConverter.ToUInt32(bytes, index) |> UIntPtr
@@ -304,9 +712,101 @@ type Communicator(pipeFile) =
         | CorElementType.ELEMENT_TYPE_U       -> Some(typeof<UIntPtr>)
         | _ -> None
 
-    member x.ReadExecuteCommand() =
-        match readBuffer() with
-        | Some bytes ->
+    member private x.ReadExecuteCommandTypes(staticPart : execCommandStatic, newCallStackFrames, evaluationStackPushes, newAddresses, deletedAddresses, dynamicBytes : byte[], offset : int) =
+        let mutable offset = offset
+        // TODO: 2Misha what's with these sizes?
+//        let newAddressesTypesLengths = Array.init (int staticPart.newAddressesCount) (fun _ ->
+//            let res = BitConverter.ToUInt64(dynamicBytes, offset) in offset <- offset + sizeof<uint64>; res)
+        let newAddressesTypes = Array.init (int staticPart.newAddressesCount) (fun _ (*i*) ->
+//            let size = int newAddressesTypesLengths.[i]
+            let rec readType () =
+                let isValid = BitConverter.ToBoolean(dynamicBytes, offset)
+                offset <- offset + sizeof<bool>
+                if isValid then
+                    let isArray = BitConverter.ToBoolean(dynamicBytes, offset)
+                    offset <- offset + sizeof<bool>
+                    if isArray then
+                        let corElementType = Microsoft.FSharp.Core.LanguagePrimitives.EnumOfValue<byte, CorElementType>(dynamicBytes.[offset])
+                        offset <- offset + sizeof<byte>
+                        let rank = BitConverter.ToInt32(dynamicBytes, offset)
+                        offset <- offset + sizeof<int32>
+                        match x.corElementTypeToType corElementType with
+                        | Some t -> t.MakeArrayType(rank)
+                        | None ->
+                            let t : Type = readType()
+                            t.MakeArrayType(rank)
+                    else
+                        let token = BitConverter.ToInt32(dynamicBytes, offset)
+                        offset <- offset + sizeof<int>
+                        let assemblySize = BitConverter.ToInt32(dynamicBytes, offset)
+                        offset <- offset + sizeof<int>
+                        // NOTE: truncating null terminator
+                        let assemblyBytes = dynamicBytes.[offset .. offset + assemblySize - 3]
+                        offset <- offset + assemblySize
+                        let assemblyName = Encoding.Unicode.GetString(assemblyBytes)
+                        let assembly = Reflection.loadAssembly assemblyName
+                        let moduleSize = BitConverter.ToInt32(dynamicBytes, offset)
+                        offset <- offset + sizeof<int>
+                        let moduleBytes = dynamicBytes.[offset .. offset + moduleSize - 1]
+                        offset <- offset + moduleSize
+                        let moduleName = Encoding.Unicode.GetString(moduleBytes) |> Path.GetFileName
+                        let typeModule = Reflection.resolveModuleFromAssembly assembly moduleName
+                        let typeArgsCount = BitConverter.ToInt32(dynamicBytes, offset)
+                        offset <- offset + sizeof<int>
+                        let typeArgs = Array.init typeArgsCount (fun _ -> readType())
+                        let resultType = Reflection.resolveTypeFromModule typeModule token
+                        if Array.isEmpty typeArgs then resultType else resultType.MakeGenericType(typeArgs)
+                else typeof<Void>
+            readType())
+        { offset = staticPart.offset
+          isBranch = staticPart.isBranch
+          callStackFramesPops = staticPart.callStackFramesPops
+          evaluationStackPops = staticPart.evaluationStackPops
+          newCallStackFrames = newCallStackFrames
+          evaluationStackPushes = evaluationStackPushes
+          newAddresses = newAddresses
+          newAddressesTypes = newAddressesTypes
+          deletedAddresses = deletedAddresses }
+
+    member private x.ReadCompactExecuteCommandPrefix (bytes : byte[]) =
+        let reader = compactReader(bytes, 0)
+        // NOTE: i-th bit of the mask is set iff i-th header field is non-zero
+        let mask = reader.ReadByte()
+        let header = Array.init 8 (fun i -> if mask &&& (1uy <<< i) <> 0uy then uint32 (reader.ReadVarUInt()) else 0u)
+        let staticPart : execCommandStatic =
+            { offset = header.[0]
+              isBranch = header.[1]
+              newCallStackFramesCount = header.[2]
+              callStackFramesPops = header.[3]
+              evaluationStackPushesCount = header.[4]
+              evaluationStackPops = header.[5]
+              newAddressesCount = header.[6]
+              deletedAddressesCount = header.[7] }
+        let newCallStackFrames = Array.init (int staticPart.newCallStackFramesCount) (fun _ -> reader.ReadVarUInt() |> int32)
+        let evaluationStackPushes = Array.init (int staticPart.evaluationStackPushesCount) (fun _ ->
+            let evalStackArgType : evalStackArgType = reader.ReadByte() |> int |> LanguagePrimitives.EnumOfValue
+            match evalStackArgType with
+            | evalStackArgType.OpRef ->
+                let baseAddr = reader.ReadVarUInt()
+                let shift = reader.ReadVarUInt()
+                PointerOp(baseAddr, shift)
+            | evalStackArgType.OpR4
+            | evalStackArgType.OpR8 -> NumericOp(evalStackArgType, reader.ReadInt64())
+            | evalStackArgType.OpSymbolic
+            | evalStackArgType.OpI4
+            | evalStackArgType.OpI8 -> NumericOp(evalStackArgType, reader.ReadVarInt())
+            | _ -> internalfailf "unexpected evaluation stack argument type %O" evalStackArgType)
+        let newAddresses = Array.init (int staticPart.newAddressesCount) (fun _ -> reader.ReadVarUInt() |> UIntPtr)
+        // NOTE: lengths of types are not used, types are self-describing
+        for _ in 1 .. int staticPart.newAddressesCount do reader.ReadVarUInt() |> ignore
+        let deletedAddresses = Array.init (int staticPart.deletedAddressesCount) (fun _ -> reader.ReadVarUInt() |> UIntPtr)
+        staticPart, newCallStackFrames, evaluationStackPushes, newAddresses, deletedAddresses, reader.Position
+
+    member private x.ParseExecuteCommand (bytes : byte[]) =
+        if encoding = wireEncoding.CompactEncodingV1 then
+            let staticPart, newCallStackFrames, evaluationStackPushes, newAddresses, deletedAddresses, offset = x.ReadCompactExecuteCommandPrefix bytes
+            x.ReadExecuteCommandTypes(staticPart, newCallStackFrames, evaluationStackPushes, newAddresses, deletedAddresses, bytes, offset)
+        else
             let staticSize = Marshal.SizeOf typeof<execCommandStatic>
             let staticBytes, dynamicBytes = Array.splitAt staticSize bytes
             let staticPart = x.Deserialize<execCommandStatic> staticBytes
@@ -336,59 +836,20 @@ type Communicator(pipeFile) =
                 | _ -> internalfailf "unexpected evaluation stack argument type %O" evalStackArgType)
             let newAddresses = Array.init (int staticPart.newAddressesCount) (fun _ ->
                 let res = x.ToUIntPtr dynamicBytes offset in offset <- offset + IntPtr.Size; res)
-            // TODO: 2Misha what's with these sizes?
-//            let newAddressesTypesLengths = Array.init (int staticPart.newAddressesCount) (fun _ ->
-//                let res = BitConverter.ToUInt64(dynamicBytes, offset) in offset <- offset + sizeof<uint64>; res)
-            let newAddressesTypes = Array.init (int staticPart.newAddressesCount) (fun _ (*i*) ->
-//                let size = int newAddressesTypesLengths.[i]
-                let rec readType () =
-                    let isValid = BitConverter.ToBoolean(dynamicBytes, offset)
-                    offset <- offset + sizeof<bool>
-                    if isValid then
-                        let isArray = BitConverter.ToBoolean(dynamicBytes, offset)
-                        offset <- offset + sizeof<bool>
-                        if isArray then
-                            let corElementType = Microsoft.FSharp.Core.LanguagePrimitives.EnumOfValue<byte, CorElementType>(dynamicBytes.[offset])
-                            offset <- offset + sizeof<byte>
-                            let rank = BitConverter.ToInt32(dynamicBytes, offset)
-                            offset <- offset + sizeof<int32>
-                            match x.corElementTypeToType corElementType with
-                            | Some t -> t.MakeArrayType(rank)
-                            | None ->
-                                let t : Type = readType()
-                                t.MakeArrayType(rank)
-                        else
-                            let token = BitConverter.ToInt32(dynamicBytes, offset)
-                            offset <- offset + sizeof<int>
-                            let assemblySize = BitConverter.ToInt32(dynamicBytes, offset)
-                            offset <- offset + sizeof<int>
-                            // NOTE: truncating null terminator
-                            let assemblyBytes = dynamicBytes.[offset .. offset + assemblySize - 3]
-                            offset <- offset + assemblySize
-                            let assemblyName = Encoding.Unicode.GetString(assemblyBytes)
-                            let assembly = Reflection.loadAssembly assemblyName
-                            let moduleSize = BitConverter.ToInt32(dynamicBytes, offset)
-                            offset <- offset + sizeof<int>
-                            let moduleBytes = dynamicBytes.[offset .. offset + moduleSize - 1]
-                            offset <- offset + moduleSize
-                            let moduleName = Encoding.Unicode.GetString(moduleBytes) |> Path.GetFileName
-                            let typeModule = Reflection.resolveModuleFromAssembly assembly moduleName
-                            let typeArgsCount = BitConverter.ToInt32(dynamicBytes, offset)
-                            offset <- offset + sizeof<int>
-                            let typeArgs = Array.init typeArgsCount (fun _ -> readType())
-                            let resultType = Reflection.resolveTypeFromModule typeModule token
-                            if Array.isEmpty typeArgs then resultType else resultType.MakeGenericType(typeArgs)
-                    else typeof<Void>
-                readType())
-            { offset = staticPart.offset
-              isBranch = staticPart.isBranch
-              callStackFramesPops = staticPart.callStackFramesPops
-              evaluationStackPops = staticPart.evaluationStackPops
-              newCallStackFrames = newCallStackFrames
-              evaluationStackPushes = evaluationStackPushes
-              newAddresses = newAddresses
-              newAddressesTypes = newAddressesTypes }
-        | None -> unexpectedlyTerminated()
+            let deletedAddresses = Array.init (int staticPart.deletedAddressesCount) (fun _ ->
+                let res = x.ToUIntPtr dynamicBytes offset in offset <- offset + IntPtr.Size; res)
+            x.ReadExecuteCommandTypes(staticPart, newCallStackFrames, evaluationStackPushes, newAddresses, deletedAddresses, dynamicBytes, offset)
+
+    // NOTE: [ count | length of command 1 | command 1 | ... ], each command is encoded as standalone one
+    member x.ReadDeferredExecuteCommands (bytes : byte[]) =
+        let count = BitConverter.ToUInt32(bytes, 0)
+        let mutable offset = sizeof<uint32>
+        Array.init (int count) (fun _ ->
+            let length = BitConverter.ToInt32(bytes, offset)
+            offset <- offset + sizeof<int32>
+            let command = x.ParseExecuteCommand bytes.[offset .. offset + length - 1]
+            offset <- offset + length
+            command)
 
     member private x.SizeOfConcrete (typ : Type) =
         if Types.IsValueType typ then sizeof<int> + sizeof<int64>
@@ -490,18 +951,41 @@ type Communicator(pipeFile) =
         Logger.trace "Sending method body! Total %d bytes" message.Length
         writeBuffer message
 
+    // NOTE: strings of debug probes go first, client allocates them in order, so they get the indices, which were given to them
+    member x.SendModuleBodies (strings : string seq) (bodies : (uint32 * instrumentedMethodBody) array) =
+        let ehSize = Marshal.SizeOf typeof<rawExceptionHandler>
+        let header = Array.concat [BitConverter.GetBytes(uint32 bodies.Length); BitConverter.GetBytes(uint32 (Seq.length strings))]
+        let stringBytes = strings |> Seq.map (fun str -> Encoding.ASCII.GetBytes(str + Char.MinValue.ToString())) |> Array.concat
+        let bodyBytes = bodies |> Array.map (fun (token, mb) ->
+            let ehBytes : byte[] = Array.zeroCreate (ehSize * mb.ehs.Length)
+            Array.iteri (fun i eh -> x.Serialize<rawExceptionHandler>(eh, ehBytes, i * ehSize)) mb.ehs
+            let methodHeader = Array.concat [BitConverter.GetBytes token; BitConverter.GetBytes mb.properties.ilCodeSize; BitConverter.GetBytes mb.properties.maxStackSize; BitConverter.GetBytes ehBytes.Length]
+            Array.concat [methodHeader; mb.il; ehBytes])
+        let message = Array.concat (Seq.append [header; stringBytes] bodyBytes)
+        Logger.trace "Sending %d instrumented method bodies of the module! Total %d bytes" bodies.Length message.Length
+        writeBuffer message
+
     member x.ReadCommand() =
-        match readBuffer() with
+        match readRequest() with
         | Some bytes ->
-            if bytes.Length <> 1 then fail "Invalid command number!"
+            // NOTE: command byte is followed by the payload of the command in the same frame
+            if bytes.Length = 0 then fail "Invalid command number!"
+            let payload () = Array.sub bytes 1 (bytes.Length - 1)
             match bytes.[0] with
             | b when b = instrumentCommandByte ->
-                x.ReadMethodBody() |> Instrument
+                x.ReadMethodBody(payload()) |> Instrument
+            | b when b = instrumentModuleCommandByte ->
+                x.ReadModuleBodies(payload()) |> InstrumentModule
             | b when b = executeCommandByte ->
-                x.ReadExecuteCommand() |> ExecuteInstruction
-            | b -> fail "Unexpected command %d from client machine!" b
+                x.ParseExecuteCommand(payload()) |> ExecuteInstruction
+            | b when b = executeDeferredCommandByte ->
+                x.ReadDeferredExecuteCommands(payload()) |> ExecuteDeferredInstructions
+            | b when b = mainReachedCommandByte -> MainReached
+            | b ->
+                x.ReportError (sprintf "Unexpected command %d" b)
+                fail "Unexpected command %d from client machine!" b
         | None -> Terminate
 
     interface IDisposable with
         member x.Dispose() =
-            server.Dispose()
+            stream.Dispose()
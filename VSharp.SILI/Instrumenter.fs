@@ -6,17 +6,40 @@ open System.Reflection.Emit
 open System.Collections.Generic
 open VSharp.Interpreter.IL
 
-type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes : probes) =
+// NOTE: 'internString' allocates strings of debug probes in the pool of the client
+type Instrumenter(internString : string -> uint32, entryPoint : MethodBase, probes : probes) =
     // TODO: should we consider executed assembly build options here?
     let ldc_i : opcode = (if System.Environment.Is64BitOperatingSystem then OpCodes.Ldc_I8 else OpCodes.Ldc_I4) |> VSharp.OpCode
+    // NOTE: indices of probes by their addresses, by which P/Invoke methods of probes are found
+    let probeIndices =
+        let result = Dictionary<uint64, int>()
+        probes.Addresses |> Array.iteri (fun i address -> result.[address] <- i)
+        result
     static member private instrumentedFunctions = HashSet<MethodBase>()
-    [<DefaultValue>] val mutable tokens : signatureTokens
+    [<DefaultValue>] val mutable probeSignatures : uint32 array
+    [<DefaultValue>] val mutable probeMethods : uint32 array
+    [<DefaultValue>] val mutable leafSignatures : uint32 array
     [<DefaultValue>] val mutable rewriter : ILRewriter
     [<DefaultValue>] val mutable m : MethodBase
 
-    member private x.MkCalli(instr : ilInstr byref, signature : uint32) =
-        instr <- x.rewriter.NewInstr OpCodes.Calli
-        instr.arg <- Arg32 (int32 signature)
+    // NOTE: probes are called either by addresses (ldc.i8 <address>; calli <signature>) or, if the client has defined
+    //       P/Invoke methods of probes in the module, by tokens of these methods (call <token>); leaf probes are called
+    //       by the signature, which suppresses the GC transition, if the client has defined it; all signatures are
+    //       generated by the client from declarations of probes, so they are found by the index of the probe
+    member private x.ProbeCall(methodAddress : uint64) =
+        let index = ref 0
+        if not <| probeIndices.TryGetValue(methodAddress, index) then internalfailf "Unknown probe address %x" methodAddress
+        let probeToken (tokens : uint32 array) =
+            if index.Value < tokens.Length && tokens.[index.Value] <> 0u then Some tokens.[index.Value]
+            else None
+        match probeToken x.probeMethods, probeToken x.leafSignatures, probeToken x.probeSignatures with
+        | Some methodToken, _, _ -> [(VSharp.OpCode OpCodes.Call, Arg32 (int32 methodToken))]
+        | None, Some leafSignature, _ -> [(ldc_i, Arg64 (int64 methodAddress)); (VSharp.OpCode OpCodes.Calli, Arg32 (int32 leafSignature))]
+        | None, None, Some signature -> [(ldc_i, Arg64 (int64 methodAddress)); (VSharp.OpCode OpCodes.Calli, Arg32 (int32 signature))]
+        | None, None, None -> internalfailf "No signature of probe %x in the module" methodAddress
+
+    member private x.ProbeInstrs(methodAddress : uint64, args : (OpCode * ilInstrOperand) list) =
+        List.append (args |> List.map (fun (opcode, arg) -> VSharp.OpCode opcode, arg)) (x.ProbeCall methodAddress)
 
     member private x.PrependInstr(opcode, arg, beforeInstr : ilInstr byref) =
         let mutable newInstr = x.rewriter.CopyInstruction(beforeInstr)
@@ -53,103 +76,123 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
     member private x.PrependDup(beforeInstr : ilInstr byref) = x.PrependInstr(OpCodes.Dup, NoArg, &beforeInstr)
     member private x.AppendDup afterInstr = x.AppendInstr OpCodes.Dup NoArg afterInstr
 
-    member private x.PrependProbe(methodAddress : uint64, args : (OpCode * ilInstrOperand) list, signature, beforeInstr : ilInstr byref) =
+    member private x.PrependProbe(methodAddress : uint64, args : (OpCode * ilInstrOperand) list, beforeInstr : ilInstr byref) =
         let result = beforeInstr
         let mutable newInstr = x.rewriter.CopyInstruction(beforeInstr)
         x.rewriter.InsertAfter(beforeInstr, newInstr)
         swap &newInstr &beforeInstr
 
-        match args with
+        match x.ProbeInstrs(methodAddress, args) with
         | (opcode, arg)::tail ->
-            newInstr.opcode <- opcode |> VSharp.OpCode
+            newInstr.opcode <- opcode
             newInstr.arg <- arg
             for (opcode, arg) in tail do
                 let newInstr = x.rewriter.NewInstr opcode
                 newInstr.arg <- arg
                 x.rewriter.InsertBefore(beforeInstr, newInstr)
-
-            newInstr <- x.rewriter.NewInstr ldc_i
-            newInstr.arg <- Arg64 (int64 methodAddress)
-            x.rewriter.InsertBefore(beforeInstr, newInstr)
-        | [] ->
-            newInstr.opcode <- ldc_i
-            newInstr.arg <- Arg64 (int64 methodAddress)
-
-        x.MkCalli(&newInstr, signature)
-        x.rewriter.InsertBefore(beforeInstr, newInstr)
+        | [] -> __unreachable__()
         result
 
-    member private x.PrependProbeWithOffset(methodAddress : uint64, args : (OpCode * ilInstrOperand) list, signature, beforeInstr : ilInstr byref) =
-        x.PrependProbe(methodAddress, List.append args [(OpCodes.Ldc_I4, beforeInstr.offset |> int32 |> Arg32)], signature, &beforeInstr) // TODO: offset may be wrong?! #do
-
-    member private x.AppendProbe(methodAddress : uint64, args : (OpCode * ilInstrOperand) list, signature, afterInstr : ilInstr) =
-        let mutable newInstr = afterInstr
-        x.MkCalli(&newInstr, signature)
-        x.rewriter.InsertAfter(afterInstr, newInstr)
-
-        let newInstr = x.rewriter.NewInstr ldc_i
-        newInstr.arg <- Arg64 (int64 methodAddress)
-        x.rewriter.InsertAfter(afterInstr, newInstr)
+    member private x.PrependProbeWithOffset(methodAddress : uint64, args : (OpCode * ilInstrOperand) list, beforeInstr : ilInstr byref) =
+        x.PrependProbe(methodAddress, List.append args [(OpCodes.Ldc_I4, beforeInstr.offset |> int32 |> Arg32)], &beforeInstr) // TODO: offset may be wrong?! #do
 
-        for (opcode, arg) in List.rev args do
+    member private x.AppendProbe(methodAddress : uint64, args : (OpCode * ilInstrOperand) list, afterInstr : ilInstr) =
+        for (opcode, arg) in List.rev (x.ProbeInstrs(methodAddress, args)) do
             let newInstr = x.rewriter.NewInstr opcode
             newInstr.arg <- arg
             x.rewriter.InsertAfter(afterInstr, newInstr)
 
     // NOTE: offset is needed for sending concrete information from concolic to SILI
-    member private x.AppendProbeWithOffset(methodAddress : uint64, args : (OpCode * ilInstrOperand) list, signature, afterInstr : ilInstr) =
-        x.AppendProbe(methodAddress, List.append args [(OpCodes.Ldc_I4, afterInstr.offset |> int32 |> Arg32)], signature, afterInstr)
+    member private x.AppendProbeWithOffset(methodAddress : uint64, args : (OpCode * ilInstrOperand) list, afterInstr : ilInstr) =
+        x.AppendProbe(methodAddress, List.append args [(OpCodes.Ldc_I4, afterInstr.offset |> int32 |> Arg32)], afterInstr)
 
-    member private x.AppendProbeWithOffsetMemUnmem(methodAddress : uint64, args : (OpCode * ilInstrOperand) list, signature, prependTarget : ilInstr byref, afterInstr : ilInstr) =
+    member private x.AppendProbeWithOffsetMemUnmem(methodAddress : uint64, args : (OpCode * ilInstrOperand) list, prependTarget : ilInstr byref, afterInstr : ilInstr) =
         // NOTE: for interaction with SILI mem, unmem are needed
-        x.AppendProbe(methodAddress, List.append args [(OpCodes.Ldc_I4, afterInstr.offset |> int32 |> Arg32)], signature, afterInstr)
+        x.AppendProbe(methodAddress, List.append args [(OpCodes.Ldc_I4, afterInstr.offset |> int32 |> Arg32)], afterInstr)
         let t = x.TypeOfFirstStackElement afterInstr
-        let probe, token = x.PrependMemUnmemForType(t, 0, 0, &prependTarget)
-        x.PrependProbe(probe, [(OpCodes.Ldc_I4, Arg32 0)], token, &prependTarget) |> ignore
-
-    member private x.PlaceEnterProbe (firstInstr : ilInstr byref) =
+        let probe = x.PrependMemUnmemForType(t, 0, 0, &prependTarget)
+        x.PrependProbe(probe, [(OpCodes.Ldc_I4, Arg32 0)], &prependTarget) |> ignore
+
+    // NOTE: the uninstrumented clone is run instead of the instrumented body, when arguments and the heap are concrete;
+    //       the lightweight clone is run by demoted methods, which have not met symbolic values for a while;
+    //       byrefs and pointers (including 'this' of structs) may refer to symbolic locals of callers, so such methods are not cloned
+    member private x.HasConcreteClone() =
+        x.m <> entryPoint
+        && not (x.m.DeclaringType.IsValueType && Reflection.hasThis x.m)
+        && x.m.GetParameters() |> Array.forall (fun p -> not p.ParameterType.IsByRef && not p.ParameterType.IsPointer)
+
+    // NOTE: probes can not see module ids, so statistics of methods are keyed by tokens and keys of their modules
+    member private x.ModuleKey =
+        let mvid = x.m.Module.ModuleVersionId.ToByteArray()
+        Seq.init 4 (fun i -> System.BitConverter.ToInt32(mvid, 4 * i)) |> Seq.reduce (^^^)
+
+    // NOTE: the guard is inserted before the first instruction, so that branches to it do not enter the method again;
+    //       its result selects the instrumented body, the uninstrumented clone or the lightweight clone
+    member private x.PlaceGuardedEnterProbe(firstInstr : ilInstr, clone : ilInstr, lightClone : ilInstr, localsCount, argsCount) =
+        let args = [(OpCodes.Ldc_I4, Arg32 x.ModuleKey)
+                    (OpCodes.Ldc_I4, Arg32 x.m.MetadataToken)
+                    (OpCodes.Ldc_I4, x.rewriter.MaxStackSize |> int32 |> Arg32)
+                    (OpCodes.Ldc_I4, Arg32 argsCount)
+                    (OpCodes.Ldc_I4, Arg32 localsCount)]
+        for (opcode, arg) in x.ProbeInstrs(probes.enterGuarded, args) do
+            let newInstr = x.rewriter.NewInstr opcode
+            newInstr.arg <- arg
+            x.rewriter.InsertBefore(firstInstr, newInstr)
+        let targets = [firstInstr; clone; lightClone]
+        let switchInstr = x.rewriter.NewInstr OpCodes.Switch
+        switchInstr.arg <- Arg32 targets.Length
+        x.rewriter.InsertBefore(firstInstr, switchInstr)
+        for target in targets do
+            let switchArg = x.rewriter.NewInstr SwitchArg
+            switchArg.arg <- Target target
+            x.rewriter.InsertBefore(firstInstr, switchArg)
+
+    member private x.PlaceEnterProbe (firstInstr : ilInstr byref, clones : (ilInstr * ilInstr) option) =
         let localsCount =
             match x.m.GetMethodBody() with
             | null -> 0
             | mb -> mb.LocalVariables.Count
         let argsCount = x.m.GetParameters().Length
         let argsCount = if Reflection.hasThis x.m then argsCount + 1 else argsCount
-        if x.m = entryPoint then
+        match clones with
+        | Some (clone, lightClone) ->
+            x.PlaceGuardedEnterProbe(firstInstr, clone, lightClone, localsCount, argsCount)
+        | None when x.m = entryPoint ->
             let args = [(OpCodes.Ldc_I4, Arg32 x.m.MetadataToken)
                         (OpCodes.Ldc_I4, Arg32 argsCount)
 //                        (OpCodes.Ldc_I4, Arg32 1) // Arguments of entry point are concrete
                         (OpCodes.Ldc_I4, Arg32 0) // Arguments of entry point are symbolic
                         (OpCodes.Ldc_I4, x.rewriter.MaxStackSize |> int32 |> Arg32)
                         (OpCodes.Ldc_I4, Arg32 localsCount)]
-            x.PrependProbe(probes.enterMain, args, x.tokens.void_token_u2_bool_u4_u4_sig, &firstInstr)
-        else
+            x.PrependProbe(probes.enterMain, args, &firstInstr) |> ignore
+        | None ->
             let args = [(OpCodes.Ldc_I4, Arg32 x.m.MetadataToken)
                         (OpCodes.Ldc_I4, x.rewriter.MaxStackSize |> int32 |> Arg32)
                         (OpCodes.Ldc_I4, Arg32 argsCount)
                         (OpCodes.Ldc_I4, Arg32 localsCount)]
-            x.PrependProbe(probes.enter, args, x.tokens.void_token_u4_u4_u4_sig, &firstInstr)
+            x.PrependProbe(probes.enter, args, &firstInstr) |> ignore
 
     member private x.PrependMem_p(idx, order, instr : ilInstr byref) =
         x.PrependInstr(OpCodes.Conv_I, NoArg, &instr)
-        x.PrependProbe(probes.mem_p_idx, [(OpCodes.Ldc_I4, Arg32 idx); (OpCodes.Ldc_I4, Arg32 order)], x.tokens.void_i_i1_i1_sig, &instr) |> ignore
+        x.PrependProbe(probes.mem_p_idx, [(OpCodes.Ldc_I4, Arg32 idx); (OpCodes.Ldc_I4, Arg32 order)], &instr) |> ignore
 
     member private x.PrependMem_i1(idx, order, instr : ilInstr byref) =
-        x.PrependProbe(probes.mem_1_idx, [(OpCodes.Ldc_I4, Arg32 idx); (OpCodes.Ldc_I4, Arg32 order)], x.tokens.void_i1_i1_i1_sig, &instr) |> ignore
+        x.PrependProbe(probes.mem_1_idx, [(OpCodes.Ldc_I4, Arg32 idx); (OpCodes.Ldc_I4, Arg32 order)], &instr) |> ignore
 
     member private x.PrependMem_i2(idx, order, instr : ilInstr byref) =
-        x.PrependProbe(probes.mem_2_idx, [(OpCodes.Ldc_I4, Arg32 idx); (OpCodes.Ldc_I4, Arg32 order)], x.tokens.void_i2_i1_i1_sig, &instr) |> ignore
+        x.PrependProbe(probes.mem_2_idx, [(OpCodes.Ldc_I4, Arg32 idx); (OpCodes.Ldc_I4, Arg32 order)], &instr) |> ignore
 
     member private x.PrependMem_i4(idx, order, instr : ilInstr byref) =
-        x.PrependProbe(probes.mem_4_idx, [(OpCodes.Ldc_I4, Arg32 idx); (OpCodes.Ldc_I4, Arg32 order)], x.tokens.void_i4_i1_i1_sig, &instr) |> ignore
+        x.PrependProbe(probes.mem_4_idx, [(OpCodes.Ldc_I4, Arg32 idx); (OpCodes.Ldc_I4, Arg32 order)], &instr) |> ignore
 
     member private x.PrependMem_i8(idx, order, instr : ilInstr byref) =
-        x.PrependProbe(probes.mem_8_idx, [(OpCodes.Ldc_I4, Arg32 idx); (OpCodes.Ldc_I4, Arg32 order)], x.tokens.void_i8_i1_i1_sig, &instr) |> ignore
+        x.PrependProbe(probes.mem_8_idx, [(OpCodes.Ldc_I4, Arg32 idx); (OpCodes.Ldc_I4, Arg32 order)], &instr) |> ignore
 
     member private x.PrependMem_f4(idx, order, instr : ilInstr byref) =
-        x.PrependProbe(probes.mem_f4_idx, [(OpCodes.Ldc_I4, Arg32 idx); (OpCodes.Ldc_I4, Arg32 order)], x.tokens.void_r4_i1_i1_sig, &instr) |> ignore
+        x.PrependProbe(probes.mem_f4_idx, [(OpCodes.Ldc_I4, Arg32 idx); (OpCodes.Ldc_I4, Arg32 order)], &instr) |> ignore
 
     member private x.PrependMem_f8(idx, order, instr : ilInstr byref) =
-        x.PrependProbe(probes.mem_f8_idx, [(OpCodes.Ldc_I4, Arg32 idx); (OpCodes.Ldc_I4, Arg32 order)], x.tokens.void_r8_i1_i1_sig, &instr) |> ignore
+        x.PrependProbe(probes.mem_f8_idx, [(OpCodes.Ldc_I4, Arg32 idx); (OpCodes.Ldc_I4, Arg32 order)], &instr) |> ignore
 
     member private x.PrependMem2_p (instr : ilInstr byref) =
         x.PrependMem_p(1, 0, &instr)
@@ -206,44 +249,44 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
     member private x.PrependValidLeaveMain(instr : ilInstr byref) =
         match instr.stackState with
         | _ when Reflection.hasNonVoidResult x.m |> not ->
-            x.PrependProbeWithOffset(probes.leaveMain_0, [], x.tokens.void_offset_sig, &instr) |> ignore
+            x.PrependProbeWithOffset(probes.leaveMain_0, [], &instr) |> ignore
         | Some (evaluationStackCellType.I1 :: _)
         | Some (evaluationStackCellType.I2 :: _)
         | Some (evaluationStackCellType.I4 :: _) ->
             x.PrependMem_i4(0, 0, &instr)
-            x.PrependProbe(probes.unmem_4, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i4_i1_sig, &instr) |> ignore
-            x.PrependProbeWithOffset(probes.leaveMain_4, [], x.tokens.void_i4_offset_sig, &instr) |> ignore
-            x.PrependProbe(probes.unmem_4, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i4_i1_sig, &instr) |> ignore
+            x.PrependProbe(probes.unmem_4, [(OpCodes.Ldc_I4, Arg32 0)], &instr) |> ignore
+            x.PrependProbeWithOffset(probes.leaveMain_4, [], &instr) |> ignore
+            x.PrependProbe(probes.unmem_4, [(OpCodes.Ldc_I4, Arg32 0)], &instr) |> ignore
         | Some (evaluationStackCellType.I8 :: _) ->
             x.PrependMem_i8(0, 0, &instr)
-            x.PrependProbe(probes.unmem_8, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i8_i1_sig, &instr) |> ignore
-            x.PrependProbeWithOffset(probes.leaveMain_8, [], x.tokens.void_i8_offset_sig, &instr) |> ignore
-            x.PrependProbe(probes.unmem_8, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i8_i1_sig, &instr) |> ignore
+            x.PrependProbe(probes.unmem_8, [(OpCodes.Ldc_I4, Arg32 0)], &instr) |> ignore
+            x.PrependProbeWithOffset(probes.leaveMain_8, [], &instr) |> ignore
+            x.PrependProbe(probes.unmem_8, [(OpCodes.Ldc_I4, Arg32 0)], &instr) |> ignore
         | Some (evaluationStackCellType.R4 :: _) ->
             x.PrependMem_f4(0, 0, &instr)
-            x.PrependProbe(probes.unmem_f4, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.r4_i1_sig, &instr) |> ignore
-            x.PrependProbeWithOffset(probes.leaveMain_f4, [], x.tokens.void_r4_offset_sig, &instr) |> ignore
-            x.PrependProbe(probes.unmem_f4, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.r4_i1_sig, &instr) |> ignore
+            x.PrependProbe(probes.unmem_f4, [(OpCodes.Ldc_I4, Arg32 0)], &instr) |> ignore
+            x.PrependProbeWithOffset(probes.leaveMain_f4, [], &instr) |> ignore
+            x.PrependProbe(probes.unmem_f4, [(OpCodes.Ldc_I4, Arg32 0)], &instr) |> ignore
         | Some (evaluationStackCellType.R8 :: _) ->
             x.PrependMem_f8(0, 0, &instr)
-            x.PrependProbe(probes.unmem_f8, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.r8_i1_sig, &instr) |> ignore
-            x.PrependProbeWithOffset(probes.leaveMain_f8, [], x.tokens.void_r8_offset_sig, &instr) |> ignore
-            x.PrependProbe(probes.unmem_f8, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.r8_i1_sig, &instr) |> ignore
+            x.PrependProbe(probes.unmem_f8, [(OpCodes.Ldc_I4, Arg32 0)], &instr) |> ignore
+            x.PrependProbeWithOffset(probes.leaveMain_f8, [], &instr) |> ignore
+            x.PrependProbe(probes.unmem_f8, [(OpCodes.Ldc_I4, Arg32 0)], &instr) |> ignore
         | Some (evaluationStackCellType.I :: _) ->
             x.PrependMem_p(0, 0, &instr)
-            x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i_i1_sig, &instr) |> ignore
-            x.PrependProbeWithOffset(probes.leaveMain_p, [], x.tokens.void_i_offset_sig, &instr) |> ignore
-            x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i_i1_sig, &instr) |> ignore
+            x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], &instr) |> ignore
+            x.PrependProbeWithOffset(probes.leaveMain_p, [], &instr) |> ignore
+            x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], &instr) |> ignore
         | Some (evaluationStackCellType.Ref :: _) ->
             x.PrependMem_p(0, 0, &instr)
-            x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i_i1_sig, &instr) |> ignore
-            x.PrependProbeWithOffset(probes.leaveMain_p, [], x.tokens.void_i_offset_sig, &instr) |> ignore
-            x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i_i1_sig, &instr) |> ignore
+            x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], &instr) |> ignore
+            x.PrependProbeWithOffset(probes.leaveMain_p, [], &instr) |> ignore
+            x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], &instr) |> ignore
         | Some (evaluationStackCellType.Struct :: _) ->
             x.PrependMem_p(0, 0, &instr)
-            x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i_i1_sig, &instr) |> ignore
-            x.PrependProbeWithOffset(probes.leaveMain_p, [], x.tokens.void_i_offset_sig, &instr) |> ignore
-            x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i_i1_sig, &instr) |> ignore
+            x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], &instr) |> ignore
+            x.PrependProbeWithOffset(probes.leaveMain_p, [], &instr) |> ignore
+            x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], &instr) |> ignore
         | _ -> internalfailf "PrependValidLeaveMain: unexpected stack state! %O" instr.stackState
 
     member private x.PlaceLeaveProbe(instr : ilInstr byref) =
@@ -252,7 +295,7 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
         else
             let returnsSomething = Reflection.hasNonVoidResult x.m
             let args = [(OpCodes.Ldc_I4, (if returnsSomething then 1 else 0) |> Arg32)]
-            x.PrependProbeWithOffset(probes.leave, args, x.tokens.void_u1_offset_sig, &instr) |> ignore
+            x.PrependProbeWithOffset(probes.leave, args, &instr) |> ignore
 
     member x.MethodName with get() = x.m.Name
 
@@ -303,42 +346,42 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
         match t with
         | evaluationStackCellType.I1 ->
             x.PrependMem_i1(idx, order, &instr)
-            probes.unmem_1, x.tokens.i1_i1_sig
+            probes.unmem_1
         | evaluationStackCellType.I2 ->
             x.PrependMem_i2(idx, order, &instr)
-            probes.unmem_2, x.tokens.i2_i1_sig
+            probes.unmem_2
         | evaluationStackCellType.I4 ->
             x.PrependMem_i4(idx, order, &instr)
-            probes.unmem_4, x.tokens.i4_i1_sig
+            probes.unmem_4
         | evaluationStackCellType.I8 ->
             x.PrependMem_i8(idx, order, &instr)
-            probes.unmem_8, x.tokens.i8_i1_sig
+            probes.unmem_8
         | evaluationStackCellType.R4 ->
             x.PrependMem_f4(idx, order, &instr)
-            probes.unmem_f4, x.tokens.r4_i1_sig
+            probes.unmem_f4
         | evaluationStackCellType.R8 ->
             x.PrependMem_f8(idx, order, &instr)
-            probes.unmem_f8, x.tokens.r8_i1_sig
+            probes.unmem_f8
         | evaluationStackCellType.I ->
             x.PrependMem_p(idx, order, &instr)
-            probes.unmem_p, x.tokens.i_i1_sig
+            probes.unmem_p
         | evaluationStackCellType.Ref ->
             x.PrependMem_p(idx, order, &instr)
-            probes.unmem_p, x.tokens.i_i1_sig
+            probes.unmem_p
         | evaluationStackCellType.Struct ->
             // TODO: support struct
 //            x.PrependInstr(OpCodes.Box, NoArg, &instr)
             x.PrependMem_p(idx, order, &instr)
-            probes.unmem_p, x.tokens.i_i1_sig
+            probes.unmem_p
         | _ -> __unreachable__()
 
-    member x.PlaceProbes() =
+    member x.PlaceProbes(clones : (ilInstr * ilInstr) option) =
         let instructions = x.rewriter.CopyInstructions()
         assert(not <| Array.isEmpty instructions)
         let mutable atLeastOneReturnFound = false
         let mutable hasPrefix = false
         let mutable prefix : ilInstr byref = &instructions.[0]
-        x.PlaceEnterProbe(&instructions.[0]) |> ignore
+        x.PlaceEnterProbe(&instructions.[0], clones)
         for i in 0 .. instructions.Length - 1 do
             let instr = &instructions.[i]
             if not hasPrefix then prefix <- instr
@@ -346,8 +389,8 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
             | OpCode op ->
                 let prependTarget = if hasPrefix then &prefix else &instr
                 let dumpedInfo = x.rewriter.ILInstrToString probes instr
-                let idx = communicator.SendStringAndReadItsIndex dumpedInfo
-                x.PrependProbe(probes.dumpInstruction, [OpCodes.Ldc_I4, idx |> int |> Arg32], x.tokens.void_u4_sig, &prependTarget) |> ignore
+                let idx = internString dumpedInfo
+                x.PrependProbe(probes.dumpInstruction, [OpCodes.Ldc_I4, idx |> int |> Arg32], &prependTarget) |> ignore
                 let opcodeValue = LanguagePrimitives.EnumOfValue op.Value
                 match opcodeValue with
                 // Prefixes
@@ -360,16 +403,16 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
 
                 // Concrete instructions
                 | OpCodeValues.Ldarga_S ->
-                    x.AppendProbe(probes.ldarga, [(OpCodes.Ldc_I4, instr.Arg8 |> int |> Arg32)], x.tokens.void_i_u2_sig, instr)
+                    x.AppendProbe(probes.ldarga, [(OpCodes.Ldc_I4, instr.Arg8 |> int |> Arg32)], instr)
                     x.AppendDup instr
                 | OpCodeValues.Ldloca_S ->
-                    x.AppendProbe(probes.ldloca, [(OpCodes.Ldc_I4, instr.Arg8 |> int |> Arg32)], x.tokens.void_i_u2_sig, instr)
+                    x.AppendProbe(probes.ldloca, [(OpCodes.Ldc_I4, instr.Arg8 |> int |> Arg32)], instr)
                     x.AppendDup instr
                 | OpCodeValues.Ldarga ->
-                    x.AppendProbe(probes.ldarga, [(OpCodes.Ldc_I4, instr.Arg16 |> int |> Arg32)], x.tokens.void_i_u2_sig, instr)
+                    x.AppendProbe(probes.ldarga, [(OpCodes.Ldc_I4, instr.Arg16 |> int |> Arg32)], instr)
                     x.AppendDup instr
                 | OpCodeValues.Ldloca ->
-                    x.AppendProbe(probes.ldloca, [(OpCodes.Ldc_I4, instr.Arg16 |> int |> Arg32)], x.tokens.void_i_u2_sig, instr)
+                    x.AppendProbe(probes.ldloca, [(OpCodes.Ldc_I4, instr.Arg16 |> int |> Arg32)], instr)
                     x.AppendDup instr
                 | OpCodeValues.Ldnull
                 | OpCodeValues.Ldc_I4_M1
@@ -386,42 +429,42 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
                 | OpCodeValues.Ldc_I4
                 | OpCodeValues.Ldc_I8
                 | OpCodeValues.Ldc_R4
-                | OpCodeValues.Ldc_R8 -> x.AppendProbe(probes.ldc, [], x.tokens.void_sig, instr)
-                | OpCodeValues.Pop -> x.AppendProbe(probes.pop, [], x.tokens.void_sig, instr)
-                | OpCodeValues.Ldtoken -> x.AppendProbe(probes.ldtoken, [], x.tokens.void_sig, instr)
-                | OpCodeValues.Arglist -> x.AppendProbe(probes.arglist, [], x.tokens.void_sig, instr)
-                | OpCodeValues.Ldftn -> x.AppendProbe(probes.ldftn, [], x.tokens.void_sig, instr)
-                | OpCodeValues.Sizeof -> x.AppendProbe(probes.sizeof, [], x.tokens.void_sig, instr)
+                | OpCodeValues.Ldc_R8 -> x.AppendProbe(probes.ldc, [], instr)
+                | OpCodeValues.Pop -> x.AppendProbe(probes.pop, [], instr)
+                | OpCodeValues.Ldtoken -> x.AppendProbe(probes.ldtoken, [], instr)
+                | OpCodeValues.Arglist -> x.AppendProbe(probes.arglist, [], instr)
+                | OpCodeValues.Ldftn -> x.AppendProbe(probes.ldftn, [], instr)
+                | OpCodeValues.Sizeof -> x.AppendProbe(probes.sizeof, [], instr)
 
                 // Branchings
                 | OpCodeValues.Brfalse_S
-                | OpCodeValues.Brfalse -> x.PrependProbeWithOffset(probes.brfalse, [], x.tokens.void_offset_sig, &prependTarget) |> ignore
+                | OpCodeValues.Brfalse -> x.PrependProbeWithOffset(probes.brfalse, [], &prependTarget) |> ignore
                 | OpCodeValues.Brtrue_S
-                | OpCodeValues.Brtrue -> x.PrependProbeWithOffset(probes.brtrue, [], x.tokens.void_offset_sig, &prependTarget) |> ignore
-                | OpCodeValues.Switch -> x.PrependProbeWithOffset(probes.switch, [], x.tokens.void_offset_sig, &prependTarget) |> ignore
+                | OpCodeValues.Brtrue -> x.PrependProbeWithOffset(probes.brtrue, [], &prependTarget) |> ignore
+                | OpCodeValues.Switch -> x.PrependProbeWithOffset(probes.switch, [], &prependTarget) |> ignore
 
                 // Symbolic stack instructions
-                | OpCodeValues.Ldarg_0 -> x.AppendProbeWithOffset(probes.ldarg_0, [], x.tokens.void_offset_sig, instr)
-                | OpCodeValues.Ldarg_1 -> x.AppendProbeWithOffset(probes.ldarg_1, [], x.tokens.void_offset_sig, instr)
-                | OpCodeValues.Ldarg_2 -> x.AppendProbeWithOffset(probes.ldarg_2, [], x.tokens.void_offset_sig, instr)
-                | OpCodeValues.Ldarg_3 -> x.AppendProbeWithOffset(probes.ldarg_3, [], x.tokens.void_offset_sig, instr)
-                | OpCodeValues.Ldloc_0 -> x.AppendProbeWithOffset(probes.ldloc_0, [], x.tokens.void_offset_sig, instr)
-                | OpCodeValues.Ldloc_1 -> x.AppendProbeWithOffset(probes.ldloc_1, [], x.tokens.void_offset_sig, instr)
-                | OpCodeValues.Ldloc_2 -> x.AppendProbeWithOffset(probes.ldloc_2, [], x.tokens.void_offset_sig, instr)
-                | OpCodeValues.Ldloc_3 -> x.AppendProbeWithOffset(probes.ldloc_3, [], x.tokens.void_offset_sig, instr)
-                | OpCodeValues.Stloc_0 -> x.AppendProbeWithOffsetMemUnmem(probes.stloc_0, [], x.tokens.void_offset_sig, &prependTarget, instr)
-                | OpCodeValues.Stloc_1 -> x.AppendProbeWithOffsetMemUnmem(probes.stloc_1, [], x.tokens.void_offset_sig, &prependTarget, instr)
-                | OpCodeValues.Stloc_2 -> x.AppendProbeWithOffsetMemUnmem(probes.stloc_2, [], x.tokens.void_offset_sig, &prependTarget, instr)
-                | OpCodeValues.Stloc_3 -> x.AppendProbeWithOffsetMemUnmem(probes.stloc_3, [], x.tokens.void_offset_sig, &prependTarget, instr)
-                | OpCodeValues.Ldarg_S -> x.AppendProbeWithOffset(probes.ldarg_S, [(OpCodes.Ldc_I4, instr.Arg8 |> int |> Arg32)], x.tokens.void_u1_offset_sig, instr)
-                | OpCodeValues.Starg_S -> x.AppendProbeWithOffsetMemUnmem(probes.starg_S, [(OpCodes.Ldc_I4, instr.Arg8 |> int |> Arg32)], x.tokens.void_u1_offset_sig, &prependTarget, instr)
-                | OpCodeValues.Ldloc_S -> x.AppendProbeWithOffset(probes.ldloc_S, [(OpCodes.Ldc_I4, instr.Arg8 |> int |> Arg32)], x.tokens.void_u1_offset_sig, instr)
-                | OpCodeValues.Stloc_S -> x.AppendProbeWithOffsetMemUnmem(probes.stloc_S, [(OpCodes.Ldc_I4, instr.Arg8 |> int |> Arg32)], x.tokens.void_u1_offset_sig, &prependTarget, instr)
-                | OpCodeValues.Ldarg -> x.AppendProbeWithOffset(probes.ldarg, [(OpCodes.Ldc_I4, instr.Arg16 |> int |> Arg32)], x.tokens.void_u2_offset_sig, instr)
-                | OpCodeValues.Starg -> x.AppendProbeWithOffsetMemUnmem(probes.starg, [(OpCodes.Ldc_I4, instr.Arg16 |> int |> Arg32)], x.tokens.void_u2_offset_sig, &prependTarget, instr)
-                | OpCodeValues.Ldloc -> x.AppendProbeWithOffset(probes.ldloc, [(OpCodes.Ldc_I4, instr.Arg16 |> int |> Arg32)], x.tokens.void_u2_offset_sig, instr)
-                | OpCodeValues.Stloc -> x.AppendProbeWithOffsetMemUnmem(probes.stloc, [(OpCodes.Ldc_I4, instr.Arg16 |> int |> Arg32)], x.tokens.void_u2_offset_sig, &prependTarget, instr)
-                | OpCodeValues.Dup -> x.AppendProbeWithOffsetMemUnmem(probes.dup, [], x.tokens.void_offset_sig, &prependTarget, instr)
+                | OpCodeValues.Ldarg_0 -> x.AppendProbeWithOffset(probes.ldarg_0, [], instr)
+                | OpCodeValues.Ldarg_1 -> x.AppendProbeWithOffset(probes.ldarg_1, [], instr)
+                | OpCodeValues.Ldarg_2 -> x.AppendProbeWithOffset(probes.ldarg_2, [], instr)
+                | OpCodeValues.Ldarg_3 -> x.AppendProbeWithOffset(probes.ldarg_3, [], instr)
+                | OpCodeValues.Ldloc_0 -> x.AppendProbeWithOffset(probes.ldloc_0, [], instr)
+                | OpCodeValues.Ldloc_1 -> x.AppendProbeWithOffset(probes.ldloc_1, [], instr)
+                | OpCodeValues.Ldloc_2 -> x.AppendProbeWithOffset(probes.ldloc_2, [], instr)
+                | OpCodeValues.Ldloc_3 -> x.AppendProbeWithOffset(probes.ldloc_3, [], instr)
+                | OpCodeValues.Stloc_0 -> x.AppendProbeWithOffsetMemUnmem(probes.stloc_0, [], &prependTarget, instr)
+                | OpCodeValues.Stloc_1 -> x.AppendProbeWithOffsetMemUnmem(probes.stloc_1, [], &prependTarget, instr)
+                | OpCodeValues.Stloc_2 -> x.AppendProbeWithOffsetMemUnmem(probes.stloc_2, [], &prependTarget, instr)
+                | OpCodeValues.Stloc_3 -> x.AppendProbeWithOffsetMemUnmem(probes.stloc_3, [], &prependTarget, instr)
+                | OpCodeValues.Ldarg_S -> x.AppendProbeWithOffset(probes.ldarg_S, [(OpCodes.Ldc_I4, instr.Arg8 |> int |> Arg32)], instr)
+                | OpCodeValues.Starg_S -> x.AppendProbeWithOffsetMemUnmem(probes.starg_S, [(OpCodes.Ldc_I4, instr.Arg8 |> int |> Arg32)], &prependTarget, instr)
+                | OpCodeValues.Ldloc_S -> x.AppendProbeWithOffset(probes.ldloc_S, [(OpCodes.Ldc_I4, instr.Arg8 |> int |> Arg32)], instr)
+                | OpCodeValues.Stloc_S -> x.AppendProbeWithOffsetMemUnmem(probes.stloc_S, [(OpCodes.Ldc_I4, instr.Arg8 |> int |> Arg32)], &prependTarget, instr)
+                | OpCodeValues.Ldarg -> x.AppendProbeWithOffset(probes.ldarg, [(OpCodes.Ldc_I4, instr.Arg16 |> int |> Arg32)], instr)
+                | OpCodeValues.Starg -> x.AppendProbeWithOffsetMemUnmem(probes.starg, [(OpCodes.Ldc_I4, instr.Arg16 |> int |> Arg32)], &prependTarget, instr)
+                | OpCodeValues.Ldloc -> x.AppendProbeWithOffset(probes.ldloc, [(OpCodes.Ldc_I4, instr.Arg16 |> int |> Arg32)], instr)
+                | OpCodeValues.Stloc -> x.AppendProbeWithOffsetMemUnmem(probes.stloc, [(OpCodes.Ldc_I4, instr.Arg16 |> int |> Arg32)], &prependTarget, instr)
+                | OpCodeValues.Dup -> x.AppendProbeWithOffsetMemUnmem(probes.dup, [], &prependTarget, instr)
 
                 | OpCodeValues.Add
                 | OpCodeValues.Sub
@@ -469,11 +512,11 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
                         | _ -> true
 
                     // Track
-                    x.PrependProbe(probes.binOp, [], x.tokens.bool_sig, &prependTarget) |> ignore
+                    x.PrependProbe(probes.binOp, [], &prependTarget) |> ignore
                     let br = x.PrependBranch(OpCodes.Brtrue_S, &prependTarget)
 
                     // Mem and get exec with unmem
-                    let execProbe, execSig, unmem1Probe, unmem1Sig, unmem2Probe, unmem2Sig =
+                    let execProbe, unmem1Probe, unmem2Probe =
                         match instr.stackState with // TODO: unify getting stackState #do
                         | Some (evaluationStackCellType.I4 :: evaluationStackCellType.I4 :: _)
                         | Some (evaluationStackCellType.I1 :: evaluationStackCellType.I1 :: _)
@@ -484,32 +527,32 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
                         | Some (evaluationStackCellType.I2 :: evaluationStackCellType.I4 :: _)
                         | Some (evaluationStackCellType.I4 :: evaluationStackCellType.I1 :: _)
                         | Some (evaluationStackCellType.I4 :: evaluationStackCellType.I2 :: _) ->
-                            x.PrependProbe(probes.mem2_4, [], x.tokens.void_i4_i4_sig, &prependTarget) |> ignore
-                            (if isUnchecked then probes.execBinOp_4 else probes.execBinOp_4_ovf), x.tokens.void_u2_i4_i4_offset_sig,
-                                probes.unmem_4, x.tokens.i4_i1_sig, probes.unmem_4, x.tokens.i4_i1_sig
+                            x.PrependProbe(probes.mem2_4, [], &prependTarget) |> ignore
+                            (if isUnchecked then probes.execBinOp_4 else probes.execBinOp_4_ovf),
+                                probes.unmem_4, probes.unmem_4
                         | Some (evaluationStackCellType.I4 :: evaluationStackCellType.I8 :: _) ->
-                            x.PrependProbe(probes.mem2_8_4, [], x.tokens.void_i8_i4_sig, &prependTarget) |> ignore
-                            (if isUnchecked then probes.execBinOp_8_4 else probes.execBinOp_8_4_ovf), x.tokens.void_u2_i8_i4_offset_sig,
-                                probes.unmem_8, x.tokens.i8_i1_sig, probes.unmem_4, x.tokens.i4_i1_sig
+                            x.PrependProbe(probes.mem2_8_4, [], &prependTarget) |> ignore
+                            (if isUnchecked then probes.execBinOp_8_4 else probes.execBinOp_8_4_ovf),
+                                probes.unmem_8, probes.unmem_4
                         | Some (evaluationStackCellType.I8 :: evaluationStackCellType.I8 :: _) ->
-                            x.PrependProbe(probes.mem2_8, [], x.tokens.void_i8_i8_sig, &prependTarget) |> ignore
-                            (if isUnchecked then probes.execBinOp_8 else probes.execBinOp_8_ovf), x.tokens.void_u2_i8_i8_offset_sig,
-                                probes.unmem_8, x.tokens.i8_i1_sig, probes.unmem_8, x.tokens.i8_i1_sig
+                            x.PrependProbe(probes.mem2_8, [], &prependTarget) |> ignore
+                            (if isUnchecked then probes.execBinOp_8 else probes.execBinOp_8_ovf),
+                                probes.unmem_8, probes.unmem_8
                         | Some (evaluationStackCellType.R4 :: evaluationStackCellType.R4 :: _) ->
-                            x.PrependProbe(probes.mem2_f4, [], x.tokens.void_r4_r4_sig, &prependTarget) |> ignore
-                            (if isUnchecked then probes.execBinOp_f4 else probes.execBinOp_f4_ovf), x.tokens.void_u2_r4_r4_offset_sig,
-                                probes.unmem_f4, x.tokens.r4_i1_sig, probes.unmem_f4, x.tokens.r4_i1_sig
+                            x.PrependProbe(probes.mem2_f4, [], &prependTarget) |> ignore
+                            (if isUnchecked then probes.execBinOp_f4 else probes.execBinOp_f4_ovf),
+                                probes.unmem_f4, probes.unmem_f4
                         | Some (evaluationStackCellType.R8 :: evaluationStackCellType.R8 :: _) ->
-                            x.PrependProbe(probes.mem2_f8, [], x.tokens.void_r8_r8_sig, &prependTarget) |> ignore
-                            (if isUnchecked then probes.execBinOp_f8 else probes.execBinOp_f8_ovf), x.tokens.void_u2_r8_r8_offset_sig,
-                                probes.unmem_f8, x.tokens.r8_i1_sig, probes.unmem_f8, x.tokens.r8_i1_sig
+                            x.PrependProbe(probes.mem2_f8, [], &prependTarget) |> ignore
+                            (if isUnchecked then probes.execBinOp_f8 else probes.execBinOp_f8_ovf),
+                                probes.unmem_f8, probes.unmem_f8
                         | Some (evaluationStackCellType.I :: evaluationStackCellType.I :: _)
                         | Some (evaluationStackCellType.I :: evaluationStackCellType.Ref :: _)
                         | Some (evaluationStackCellType.Ref :: evaluationStackCellType.I :: _)
                         | Some (evaluationStackCellType.Ref :: evaluationStackCellType.Ref :: _) ->
                             x.PrependMem2_p &prependTarget
-                            (if isUnchecked then probes.execBinOp_p else probes.execBinOp_p_ovf), x.tokens.void_u2_i_i_offset_sig,
-                                probes.unmem_p, x.tokens.i_i1_sig, probes.unmem_p, x.tokens.i_i1_sig
+                            (if isUnchecked then probes.execBinOp_p else probes.execBinOp_p_ovf),
+                                probes.unmem_p, probes.unmem_p
                         | Some (evaluationStackCellType.I1 :: evaluationStackCellType.I :: _)
                         | Some (evaluationStackCellType.I2 :: evaluationStackCellType.I :: _)
                         | Some (evaluationStackCellType.I4 :: evaluationStackCellType.I :: _)
@@ -517,8 +560,8 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
                         | Some (evaluationStackCellType.I2 :: evaluationStackCellType.Ref :: _)
                         | Some (evaluationStackCellType.I4 :: evaluationStackCellType.Ref :: _) ->
                             x.PrependMem2_p_4 &prependTarget
-                            (if isUnchecked then probes.execBinOp_p_4 else probes.execBinOp_p_4_ovf), x.tokens.void_u2_i_i4_offset_sig,
-                                probes.unmem_p, x.tokens.i_i1_sig, probes.unmem_4, x.tokens.i4_i1_sig
+                            (if isUnchecked then probes.execBinOp_p_4 else probes.execBinOp_p_4_ovf),
+                                probes.unmem_p, probes.unmem_4
                         | Some (evaluationStackCellType.I :: evaluationStackCellType.I1 :: _)
                         | Some (evaluationStackCellType.I :: evaluationStackCellType.I2 :: _)
                         | Some (evaluationStackCellType.I :: evaluationStackCellType.I4 :: _)
@@ -526,23 +569,23 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
                         | Some (evaluationStackCellType.Ref :: evaluationStackCellType.I2 :: _)
                         | Some (evaluationStackCellType.Ref :: evaluationStackCellType.I4 :: _) ->
                             x.PrependMem2_4_p &prependTarget
-                            (if isUnchecked then probes.execBinOp_4_p else probes.execBinOp_4_p_ovf), x.tokens.void_u2_i4_i_offset_sig,
-                                probes.unmem_4, x.tokens.i4_i1_sig, probes.unmem_p, x.tokens.i_i1_sig
+                            (if isUnchecked then probes.execBinOp_4_p else probes.execBinOp_4_p_ovf),
+                                probes.unmem_4, probes.unmem_p
                         | Some (x :: y :: _) -> internalfailf "Unexpected binop ([%O]%O) evaluation stack types: %O, %O" i opcodeValue x y
                         | stack -> internalfailf "Unexpected binop (%O) evaluation stack types! stack: %O" opcodeValue stack
 
                     x.PrependInstr(OpCodes.Ldc_I4, op.Value |> int |> Arg32 , &prependTarget)
-                    x.PrependProbe(unmem1Probe, [(OpCodes.Ldc_I4, Arg32 0)], unmem1Sig, &prependTarget) |> ignore
-                    x.PrependProbe(unmem2Probe, [(OpCodes.Ldc_I4, Arg32 1)], unmem2Sig, &prependTarget) |> ignore
-                    x.PrependProbeWithOffset(execProbe, [], execSig, &prependTarget) |> ignore
-                    x.PrependProbe(unmem1Probe, [(OpCodes.Ldc_I4, Arg32 0)], unmem1Sig, &prependTarget) |> ignore
-                    x.PrependProbe(unmem2Probe, [(OpCodes.Ldc_I4, Arg32 1)], unmem2Sig, &prependTarget) |> ignore
+                    x.PrependProbe(unmem1Probe, [(OpCodes.Ldc_I4, Arg32 0)], &prependTarget) |> ignore
+                    x.PrependProbe(unmem2Probe, [(OpCodes.Ldc_I4, Arg32 1)], &prependTarget) |> ignore
+                    x.PrependProbeWithOffset(execProbe, [], &prependTarget) |> ignore
+                    x.PrependProbe(unmem1Probe, [(OpCodes.Ldc_I4, Arg32 0)], &prependTarget) |> ignore
+                    x.PrependProbe(unmem2Probe, [(OpCodes.Ldc_I4, Arg32 1)], &prependTarget) |> ignore
                     br.arg <- Target prependTarget
 
                 | OpCodeValues.Neg
                 | OpCodeValues.Not ->
                     match instr.opcode with
-                    | OpCode op -> x.AppendProbeWithOffset(probes.unOp, [(OpCodes.Ldc_I4, op.Value |> int |> Arg32)], x.tokens.void_u2_offset_sig, instr)
+                    | OpCode op -> x.AppendProbeWithOffset(probes.unOp, [(OpCodes.Ldc_I4, op.Value |> int |> Arg32)], instr)
                     | _ -> __unreachable__()
 
                 | OpCodeValues.Conv_I1
@@ -558,7 +601,7 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
                 | OpCodeValues.Conv_U1
                 | OpCodeValues.Conv_I
                 | OpCodeValues.Conv_U ->
-                    x.AppendProbeWithOffsetMemUnmem(probes.conv, [], x.tokens.void_offset_sig, &prependTarget, instr)
+                    x.AppendProbeWithOffsetMemUnmem(probes.conv, [], &prependTarget, instr)
                 | OpCodeValues.Conv_Ovf_I1_Un
                 | OpCodeValues.Conv_Ovf_I2_Un
                 | OpCodeValues.Conv_Ovf_I4_Un
@@ -579,7 +622,8 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
                 | OpCodeValues.Conv_Ovf_U8
                 | OpCodeValues.Conv_Ovf_I
                 | OpCodeValues.Conv_Ovf_U ->
-                    x.AppendProbeWithOffsetMemUnmem(probes.conv, [], x.tokens.void_offset_sig, &prependTarget, instr)
+                    // NOTE: checked conversions may throw, so client does not defer their commands
+                    x.AppendProbeWithOffsetMemUnmem(probes.conv_Ovf, [], &prependTarget, instr)
 
                 | OpCodeValues.Ldind_I1
                 | OpCodeValues.Ldind_U1
@@ -596,7 +640,7 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
                     // calli track_ldind
                     // ldind
                     x.PrependDup &prependTarget
-                    x.PrependProbeWithOffset(probes.ldind, [], x.tokens.void_i_offset_sig, &prependTarget) |> ignore
+                    x.PrependProbeWithOffset(probes.ldind, [], &prependTarget) |> ignore
 
                 | OpCodeValues.Stind_Ref
                 | OpCodeValues.Stind_I1
@@ -620,7 +664,7 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
                     // stind
                     // B:
 
-                    let execProbe, execSig, unmem2Probe, unmem2Sig =
+                    let execProbe, unmem2Probe =
                         match opcodeValue with
                         | OpCodeValues.Stind_I ->
                             match instr.stackState with
@@ -628,14 +672,14 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
                             | Some (evaluationStackCellType.I :: evaluationStackCellType.Ref :: _) -> ()
                             | _ -> internalfail "Stack validation failed"
                             x.PrependMem2_p &prependTarget
-                            probes.execStind_ref, x.tokens.void_i_i_offset_sig, probes.unmem_p, x.tokens.i_i1_sig
+                            probes.execStind_ref, probes.unmem_p
                         | OpCodeValues.Stind_Ref ->
                             match instr.stackState with
                             | Some (evaluationStackCellType.Ref :: evaluationStackCellType.I :: _)
                             | Some (evaluationStackCellType.Ref :: evaluationStackCellType.Ref :: _) -> ()
                             | _ -> internalfail "Stack validation failed"
                             x.PrependMem2_p &prependTarget
-                            probes.execStind_ref, x.tokens.void_i_i_offset_sig, probes.unmem_p, x.tokens.i_i1_sig
+                            probes.execStind_ref, probes.unmem_p
                         | OpCodeValues.Stind_I1 ->
                             match instr.stackState with
                             | Some (evaluationStackCellType.I1 :: evaluationStackCellType.I :: _)
@@ -646,7 +690,7 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
                             | Some (evaluationStackCellType.I4 :: evaluationStackCellType.Ref :: _) -> ()
                             | _ -> internalfail "Stack validation failed"
                             x.PrependMem2_p_1 &prependTarget
-                            probes.execStind_I1, x.tokens.void_i_i1_offset_sig, probes.unmem_1, x.tokens.i1_i1_sig
+                            probes.execStind_I1, probes.unmem_1
                         | OpCodeValues.Stind_I2 ->
                             match instr.stackState with
                             | Some (evaluationStackCellType.I2 :: evaluationStackCellType.I :: _)
@@ -655,60 +699,60 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
                             | Some (evaluationStackCellType.I4 :: evaluationStackCellType.Ref :: _) -> ()
                             | _ -> internalfail "Stack validation failed"
                             x.PrependMem2_p_2 &prependTarget
-                            probes.execStind_I2, x.tokens.void_i_i2_offset_sig, probes.unmem_2, x.tokens.i2_i1_sig
+                            probes.execStind_I2, probes.unmem_2
                         | OpCodeValues.Stind_I4 ->
                             match instr.stackState with
                             | Some (evaluationStackCellType.I4 :: evaluationStackCellType.I :: _)
                             | Some (evaluationStackCellType.I4 :: evaluationStackCellType.Ref :: _) -> ()
                             | _ -> internalfail "Stack validation failed"
                             x.PrependMem2_p_4 &prependTarget
-                            probes.execStind_I4, x.tokens.void_i_i4_offset_sig, probes.unmem_4, x.tokens.i4_i1_sig
+                            probes.execStind_I4, probes.unmem_4
                         | OpCodeValues.Stind_I8 ->
                             match instr.stackState with
                             | Some (evaluationStackCellType.I8 :: evaluationStackCellType.I :: _)
                             | Some (evaluationStackCellType.I8 :: evaluationStackCellType.Ref :: _) -> ()
                             | _ -> internalfail "Stack validation failed"
                             x.PrependMem2_p_8 &prependTarget
-                            probes.execStind_I8, x.tokens.void_i_i8_offset_sig, probes.unmem_8, x.tokens.i8_i1_sig
+                            probes.execStind_I8, probes.unmem_8
                         | OpCodeValues.Stind_R4 ->
                             match instr.stackState with
                             | Some (evaluationStackCellType.R4 :: evaluationStackCellType.I :: _)
                             | Some (evaluationStackCellType.R4 :: evaluationStackCellType.Ref :: _) -> ()
                             | _ -> internalfail "Stack validation failed"
                             x.PrependMem2_p_f4 &prependTarget
-                            probes.execStind_R4, x.tokens.void_i_r4_offset_sig, probes.unmem_f4, x.tokens.r4_i1_sig
+                            probes.execStind_R4, probes.unmem_f4
                         | OpCodeValues.Stind_R8 ->
                             match instr.stackState with
                             | Some (evaluationStackCellType.R8 :: evaluationStackCellType.I :: _)
                             | Some (evaluationStackCellType.R8 :: evaluationStackCellType.Ref :: _) -> ()
                             | _ -> internalfail "Stack validation failed"
                             x.PrependMem2_p_f8 &prependTarget
-                            probes.execStind_R8, x.tokens.void_i_r8_offset_sig, probes.unmem_f8, x.tokens.r8_i1_sig
+                            probes.execStind_R8, probes.unmem_f8
                         | _ -> __unreachable__()
 
-//                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i_i1_sig, &prependTarget) |> ignore
-//                    x.PrependProbe(unmem2Probe, [(OpCodes.Ldc_I4, Arg32 1)], unmem2Sig, &prependTarget) |> ignore
-                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i_i1_sig, &prependTarget) |> ignore
+//                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], &prependTarget) |> ignore
+//                    x.PrependProbe(unmem2Probe, [(OpCodes.Ldc_I4, Arg32 1)], &prependTarget) |> ignore
+                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], &prependTarget) |> ignore
                     x.PrependInstr(OpCodes.Ldc_I4, Arg32 (x.SizeOfIndirection opcodeValue), &prependTarget)
-                    x.PrependProbe(probes.stind, [], x.tokens.bool_i_i4_sig, &prependTarget) |> ignore
+                    x.PrependProbe(probes.stind, [], &prependTarget) |> ignore
                     let br_true = x.PrependBranch(OpCodes.Brtrue_S, &prependTarget)
-                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i_i1_sig, &prependTarget) |> ignore
-                    x.PrependProbe(unmem2Probe, [(OpCodes.Ldc_I4, Arg32 1)], unmem2Sig, &prependTarget) |> ignore
-                    x.PrependProbeWithOffset(execProbe, [], execSig, &prependTarget) |> ignore
+                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], &prependTarget) |> ignore
+                    x.PrependProbe(unmem2Probe, [(OpCodes.Ldc_I4, Arg32 1)], &prependTarget) |> ignore
+                    x.PrependProbeWithOffset(execProbe, [], &prependTarget) |> ignore
                     let br = x.PrependBranch(OpCodes.Br, &prependTarget)
-                    let unmem_p = x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i_i1_sig, &prependTarget)
+                    let unmem_p = x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], &prependTarget)
                     br_true.arg <- Target unmem_p
-                    x.PrependProbe(unmem2Probe, [(OpCodes.Ldc_I4, Arg32 1)], unmem2Sig, &prependTarget) |> ignore
+                    x.PrependProbe(unmem2Probe, [(OpCodes.Ldc_I4, Arg32 1)], &prependTarget) |> ignore
                     br.arg <- Target instr.next // TODO: need NOP before? #do
 
-                | OpCodeValues.Mkrefany -> x.AppendProbe(probes.mkrefany, [], x.tokens.void_sig, instr)
+                | OpCodeValues.Mkrefany -> x.AppendProbe(probes.mkrefany, [], instr)
                 | OpCodeValues.Newarr ->
-                     x.AppendProbeWithOffset(probes.newarr, [], x.tokens.void_i_token_offset_sig, instr)
+                     x.AppendProbeWithOffset(probes.newarr, [], instr)
                      x.AppendInstr OpCodes.Ldc_I4 instr.arg instr
                      x.AppendInstr OpCodes.Conv_I NoArg instr
                      x.AppendDup instr
                 | OpCodeValues.Localloc ->
-                     x.AppendProbeWithOffset(probes.newarr, [], x.tokens.void_i_offset_sig, instr)
+                     x.AppendProbeWithOffset(probes.newarr, [], instr)
                      x.AppendDup instr
                 | OpCodeValues.Cpobj ->
                     // calli mem2
@@ -724,55 +768,55 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
                     // calli exec
                     // A: cpobj
                     x.PrependMem2_p &prependTarget
-                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i_i1_sig, &prependTarget) |> ignore
-                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 1)], x.tokens.i_i1_sig, &prependTarget) |> ignore
-                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i_i1_sig, &prependTarget) |> ignore
-                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 1)], x.tokens.i_i1_sig, &prependTarget) |> ignore
-                    x.PrependProbe(probes.cpobj, [], x.tokens.bool_i_i_sig, &prependTarget) |> ignore
+                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], &prependTarget) |> ignore
+                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 1)], &prependTarget) |> ignore
+                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], &prependTarget) |> ignore
+                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 1)], &prependTarget) |> ignore
+                    x.PrependProbe(probes.cpobj, [], &prependTarget) |> ignore
                     let br = x.PrependBranch(OpCodes.Brtrue_S, &prependTarget)
                     x.PrependInstr(OpCodes.Ldc_I4, instr.arg, &prependTarget)
-                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i_i1_sig, &prependTarget) |> ignore
-                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 1)], x.tokens.i_i1_sig, &prependTarget) |> ignore
-                    x.PrependProbeWithOffset(probes.execCpobj, [], x.tokens.void_token_i_i_offset_sig, &prependTarget) |> ignore
+                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], &prependTarget) |> ignore
+                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 1)], &prependTarget) |> ignore
+                    x.PrependProbeWithOffset(probes.execCpobj, [], &prependTarget) |> ignore
                     br.arg <- Target prependTarget
                 | OpCodeValues.Ldobj ->
                      x.PrependDup &prependTarget
-                     x.PrependProbeWithOffset(probes.ldobj, [], x.tokens.void_i_offset_sig, &prependTarget) |> ignore
+                     x.PrependProbeWithOffset(probes.ldobj, [], &prependTarget) |> ignore
                 | OpCodeValues.Ldstr ->
-                     x.AppendProbe(probes.ldstr, [], x.tokens.void_i_sig, instr)
+                     x.AppendProbe(probes.ldstr, [], instr)
                      x.AppendInstr OpCodes.Conv_I NoArg instr
                      x.AppendInstr OpCodes.Dup NoArg instr
                 | OpCodeValues.Castclass ->
                      x.PrependDup &prependTarget
                      x.PrependInstr(OpCodes.Ldc_I4, instr.arg, &prependTarget)
-                     x.PrependProbeWithOffset(probes.castclass, [], x.tokens.void_i_token_offset_sig, &prependTarget) |> ignore
+                     x.PrependProbeWithOffset(probes.castclass, [], &prependTarget) |> ignore
                 | OpCodeValues.Isinst ->
                      x.PrependDup &prependTarget
                      x.PrependInstr(OpCodes.Ldc_I4, instr.arg, &prependTarget)
-                     x.PrependProbeWithOffset(probes.isinst, [], x.tokens.void_i_token_offset_sig, &prependTarget) |> ignore
+                     x.PrependProbeWithOffset(probes.isinst, [], &prependTarget) |> ignore
                 | OpCodeValues.Unbox ->
                      x.PrependDup &prependTarget
                      x.PrependInstr(OpCodes.Ldc_I4, instr.arg, &prependTarget)
-                     x.PrependProbeWithOffset(probes.unbox, [], x.tokens.void_i_token_offset_sig, &prependTarget) |> ignore
+                     x.PrependProbeWithOffset(probes.unbox, [], &prependTarget) |> ignore
                 | OpCodeValues.Unbox_Any ->
                      x.PrependDup &prependTarget
                      x.PrependInstr(OpCodes.Ldc_I4, instr.arg, &prependTarget)
-                     x.PrependProbeWithOffset(probes.unboxAny, [], x.tokens.void_i_token_offset_sig, &prependTarget) |> ignore
+                     x.PrependProbeWithOffset(probes.unboxAny, [], &prependTarget) |> ignore
                 | OpCodeValues.Ldfld ->
                      x.PrependMem_p(0, 0, &prependTarget)
-                     x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i_i1_sig, &instr) |> ignore
+                     x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], &instr) |> ignore
                      let fieldInfo = Reflection.resolveField x.m instr.Arg32
                      let fieldOffset = CSharpUtils.LayoutUtils.GetFieldOffset fieldInfo
                      x.PrependInstr(OpCodes.Ldc_I4, Arg32 fieldOffset, &prependTarget)
                      let fieldSize = TypeUtils.internalSizeOf fieldInfo.FieldType
                      x.PrependInstr(OpCodes.Ldc_I4, Arg32 fieldSize, &prependTarget)
-                     x.PrependProbeWithOffset(probes.ldfld, [], x.tokens.void_i_i4_i4_offset_sig, &prependTarget) |> ignore
-                     x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i_i1_sig, &instr) |> ignore
+                     x.PrependProbeWithOffset(probes.ldfld, [], &prependTarget) |> ignore
+                     x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], &instr) |> ignore
                 | OpCodeValues.Ldflda ->
                      x.PrependDup &prependTarget
                      x.PrependInstr(OpCodes.Conv_I, NoArg, &prependTarget)
                      x.PrependInstr(OpCodes.Ldc_I4, instr.arg, &prependTarget)
-                     x.PrependProbeWithOffset(probes.ldflda, [], x.tokens.void_i_token_offset_sig, &prependTarget) |> ignore
+                     x.PrependProbeWithOffset(probes.ldflda, [], &prependTarget) |> ignore
                 | OpCodeValues.Stfld ->
                     // box [if struct]
                     // calli mem2
@@ -794,7 +838,7 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
                     if isStruct then
                         x.PrependInstr(OpCodes.Box, typeTokenArg, &prependTarget)
 
-                    let probe, signature, unmem2Probe, unmem2Sig =
+                    let probe, unmem2Probe =
                         match instr.stackState with
                         | Some (evaluationStackCellType.I1 :: evaluationStackCellType.I :: _)
                         | Some (evaluationStackCellType.I2 :: evaluationStackCellType.I :: _)
@@ -803,61 +847,61 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
                         | Some (evaluationStackCellType.I2 :: evaluationStackCellType.Ref :: _)
                         | Some (evaluationStackCellType.I4 :: evaluationStackCellType.Ref :: _) ->
                             x.PrependMem2_p_4 &prependTarget
-                            probes.stfld_4, x.tokens.void_token_i_i4_offset_sig, probes.unmem_4, x.tokens.i4_i1_sig
+                            probes.stfld_4, probes.unmem_4
                         | Some (evaluationStackCellType.I8 :: evaluationStackCellType.I :: _)
                         | Some (evaluationStackCellType.I8 :: evaluationStackCellType.Ref :: _) ->
                             x.PrependMem2_p_8 &prependTarget
-                            probes.stfld_8, x.tokens.void_token_i_i8_offset_sig, probes.unmem_8, x.tokens.i8_i1_sig
+                            probes.stfld_8, probes.unmem_8
                         | Some (evaluationStackCellType.R4 :: evaluationStackCellType.I :: _)
                         | Some (evaluationStackCellType.R4 :: evaluationStackCellType.Ref :: _) ->
                             x.PrependMem2_p_f4 &prependTarget
-                            probes.stfld_f4, x.tokens.void_token_i_r4_offset_sig, probes.unmem_f4, x.tokens.r4_i1_sig
+                            probes.stfld_f4, probes.unmem_f4
                         | Some (evaluationStackCellType.R8 :: evaluationStackCellType.I :: _)
                         | Some (evaluationStackCellType.R8 :: evaluationStackCellType.Ref :: _) ->
                             x.PrependMem2_p_f8 &prependTarget
-                            probes.stfld_f8, x.tokens.void_token_i_r8_offset_sig, probes.unmem_f8, x.tokens.r8_i1_sig
+                            probes.stfld_f8, probes.unmem_f8
                         | Some (evaluationStackCellType.I :: evaluationStackCellType.I :: _)
                         | Some (evaluationStackCellType.I :: evaluationStackCellType.Ref :: _)
                         | Some (evaluationStackCellType.Ref :: evaluationStackCellType.I :: _)
                         | Some (evaluationStackCellType.Ref :: evaluationStackCellType.Ref :: _) ->
                             x.PrependMem2_p &prependTarget
-                            probes.stfld_p, x.tokens.void_token_i_i_offset_sig, probes.unmem_p, x.tokens.i_i1_sig
+                            probes.stfld_p, probes.unmem_p
                         | Some (evaluationStackCellType.Struct :: evaluationStackCellType.I :: _)
                         | Some (evaluationStackCellType.Struct :: evaluationStackCellType.Ref :: _) ->
                             x.PrependMem2_p &prependTarget
-                            probes.stfld_struct, x.tokens.void_token_i_i_offset_sig, probes.unmem_p, x.tokens.i_i1_sig
+                            probes.stfld_struct, probes.unmem_p
                         | _ -> __unreachable__()
 
                     x.PrependInstr(OpCodes.Ldc_I4, instr.arg, &prependTarget)
-                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i_i1_sig, &prependTarget) |> ignore
+                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], &prependTarget) |> ignore
 //                    x.PrependInstr(OpCodes.Conv_I, NoArg, &prependTarget)
-                    x.PrependProbe(unmem2Probe, [(OpCodes.Ldc_I4, Arg32 1)], unmem2Sig, &prependTarget) |> ignore
-                    x.PrependProbeWithOffset(probe, [], signature, &prependTarget) |> ignore
-                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i_i1_sig, &prependTarget) |> ignore
+                    x.PrependProbe(unmem2Probe, [(OpCodes.Ldc_I4, Arg32 1)], &prependTarget) |> ignore
+                    x.PrependProbeWithOffset(probe, [], &prependTarget) |> ignore
+                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], &prependTarget) |> ignore
 //                    let field = Reflection.resolveField x.m instr.Arg32
 //                    x.PrependInstr(OpCodes.Mkrefany, Arg32 field.FieldType.MetadataToken, &prependTarget)
-                    x.PrependProbe(unmem2Probe, [(OpCodes.Ldc_I4, Arg32 1)], unmem2Sig, &prependTarget) |> ignore
+                    x.PrependProbe(unmem2Probe, [(OpCodes.Ldc_I4, Arg32 1)], &prependTarget) |> ignore
                     if isStruct then
                         x.PrependInstr(OpCodes.Unbox_Any, typeTokenArg, &prependTarget)
                 | OpCodeValues.Ldsfld ->
                     x.PrependInstr(OpCodes.Ldc_I4, instr.arg, &prependTarget)
-                    x.PrependProbeWithOffset(probes.ldsfld, [], x.tokens.void_token_offset_sig, &prependTarget) |> ignore
+                    x.PrependProbeWithOffset(probes.ldsfld, [], &prependTarget) |> ignore
                 | OpCodeValues.Ldsflda ->
                     x.PrependDup &prependTarget
-                    x.PrependProbe(probes.ldsflda, [], x.tokens.void_sig, &prependTarget) |> ignore
+                    x.PrependProbe(probes.ldsflda, [], &prependTarget) |> ignore
                 | OpCodeValues.Stsfld ->
                     x.PrependInstr(OpCodes.Ldc_I4, instr.arg, &prependTarget)
-                    x.PrependProbeWithOffset(probes.stsfld, [], x.tokens.void_token_offset_sig, &prependTarget) |> ignore
+                    x.PrependProbeWithOffset(probes.stsfld, [], &prependTarget) |> ignore
                 | OpCodeValues.Stobj -> __notImplemented__() // ?????????????????
                 | OpCodeValues.Box ->
-                    x.AppendProbeWithOffset(probes.box, [], x.tokens.void_i_offset_sig, instr)
+                    x.AppendProbeWithOffset(probes.box, [], instr)
                     x.AppendDup instr
                 | OpCodeValues.Ldlen ->
                     x.PrependInstr(OpCodes.Conv_I, NoArg, &prependTarget)
-                    x.PrependProbe(probes.mem_p, [], x.tokens.void_i_sig, &prependTarget) |> ignore
-                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i_i1_sig, &prependTarget) |> ignore
-                    x.PrependProbeWithOffset(probes.ldlen, [], x.tokens.void_i_offset_sig, &prependTarget) |> ignore
-                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i_i1_sig, &prependTarget) |> ignore
+                    x.PrependProbe(probes.mem_p, [], &prependTarget) |> ignore
+                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], &prependTarget) |> ignore
+                    x.PrependProbeWithOffset(probes.ldlen, [], &prependTarget) |> ignore
+                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], &prependTarget) |> ignore
                 | OpCodeValues.Ldelema
                 | OpCodeValues.Ldelem_I1
                 | OpCodeValues.Ldelem_U1
@@ -885,15 +929,15 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
                     // calli exec
                     // A: ldelem(a)
                     x.PrependMem2_p &prependTarget
-                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i_i1_sig, &prependTarget) |> ignore
-                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 1)], x.tokens.i_i1_sig, &prependTarget) |> ignore
-                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i_i1_sig, &prependTarget) |> ignore
-                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 1)], x.tokens.i_i1_sig, &prependTarget) |> ignore
-                    x.PrependProbe(track, [], x.tokens.bool_i_i_sig, &prependTarget) |> ignore
+                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], &prependTarget) |> ignore
+                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 1)], &prependTarget) |> ignore
+                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], &prependTarget) |> ignore
+                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 1)], &prependTarget) |> ignore
+                    x.PrependProbe(track, [], &prependTarget) |> ignore
                     let br = x.PrependBranch(OpCodes.Brtrue_S, &prependTarget)
-                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i_i1_sig, &prependTarget) |> ignore
-                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 1)], x.tokens.i_i1_sig, &prependTarget) |> ignore
-                    x.PrependProbeWithOffset(exec, [], x.tokens.void_i_i_offset_sig, &prependTarget) |> ignore
+                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], &prependTarget) |> ignore
+                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 1)], &prependTarget) |> ignore
+                    x.PrependProbeWithOffset(exec, [], &prependTarget) |> ignore
                     br.arg <- Target prependTarget
 
                 | OpCodeValues.Stelem_I
@@ -936,74 +980,74 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
                     if isStruct then
                         x.PrependInstr(OpCodes.Box, typeTokenArg, &prependTarget)
 
-                    let execProbe, execSig, unmem3Probe, unmem3Sig =
+                    let execProbe, unmem3Probe =
                         match opcodeValue, instr.stackState with
                         | OpCodeValues.Stelem_I, _
                         | OpCodeValues.Stelem, Some (evaluationStackCellType.I :: _ :: evaluationStackCellType.Ref :: _) ->
                             x.PrependMem_p(2, 0, &prependTarget)
-                            probes.execStelem_Ref, x.tokens.void_i_i_i_offset_sig, probes.unmem_p, x.tokens.i_i1_sig
+                            probes.execStelem_Ref, probes.unmem_p
                         | OpCodeValues.Stelem_Ref, _
                         | OpCodeValues.Stelem, Some (evaluationStackCellType.Ref :: _ :: evaluationStackCellType.Ref :: _) ->
                             x.PrependMem_p(2, 0, &prependTarget)
-                            probes.execStind_ref, x.tokens.void_i_i_i_offset_sig, probes.unmem_p, x.tokens.i_i1_sig
+                            probes.execStind_ref, probes.unmem_p
                         | OpCodeValues.Stelem_I1, _
                         | OpCodeValues.Stelem, Some (evaluationStackCellType.I1 :: _ :: evaluationStackCellType.Ref :: _) ->
                             x.PrependMem_i1(2, 0, &prependTarget)
-                            probes.execStelem_I1, x.tokens.void_i_i_i1_offset_sig, probes.unmem_1, x.tokens.i1_i1_sig
+                            probes.execStelem_I1, probes.unmem_1
                         | OpCodeValues.Stelem_I2, _
                         | OpCodeValues.Stelem, Some (evaluationStackCellType.I2 :: _ :: evaluationStackCellType.Ref :: _) ->
                             x.PrependMem_i2(2, 0, &prependTarget)
-                            probes.execStelem_I2, x.tokens.void_i_i_i2_offset_sig, probes.unmem_2, x.tokens.i2_i1_sig
+                            probes.execStelem_I2, probes.unmem_2
                         | OpCodeValues.Stelem_I4, _
                         | OpCodeValues.Stelem, Some (evaluationStackCellType.I4 :: _ :: evaluationStackCellType.Ref :: _) ->
                             x.PrependMem_i4(2, 0, &prependTarget)
-                            probes.execStelem_I4, x.tokens.void_i_i_i4_offset_sig, probes.unmem_4, x.tokens.i4_i1_sig
+                            probes.execStelem_I4, probes.unmem_4
                         | OpCodeValues.Stelem_I8, _
                         | OpCodeValues.Stelem, Some (evaluationStackCellType.I8 :: _ :: evaluationStackCellType.Ref :: _) ->
                             x.PrependMem_i8(2, 0, &prependTarget)
-                            probes.execStelem_I8, x.tokens.void_i_i_i8_offset_sig, probes.unmem_8, x.tokens.i8_i1_sig
+                            probes.execStelem_I8, probes.unmem_8
                         | OpCodeValues.Stelem_R4, _
                         | OpCodeValues.Stelem, Some (evaluationStackCellType.R4 :: _ :: evaluationStackCellType.Ref :: _) ->
                             x.PrependMem_f4(2, 0, &prependTarget)
-                            probes.execStelem_R4, x.tokens.void_i_i_r4_offset_sig, probes.unmem_f4, x.tokens.r4_i1_sig
+                            probes.execStelem_R4, probes.unmem_f4
                         | OpCodeValues.Stelem_R8, _
                         | OpCodeValues.Stelem, Some (evaluationStackCellType.R8 :: _ :: evaluationStackCellType.Ref :: _) ->
                             x.PrependMem_f8(2, 0, &prependTarget)
-                            probes.execStelem_R8, x.tokens.void_i_i_r8_offset_sig, probes.unmem_f8, x.tokens.r8_i1_sig
+                            probes.execStelem_R8, probes.unmem_f8
                         | OpCodeValues.Stelem, Some (evaluationStackCellType.Struct :: _ :: evaluationStackCellType.Ref :: _) ->
                             x.PrependMem_p(2, 0, &prependTarget)
-                            probes.execStelem_Struct, x.tokens.void_i_i_i_offset_sig, probes.unmem_p, x.tokens.i_i1_sig
+                            probes.execStelem_Struct, probes.unmem_p
                         | _ -> __unreachable__()
 
                     x.PrependMem_p(1, 1, &prependTarget)
                     x.PrependMem_p(0, 2, &prependTarget)
 
-                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i_i1_sig, &prependTarget) |> ignore
-                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 1)], x.tokens.i_i1_sig, &prependTarget) |> ignore
-                    x.PrependProbe(probes.stelem, [], x.tokens.bool_i_i_sig, &prependTarget) |> ignore
+                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], &prependTarget) |> ignore
+                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 1)], &prependTarget) |> ignore
+                    x.PrependProbe(probes.stelem, [], &prependTarget) |> ignore
                     let brtrue = x.PrependBranch(OpCodes.Brtrue_S, &prependTarget)
-                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i_i1_sig, &prependTarget) |> ignore
-                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 1)], x.tokens.i_i1_sig, &prependTarget) |> ignore
-                    x.PrependProbe(unmem3Probe, [(OpCodes.Ldc_I4, Arg32 2)], unmem3Sig, &prependTarget) |> ignore
-                    x.PrependProbeWithOffset(execProbe, [], execSig, &prependTarget) |> ignore
+                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], &prependTarget) |> ignore
+                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 1)], &prependTarget) |> ignore
+                    x.PrependProbe(unmem3Probe, [(OpCodes.Ldc_I4, Arg32 2)], &prependTarget) |> ignore
+                    x.PrependProbeWithOffset(execProbe, [], &prependTarget) |> ignore
                     let br = x.PrependBranch(OpCodes.Br, &prependTarget)
-                    let tgt = x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i_i1_sig, &prependTarget)
-                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 1)], x.tokens.i_i1_sig, &prependTarget) |> ignore
-                    x.PrependProbe(unmem3Probe, [(OpCodes.Ldc_I4, Arg32 2)], unmem3Sig, &prependTarget) |> ignore
+                    let tgt = x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], &prependTarget)
+                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 1)], &prependTarget) |> ignore
+                    x.PrependProbe(unmem3Probe, [(OpCodes.Ldc_I4, Arg32 2)], &prependTarget) |> ignore
                     if isStruct then
                         x.PrependInstr(OpCodes.Unbox_Any, typeTokenArg, &prependTarget)
                     brtrue.arg <- Target tgt
                     x.AppendInstr OpCodes.Nop NoArg instr
                     br.arg <- Target instr.next
 
-                | OpCodeValues.Ckfinite ->  x.AppendProbe(probes.ckfinite, [], x.tokens.void_sig, instr)
+                | OpCodeValues.Ckfinite ->  x.AppendProbe(probes.ckfinite, [], instr)
                 | OpCodeValues.Ldvirtftn ->
                      x.PrependDup &prependTarget
                      x.PrependInstr(OpCodes.Ldc_I4, instr.arg, &prependTarget)
-                     x.PrependProbeWithOffset(probes.ldvirtftn, [], x.tokens.void_i_token_offset_sig, &prependTarget) |> ignore
+                     x.PrependProbeWithOffset(probes.ldvirtftn, [], &prependTarget) |> ignore
                 | OpCodeValues.Initobj ->
                      x.PrependDup &prependTarget
-                     x.PrependProbe(probes.initobj, [], x.tokens.void_i_sig, &prependTarget) |> ignore
+                     x.PrependProbe(probes.initobj, [], &prependTarget) |> ignore
                 | OpCodeValues.Cpblk ->
                     // calli mem3
                     // calli unmem 0
@@ -1019,17 +1063,17 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
                     // calli exec
                     // A: cpblk
                     x.PrependMem3_p &prependTarget
-                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i_i1_sig, &prependTarget) |> ignore
-                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 1)], x.tokens.i_i1_sig, &prependTarget) |> ignore
-                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 2)], x.tokens.i_i1_sig, &prependTarget) |> ignore
-                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i_i1_sig, &prependTarget) |> ignore
-                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 1)], x.tokens.i_i1_sig, &prependTarget) |> ignore
-                    x.PrependProbe(probes.cpblk, [], x.tokens.bool_i_i_sig, &prependTarget) |> ignore
+                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], &prependTarget) |> ignore
+                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 1)], &prependTarget) |> ignore
+                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 2)], &prependTarget) |> ignore
+                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], &prependTarget) |> ignore
+                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 1)], &prependTarget) |> ignore
+                    x.PrependProbe(probes.cpblk, [], &prependTarget) |> ignore
                     let br = x.PrependBranch(OpCodes.Brtrue_S, &prependTarget)
-                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i_i1_sig, &prependTarget) |> ignore
-                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 1)], x.tokens.i_i1_sig, &prependTarget) |> ignore
-                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 2)], x.tokens.i_i1_sig, &prependTarget) |> ignore
-                    x.PrependProbeWithOffset(probes.execCpblk, [], x.tokens.void_i_i_i_offset_sig, &prependTarget) |> ignore
+                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], &prependTarget) |> ignore
+                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 1)], &prependTarget) |> ignore
+                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 2)], &prependTarget) |> ignore
+                    x.PrependProbeWithOffset(probes.execCpblk, [], &prependTarget) |> ignore
                     br.arg <- Target prependTarget
                 | OpCodeValues.Initblk ->
                     // calli mem3
@@ -1045,22 +1089,22 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
                     // calli exec
                     // A: initblk
                     x.PrependMem3_p_i1_p &prependTarget
-                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i_i1_sig, &prependTarget) |> ignore
-                    x.PrependProbe(probes.unmem_1, [(OpCodes.Ldc_I4, Arg32 1)], x.tokens.i1_i1_sig, &prependTarget) |> ignore
-                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 2)], x.tokens.i_i1_sig, &prependTarget) |> ignore
-                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i_i1_sig, &prependTarget) |> ignore
-                    x.PrependProbe(probes.initblk, [], x.tokens.bool_i_sig, &prependTarget) |> ignore
+                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], &prependTarget) |> ignore
+                    x.PrependProbe(probes.unmem_1, [(OpCodes.Ldc_I4, Arg32 1)], &prependTarget) |> ignore
+                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 2)], &prependTarget) |> ignore
+                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], &prependTarget) |> ignore
+                    x.PrependProbe(probes.initblk, [], &prependTarget) |> ignore
                     let br = x.PrependBranch(OpCodes.Brtrue_S, &prependTarget)
-                    x.PrependProbe(probes.unmem_1, [(OpCodes.Ldc_I4, Arg32 1)], x.tokens.i1_i1_sig, &prependTarget) |> ignore
-                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i_i1_sig, &prependTarget) |> ignore
-                    x.PrependProbe(probes.unmem_1, [(OpCodes.Ldc_I4, Arg32 1)], x.tokens.i1_i1_sig, &prependTarget) |> ignore
-                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 2)], x.tokens.i_i1_sig, &prependTarget) |> ignore
-                    x.PrependProbeWithOffset(probes.execInitblk, [], x.tokens.void_i_i1_i_offset_sig, &prependTarget) |> ignore
+                    x.PrependProbe(probes.unmem_1, [(OpCodes.Ldc_I4, Arg32 1)], &prependTarget) |> ignore
+                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], &prependTarget) |> ignore
+                    x.PrependProbe(probes.unmem_1, [(OpCodes.Ldc_I4, Arg32 1)], &prependTarget) |> ignore
+                    x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 2)], &prependTarget) |> ignore
+                    x.PrependProbeWithOffset(probes.execInitblk, [], &prependTarget) |> ignore
                     br.arg <- Target prependTarget
 
                 | OpCodeValues.Rethrow ->
                     atLeastOneReturnFound <- true
-                    x.PrependProbeWithOffset(probes.rethrow, [], x.tokens.void_offset_sig, &prependTarget) |> ignore
+                    x.PrependProbeWithOffset(probes.rethrow, [], &prependTarget) |> ignore
 
                 | OpCodeValues.Call
                 | OpCodeValues.Callvirt
@@ -1114,37 +1158,37 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
                                 let t = types.[i]
                                 unmems.Add(x.PrependMemUnmemForType(t, argsCount - i - 1, i, &prependTarget))
                         | None -> internalfail "unexpected stack state"
-                        x.PrependProbe(probes.call, [(OpCodes.Ldc_I4, Arg32 argsCount)], x.tokens.bool_u2_sig, &prependTarget) |> ignore
+                        x.PrependProbe(probes.call, [(OpCodes.Ldc_I4, Arg32 argsCount)], &prependTarget) |> ignore
                         let br_true = x.PrependBranch(OpCodes.Brtrue_S, &prependTarget)
                         let calleeMethod = Application.getMethod callee
                         if calleeMethod.IsInternalCall then
                             let retType = Reflection.getMethodReturnType callee
                             x.PrependLdcDefault(retType, &instr)
-                            let probe, token = x.PrependMemUnmemForType(EvaluationStackTyper.abstractType retType, argsCount, argsCount, &prependTarget)
-                            x.PrependProbeWithOffset(probes.execCall, [(OpCodes.Ldc_I4, Arg32 argsCount)], x.tokens.void_i4_offset_sig, &prependTarget) |> ignore
-                            x.PrependProbe(probe, [(OpCodes.Ldc_I4, Arg32 argsCount)], token, &prependTarget) |> ignore
-                        else x.PrependProbeWithOffset(probes.execCall, [(OpCodes.Ldc_I4, Arg32 argsCount)], x.tokens.void_i4_offset_sig, &prependTarget) |> ignore
+                            let probe = x.PrependMemUnmemForType(EvaluationStackTyper.abstractType retType, argsCount, argsCount, &prependTarget)
+                            x.PrependProbeWithOffset(probes.execCall, [(OpCodes.Ldc_I4, Arg32 argsCount)], &prependTarget) |> ignore
+                            x.PrependProbe(probe, [(OpCodes.Ldc_I4, Arg32 argsCount)], &prependTarget) |> ignore
+                        else x.PrependProbeWithOffset(probes.execCall, [(OpCodes.Ldc_I4, Arg32 argsCount)], &prependTarget) |> ignore
                         let br = x.PrependBranch(OpCodes.Br, &prependTarget)
 
                         let callStart = x.PrependNop(&prependTarget)
                         br_true.arg <- Target callStart
                         for i = argsCount - 1 downto 0 do
-                            let probe, token = unmems.[i]
-                            x.PrependProbe(probe, [(OpCodes.Ldc_I4, Arg32 (argsCount - 1 - i))], token, &prependTarget) |> ignore
+                            let probe = unmems.[i]
+                            x.PrependProbe(probe, [(OpCodes.Ldc_I4, Arg32 (argsCount - 1 - i))], &prependTarget) |> ignore
                         let expectedToken = if opcodeValue = OpCodeValues.Callvirt then 0 else callee.MetadataToken
                         let args = [(OpCodes.Ldc_I4, Arg32 token)
                                     (OpCodes.Ldc_I4, Arg32 expectedToken)
                                     (OpCodes.Ldc_I4, Arg32 (if opcodeValue = OpCodeValues.Newobj then 1 else 0))
                                     (OpCodes.Ldc_I4, Arg32 argsCount)]
-                        x.PrependProbeWithOffset(probes.pushFrame, args, x.tokens.void_token_token_bool_u2_offset_sig, &prependTarget) |> ignore
+                        x.PrependProbeWithOffset(probes.pushFrame, args, &prependTarget) |> ignore
 
                         if opcodeValue = OpCodeValues.Newobj then
-                            x.AppendProbe(probes.newobj, [], x.tokens.void_i_sig, instr)
+                            x.AppendProbe(probes.newobj, [], instr)
                             x.AppendInstr OpCodes.Conv_I NoArg instr
                             x.AppendDup(instr)
                         let returnValues = if Reflection.hasNonVoidResult callee then 1 else 0
                         let nop = x.AppendNop instr
-                        x.AppendProbe(probes.finalizeCall, [(OpCodes.Ldc_I4, Arg32 returnValues)], x.tokens.void_u1_sig, instr)
+                        x.AppendProbe(probes.finalizeCall, [(OpCodes.Ldc_I4, Arg32 returnValues)], instr)
 
                         if calleeMethod.IsInternalCall then br.arg <- Target nop
                         else br.arg <- Target callStart
@@ -1156,7 +1200,7 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
                     atLeastOneReturnFound <- true
                     x.PlaceLeaveProbe &instr
                 | OpCodeValues.Throw ->
-                    x.PrependProbeWithOffset(probes.throw, [], x.tokens.void_offset_sig, &prependTarget) |> ignore
+                    x.PrependProbeWithOffset(probes.throw, [], &prependTarget) |> ignore
                     atLeastOneReturnFound <- true
 
                 // Ignored instructions
@@ -1178,12 +1222,59 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
             | SwitchArg -> ()
         assert(atLeastOneReturnFound)
 
+    // NOTE: the lightweight clone does not track its evaluation stack: it only pushes frames of callees, pops frames
+    //       of externs and leaves its own frame, so that the shadow stack stays balanced
+    member x.PlaceLightProbes(first : ilInstr, last : ilInstr) =
+        let instructions = List<ilInstr>()
+        let mutable instr = first
+        while not <| x.rewriter.InstrEq instr last do
+            instructions.Add instr
+            instr <- instr.next
+        instructions.Add last
+        let instructions = instructions.ToArray()
+        let mutable hasPrefix = false
+        let mutable prefix : ilInstr byref = &instructions.[0]
+        for i in 0 .. instructions.Length - 1 do
+            let instr = &instructions.[i]
+            if not hasPrefix then prefix <- instr
+            match instr.opcode with
+            | OpCode op ->
+                let prependTarget = if hasPrefix then &prefix else &instr
+                let opcodeValue = LanguagePrimitives.EnumOfValue op.Value
+                match opcodeValue with
+                | OpCodeValues.Call
+                | OpCodeValues.Callvirt
+                | OpCodeValues.Newobj ->
+                    match instr.arg with
+                    | Arg32 token ->
+                        let callee = Reflection.resolveMethod x.m token
+                        let hasThis = callee.CallingConvention.HasFlag(CallingConventions.HasThis)
+                        let argsCount = callee.GetParameters().Length
+                        let argsCount = if hasThis && opcodeValue <> OpCodeValues.Newobj then argsCount + 1 else argsCount
+                        let expectedToken = if opcodeValue = OpCodeValues.Callvirt then 0 else callee.MetadataToken
+                        let args = [(OpCodes.Ldc_I4, Arg32 token)
+                                    (OpCodes.Ldc_I4, Arg32 expectedToken)
+                                    (OpCodes.Ldc_I4, Arg32 (if opcodeValue = OpCodeValues.Newobj then 1 else 0))
+                                    (OpCodes.Ldc_I4, Arg32 argsCount)]
+                        x.PrependProbeWithOffset(probes.pushFrame, args, &prependTarget) |> ignore
+                        let returnValues = if Reflection.hasNonVoidResult callee then 1 else 0
+                        x.AppendProbe(probes.finalizeCall, [(OpCodes.Ldc_I4, Arg32 returnValues)], instr)
+                    | _ -> __unreachable__()
+                | OpCodeValues.Ret ->
+                    let returnsSomething = Reflection.hasNonVoidResult x.m
+                    x.PrependProbe(probes.leaveLight, [(OpCodes.Ldc_I4, (if returnsSomething then 1 else 0) |> Arg32)], &instr) |> ignore
+                | _ -> ()
+                hasPrefix <- op.OpCodeType = OpCodeType.Prefix
+            | SwitchArg -> ()
+
     member x.Skip (body : rawMethodBody) =
         { properties = {ilCodeSize = body.properties.ilCodeSize; maxStackSize = body.properties.maxStackSize}; il = body.il; ehs = body.ehs}
 
     member x.Instrument(body : rawMethodBody) =
         assert(x.rewriter = null)
-        x.tokens <- body.tokens
+        x.probeSignatures <- body.probeSignatures
+        x.probeMethods <- body.probeMethods
+        x.leafSignatures <- body.leafSignatures
         // TODO: call Application.getMethod and take ILRewriter there!
         x.rewriter <- ILRewriter(body)
         x.m <- x.rewriter.Method
@@ -1193,7 +1284,14 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
                 try
                     x.rewriter.Import()
                     x.rewriter.PrintInstructions "before instrumentation" probes
-                    x.PlaceProbes()
+                    let clones = if x.HasConcreteClone() then Some(x.rewriter.CloneBody(), x.rewriter.CloneBody()) else None
+                    x.PlaceProbes(clones |> Option.map (fun ((first, _, _), (lightFirst, _, _)) -> first, lightFirst))
+                    match clones with
+                    | Some (clone, ((lightFirst, lightLast, _) as lightClone)) ->
+                        x.rewriter.AppendClone clone
+                        x.rewriter.AppendClone lightClone
+                        x.PlaceLightProbes(lightFirst, lightLast)
+                    | None -> ()
                     x.rewriter.PrintInstructions "after instrumentation" probes
                     let result = x.rewriter.Export()
                     result
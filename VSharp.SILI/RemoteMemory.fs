@@ -0,0 +1,116 @@
+namespace VSharp.Concolic
+
+#nowarn "9"
+
+open System
+open System.Collections.Generic
+open System.Reflection
+open System.Runtime.InteropServices
+open Microsoft.FSharp.NativeInterop
+open VSharp
+
+// NOTE: must be kept in sync with VSharp.ClrInteraction/communication/protocol.h
+[<type: StructLayout(LayoutKind.Sequential, Pack=1, CharSet=CharSet.Ansi)>]
+type remoteMemoryLayout = {
+    processId : uint64
+    objectLeftOffset : uint32
+    objectRightOffset : uint32
+}
+
+[<Struct; StructLayout(LayoutKind.Sequential)>]
+type private iovec = {
+    iovBase : nativeint
+    iovLength : unativeint
+}
+
+module private ProcessVm =
+    [<DllImport("libc", SetLastError = true)>]
+    extern nativeint process_vm_readv(int pid, iovec& localIov, unativeint localCount, iovec& remoteIov, unativeint remoteCount, unativeint flags)
+
+// Reads concrete memory of the client directly via process_vm_readv, without a round trip through the profiler.
+// Objects are identified by ids from exec commands, which are addresses of shadow objects in the profiler;
+// bounds of a CLR object are read from its shadow object, then its contents are read from these bounds
+type RemoteMemoryReader(layout : remoteMemoryLayout) =
+    let pid = int layout.processId
+    // NOTE: GC moves objects while the client runs, so bounds are cached only until the next exec command
+    let bounds = Dictionary<uint64, uint64 * uint64>()
+    let mutable reads = 0
+    let mutable failedReads = 0
+
+    let readInto (address : uint64) (buffer : byte[]) =
+        use pointer = fixed buffer
+        let mutable local = {iovBase = NativePtr.toNativeInt pointer; iovLength = unativeint buffer.Length}
+        let mutable remote = {iovBase = nativeint address; iovLength = unativeint buffer.Length}
+        reads <- reads + 1
+        let read = ProcessVm.process_vm_readv(pid, &local, 1un, &remote, 1un, 0un)
+        if read = nativeint buffer.Length then true
+        else
+            failedReads <- failedReads + 1
+            Logger.trace "Remote read of %d bytes at 0x%x failed: error %d" buffer.Length address (Marshal.GetLastWin32Error())
+            false
+
+    let decode (typ : Type) (bytes : byte[]) : obj =
+        let underlying = if typ.IsEnum then typ.GetEnumUnderlyingType() else typ
+        let value : obj =
+            match underlying with
+            | _ when underlying = typeof<bool> -> bytes.[0] <> 0uy :> obj
+            | _ when underlying = typeof<byte> -> bytes.[0] :> obj
+            | _ when underlying = typeof<sbyte> -> sbyte bytes.[0] :> obj
+            | _ when underlying = typeof<char> -> BitConverter.ToChar(bytes, 0) :> obj
+            | _ when underlying = typeof<int16> -> BitConverter.ToInt16(bytes, 0) :> obj
+            | _ when underlying = typeof<uint16> -> BitConverter.ToUInt16(bytes, 0) :> obj
+            | _ when underlying = typeof<int32> -> BitConverter.ToInt32(bytes, 0) :> obj
+            | _ when underlying = typeof<uint32> -> BitConverter.ToUInt32(bytes, 0) :> obj
+            | _ when underlying = typeof<int64> -> BitConverter.ToInt64(bytes, 0) :> obj
+            | _ when underlying = typeof<uint64> -> BitConverter.ToUInt64(bytes, 0) :> obj
+            | _ when underlying = typeof<float32> -> BitConverter.ToSingle(bytes, 0) :> obj
+            | _ when underlying = typeof<double> -> BitConverter.ToDouble(bytes, 0) :> obj
+            | _ when underlying = typeof<nativeint> -> nativeint (BitConverter.ToInt64(bytes, 0)) :> obj
+            | _ when underlying = typeof<unativeint> -> unativeint (BitConverter.ToUInt64(bytes, 0)) :> obj
+            | _ -> __unreachable__()
+        if typ.IsEnum then Enum.ToObject(typ, value) else value
+
+    static member IsSupported = RuntimeInformation.IsOSPlatform(OSPlatform.Linux)
+
+    // NOTE: only primitive values can be decoded, references of the client mean nothing to the engine
+    static member CanRead (typ : Type) = typ.IsPrimitive || typ.IsEnum
+
+    member x.Invalidate() = bounds.Clear()
+
+    member x.ReadBytes (address : uint64) (count : int) =
+        let buffer : byte[] = Array.zeroCreate count
+        if count = 0 || readInto address buffer then Some buffer else None
+
+    // NOTE: bounds are physical addresses of the first and the last bytes of the CLR object
+    member x.TryObjectBounds (objectId : uint64) =
+        let mutable cached = (0UL, 0UL)
+        if bounds.TryGetValue(objectId, &cached) then Some cached
+        else
+            let headerSize = int (max layout.objectLeftOffset layout.objectRightOffset) + sizeof<uint64>
+            match x.ReadBytes objectId headerSize with
+            | Some header ->
+                let result = BitConverter.ToUInt64(header, int layout.objectLeftOffset), BitConverter.ToUInt64(header, int layout.objectRightOffset)
+                bounds.[objectId] <- result
+                Some result
+            | None -> None
+
+    // NOTE: 'offset' is counted from the beginning of the CLR object, i.e. from its method table pointer
+    member x.TryRead (objectId : uint64) (offset : int) (typ : Type) =
+        if not (RemoteMemoryReader.CanRead typ) then None
+        else
+            let size = TypeUtils.internalSizeOf typ
+            match x.TryObjectBounds objectId with
+            | Some(left, right) when offset >= 0 && left + uint64 offset + uint64 size - 1UL <= right ->
+                x.ReadBytes (left + uint64 offset) size |> Option.map (decode typ)
+            | _ -> None
+
+    member x.TryReadField (objectId : uint64) (field : FieldInfo) =
+        let offset = sizeof<nativeint> + CSharpUtils.LayoutUtils.GetFieldOffset field
+        x.TryRead objectId offset field.FieldType
+
+    member x.TryReadArrayElement (objectId : uint64) (index : int) (elementType : Type) =
+        let offset = CSharpUtils.LayoutUtils.ArrayElementsOffset + index * TypeUtils.internalSizeOf elementType
+        x.TryRead objectId offset elementType
+
+    member x.Report() =
+        Logger.trace "Remote memory reader: %d reads, %d failed" reads failedReads
@@ -0,0 +1,322 @@
+namespace VSharp.Concolic
+
+#nowarn "9"
+
+open System
+open System.Diagnostics
+open System.IO
+open System.IO.MemoryMappedFiles
+open System.Runtime.InteropServices
+open System.Threading
+open Microsoft.FSharp.NativeInterop
+open VSharp
+
+type concolicTransport =
+    | SocketTransport
+    | SharedMemoryTransport
+    // NOTE: recorded traffic of the profiler is served instead of the live client
+    | ReplayTransport
+
+[<Struct; StructLayout(LayoutKind.Sequential)>]
+type private timespec = {
+    seconds : int64
+    nanoseconds : int64
+}
+
+module private Futex =
+    [<DllImport("libc", SetLastError = true)>]
+    extern int64 syscall(int64 number, nativeint address, int operation, uint32 value, nativeint timeout, nativeint address2, uint32 value3)
+
+    let private futexWait = 0
+    let private futexWake = 1
+    let private etimedout = 110
+
+    let private sysFutex =
+        match RuntimeInformation.ProcessArchitecture with
+        | Architecture.X64 -> 202L
+        | Architecture.Arm64 -> 98L
+        | Architecture.X86
+        | Architecture.Arm -> 240L
+        | a -> internalfailf "futex: unsupported architecture %O" a
+
+    // NOTE: the segment is shared between processes, so private futexes can not be used; returns false on timeout
+    let wait (word : nativeptr<uint32>) (expected : uint32) =
+        // NOTE: waking up periodically to notice the termination of the client
+        let mutable timeout = { seconds = 0L; nanoseconds = 100L * 1000L * 1000L }
+        syscall(sysFutex, NativePtr.toNativeInt word, futexWait, expected, NativePtr.toNativeInt &&timeout, 0n, 0u) = 0L
+        || Marshal.GetLastWin32Error() <> etimedout
+
+    let wake (word : nativeptr<uint32>) =
+        syscall(sysFutex, NativePtr.toNativeInt word, futexWake, 1u, 0n, 0n, 0u) |> ignore
+
+// NOTE: CLOCK_MONOTONIC is shared with the profiler, so it can be used to stamp publications in the segment
+module private MonotonicClock =
+    [<DllImport("libc", SetLastError = true)>]
+    extern int clock_gettime(int clock, timespec& time)
+
+    let private clockMonotonic = 1
+
+    let nanoseconds () =
+        let mutable time = { seconds = 0L; nanoseconds = 0L }
+        clock_gettime(clockMonotonic, &time) |> ignore
+        uint64 time.seconds * 1000000000UL + uint64 time.nanoseconds
+
+// NOTE: chosen via VSHARP_CONCOLIC_WAIT=block|spin|poll, spin budget is set via VSHARP_CONCOLIC_SPIN_BUDGET (iterations);
+//       the same settings are passed to the profiler
+type waitStrategy =
+    | BlockingWait
+    | SpinThenBlockWait of int
+    | BusyPollWait
+    with
+    static member DefaultSpinBudget = 4096
+
+    static member FromEnvironment() =
+        let budget =
+            match Int32.TryParse(Environment.GetEnvironmentVariable("VSHARP_CONCOLIC_SPIN_BUDGET")) with
+            | true, budget when budget >= 0 -> budget
+            | _ -> waitStrategy.DefaultSpinBudget
+        match Environment.GetEnvironmentVariable("VSHARP_CONCOLIC_WAIT") with
+        | "spin" -> SpinThenBlockWait budget
+        | "poll" -> BusyPollWait
+        | _ -> BlockingWait
+
+    member x.ClientName =
+        match x with
+        | BlockingWait -> "block"
+        | SpinThenBlockWait _ -> "spin"
+        | BusyPollWait -> "poll"
+
+    member x.MaySpin iteration =
+        match x with
+        | BlockingWait -> false
+        | SpinThenBlockWait budget -> iteration < budget
+        | BusyPollWait -> true
+
+// NOTE: wakeup latency is the time between publication of data by the profiler and the moment the engine notices it
+type waitStatistics = {
+    mutable waits : uint64
+    mutable spinWakeups : uint64
+    mutable blockedWakeups : uint64
+    mutable waitNanoseconds : uint64
+    mutable latencySamples : uint64
+    mutable wakeupLatencyNanoseconds : uint64
+}
+with
+    member x.MeanWaitNanoseconds = if x.waits = 0UL then 0UL else x.waitNanoseconds / x.waits
+    member x.MeanWakeupLatencyNanoseconds = if x.latencySamples = 0UL then 0UL else x.wakeupLatencyNanoseconds / x.latencySamples
+
+// NOTE: pins threads to CPUs, listed like "2,3" or "2-5", so that the engine and the profiled process share caches
+module Affinity =
+    [<DllImport("libc", SetLastError = true)>]
+    extern int sched_setaffinity(int pid, unativeint size, byte[] mask)
+
+    let parse (cpus : string) =
+        cpus.Split(',', StringSplitOptions.RemoveEmptyEntries) |> Array.collect (fun range ->
+            match range.Split('-') with
+            | [| cpu |] -> [| Int32.Parse cpu |]
+            | [| first; last |] -> [| Int32.Parse first .. Int32.Parse last |]
+            | _ -> internalfailf "invalid CPU range %s" range)
+
+    // NOTE: on Linux pid 0 stands for the calling thread, other threads of the engine are not affected
+    let pinCurrentThread (cpus : string) =
+        if not (RuntimeInformation.IsOSPlatform(OSPlatform.Linux)) then
+            Logger.warning "CPU pinning is not supported on this platform, ignoring CPU list %s" cpus
+        else
+            let cpus = parse cpus
+            let mask : byte[] = Array.zeroCreate 128
+            for cpu in cpus do mask.[cpu / 8] <- mask.[cpu / 8] ||| (1uy <<< (cpu % 8))
+            if sched_setaffinity(0, unativeint mask.Length, mask) <> 0 then
+                Logger.warning "Could not pin engine thread to CPUs %O: error %d" cpus (Marshal.GetLastWin32Error())
+            else Logger.trace "Pinned engine thread to CPUs %O" cpus
+
+// NOTE: layout of the segment must be kept in sync with VSharp.ClrInteraction/communication/sharedMemoryChannel.h
+//       [ header | ring control (engine -> profiler) | ring control (profiler -> engine) | data 0 | data 1 ]
+//       ring control is [ head | readerWaiting | publishedAt : uint64 | padding | tail | writerWaiting | padding ]
+type private ring = {
+    head : nativeptr<uint32>
+    readerWaiting : nativeptr<uint32>
+    publishedAt : nativeptr<uint64>
+    tail : nativeptr<uint32>
+    writerWaiting : nativeptr<uint32>
+    data : nativeptr<byte>
+    mask : uint32
+}
+
+// Single-producer/single-consumer transport over a shared memory segment, the engine creates and owns the segment
+type SharedMemoryStream(segmentName : string, capacity : uint32, strategy : waitStrategy) =
+    inherit Stream()
+
+    static let magic = 0x4D485356u // "VSHM"
+    static let version = 2u
+    static let cacheLine = 64
+
+    do if capacity = 0u || capacity &&& (capacity - 1u) <> 0u then internalfailf "shared memory ring capacity %d must be a power of two" capacity
+
+    let path = Path.Combine("/dev/shm", segmentName.TrimStart('/'))
+    let controlSize = 2 * cacheLine
+    let segmentSize = int64 cacheLine + 2L * int64 controlSize + 2L * int64 capacity
+    let file = MemoryMappedFile.CreateFromFile(path, FileMode.CreateNew, null, segmentSize, MemoryMappedFileAccess.ReadWrite)
+    let view = file.CreateViewAccessor(0L, segmentSize, MemoryMappedFileAccess.ReadWrite)
+    let segment =
+        let mutable pointer = NativePtr.nullPtr<byte>
+        view.SafeMemoryMappedViewHandle.AcquirePointer(&pointer)
+        pointer
+    let word (offset : int) = NativePtr.add segment offset |> NativePtr.toNativeInt |> NativePtr.ofNativeInt<uint32>
+    let closed = word 12
+    let mkRing index =
+        let control = cacheLine + index * controlSize
+        { head = word control; readerWaiting = word (control + 4)
+          publishedAt = NativePtr.add segment (control + 8) |> NativePtr.toNativeInt |> NativePtr.ofNativeInt<uint64>
+          tail = word (control + cacheLine); writerWaiting = word (control + cacheLine + 4)
+          data = NativePtr.add segment (cacheLine + 2 * controlSize + index * int capacity)
+          mask = capacity - 1u }
+    // NOTE: ring 0 is written by the engine, ring 1 is written by the profiler
+    let output = mkRing 0
+    let input = mkRing 1
+    let mutable disposed = false
+    // NOTE: a crashed client can not set 'closed', so the client process is polled on timeouts
+    let mutable client : Process = null
+    let mutable clientLost = false
+    let statistics = { waits = 0UL; spinWakeups = 0UL; blockedWakeups = 0UL; waitNanoseconds = 0UL; latencySamples = 0UL; wakeupLatencyNanoseconds = 0UL }
+
+    do
+        NativePtr.write (word 0) magic
+        NativePtr.write (word 4) version
+        NativePtr.write (word 8) capacity
+
+    // NOTE: full fences give the same ordering as seq_cst atomics of the profiler side
+    let load (p : nativeptr<uint32>) =
+        let value = NativePtr.read p
+        Interlocked.MemoryBarrier()
+        value
+    let store (p : nativeptr<uint32>) (v : uint32) =
+        Interlocked.MemoryBarrier()
+        NativePtr.write p v
+        Interlocked.MemoryBarrier()
+
+    let peerClosed () = clientLost || load closed <> 0u
+
+    let peerAlive () =
+        if isNull client || not client.HasExited then true
+        else
+            Logger.error "Concolic client %d has exited, failing shared memory transport" client.Id
+            clientLost <- true
+            false
+
+    let recordWait startedAt blocked =
+        statistics.waits <- statistics.waits + 1UL
+        if blocked then statistics.blockedWakeups <- statistics.blockedWakeups + 1UL
+        else statistics.spinWakeups <- statistics.spinWakeups + 1UL
+        let observedAt = MonotonicClock.nanoseconds()
+        statistics.waitNanoseconds <- statistics.waitNanoseconds + (observedAt - startedAt)
+        // NOTE: profiler could publish a timestamp of the later write, than the one, which woke the engine
+        let publishedAt = NativePtr.read input.publishedAt
+        if publishedAt <> 0UL && publishedAt <= observedAt then
+            statistics.latencySamples <- statistics.latencySamples + 1UL
+            statistics.wakeupLatencyNanoseconds <- statistics.wakeupLatencyNanoseconds + (observedAt - publishedAt)
+
+    let waitForData tail =
+        let mutable head = load input.head
+        if head = tail then
+            let startedAt = MonotonicClock.nanoseconds()
+            let mutable blocked = false
+            let mutable iteration = 0
+            while head = tail && strategy.MaySpin iteration && not (peerClosed()) do
+                Thread.SpinWait 1
+                head <- load input.head
+                iteration <- iteration + 1
+            while head = tail && not (peerClosed()) do
+                store input.readerWaiting 1u
+                head <- load input.head
+                if head = tail then
+                    if not (Futex.wait input.head head) then peerAlive() |> ignore
+                    blocked <- true
+                store input.readerWaiting 0u
+                head <- load input.head
+            if head <> tail then recordWait startedAt blocked
+        head
+
+    let waitForSpace head =
+        let mutable tail = load output.tail
+        let mutable iteration = 0
+        while head - tail = capacity && strategy.MaySpin iteration && not (peerClosed()) do
+            Thread.SpinWait 1
+            tail <- load output.tail
+            iteration <- iteration + 1
+        while head - tail = capacity && not (peerClosed()) do
+            store output.writerWaiting 1u
+            tail <- load output.tail
+            if head - tail = capacity && not (Futex.wait output.tail tail) then peerAlive() |> ignore
+            store output.writerWaiting 0u
+            tail <- load output.tail
+        tail
+
+    let copyFromRing (source : nativeptr<byte>) (buffer : byte[]) offset count =
+        if count > 0 then Marshal.Copy(NativePtr.toNativeInt source, buffer, offset, count)
+
+    let copyToRing (buffer : byte[]) offset (destination : nativeptr<byte>) count =
+        if count > 0 then Marshal.Copy(buffer, offset, NativePtr.toNativeInt destination, count)
+
+    static member DefaultCapacity = 1u <<< 20
+
+    member x.SegmentName = segmentName
+    member x.Client with set (proc : Process) = client <- proc
+    member x.WaitStatistics = statistics
+
+    override x.CanRead = true
+    override x.CanWrite = true
+    override x.CanSeek = false
+    override x.Length = raise <| NotSupportedException()
+    override x.Position with get() = raise <| NotSupportedException() and set _ = raise <| NotSupportedException()
+    override x.Seek(_, _) = raise <| NotSupportedException()
+    override x.SetLength _ = raise <| NotSupportedException()
+    override x.Flush() = ()
+
+    override x.Read(buffer : byte[], offset : int, count : int) =
+        let tail = load input.tail
+        let head = waitForData tail
+        let available = head - tail
+        if available = 0u || count = 0 then 0
+        else
+            let size = min available (uint32 count)
+            let start = tail &&& input.mask
+            let firstPart = min size (capacity - start)
+            copyFromRing (NativePtr.add input.data (int start)) buffer offset (int firstPart)
+            copyFromRing input.data buffer (offset + int firstPart) (int (size - firstPart))
+            store input.tail (tail + size)
+            if load input.writerWaiting <> 0u then Futex.wake input.tail
+            int size
+
+    override x.Write(buffer : byte[], offset : int, count : int) =
+        let mutable head = load output.head
+        let mutable written = 0
+        while written < count do
+            let tail = waitForSpace head
+            let space = capacity - (head - tail)
+            if space = 0u then
+                raise <| IOException "Communication with CLR: shared memory segment was closed by the client"
+            let size = min space (uint32 (count - written))
+            let start = head &&& output.mask
+            let firstPart = min size (capacity - start)
+            copyToRing buffer (offset + written) (NativePtr.add output.data (int start)) (int firstPart)
+            copyToRing buffer (offset + written + int firstPart) output.data (int (size - firstPart))
+            head <- head + size
+            written <- written + int size
+            NativePtr.write output.publishedAt (MonotonicClock.nanoseconds())
+            store output.head head
+            if load output.readerWaiting <> 0u then Futex.wake output.head
+
+    override x.Dispose(disposing : bool) =
+        if not disposed then
+            disposed <- true
+            Logger.info "Wait statistics of shared memory transport (strategy %O): %d waits, %d woken while spinning, %d woken after blocking, mean wait %d ns, mean wakeup latency %d ns"
+                strategy statistics.waits statistics.spinWakeups statistics.blockedWakeups statistics.MeanWaitNanoseconds statistics.MeanWakeupLatencyNanoseconds
+            store closed 1u
+            Futex.wake input.tail
+            Futex.wake output.head
+            view.SafeMemoryMappedViewHandle.ReleasePointer()
+            view.Dispose()
+            file.Dispose()
+            try File.Delete path
+            with :? IOException as e -> Logger.warning "Could not remove shared memory segment %s: %s" path e.Message
+        base.Dispose(disposing)
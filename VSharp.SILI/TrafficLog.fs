@@ -0,0 +1,151 @@
+namespace VSharp.Concolic
+
+open System
+open System.Diagnostics
+open System.IO
+open VSharp
+
+// NOTE: format must be kept in sync with VSharp.ClrInteraction/communication/trafficLog.h
+//       [ magic | version | side ] followed by records [ direction : byte | time delta in ns : varint | length : varint | bytes ]
+module private TrafficLogFormat =
+    let magic = 0x4C545356u // "VSTL"
+    let version = 1u
+    let profilerSide = 0u
+    let engineSide = 1u
+    let readDirection = 0uy
+    let writtenDirection = 1uy
+
+    let writeVarUInt (stream : Stream) (value : uint64) =
+        let mutable value = value
+        while value >= 0x80UL do
+            stream.WriteByte(byte (value ||| 0x80UL))
+            value <- value >>> 7
+        stream.WriteByte(byte value)
+
+    // NOTE: returns None if the log ends in the middle of the value
+    let readVarUInt (bytes : byte[], position : int byref) =
+        let mutable result = 0UL
+        let mutable shift = 0
+        let mutable finished = false
+        while not finished && position < bytes.Length && shift < 70 do
+            let b = bytes.[position]
+            position <- position + 1
+            result <- result ||| (uint64 (b &&& 0x7Fuy) <<< shift)
+            shift <- shift + 7
+            finished <- b < 0x80uy
+        if finished then Some result else None
+
+// Tees all traffic of the engine with the profiler into a log file, enabled via VSHARP_CONCOLIC_RECORD=<path>
+type TrafficRecordingStream(inner : Stream, path : string) =
+    inherit Stream()
+
+    let log = new BufferedStream(File.Create path)
+    let timer = Stopwatch.StartNew()
+    let mutable lastRecord = 0L
+    let mutable disposed = false
+
+    do
+        log.Write(BitConverter.GetBytes TrafficLogFormat.magic, 0, sizeof<uint32>)
+        log.Write(BitConverter.GetBytes TrafficLogFormat.version, 0, sizeof<uint32>)
+        log.Write(BitConverter.GetBytes TrafficLogFormat.engineSide, 0, sizeof<uint32>)
+
+    let record direction (buffer : byte[]) offset count =
+        if count > 0 then
+            lock log (fun () ->
+                let now = timer.Elapsed.Ticks
+                let delta = uint64 (now - lastRecord) * (1000000000UL / uint64 TimeSpan.TicksPerSecond)
+                lastRecord <- now
+                log.WriteByte direction
+                TrafficLogFormat.writeVarUInt log delta
+                TrafficLogFormat.writeVarUInt log (uint64 count)
+                log.Write(buffer, offset, count))
+
+    static member FromEnvironment (inner : Stream) =
+        match Environment.GetEnvironmentVariable("VSHARP_CONCOLIC_RECORD") with
+        | null | "" -> inner
+        | path ->
+            Logger.info "Recording concolic traffic to %s" path
+            new TrafficRecordingStream(inner, path) :> Stream
+
+    override x.CanRead = inner.CanRead
+    override x.CanWrite = inner.CanWrite
+    override x.CanSeek = false
+    override x.Length = raise <| NotSupportedException()
+    override x.Position with get() = raise <| NotSupportedException() and set _ = raise <| NotSupportedException()
+    override x.Seek(_, _) = raise <| NotSupportedException()
+    override x.SetLength _ = raise <| NotSupportedException()
+    override x.Flush() = inner.Flush()
+
+    override x.Read(buffer : byte[], offset : int, count : int) =
+        let bytesRead = inner.Read(buffer, offset, count)
+        record TrafficLogFormat.readDirection buffer offset bytesRead
+        bytesRead
+
+    override x.Write(buffer : byte[], offset : int, count : int) =
+        inner.Write(buffer, offset, count)
+        record TrafficLogFormat.writtenDirection buffer offset count
+
+    override x.Dispose(disposing : bool) =
+        if not disposed then
+            disposed <- true
+            lock log (fun () -> log.Dispose())
+            inner.Dispose()
+        base.Dispose(disposing)
+
+// Serves the recorded traffic of the profiler to the engine, replies of the engine are dropped.
+// Logs of both sides can be replayed, so that the engine can be benchmarked without CLR.
+type TrafficReplayStream(path : string) =
+    inherit Stream()
+
+    let traffic, recordedNanoseconds =
+        let bytes = File.ReadAllBytes path
+        let headerSize = 3 * sizeof<uint32>
+        if bytes.Length < headerSize then
+            raise <| IOException(sprintf "Traffic log %s is too small" path)
+        let magic = BitConverter.ToUInt32(bytes, 0)
+        let version = BitConverter.ToUInt32(bytes, sizeof<uint32>)
+        if magic <> TrafficLogFormat.magic || version <> TrafficLogFormat.version then
+            raise <| IOException(sprintf "Traffic log %s has unexpected format (magic = %x, version = %d)" path magic version)
+        let side = BitConverter.ToUInt32(bytes, 2 * sizeof<uint32>)
+        let fromProfiler = if side = TrafficLogFormat.profilerSide then TrafficLogFormat.writtenDirection else TrafficLogFormat.readDirection
+        let traffic = new MemoryStream()
+        let mutable total = 0UL
+        let mutable position = headerSize
+        let mutable finished = false
+        while not finished && position < bytes.Length do
+            let direction = bytes.[position]
+            position <- position + 1
+            match TrafficLogFormat.readVarUInt(bytes, &position) with
+            | Some delta ->
+                match TrafficLogFormat.readVarUInt(bytes, &position) with
+                | Some size when size <= uint64 (bytes.Length - position) ->
+                    if direction = fromProfiler then traffic.Write(bytes, position, int size)
+                    total <- total + delta
+                    position <- position + int size
+                | _ -> finished <- true
+            | None -> finished <- true
+        // NOTE: log of the crashed session may end with an incomplete record
+        if finished then Logger.warning "Traffic log %s is truncated, replaying its complete records" path
+        traffic.Position <- 0L
+        traffic, total
+
+    member x.RecordedNanoseconds = recordedNanoseconds
+    member x.Finished = traffic.Position = traffic.Length
+
+    override x.CanRead = true
+    override x.CanWrite = true
+    override x.CanSeek = false
+    override x.Length = raise <| NotSupportedException()
+    override x.Position with get() = raise <| NotSupportedException() and set _ = raise <| NotSupportedException()
+    override x.Seek(_, _) = raise <| NotSupportedException()
+    override x.SetLength _ = raise <| NotSupportedException()
+    override x.Flush() = ()
+
+    override x.Read(buffer : byte[], offset : int, count : int) =
+        traffic.Read(buffer, offset, count)
+
+    override x.Write(_ : byte[], _ : int, _ : int) = ()
+
+    override x.Dispose(disposing : bool) =
+        traffic.Dispose()
+        base.Dispose(disposing)
@@ -0,0 +1,27 @@
+using NUnit.Framework;
+using VSharp.Test;
+
+namespace IntegrationTests
+{
+    // NOTE: concolic runs of both entry points share the instrumentation cache of the working directory;
+    //       each entry point calls the other one, so bodies, cached by the first run, are reused by the second
+    [TestSvmFixture]
+    public static class InstrumentationCache
+    {
+        [TestSvm(100, concolicMode: true)]
+        public static int FirstEntryPoint(int x)
+        {
+            if (x > 0)
+                return SecondEntryPoint(-x);
+            return 0;
+        }
+
+        [TestSvm(100, concolicMode: true)]
+        public static int SecondEntryPoint(int x)
+        {
+            if (x > 10)
+                return FirstEntryPoint(-x);
+            return 1;
+        }
+    }
+}